@@ -315,16 +315,20 @@ if argweaverclib:
         argweaverclib, "setLogLevel", C.c_int,
         [C.c_int, "level"])
 
+    setRandomSeed = export(
+        argweaverclib, "setRandomSeed", C.c_int,
+        [C.c_int, "seed"])
+
 
 # By default use a random seed.
 if argweaverclib:
-    argweaverclib.srand(int((time.time() * 1000) % 1e9))
+    argweaverclib.setRandomSeed(int((time.time() * 1000) % 1e9))
     argweaverclib.setLogLevel(1)
 
 
 def set_random_seed(num):
     """Set the C random number generator seed"""
-    argweaverclib.srand(num)
+    argweaverclib.setRandomSeed(num)
 
 
 #=============================================================================
@@ -4,6 +4,7 @@
 #endif
 #include <time.h>
 #include <memory>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -47,19 +48,6 @@ const char *COAL_RECORDS_SUFFIX = ".cr";
 const int EXIT_ERROR = 1;
 
 
-class MigEvent {
-public:
-    MigEvent(char *name0, int from_pop, int to_pop, int time) :
-        from_pop(from_pop), to_pop(to_pop), time(time) {
-        name = string(name0);
-    }
-    string name;
-    int from_pop;
-    int to_pop;
-    int time;
-};
-
-
 // parsing command-line options
 class Config
 {
@@ -97,6 +85,10 @@ public:
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
                     "initial ARG file (*.smc) for resampling"));
+        config.add(new ConfigParam<string>
+                   ("", "--arg-list", "<args.txt>", &arg_list_file, "",
+                    "(alternative to --arg) file listing ARG samples to"
+                    " evaluate, one per line as '<SMC file> <MCMC rep>'"));
         config.add(new ConfigParam<string>
                    ("", "--region", "<start>-<end>",
                     &region, "",
@@ -152,6 +144,10 @@ public:
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<threads>", &nthreads, 1,
+                    "number of ARG samples to evaluate in parallel"
+                    " (default=1)"));
         config.add(new ConfigSwitch
                    ("", "--overwrite", &overwrite,
                     "overwrite output file (default: append)"));
@@ -191,6 +187,11 @@ public:
             printf(VERSION_INFO);
             return EXIT_ERROR;
         }
+
+        if (nthreads < 1) {
+            printError("--threads must be at least 1");
+            return EXIT_ERROR;
+        }
         return 0;
     }
 
@@ -202,6 +203,7 @@ public:
     string subsites_file;
     string outfile_name;
     string arg_file;
+    string arg_list_file;
     string region;
     string log_file;
     string regions_bed_file;
@@ -219,6 +221,7 @@ public:
 
     // misc
     int randseed;
+    int nthreads;
 
     // help/information
     bool quiet;
@@ -323,89 +326,26 @@ bool read_init_arg(const char *arg_file, const ArgModel *model,
 
 
 
-// region_start and region_end are 0-based, not compressed
-void print_arg_likelihood(const ArgModel *model,
-                          const Sequences *sequences,
-                          const LocalTrees *trees,
-                          const Config *c,
-                          const Region *region,
-                          const vector<int> &invisible_recomb_pos,
-                          const vector<Spr> &invisible_recombs,
-                          const SitesMapping *sites_mapping,
-                          const vector<class MigEvent> &migevents) {
-    int start, end;
-    if (sites_mapping != NULL) {
-        start = sites_mapping->compress(region->start);
-        end = sites_mapping->compress(region->end-1)+1;
-    } else {
-        start = region->start;
-        end = region->end;
-    }
-    double prior = calc_arg_prior(model, trees, NULL, NULL,
-                                  start, end,
-                                  invisible_recomb_pos, invisible_recombs);
-    double prior2 = calc_arg_prior_recomb_integrate(model, trees,
-                                                    start, end);
-    double like = calc_arg_likelihood(model, sequences, trees,
-                                      start, end);
-    int noncompat = count_noncompat(trees, sequences, start, end);
-    int nrecomb=0;
-    int curr_end=trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ++it) {
-        int curr_start = curr_end;
-        curr_end += it->blocklen;
-        if (curr_end <= start) continue;
-        if (curr_start >= end) break;
-        if (curr_end != end) nrecomb++;
-    }
-    fprintf(c->outfile, "%s\t%i\t%i\t%i\t%f\t%f\t%f\t%i\t%i", region->chrom.c_str(),
-            region->start, region->end, c->mcmc_rep, prior, prior2, like,
-            nrecomb, noncompat);
-
-    for (unsigned int i=0; i < migevents.size(); i++) {
-        int count[2]={0,0};
-        int migtime = migevents[i].time;
-        int from_pop = migevents[i].from_pop;
-        int to_pop = migevents[i].to_pop;
-        int prev_time=0; // set prev_time to time interval immediately before migtime
-        for (int j=0; j < model->ntimes; j++) {
-            if (model->times[j] < migtime)
-                prev_time = j;
-            else break;
-        }
-        if (start <= trees->start_coord) {
-            const LocalTree *tree = trees->begin()->tree;
-            for (int j=0; j < tree->nnodes; j++) {
-                if (tree->nodes[j].age > prev_time) continue;
-                if (j != tree->root &&
-                    tree->nodes[tree->nodes[j].parent].age <= prev_time)
-                    continue;
-                if (model->get_pop(tree->nodes[j].pop_path, prev_time) == from_pop) {
-                    if (model->get_pop(tree->nodes[j].pop_path, prev_time+1) == to_pop)
-                        count[1]++;
-                    else count[0]++;
-                }
-            }
-        }
-        int curr_end = trees->start_coord;
-        for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ++it) {
-            int curr_start = curr_end;
-            curr_end += it->blocklen;
-            if (curr_end <= start) continue;
-            if (curr_start >= end) break;
-            const Spr *spr = &it->spr;
-            if (spr->recomb_time <= prev_time && spr->coal_time >= prev_time+1 &&
-                model->get_pop(spr->pop_path, prev_time) == from_pop) {
-                if (model->get_pop(spr->pop_path, prev_time+1) == to_pop)
-                    count[1]++;
-                else count[0]++;
-            }
+// Formats the statistics of each region as lines of the output file
+void format_region_stats(const vector<Region> &regions,
+                         const vector<RegionStats> &stats, int rep,
+                         string &output)
+{
+    char buf[1000];
+    for (unsigned int i=0; i<regions.size(); i++) {
+        const RegionStats &st = stats[i];
+        snprintf(buf, sizeof(buf), "%s\t%i\t%i\t%i\t%f\t%f\t%f\t%i\t%i",
+                 regions[i].chrom.c_str(), regions[i].start, regions[i].end,
+                 rep, st.prior, st.prior2, st.likelihood, st.nrecomb,
+                 st.noncompat);
+        output += buf;
+        for (unsigned int k=0; k < st.mig_counts.size(); k += 2) {
+            snprintf(buf, sizeof(buf), "\t%i\t%i",
+                     st.mig_counts[k], st.mig_counts[k+1]);
+            output += buf;
         }
-        fprintf(c->outfile, "\t%i\t%i", count[1], count[0]);
-
+        output += "\n";
     }
-    fprintf(c->outfile, "\n");
-
 }
 
 void parse_status_file(string log_file, int mcmc_rep, ArgModel *model) {
@@ -449,6 +389,237 @@ void parse_status_file(string log_file, int mcmc_rep, ArgModel *model) {
 
 
 
+//=============================================================================
+// ARG samples
+
+
+// An ARG sample and the MCMC rep it was sampled at
+class ArgSample
+{
+public:
+    ArgSample(string arg_file="", int rep=0) :
+        arg_file(arg_file), rep(rep) {}
+
+    string arg_file;
+    int rep;
+};
+
+
+bool read_arg_list(const char *filename, vector<ArgSample> &samples)
+{
+    FILE *infile = fopen(filename, "r");
+    if (!infile) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+    char *line;
+    int lineno = 0;
+    while ((line = fgetline(infile))) {
+        lineno++;
+        chomp(line);
+        vector<string> tokens;
+        split(line, " \t", tokens);
+        delete [] line;
+        if (tokens.size() == 0 || tokens[0][0] == '#')
+            continue;
+        int rep;
+        if (tokens.size() != 2 || sscanf(tokens[1].c_str(), "%d", &rep) != 1) {
+            printError("%s:%d: expected '<SMC file> <MCMC rep>'",
+                       filename, lineno);
+            fclose(infile);
+            return false;
+        }
+        samples.push_back(ArgSample(tokens[0], rep));
+    }
+    fclose(infile);
+    return true;
+}
+
+
+// Returns the model of MCMC rep 'rep' of the arg-sample run
+ArgModel *get_sample_model(const Config *c, const ArgModel *base_model,
+                           int rep)
+{
+    ArgModel *model = new ArgModel(*base_model);
+    parse_status_file(c->log_file, rep, model);
+    if (c->panmictic_popsize > 0) {
+        if (model->pop_tree != NULL) {
+            delete(model->pop_tree);
+            model->pop_tree = NULL;
+        }
+        model->free_popsizes();
+        model->set_popsizes(c->panmictic_popsize);
+    }
+    return model;
+}
+
+
+// Reads an ARG sample and appends the statistics of all 'regions' to
+// 'output'.  If 'regions' is empty, the whole ARG is used as a region of
+// 'chrom'.
+bool eval_arg_sample(const Config *c, const ArgModel *base_model,
+                     const Sequences *sequences,
+                     const SitesMapping *sites_mapping,
+                     const vector<Region> &regions, const string &chrom,
+                     const vector<MigEvent> &migevents,
+                     const ArgSample &sample, string &output)
+{
+    ArgModel *model = get_sample_model(c, base_model, sample.rep);
+
+    LocalTrees trees;
+    vector<string> seqnames;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    if (!read_init_arg(sample.arg_file.c_str(), model, &trees, seqnames,
+                       &invisible_recomb_pos, &invisible_recombs)) {
+        printError("could not read ARG");
+        delete model;
+        return false;
+    }
+    if (!trees.set_seqids(seqnames, sequences->names)) {
+        printError("input ARG's sequence names do not match input"
+                   " sequences");
+        delete model;
+        return false;
+    }
+    if (c->panmictic_popsize > 0)
+        remove_population_paths(&trees);
+
+    vector<Region> arg_region;
+    if (regions.size() == 0)
+        arg_region.push_back(Region(chrom, trees.start_coord,
+                                    trees.end_coord));
+    if (sites_mapping) {
+        compress_local_trees(&trees, sites_mapping);
+        for (unsigned int i=0; i < invisible_recomb_pos.size(); i++)
+            invisible_recomb_pos[i] = sites_mapping->compress(invisible_recomb_pos[i], 0,
+                                                              i==0 ? 0 : invisible_recomb_pos[i-1]);
+    }
+
+    printLog(LOG_LOW, "read input ARG (chrom=%s, start=%d, end=%d,"
+             " nseqs=%d)\n",
+             trees.chrom.c_str(), trees.start_coord, trees.end_coord,
+             trees.get_num_leaves());
+
+    const vector<Region> &regions2 = (regions.size() ? regions : arg_region);
+    vector<RegionStats> stats;
+    calc_region_stats(model, sequences, &trees, regions2,
+                      invisible_recomb_pos, invisible_recombs,
+                      sites_mapping, migevents, stats);
+    format_region_stats(regions2, stats, sample.rep, output);
+
+    delete model;
+    return true;
+}
+
+
+// ARG samples evaluated by a pool of threads.  Output is written in the
+// order of the samples.
+class ArgSampleJobs
+{
+public:
+    ArgSampleJobs(const Config *c, const ArgModel *base_model,
+                  const Sequences *sequences,
+                  const SitesMapping *sites_mapping,
+                  const vector<Region> &regions, const string &chrom,
+                  const vector<MigEvent> &migevents,
+                  const vector<ArgSample> &samples) :
+        c(c), base_model(base_model), sequences(sequences),
+        sites_mapping(sites_mapping), regions(regions), chrom(chrom),
+        migevents(migevents), samples(samples),
+        outputs(samples.size()), done(samples.size(), false),
+        next_sample(0), next_output(0), error(false)
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~ArgSampleJobs()
+    {
+        pthread_mutex_destroy(&lock);
+    }
+
+    const Config *c;
+    const ArgModel *base_model;
+    const Sequences *sequences;
+    const SitesMapping *sites_mapping;
+    const vector<Region> &regions;
+    const string &chrom;
+    const vector<MigEvent> &migevents;
+    const vector<ArgSample> &samples;
+
+    vector<string> outputs;
+    vector<bool> done;
+    int next_sample;
+    int next_output;
+    bool error;
+    pthread_mutex_t lock;
+};
+
+
+static void *eval_arg_samples_thread(void *ptr)
+{
+    ArgSampleJobs *jobs = (ArgSampleJobs*) ptr;
+    const int nsamples = jobs->samples.size();
+
+    while (true) {
+        pthread_mutex_lock(&jobs->lock);
+        const int i = (jobs->error ? nsamples : jobs->next_sample++);
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= nsamples)
+            break;
+
+        string output;
+        bool ok = eval_arg_sample(jobs->c, jobs->base_model,
+                                  jobs->sequences, jobs->sites_mapping,
+                                  jobs->regions, jobs->chrom,
+                                  jobs->migevents,
+                                  jobs->samples[i], output);
+
+        pthread_mutex_lock(&jobs->lock);
+        if (!ok)
+            jobs->error = true;
+        jobs->outputs[i].swap(output);
+        jobs->done[i] = true;
+        while (jobs->next_output < nsamples && jobs->done[jobs->next_output]) {
+            string &out = jobs->outputs[jobs->next_output++];
+            fputs(out.c_str(), jobs->c->outfile);
+            string().swap(out);
+        }
+        pthread_mutex_unlock(&jobs->lock);
+    }
+    return NULL;
+}
+
+
+// Evaluates all ARG samples using c->nthreads threads
+bool eval_arg_samples(const Config *c, const ArgModel *base_model,
+                      const Sequences *sequences,
+                      const SitesMapping *sites_mapping,
+                      const vector<Region> &regions, const string &chrom,
+                      const vector<MigEvent> &migevents,
+                      const vector<ArgSample> &samples)
+{
+    ArgSampleJobs jobs(c, base_model, sequences, sites_mapping, regions,
+                       chrom, migevents, samples);
+
+    // the calling thread is one of the workers
+    vector<pthread_t> threads;
+    for (int i=1; i<c->nthreads && i<(int)samples.size(); i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, eval_arg_samples_thread,
+                           &jobs) != 0)
+            break;
+        threads.push_back(thread);
+    }
+    eval_arg_samples_thread(&jobs);
+    for (unsigned int i=0; i<threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    return !jobs.error;
+}
+
+
+
 //=============================================================================
 
 
@@ -477,7 +648,7 @@ int main(int argc, char **argv)
     // probably never used in this program
     if (c.randseed == 0)
         c.randseed = time(NULL);
-    srand(c.randseed);
+    seed_rand(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
     vector<class MigEvent> migevents;
@@ -600,15 +771,6 @@ int main(int argc, char **argv)
         return EXIT_ERROR;
     }
     c.model = new ArgModel(c.log_file.c_str());
-    parse_status_file(c.log_file, c.mcmc_rep, c.model);
-    if (c.panmictic_popsize > 0) {
-        if (c.model->pop_tree != NULL) {
-            delete(c.model->pop_tree);
-            c.model->pop_tree = NULL;
-        }
-        c.model->free_popsizes();
-        c.model->set_popsizes(c.panmictic_popsize);
-    }
     // log model has compressed rates so un-compress them; they
     // will later be re-compressed
     int old_compress = get_compress_from_logfile(c.log_file);
@@ -646,91 +808,42 @@ int main(int argc, char **argv)
 
     compress_model(c.model, sites_mapping, c.compress_seq);
 
-    c.model->log_model();
-
-    // setup init ARG
-    LocalTrees *trees = NULL;
-    unique_ptr<LocalTrees> trees_ptr;
-    if (c.arg_file == "") {
+    // setup ARG samples
+    vector<ArgSample> samples;
+    if (c.arg_list_file != "") {
+        if (c.arg_file != "") {
+            printError("--arg and --arg-list should not both be used");
+            return EXIT_ERROR;
+        }
+        if (!read_arg_list(c.arg_list_file.c_str(), samples))
+            return EXIT_ERROR;
+    } else if (c.arg_file != "") {
+        samples.push_back(ArgSample(c.arg_file, c.mcmc_rep));
+    } else {
         printError("Error: --arg-file required\n");
         return EXIT_ERROR;
     }
-    // init ARG from file
-    trees = new LocalTrees();
-    trees_ptr = unique_ptr<LocalTrees>(trees);
-    vector<string> seqnames;
-    vector<int> invisible_recomb_pos;
-    vector<Spr> invisible_recombs;
-    if (!read_init_arg(c.arg_file.c_str(), c.model, trees, seqnames,
-                       &invisible_recomb_pos, &invisible_recombs)) {
-        printError("could not read ARG");
-        return EXIT_ERROR;
-    }
-    if (!trees->set_seqids(seqnames, sequences.names)) {
-        printError("input ARG's sequence names do not match input"
-                   " sequences");
-        return EXIT_ERROR;
-    }
-    if (c.panmictic_popsize > 0)
-        remove_population_paths(trees);
-    if (c.region == "" && c.regions_bed_file == "") {
-        char tmp[1000];
-        sprintf(tmp, "%i-%i", trees->start_coord+1, trees->end_coord);
-        c.region = string(tmp);
-    }
-    if (sites_mapping) {
-        compress_local_trees(trees, sites_mapping);
-        for (unsigned int i=0; i < invisible_recomb_pos.size(); i++)
-            invisible_recomb_pos[i] = sites_mapping->compress(invisible_recomb_pos[i], 0,
-                                                              i==0 ? 0 : invisible_recomb_pos[i-1]);
-    }
-
-    printLog(LOG_LOW, "read input ARG (chrom=%s, start=%d, end=%d,"
-             " nseqs=%d)\n",
-             trees->chrom.c_str(), trees->start_coord, trees->end_coord,
-             trees->get_num_leaves());
-
-    // get memory usage in MB
-    double maxrss = get_max_memory_usage() / 1000.0;
-    printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
-
-
-    if (!(c.outfile = fopen(c.outfile_name.c_str(),
-                            c.overwrite ? "w" : "a"))) {
-        printError("Could not open out file %s for writing\n",
-                   c.outfile_name.c_str());
+    if (samples.size() == 0) {
+        printError("no ARG samples given");
         return EXIT_ERROR;
     }
 
-    if (c.overwrite) {
-        fprintf(c.outfile, "#chrom\tstart\tend\trep\tprior\tprior2\tlikelihood\tnrecomb\tncompat");
-        for (unsigned int i=0; i < migevents.size(); i++)
-            fprintf(c.outfile, "\t%s_1\t%s_0", migevents[i].name.c_str(),
-                    migevents[i].name.c_str());
-        fprintf(c.outfile, "\n");
+    {
+        ArgModel *model = get_sample_model(&c, c.model, samples[0].rep);
+        model->log_model();
+        delete model;
     }
 
-    // get likelihod
-    printLog(LOG_LOW, "\n");
-
+    // setup regions; without any, each sample is evaluated as a whole
+    vector<Region> regions;
     if (c.region != "") {
         int start, end;
         if (!parse_region(c.region.c_str(), &start, &end)) {
             printError("Error parsing region string %s\n", c.region.c_str());
             return EXIT_ERROR;
         }
-        seq_region.start = start-1;
-        seq_region.end = end;
-
-        print_arg_likelihood(c.model, &sequences, trees, &c,
-                             &seq_region,
-                             invisible_recomb_pos, invisible_recombs,
-                             sites_mapping, migevents);
-    } else {
-        if (c.regions_bed_file == "") {
-            printError("Need to supply --region or --region-bed");
-            return EXIT_ERROR;
-        }
+        regions.push_back(Region(sites.chrom, start-1, end));
+    } else if (c.regions_bed_file != "") {
         FILE *bedfile;
         if (!(bedfile = fopen(c.regions_bed_file.c_str(), "r"))) {
             printError("Error opening bed file %s\n", c.regions_bed_file.c_str());
@@ -748,19 +861,42 @@ int main(int argc, char **argv)
                 printError("Should have at least three entries in each line of bed file");
                 return EXIT_ERROR;
             }
-            if (tokens[0] == sites.chrom) {
-                seq_region.start = atoi(tokens[1].c_str());
-                seq_region.end = atoi(tokens[2].c_str());
-                print_arg_likelihood(c.model, &sequences, trees, &c,
-                                     &seq_region,
-                                     invisible_recomb_pos, invisible_recombs,
-                                     sites_mapping, migevents);
-            }
+            if (tokens[0] == sites.chrom)
+                regions.push_back(Region(sites.chrom,
+                                         atoi(tokens[1].c_str()),
+                                         atoi(tokens[2].c_str())));
             delete [] line;
         }
         fclose(bedfile);
     }
-    // TODO: call in loop for bed file
+
+    // get memory usage in MB
+    double maxrss = get_max_memory_usage() / 1000.0;
+    printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
+
+
+    if (!(c.outfile = fopen(c.outfile_name.c_str(),
+                            c.overwrite ? "w" : "a"))) {
+        printError("Could not open out file %s for writing\n",
+                   c.outfile_name.c_str());
+        return EXIT_ERROR;
+    }
+
+    if (c.overwrite) {
+        fprintf(c.outfile, "#chrom\tstart\tend\trep\tprior\tprior2\tlikelihood\tnrecomb\tncompat");
+        for (unsigned int i=0; i < migevents.size(); i++)
+            fprintf(c.outfile, "\t%s_1\t%s_0", migevents[i].name.c_str(),
+                    migevents[i].name.c_str());
+        fprintf(c.outfile, "\n");
+    }
+
+    // get likelihod
+    printLog(LOG_LOW, "\n");
+    if (!eval_arg_samples(&c, c.model, &sequences, sites_mapping, regions,
+                          sites.chrom, migevents, samples)) {
+        fclose(c.outfile);
+        return EXIT_ERROR;
+    }
 
     // final log message
     maxrss = get_max_memory_usage() / 1000.0;
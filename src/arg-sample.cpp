@@ -2,6 +2,7 @@
 #ifdef ARGWEAVER_MPI
 #include "mpi.h"
 #endif
+#include <pthread.h>
 #include <time.h>
 #include <memory>
 #include <sys/stat.h>
@@ -13,10 +14,12 @@
 #include "argweaver/emit.h"
 #include "argweaver/fs.h"
 #include "argweaver/logging.h"
+#include "argweaver/local_tree_binary.h"
 #include "argweaver/mem.h"
 #include "argweaver/parsing.h"
 #include "argweaver/sample_arg.h"
 #include "argweaver/sequences.h"
+#include "argweaver/simd.h"
 #include "argweaver/total_prob.h"
 #include "argweaver/track.h"
 #include "argweaver/est_popsize.h"
@@ -137,7 +140,8 @@ public:
                     " ind_1 and ind_2)"));
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
-                    "initial ARG file (*.smc) for resampling (optional)"));
+                    "initial ARG file (*.smc or smc2bin output) for resampling"
+                    " (optional)"));
         /*        config.add(new ConfigParam<string>
                    ("", "--cr", "<CR file>", &cr_file, "",
                    "initial ARGfile (*.cf) for resampling (optional)"));*/
@@ -373,18 +377,18 @@ public:
 		    "Hamiltonian population size updates", EXPERIMENTAL_OPT));
         config.add(new ConfigParam<double>
 		   ("", "--pseudocount", "<val>", &pseudocount,
-		    1.0, "(for use with --sample-popsize) gives weight to prior",
+		    1.0, "ignored: pseudocount for EM popsize estimates, which"
+		    " are not currently made",
 		    EXPERIMENTAL_OPT));
-#ifdef ARGWEAVER_MPI
         config.add(new ConfigParam<int>
                    ("", "--mcmcmc", "<int>", &mcmcmc_numgroup,
-                    1, "number of mcmcmc threads",
+                    1, "number of mcmcmc threads (without MPI, the chains"
+                    " run on threads of this process)",
                     EXPERIMENTAL_OPT));
         config.add(new ConfigParam<double>
                    ("", "--mcmcmc-heat", "<val>", &mcmcmc_heat,
                     0.05, "heat interval for each thread in (MC)^3 group",
                     EXPERIMENTAL_OPT));
-#endif
         config.add(new ConfigSwitch
                    ("", "--init-popsize-random", &init_popsize_random,
                     "(for use with --sample-popsize). Initialize each"
@@ -469,6 +473,41 @@ public:
                     &resample_window_iters, 10,
                     "number of iterations per sliding window for resampling"
                     " (default=10)", ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--matrix-cache", "<MB>", &matrix_cache_mb, 256.0,
+                    "memory budget for reusing transition matrices between"
+                    " the forward algorithm and traceback (default=256,"
+                    " 0 disables the cache)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<threads>", &nthreads, 1,
+                    "number of threads used to compute HMM matrices ahead"
+                    " of the forward algorithm, to read --vcf-files and to"
+                    " compress output files (default=1)", ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--parallel-windows", &parallel_windows,
+                    "resample non-overlapping windows in parallel (using"
+                    " --threads) instead of a sliding window",
+                    EXPERIMENTAL_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--forward-segments", "<segments>", &forward_segments,
+                    0, "split the forward algorithm into segments that are"
+                    " computed in parallel (using --threads) and then"
+                    " reconciled (default=0, sequential)", EXPERIMENTAL_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--forward-table", "<MB>", &forward_table_mb, 0.0,
+                    "memory budget for the forward table; if the full table"
+                    " does not fit, columns are recomputed during the"
+                    " traceback (default=0, no limit)", ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--forward-table-float", &forward_table_float,
+                    "store the columns kept by --forward-table in single"
+                    " precision", ADVANCED_OPT));
+        config.add(new ConfigParam<string>
+                   ("", "--simd", "<auto|scalar|avx2|avx512>", &simd_str,
+                    "auto",
+                    "vector instruction set used by the forward algorithm"
+                    " (default=auto, the best one supported by the CPU)",
+                    ADVANCED_OPT));
 
 
         // help information
@@ -532,8 +571,33 @@ public:
             printf(VERSION_INFO);
             return EXIT_ERROR;
         }
-#ifdef ARGWEAVER_MPI
+
+        if (nthreads < 1) {
+            printError("--threads must be at least 1");
+            return EXIT_ERROR;
+        }
+
+        if (forward_table_mb < 0) {
+            printError("--forward-table must be non-negative");
+            return EXIT_ERROR;
+        }
+
+        if (!parse_simd_level(simd_str.c_str(), &simd_level)) {
+            printError("unknown --simd level '%s'", simd_str.c_str());
+            return EXIT_ERROR;
+        }
+        if (mcmcmc_numgroup < 1) {
+            printError("--mcmcmc must be at least 1");
+            return EXIT_ERROR;
+        }
+        if (mcmcmc_heat * (mcmcmc_numgroup - 1) >= 1.0) {
+            printError("--mcmcmc-heat is too large for %d chains",
+                       mcmcmc_numgroup);
+            return EXIT_ERROR;
+        }
+
         mcmcmc_group = 0;
+#ifdef ARGWEAVER_MPI
         int groupsize = MPI::COMM_WORLD.Get_size() / mcmcmc_numgroup;
         mcmcmc_group = MPI::COMM_WORLD.Get_rank() / groupsize;
         if (mcmcmc_group != 0) {
@@ -603,10 +667,10 @@ public:
     double epsilon;
     double pseudocount;
 
-#ifdef ARGWEAVER_MPI
     double mcmcmc_heat;
     int mcmcmc_group;
     int mcmcmc_numgroup;
+#ifdef ARGWEAVER_MPI
     bool mpi;
 #endif
     string mcmcmc_prefix;
@@ -627,6 +691,14 @@ public:
     int resample_window;
     int resample_window_iters;
     bool gibbs;
+    double matrix_cache_mb;
+    int nthreads;
+    bool parallel_windows;
+    int forward_segments;
+    double forward_table_mb;
+    bool forward_table_float;
+    string simd_str;
+    int simd_level;
 
     // misc
     int compress_seq;
@@ -658,6 +730,7 @@ public:
 
     // logging
     FILE *stats_file;
+    ArgProbCache prob_cache;
 };
 
 
@@ -751,28 +824,23 @@ void print_stats_header(Config *config) {
 }
 
 
-void print_stats(FILE *stats_file, const char *stage, int iter,
-                 ArgModel *model,
-                 const Sequences *sequences, LocalTrees *trees,
-                 const SitesMapping* sites_mapping, const Config *config,
-                 const TrackNullValue *maskmap_uncompressed,
-                 const vector<int> &invisible_recomb_pos0=vector<int>(),
-                 const vector<Spr> &invisible_recombs=vector<Spr>())
+// Bring config->prob_cache up to date with 'trees', which are uncompressed
+// for the calculation.  Sets the length of the uncompressed ARG if
+// 'arglen' is given.
+void update_prob_cache(ArgModel *model, const Sequences *sequences,
+                       LocalTrees *trees, const SitesMapping* sites_mapping,
+                       Config *config,
+                       const TrackNullValue *maskmap_uncompressed,
+                       const vector<int> &invisible_recomb_pos0=vector<int>(),
+                       const vector<Spr> &invisible_recombs=vector<Spr>(),
+                       double *arglen=NULL)
 {
+    // only the blocks that changed since the last call are recomputed
+    ArgProbCache *cache = &config->prob_cache;
 
-    // calculate number of recombinations
-    int nrecombs = trees->get_num_trees() - 1;
-
-    // calculate number of non-compatiable sites
-    int nseqs = trees->get_num_leaves();
-    char *seqs[nseqs];
-    for (int i=0; i<nseqs; i++)
-        seqs[i] = sequences->seqs[trees->seqids[i]];
-    int noncompats = count_noncompat(trees, seqs, nseqs, sequences->length());
-
-    // get memory usage in MB
-    double maxrss = get_max_memory_usage() / 1000.0;
-
+    // phase sampling rewrites the sequences in place
+    if (model->unphased)
+        cache->clear_sequence_terms();
 
     // calculate likelihood, prior, and joint probabilities
     // uncompressed local trees
@@ -783,21 +851,47 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
         sites_mapping->uncompress(invisible_recomb_pos0, invisible_recomb_pos);
     }
 
-    double prior = calc_arg_prior(model, trees, NULL, NULL, -1, -1,
-                                  invisible_recomb_pos, invisible_recombs);
-    double prior2 = calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
-    double likelihood = config->all_masked ? 0.0 :
-        calc_arg_likelihood(model, sequences, trees,
-                            sites_mapping,
-                            maskmap_uncompressed);
-    double joint = prior + likelihood;
-    double arglen = get_arglen(trees, model->times);
+    cache->update(model, sequences, trees, sites_mapping,
+                  maskmap_uncompressed, !config->all_masked,
+                  invisible_recomb_pos, invisible_recombs);
+    if (arglen)
+        *arglen = get_arglen(trees, model->times);
 
     // recompress local trees
     if (sites_mapping) {
         compress_local_trees(trees, sites_mapping);
 	compress_model(model, sites_mapping, config->compress_seq);
     }
+}
+
+
+void print_stats(FILE *stats_file, const char *stage, int iter,
+                 ArgModel *model,
+                 const Sequences *sequences, LocalTrees *trees,
+                 const SitesMapping* sites_mapping, Config *config,
+                 const TrackNullValue *maskmap_uncompressed,
+                 const vector<int> &invisible_recomb_pos=vector<int>(),
+                 const vector<Spr> &invisible_recombs=vector<Spr>())
+{
+    ArgProbCache *cache = &config->prob_cache;
+
+    // calculate number of recombinations
+    int nrecombs = trees->get_num_trees() - 1;
+
+    // calculate number of non-compatiable sites
+    int noncompats = cache->update_noncompat(trees, sequences);
+
+    // get memory usage in MB
+    double maxrss = get_max_memory_usage() / 1000.0;
+
+    double arglen;
+    update_prob_cache(model, sequences, trees, sites_mapping, config,
+                      maskmap_uncompressed, invisible_recomb_pos,
+                      invisible_recombs, &arglen);
+    double prior = cache->prior;
+    double prior2 = cache->prior2;
+    double likelihood = cache->likelihood;
+    double joint = prior + likelihood;
 
     // output stats
     fprintf(stats_file, "%s\t%d\t%f\t%f\t%f\t%f\t%d\t%d\t%f",
@@ -981,6 +1075,10 @@ bool read_doubles(const char *filename, vector<double> &values) {
 bool read_init_arg(const char *arg_file, const ArgModel *model,
                    LocalTrees *trees, vector<string> &seqnames)
 {
+    if (is_local_trees_binary(arg_file))
+        return read_local_trees_binary(arg_file, model->times, model->ntimes,
+                                       trees, seqnames);
+
     CompressStream stream(arg_file, "r");
     if (!stream.stream) {
         printError("cannot read '%s'", arg_file);
@@ -1035,7 +1133,8 @@ void climb_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 }
 
 void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
-                 const LocalTrees *trees, const SitesMapping *sites_mapping) {
+                 LocalTrees *trees, const SitesMapping *sites_mapping,
+                 const TrackNullValue *maskmap_orig) {
 #ifdef ARGWEAVER_MPI
     printLog(LOG_LOW, "mcmcmc_swap model->mc3.max_group=%i\n", model->mc3.max_group);
     if (model->mc3.max_group == 0) return;
@@ -1056,8 +1155,9 @@ void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
     MPI::COMM_WORLD.Bcast(swap, 2, MPI::INT, 0);
     if (mc3->group == swap[0] || mc3->group == swap[1]) {
         double vals[2];
-        vals[0] = calc_arg_prior(model, trees) +
-            calc_arg_likelihood(model, sequences, trees, sites_mapping);
+        update_prob_cache(model, sequences, trees, sites_mapping, config,
+                          maskmap_orig);
+        vals[0] = config->prob_cache.prior + config->prob_cache.likelihood;
         vals[1] = mc3->heat;
         if (mc3->group_comm->Get_rank()==0)
             mc3->group_comm->Reduce(MPI_IN_PLACE, vals, 1, MPI::DOUBLE, MPI_SUM,
@@ -1130,6 +1230,16 @@ void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
             }
         }
     }
+#else
+    // chains running on threads swap their states in shared memory
+    Mc3Exchange *exchange = model->mc3.exchange;
+    if (!exchange)
+        return;
+    // the same joint probability as in the stats, from the cached terms
+    update_prob_cache(model, sequences, trees, sites_mapping, config,
+                      maskmap_orig);
+    double lnl = config->prob_cache.prior + config->prob_cache.likelihood;
+    exchange->swap(model->mc3.group, lnl);
 #endif
 }
 
@@ -1172,6 +1282,7 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     double frac_leaf = 0.5;
 
 #ifdef ARGWEAVER_MPI
+    seed_rand(config->randseed);
     for (int i=0; i <= config->niters; i++) do_leaf[i] = (frand() < frac_leaf);
     MPI::COMM_WORLD.Bcast(do_leaf, config->niters+1, MPI::BOOL, 0);
 #endif
@@ -1179,6 +1290,14 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     for (int i=iter; i<=config->niters; i++) {
         printLog(LOG_LOW, "sample %d\n", i);
         Timer timer;
+
+        // every iteration of every chain draws from its own stream, so
+        // that a resumed run does not depend on the numbers drawn before
+        // it stopped
+        rand_stream().set_seed(
+            config->randseed, (unsigned long long) i *
+            config->mcmcmc_numgroup + config->mcmcmc_group);
+
         double heat = model->mc3.heat;
         if (model->pop_tree != NULL && i >= config->start_mig_iter) {
             if (model->pop_tree->max_migrations != config->max_migrations)
@@ -1196,7 +1315,8 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 	    else
 		resample_arg_mcmc_all(model, sequences, trees, do_leaf[i],
 				      window, niters, heat,
-                                      config->no_resample_mig);
+                                      config->no_resample_mig,
+                                      config->parallel_windows);
 	}
 
 
@@ -1206,16 +1326,13 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 	    mle_popsize(model, trees, config->popsize_em_min_event);
             else */
         if (model->popsize_config.sample > 0 && i % model->popsize_config.sample == 0) {
-            resample_popsizes_mh(model, trees, true, heat);
-            //	    update_popsize_hmc(model, trees);
-        } /*else {
-            printError("Have not implemented popsize update for multipop yet\n");
-            //no_update_popsize(model, trees);
-            }*/
+            update_popsize_hmc(model, trees, heat);
+        }
 
         printTimerLog(timer, LOG_LOW, "sample time:");
 
-        mcmcmc_swap(config, model, sequences, trees, sites_mapping);
+        mcmcmc_swap(config, model, sequences, trees, sites_mapping,
+                    maskmap_orig);
 
         if (model->smc_prime && config->invisible_recombs) {
             sample_invisible_recombinations(model, trees,
@@ -1312,6 +1429,137 @@ void sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 }
 
 
+// A chain of a threaded (MC)^3 run, other than the cold chain
+class Mc3Chain
+{
+public:
+    Mc3Chain(const Config &config, const ArgModel &model) :
+        config(config),
+        model(model),
+        logger(NULL)
+    {}
+
+    Config config;
+    ArgModel model;
+    LocalTrees trees;
+    RandStream rand;
+    Logger *logger;
+
+    Sequences *sequences;
+    SitesMapping *sites_mapping;
+    const TrackNullValue *maskmap_orig;
+};
+
+
+static void *sample_arg_mc3_chain(void *ptr)
+{
+    Mc3Chain *chain = (Mc3Chain*) ptr;
+    set_thread_rand_stream(&chain->rand);
+    set_thread_logger(chain->logger);
+    sample_arg(&chain->model, chain->sequences, &chain->trees,
+               chain->sites_mapping, &chain->config, chain->maskmap_orig);
+    set_thread_logger(NULL);
+    set_thread_rand_stream(NULL);
+    return NULL;
+}
+
+
+// Sample an ARG with --mcmcmc tempered chains that run on threads of this
+// process.  The cold chain runs on the calling thread and writes the usual
+// output files.  Chain k writes files with the prefix <out>.k.  On resume,
+// all chains continue from the last ARG of the cold chain.
+bool sample_arg_mc3(ArgModel *model, Sequences *sequences, LocalTrees *trees,
+                    SitesMapping* sites_mapping, Config *config,
+                    const TrackNullValue *maskmap_orig)
+{
+    const int nchains = config->mcmcmc_numgroup;
+    if (model->unphased) {
+        printError("--mcmcmc chains on threads cannot sample phases");
+        return false;
+    }
+
+    Mc3Exchange exchange(nchains, rand_stream().next_seed());
+    model->mc3 = Mc3Config(0, config->mcmcmc_heat);
+    model->mc3.max_group = nchains - 1;
+    model->mc3.exchange = &exchange;
+    exchange.add_chain(0, model, trees);
+
+    // setup the heated chains
+    vector<Mc3Chain*> chains;
+    bool ok = true;
+    for (int k=1; k<nchains && ok; k++) {
+        Mc3Chain *chain = new Mc3Chain(*config, *model);
+        chains.push_back(chain);
+        chain->config.mcmcmc_group = k;
+        char prefix[20];
+        snprintf(prefix, sizeof(prefix), ".%d", k);
+        chain->config.mcmcmc_prefix = prefix;
+        chain->model.mc3 = Mc3Config(k, config->mcmcmc_heat);
+        chain->model.mc3.max_group = nchains - 1;
+        chain->model.mc3.exchange = &exchange;
+        chain->trees.copy(*trees);
+        chain->rand.set_seed(rand_stream().next_seed());
+        chain->sequences = sequences;
+        chain->sites_mapping = sites_mapping;
+        chain->maskmap_orig = maskmap_orig;
+        exchange.add_chain(k, &chain->model, &chain->trees);
+
+        const char *mode = (config->resume ? "a" : "w");
+        string out_prefix = config->out_prefix + chain->config.mcmcmc_prefix;
+        string stats_filename = out_prefix + STATS_SUFFIX;
+        if (!(chain->config.stats_file = fopen(stats_filename.c_str(),
+                                               mode))) {
+            printError("could not open stats file '%s'",
+                       stats_filename.c_str());
+            ok = false;
+            break;
+        }
+        string log_filename = out_prefix + LOG_SUFFIX;
+        chain->logger = new Logger(NULL, get_logger().getLogLevel());
+        if (!chain->logger->openLogFile(log_filename.c_str(), mode)) {
+            printError("could not open log file '%s'", log_filename.c_str());
+            ok = false;
+            break;
+        }
+        chain->logger->printLog(LOG_LOW, "chain %d of %d, heat=%f\n",
+                                k, nchains, chain->model.mc3.heat);
+    }
+
+    // run chains
+    vector<pthread_t> threads;
+    if (ok) {
+        for (unsigned int i=0; i<chains.size(); i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, sample_arg_mc3_chain,
+                               chains[i]) != 0) {
+                // the chains would wait for each other forever
+                exitError("could not start thread for chain %d", i + 1);
+            }
+            threads.push_back(thread);
+        }
+        sample_arg(model, sequences, trees, sites_mapping, config,
+                   maskmap_orig);
+        for (unsigned int i=0; i<threads.size(); i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    // clean up
+    for (unsigned int i=0; i<chains.size(); i++) {
+        if (chains[i]->config.stats_file)
+            fclose(chains[i]->config.stats_file);
+        if (chains[i]->logger) {
+            if (chains[i]->logger->getLogFile())
+                chains[i]->logger->closeLogFile();
+            delete chains[i]->logger;
+        }
+        delete chains[i];
+    }
+    model->mc3.exchange = NULL;
+
+    return ok;
+}
+
+
 //=============================================================================
 
 bool parse_status_line(const char* line, Config &config,
@@ -1564,6 +1812,7 @@ int main(int argc, char **argv)
         c.randseed = time(NULL);
 #ifdef ARGWEAVER_MPI
     if (MPI::COMM_WORLD.Get_rank()==0) {
+        seed_rand(c.randseed);
         for (int i=1; i < MPI::COMM_WORLD.Get_size(); i++) {
             int seed = irand(12581020);
             MPI::COMM_WORLD.Send(&seed, 1, MPI::INT, i, 13);
@@ -1572,9 +1821,13 @@ int main(int argc, char **argv)
         MPI::COMM_WORLD.Recv(&c.randseed, 1, MPI::INT, 0, 13);
     }
 #endif
-    srand(c.randseed);
+    seed_rand(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
+    // select vectorized kernels
+    set_simd_level(c.simd_level);
+    printLog(LOG_LOW, "simd kernels: %s\n", simd_level_name(get_simd_level()));
+
     // read sequences
     Sites sites;
     Sequences sequences;
@@ -1683,7 +1936,8 @@ int main(int argc, char **argv)
         }
         if (!read_vcfs(vcf_files, &sites, c.subregion_str,
                        c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
-                       c.mask_uncertain, c.tabix_dir, keep_inds)) {
+                       c.mask_uncertain, c.tabix_dir, keep_inds,
+                       c.nthreads)) {
             printError("Error reading VCF files\n");
             return EXIT_ERROR;
         }
@@ -1883,6 +2137,12 @@ int main(int argc, char **argv)
         // use single constant population size
         c.model.set_popsizes(c.popsize_str);
     }
+    c.model.hmm_config.matrix_cache_size = long(c.matrix_cache_mb * 1e6);
+    c.model.hmm_config.nthreads = c.nthreads;
+    set_compress_threads(c.nthreads);
+    c.model.hmm_config.forward_segments = c.forward_segments;
+    c.model.hmm_config.forward_table_size = long(c.forward_table_mb * 1e6);
+    c.model.hmm_config.forward_table_float = c.forward_table_float;
     const double infsites_penalty = 1e-100; // TODO: make configurable
     if (c.infsites)
         c.model.infsites_penalty = infsites_penalty;
@@ -2050,6 +2310,13 @@ int main(int argc, char **argv)
 
     // sample ARG
     printLog(LOG_LOW, "\n");
+#ifndef ARGWEAVER_MPI
+    if (c.mcmcmc_numgroup > 1) {
+        if (!sample_arg_mc3(&model, &sequences, trees, sites_mapping, &c,
+                            &maskmap_orig))
+            return EXIT_ERROR;
+    } else
+#endif
     sample_arg(&model, &sequences, trees, sites_mapping, &c, &maskmap_orig);
 
     // final log message
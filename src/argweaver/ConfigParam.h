@@ -200,6 +200,13 @@ public:
     ConfigParser()
     {}
 
+    // The rules point into the object that owns the parser, so a copy
+    // starts without any rules.
+    ConfigParser(const ConfigParser &other) :
+        prog(other.prog),
+        rest(other.rest)
+    {}
+
     ~ConfigParser()
     {
         clear();
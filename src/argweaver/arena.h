@@ -0,0 +1,113 @@
+//=============================================================================
+// Scratch memory for the threading HMM
+
+#ifndef ARGWEAVER_ARENA_H
+#define ARGWEAVER_ARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+
+namespace argweaver {
+
+// A bump allocator for temporary arrays whose lifetime is one block of the
+// HMM.  reset() releases all arrays at once but keeps the memory, so once
+// the arena has grown to the size of the largest block, no more memory is
+// allocated.  Arrays are 64-byte aligned and uninitialized, and should only
+// hold plain data (no constructors or destructors are called).
+//
+// An arena must only be used by one thread at a time.
+class ScratchArena
+{
+public:
+    ScratchArena() :
+        ptr(NULL),
+        end(NULL),
+        capacity(0)
+    {}
+
+    ~ScratchArena()
+    {
+        for (unsigned int i=0; i<chunks.size(); i++)
+            delete [] chunks[i];
+    }
+
+    // Releases all arrays.  If several chunks were needed since the last
+    // reset, they are merged into one that holds exactly their sizes.
+    void reset()
+    {
+        if (chunks.size() > 1) {
+            for (unsigned int i=0; i<chunks.size(); i++)
+                delete [] chunks[i];
+            chunks.clear();
+            const size_t total = capacity;
+            capacity = 0;
+            add_chunk(total);
+        } else if (chunks.size() == 1) {
+            ptr = chunks[0];
+        }
+    }
+
+    template <class T>
+    T *alloc(size_t n)
+    {
+        const size_t nbytes = n * sizeof(T);
+        char *start = align(ptr);
+        if (chunks.size() == 0 || start + nbytes > end) {
+            add_chunk(capacity > nbytes ? capacity : nbytes);
+            start = align(ptr);
+        }
+        ptr = start + nbytes;
+        return (T*) start;
+    }
+
+    // matrix with row pointers, laid out like new_matrix()
+    template <class T>
+    T **alloc_matrix(int nrows, int ncols)
+    {
+        T **mat = alloc<T*>(nrows);
+        T *block = alloc<T>(size_t(nrows) * ncols);
+        for (int i=0; i<nrows; i++)
+            mat[i] = &block[size_t(i) * ncols];
+        return mat;
+    }
+
+    // bytes available for arrays, not counting the slack for aligning
+    // each chunk
+    size_t get_nbytes() const {
+        return capacity;
+    }
+
+protected:
+    static const size_t ALIGN = 64;
+
+    static size_t round_up(size_t n) {
+        return (n + ALIGN - 1) & ~(ALIGN - 1);
+    }
+
+    static char *align(char *p) {
+        return (char*) round_up((size_t) p);
+    }
+
+    // Adds a chunk of at least 'size' bytes, rounded up to whole aligned
+    // blocks.  Since arrays start on block boundaries, a chunk holds any
+    // arrays whose rounded sizes sum to its size.
+    void add_chunk(size_t size)
+    {
+        size = round_up(size);
+        char *chunk = new char [size + ALIGN - 1];
+        chunks.push_back(chunk);
+        ptr = align(chunk);
+        end = ptr + size;
+        capacity += size;
+    }
+
+    std::vector<char*> chunks;
+    char *ptr;      // next free byte of the current chunk
+    char *end;      // end of the current chunk
+    size_t capacity;
+};
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_ARENA_H
@@ -4,8 +4,12 @@
 
 namespace argweaver {
 
+RandStream g_rand_stream;
+__thread RandStream *g_thread_rand_stream = NULL;
+
+
 /* make a draw from a gamma distribution with parameters 'a' and
- * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
+ * 'b'. Be sure to call seed_rand externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
  * if a < 1, rejection sampling from the Weibull distribution is
  * performed, both as described in "Non-Uniform Random Variate
@@ -109,4 +113,16 @@ double rand_beta(double a, double b, bool do_test) {
     }
     return rv;
 }
+
+
+//=============================================================================
+// C interface
+
+extern "C" {
+
+void setRandomSeed(int seed)
+{ seed_rand(seed); }
+
+} // extern "C"
+
 }
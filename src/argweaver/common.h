@@ -101,45 +101,114 @@ void permute(T* array, int *perm, int size)
 //=============================================================================
 // Math
 
+// A stream of pseudo-random integers in [0, RAND_MAX] (xorshift64*).
+// Threads that sample concurrently each draw from their own stream, so
+// that results do not depend on how the work is scheduled.
+class RandStream
+{
+public:
+    explicit RandStream(unsigned long long seed=0,
+                        unsigned long long stream=0)
+    { set_seed(seed, stream); }
+
+    // Start stream number 'stream' of 'seed'.  Streams with different
+    // numbers are independent, so a sampler can derive one for each
+    // chain, window or iteration from a single seed.
+    void set_seed(unsigned long long seed, unsigned long long stream=0)
+    {
+        // splitmix64, so that nearby seeds give unrelated streams
+        unsigned long long z = seed + (stream + 1) * 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        state = (z ^ (z >> 31)) | 1;
+        have_spare_norm = false;
+    }
+
+    inline int next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return int(((state * 0x2545f4914f6cdd1dULL) >> 33) %
+                   ((unsigned long long) RAND_MAX + 1));
+    }
+
+    // draw a seed for deriving further streams
+    unsigned long long next_seed()
+    {
+        // draw in a fixed order; the operands of | are unsequenced
+        const unsigned long long high = next();
+        const unsigned long long low = next();
+        return high << 31 | low;
+    }
+
+    // standard normal draw (Box-Muller); the second value of each pair
+    // is kept for the next call
+    double next_norm()
+    {
+        if (have_spare_norm) {
+            have_spare_norm = false;
+            return spare_norm;
+        }
+        const double pi = 3.1415926535897;
+        const double r1 = sqrt(-2.0*log(next() / double(RAND_MAX)));
+        const double r2 = 2*pi*(next() / double(RAND_MAX));
+        spare_norm = r1 * sin(r2);
+        have_spare_norm = true;
+        return r1 * cos(r2);
+    }
+
+protected:
+    unsigned long long state;
+    bool have_spare_norm;
+    double spare_norm;
+};
+
+// stream used by threads that have not set their own
+extern RandStream g_rand_stream;
+
+// stream used by the calling thread (NULL uses g_rand_stream)
+extern __thread RandStream *g_thread_rand_stream;
+
+// Seed the default stream, replacing srand()
+inline void seed_rand(unsigned long long seed, unsigned long long stream=0)
+{ g_rand_stream.set_seed(seed, stream); }
+
+// Draw random numbers on the calling thread from 'stream' instead of
+// the default stream.  Pass NULL to return to the default stream.
+inline void set_thread_rand_stream(RandStream *stream)
+{ g_thread_rand_stream = stream; }
+
+// the stream random numbers are drawn from on the calling thread
+inline RandStream &rand_stream()
+{ return g_thread_rand_stream ? *g_thread_rand_stream : g_rand_stream; }
+
+inline int rand_int()
+{ return rand_stream().next(); }
+
 inline double frand()
-{ return rand() / double(RAND_MAX); }
+{ return rand_int() / double(RAND_MAX); }
 
 inline double frand(double max)
-{ return rand() / double(RAND_MAX) * max; }
+{ return rand_int() / double(RAND_MAX) * max; }
 
 inline double frand(double min, double max)
-{ return min + (rand() / double(RAND_MAX) * (max-min)); }
+{ return min + (rand_int() / double(RAND_MAX) * (max-min)); }
 
 inline int irand(int max)
 {
-    const int i = int(rand() / float(RAND_MAX) * max);
+    const int i = int(rand_int() / float(RAND_MAX) * max);
     return (i == max) ? max - 1 : i;
 }
 
 inline int irand(int min, int max)
 {
-    const int i = min + int(rand() / float(RAND_MAX) * (max - min));
+    const int i = min + int(rand_int() / float(RAND_MAX) * (max - min));
     return (i == max) ? max - 1 : i;
 }
 
 inline double rand_norm(const double mean=0, const double sd=1) {
-  static bool gen_new=true;
-  static double y=0;
-  double x;
-  double pi = 3.1415926535897;
-  if (gen_new) {
-     double r1 = sqrt(-2.0*log(frand()));
-     double r2 = 2*pi*frand();
-     x = r1 * cos(r2);
-     y = r1 * sin(r2);
-     gen_new = false;
-  } else {
-     x = y;
-     gen_new = true;
-  }
-  x *= sd;
-  x += mean;
-  return x;
+  return mean + sd * rand_stream().next_norm();
 }
 
 /* make a draw from an exponential distribution with parameter
@@ -172,7 +241,7 @@ inline int rand_poisson(double rate) {
 }
 
  /* make a draw from a gamma distribution with parameters 'a' and
- * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
+ * 'b'. Be sure to call seed_rand externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
  * if a < 1, rejection sampling from the Weibull distribution is
  * performed, both as described in "Non-Uniform Random Variate
@@ -1,6 +1,11 @@
 
 #include <unistd.h>
+#include <algorithm>
 #include <string>
+#include <set>
+#include <vector>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "compress.h"
 #include "parsing.h"
@@ -9,11 +14,354 @@ namespace argweaver {
 
 using namespace std;
 
+
+//=============================================================================
+// in-process gzip streams
+//
+// Compressed files are read with zlib and written as BGZF, i.e. a series
+// of gzip members of at most 64KB each, which gzip reads like any other
+// gzip file and which tabix can index.  The streams are exposed as FILE*
+// through fopencookie(), so callers can use stdio as with the pipes.
+
+#ifdef __GLIBC__
+#define ARGWEAVER_INPROCESS_GZIP
+#endif
+
+
+static int compress_threads = 1;
+
+void set_compress_threads(int nthreads)
+{
+    compress_threads = max(nthreads, 1);
+}
+
+
+#ifdef ARGWEAVER_INPROCESS_GZIP
+
+// streams opened with fopencookie (everything else is a pipe)
+static set<FILE*> cookie_streams;
+static pthread_mutex_t cookie_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_cookie_stream(FILE *stream)
+{
+    pthread_mutex_lock(&cookie_streams_lock);
+    cookie_streams.insert(stream);
+    pthread_mutex_unlock(&cookie_streams_lock);
+}
+
+static bool remove_cookie_stream(FILE *stream)
+{
+    pthread_mutex_lock(&cookie_streams_lock);
+    bool found = cookie_streams.erase(stream) > 0;
+    pthread_mutex_unlock(&cookie_streams_lock);
+    return found;
+}
+
+
+static ssize_t gzip_read(void *cookie, char *buf, size_t size)
+{
+    return gzread((gzFile) cookie, buf, size);
+}
+
+static int gzip_close(void *cookie)
+{
+    return gzclose((gzFile) cookie) == Z_OK ? 0 : EOF;
+}
+
+
+// BGZF limits (see the SAM/BAM specification)
+static const int BGZF_MAX_INPUT = 0xff00;
+static const int BGZF_MAX_BLOCK = 0x10000;
+static const int BGZF_HEADER = 18;
+static const int BGZF_FOOTER = 8;
+static const unsigned char BGZF_EOF[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43,
+    0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+
+static void put_le16(unsigned char *buf, unsigned int x)
+{
+    buf[0] = x & 0xff;
+    buf[1] = (x >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *buf, unsigned int x)
+{
+    put_le16(buf, x & 0xffff);
+    put_le16(buf + 2, x >> 16);
+}
+
+
+// compress 'data' into one BGZF block
+static bool bgzf_compress(const string &data, string &block)
+{
+    unsigned char buf[BGZF_MAX_BLOCK];
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    zs.next_in = (Bytef*) data.data();
+    zs.avail_in = data.size();
+    zs.next_out = buf + BGZF_HEADER;
+    zs.avail_out = BGZF_MAX_BLOCK - BGZF_HEADER - BGZF_FOOTER;
+    int status = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (status != Z_STREAM_END)
+        return false;
+
+    const int size = BGZF_HEADER + zs.total_out + BGZF_FOOTER;
+    const unsigned char header[BGZF_HEADER - 2] = {
+        0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43,
+        0x02, 0};
+    copy(header, header + BGZF_HEADER - 2, buf);
+    put_le16(buf + BGZF_HEADER - 2, size - 1);
+    unsigned char *footer = buf + BGZF_HEADER + zs.total_out;
+    put_le32(footer, crc32(crc32(0, Z_NULL, 0),
+                           (const Bytef*) data.data(), data.size()));
+    put_le32(footer + 4, data.size());
+
+    block.assign((const char*) buf, size);
+    return true;
+}
+
+
+// Writes BGZF blocks to a file.  With several threads, full blocks are
+// compressed by worker threads and written in order.
+class BgzfWriter
+{
+public:
+    BgzfWriter(FILE *out, int nthreads) :
+        out(out),
+        error(false),
+        next_job(0),
+        stopping(false)
+    {
+        data.reserve(BGZF_MAX_INPUT);
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&job_ready, NULL);
+        pthread_cond_init(&job_done, NULL);
+        for (int i=0; i<nthreads - 1; i++) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, &BgzfWriter::work_main,
+                               this) != 0)
+                break;
+            workers.push_back(worker);
+        }
+    }
+
+    ~BgzfWriter()
+    {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_broadcast(&job_ready);
+        pthread_mutex_unlock(&lock);
+        for (unsigned int i=0; i<workers.size(); i++)
+            pthread_join(workers[i], NULL);
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&job_ready);
+        pthread_cond_destroy(&job_done);
+    }
+
+    ssize_t write(const char *buf, size_t size)
+    {
+        size_t nwritten = 0;
+        while (nwritten < size) {
+            size_t n = min(size - nwritten, BGZF_MAX_INPUT - data.size());
+            data.append(buf + nwritten, n);
+            nwritten += n;
+            if (data.size() == size_t(BGZF_MAX_INPUT))
+                flush_block();
+        }
+        return error ? -1 : size;
+    }
+
+    // write remaining data and the end-of-file marker
+    int close()
+    {
+        if (data.size() > 0)
+            flush_block();
+        while (jobs.size() > 0)
+            write_job();
+        if (fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out) != sizeof(BGZF_EOF))
+            error = true;
+        if (fclose(out) != 0)
+            error = true;
+        return error ? EOF : 0;
+    }
+
+protected:
+    struct Job {
+        string data;
+        string block;
+        bool done;
+    };
+
+    void flush_block()
+    {
+        if (workers.size() == 0) {
+            string block;
+            if (!bgzf_compress(data, block) ||
+                fwrite(block.data(), 1, block.size(), out) != block.size())
+                error = true;
+            data.clear();
+            return;
+        }
+
+        // keep a bounded number of blocks in flight
+        while (jobs.size() >= 2 * workers.size())
+            write_job();
+
+        Job *job = new Job();
+        job->data.swap(data);
+        job->done = false;
+        data.reserve(BGZF_MAX_INPUT);
+        pthread_mutex_lock(&lock);
+        jobs.push_back(job);
+        pthread_cond_signal(&job_ready);
+        pthread_mutex_unlock(&lock);
+    }
+
+    // write the oldest job once it is compressed
+    void write_job()
+    {
+        pthread_mutex_lock(&lock);
+        Job *job = jobs.front();
+        while (!job->done)
+            pthread_cond_wait(&job_done, &lock);
+        jobs.erase(jobs.begin());
+        next_job--;
+        pthread_mutex_unlock(&lock);
+
+        if (job->block.size() == 0 ||
+            fwrite(job->block.data(), 1, job->block.size(), out) !=
+            job->block.size())
+            error = true;
+        delete job;
+    }
+
+    void work()
+    {
+        pthread_mutex_lock(&lock);
+        while (true) {
+            while (!stopping && next_job >= int(jobs.size()))
+                pthread_cond_wait(&job_ready, &lock);
+            if (next_job >= int(jobs.size()))
+                break;
+            Job *job = jobs[next_job++];
+            pthread_mutex_unlock(&lock);
+
+            bgzf_compress(job->data, job->block);
+
+            pthread_mutex_lock(&lock);
+            job->done = true;
+            pthread_cond_broadcast(&job_done);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    static void *work_main(void *writer)
+    {
+        ((BgzfWriter*) writer)->work();
+        return NULL;
+    }
+
+    FILE *out;
+    bool error;
+    string data;    // uncompressed data of the current block
+
+    vector<pthread_t> workers;
+    vector<Job*> jobs;  // blocks not yet written, oldest first
+    int next_job;       // first job not yet taken by a worker
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    pthread_cond_t job_done;
+};
+
+
+static ssize_t bgzf_write(void *cookie, const char *buf, size_t size)
+{
+    return ((BgzfWriter*) cookie)->write(buf, size);
+}
+
+static int bgzf_close(void *cookie)
+{
+    BgzfWriter *writer = (BgzfWriter*) cookie;
+    int status = writer->close();
+    delete writer;
+    return status;
+}
+
+
+static FILE *read_gzip(const char *filename)
+{
+    // like 'gunzip -f', uncompressed files are read as they are
+    gzFile file = gzopen(filename, "rb");
+    if (!file)
+        return NULL;
+    gzbuffer(file, 1 << 17);
+
+    FILE *stream = open_read_stream(file, gzip_read, gzip_close);
+    if (!stream)
+        gzclose(file);
+    return stream;
+}
+
+
+static FILE *write_bgzf(const char *filename)
+{
+    FILE *out = fopen(filename, "wb");
+    if (!out)
+        return NULL;
+
+    BgzfWriter *writer = new BgzfWriter(out, compress_threads);
+    cookie_io_functions_t io = {NULL, bgzf_write, NULL, bgzf_close};
+    FILE *stream = fopencookie(writer, "w", io);
+    if (!stream) {
+        delete writer;
+        fclose(out);
+        return NULL;
+    }
+    setvbuf(stream, NULL, _IOFBF, BGZF_MAX_INPUT);
+    add_cookie_stream(stream);
+    return stream;
+}
+
+#endif // ARGWEAVER_INPROCESS_GZIP
+
+
+//=============================================================================
+// compressed file streams
+
+
+FILE *open_read_stream(void *cookie,
+                       ssize_t (*read)(void *cookie, char *buf, size_t size),
+                       int (*close)(void *cookie))
+{
+#ifdef ARGWEAVER_INPROCESS_GZIP
+    cookie_io_functions_t io = {read, NULL, NULL, close};
+    FILE *stream = fopencookie(cookie, "r", io);
+    if (stream)
+        add_cookie_stream(stream);
+    return stream;
+#else
+    return NULL;
+#endif
+}
+
+
 FILE *read_compress(const char *filename, const char *command)
 {
     bool exists = !access(filename, F_OK);
     if (!exists)
         return NULL;
+#ifdef ARGWEAVER_INPROCESS_GZIP
+    if (!command || strcmp(command, UNZIP_COMMAND) == 0)
+        return read_gzip(filename);
+#endif
     const char *command2 = (command ? command : UNZIP_COMMAND);
     string cmd = string(command2) + " < " + quote_arg(filename);
     return popen(cmd.c_str(), "r");
@@ -22,6 +370,10 @@ FILE *read_compress(const char *filename, const char *command)
 
 FILE *write_compress(const char *filename, const char *command)
 {
+#ifdef ARGWEAVER_INPROCESS_GZIP
+    if (!command || strcmp(command, ZIP_COMMAND) == 0)
+        return write_bgzf(filename);
+#endif
     // TODO: add check to prevent write error
     const char *command2 = (command ? command : ZIP_COMMAND);
     string cmd = string(command2) + " > " + quote_arg(filename);
@@ -44,10 +396,12 @@ FILE *open_compress(const char *filename, const char *mode,
 
 int close_compress(FILE *stream)
 {
+#ifdef ARGWEAVER_INPROCESS_GZIP
+    if (remove_cookie_stream(stream))
+        return fclose(stream);
+#endif
     return pclose(stream);
 }
 
 
 } // namespace argweaver
-
-
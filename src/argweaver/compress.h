@@ -3,6 +3,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 namespace argweaver {
 
@@ -21,6 +22,16 @@ FILE *open_compress(const char *filename, const char *mode,
 
 int close_compress(FILE *stream);
 
+// Returns a stream that reads through the given functions and is closed
+// by close_compress(), or NULL if this is not supported by the C library.
+FILE *open_read_stream(void *cookie,
+                       ssize_t (*read)(void *cookie, char *buf, size_t size),
+                       int (*close)(void *cookie));
+
+// Number of threads used to compress files written with the default
+// command (default 1).
+void set_compress_threads(int nthreads);
+
 
 class CompressStream
 {
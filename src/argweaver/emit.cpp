@@ -2,6 +2,7 @@
 #include "common.h"
 #include "emit.h"
 #include "seq.h"
+#include "simd.h"
 #include "thread.h"
 
 namespace argweaver {
@@ -28,7 +29,7 @@ static inline bool is_invariant_site(const char *const *seqs,
 // Returns true if position 'pos' is invariant
 static inline bool is_invariant_site(const char *const *seqs,
                                      const int nseqs, const int pos,
-                                     const vector<vector<BaseProbs> > &base_probs)
+                                     const BaseProbsView &base_probs)
 {
     if (base_probs.size() == 0)
         return is_invariant_site(seqs, nseqs, pos);
@@ -50,7 +51,7 @@ static inline bool is_invariant_site(const char *const *seqs,
 // Populates array 'variant' with false for invariant sites and true otherwise
 void find_variant_sites(const char *const *seqs, int nseqs, int seqlen,
                         bool *variant,
-                        const vector<vector<BaseProbs> > &base_probs)
+                        const BaseProbsView &base_probs)
 {
     bool have_base_probs = ( base_probs.size() > 0 );
     // find invariant sites
@@ -85,6 +86,44 @@ void find_masked_sites(const char *const *seqs, int nseqs, int seqlen,
 }
 
 
+// Groups the variant sites into distinct site patterns.  Sites share a
+// pattern if every sequence has the same base (and base probabilities)
+// at both sites.  'pattern[i]' is set to the pattern of variant site 'i'
+// (-1 for other sites) and 'sites' lists the first site of each pattern.
+void find_site_patterns(const char *const *seqs, int nseqs, int seqlen,
+                        const bool *variant,
+                        const BaseProbsView &base_probs,
+                        int *pattern, vector<int> &sites)
+{
+    const bool have_base_probs = (base_probs.size() > 0);
+    map<string, int> patterns;
+    string key;
+
+    sites.clear();
+    for (int i=0; i<seqlen; i++) {
+        pattern[i] = -1;
+        if (!variant[i])
+            continue;
+
+        key.assign(nseqs, ' ');
+        for (int j=0; j<nseqs; j++)
+            key[j] = seqs[j][i];
+        if (have_base_probs) {
+            for (int j=0; j<nseqs; j++) {
+                const BaseProbs bp = base_probs[j][i];
+                key.append((const char*) bp.prob, sizeof(bp.prob));
+            }
+        }
+
+        pair<map<string, int>::iterator, bool> found =
+            patterns.insert(make_pair(key, int(sites.size())));
+        if (found.second)
+            sites.push_back(i);
+        pattern[i] = found.first->second;
+    }
+}
+
+
 int count_alleles(const char *const *seqs,
                   const int nseqs, const int pos)
 {
@@ -152,13 +191,14 @@ typedef double lk_row[4];
 class LikelihoodTable
 {
 public:
-    LikelihoodTable(int seqlen, int nnodes) :
+    // only the sites with rows[i] set are allocated (all if rows is NULL)
+    LikelihoodTable(int seqlen, int nnodes, const bool *rows=NULL) :
         seqlen(seqlen),
         nnodes(nnodes)
     {
         data = new lk_row* [seqlen];
         for (int i=0; i<seqlen; i++)
-            data[i] = new double [nnodes][4];
+            data[i] = (!rows || rows[i]) ? new double [nnodes][4] : NULL;
     }
 
     ~LikelihoodTable()
@@ -178,7 +218,7 @@ public:
 inline void likelihood_site_node_inner(
     const LocalTree *tree, const int node,
     const char *const *seqs,
-    const vector<vector<BaseProbs> > &base_probs,
+    const BaseProbsView &base_probs,
     const int pos,
     const double *muts, const double *nomuts, lk_row* inner)
 {
@@ -194,8 +234,10 @@ inline void likelihood_site_node_inner(
             inner[j][2] = 1.0;
             inner[j][3] = 1.0;
         } else if (base_probs.size() > 0) {
+            // decode the packed entry once
+            const BaseProbs bp = base_probs[j][pos];
             for (int k=0; k < 4; k++)
-                inner[j][k] = base_probs[j][pos].prob[k];
+                inner[j][k] = bp.prob[k];
         } else {
             inner[j][0] = 0.0;
             inner[j][1] = 0.0;
@@ -282,7 +324,7 @@ inline void likelihood_site_node_outer(
 // calculate entire inner partial likelihood table
 double likelihood_site_inner(
     const LocalTree *tree, const char *const *seqs,
-    const vector<vector<BaseProbs> > &base_probs,
+    const BaseProbsView &base_probs,
     const int pos, const int *order, const int norder,
     const double *muts, const double *nomuts, lk_row* inner)
 {
@@ -330,7 +372,7 @@ void likelihood_site_outer(
 
 void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
                       const char *const *seqs,
-                      const vector<vector<BaseProbs> > &base_probs,
+                      const BaseProbsView &base_probs,
                       const int seqlen,
                       const bool *variant, bool internal,
                       lk_row **inner, lk_row **outer)
@@ -359,9 +401,197 @@ void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
 
 
 
+//=============================================================================
+// packed partial likelihoods
+//
+// The vector SIMD levels compute the partial likelihoods of variant sites
+// in packs of EMIT_LANES sites (see simd.h), so that pruning runs across
+// sites instead of across the 4 bases of one site.  Only variant sites
+// are stored.  Lanes past the last site are padded with masked sites.
+
+class LikelihoodPacks
+{
+public:
+    LikelihoodPacks(int nsites, int nnodes) :
+        nsites(nsites),
+        npacks((nsites + EMIT_LANES - 1) / EMIT_LANES),
+        nnodes(nnodes),
+        data(npacks * nnodes * EMIT_PACK)
+    {}
+
+    // partial likelihoods of a node for one pack of sites
+    double *get(int pack, int node)
+    {
+        return &data[(pack * nnodes + node) * EMIT_PACK];
+    }
+
+    int nsites;
+    int npacks;
+    int nnodes;
+    vector<double> data;
+};
+
+
+// set the partial likelihood of a leaf for one lane of a pack
+static inline void set_leaf_lane(double *lk, int lane, char c,
+                                 const BaseProbs *base_probs)
+{
+    const int L = EMIT_LANES;
+    const int base = dna2int[(int) c];
+    if (c == 'N' || base < 0) {
+        for (int a=0; a<4; a++)
+            lk[a*L + lane] = 1.0;
+    } else if (base_probs) {
+        for (int a=0; a<4; a++)
+            lk[a*L + lane] = base_probs->prob[a];
+    } else {
+        for (int a=0; a<4; a++)
+            lk[a*L + lane] = 0.0;
+        lk[base*L + lane] = 1.0;
+    }
+}
+
+
+// set the partial likelihoods of sequence 'seqid' for all packs
+static void set_leaf_packs(const char *const *seqs,
+                           const BaseProbsView &base_probs,
+                           const int *sites, int seqid, int node,
+                           LikelihoodPacks &packs)
+{
+    const bool have_base_probs = (base_probs.size() > 0);
+    for (int p=0; p<packs.npacks; p++) {
+        double *lk = packs.get(p, node);
+        for (int l=0; l<EMIT_LANES; l++) {
+            const int k = p * EMIT_LANES + l;
+            if (k < packs.nsites) {
+                const int i = sites[k];
+                if (have_base_probs) {
+                    const BaseProbs bp = base_probs[seqid][i];
+                    set_leaf_lane(lk, l, seqs[seqid][i], &bp);
+                } else {
+                    set_leaf_lane(lk, l, seqs[seqid][i], NULL);
+                }
+            } else {
+                set_leaf_lane(lk, l, 'N', NULL);
+            }
+        }
+    }
+}
+
+
+// calculate inner partial likelihoods of the nodes in 'order' (postorder)
+static void calc_inner_packs(const LocalTree *tree, const char *const *seqs,
+                             const BaseProbsView &base_probs,
+                             const int *sites, const int *order, int norder,
+                             const double *muts, const double *nomuts,
+                             LikelihoodPacks &inner)
+{
+    const LocalNode *nodes = tree->nodes;
+
+    for (int k=0; k<norder; k++) {
+        const int j = order[k];
+        if (nodes[j].is_leaf()) {
+            set_leaf_packs(seqs, base_probs, sites, j, j, inner);
+        } else {
+            const int c1 = nodes[j].child[0];
+            const int c2 = nodes[j].child[1];
+            for (int p=0; p<inner.npacks; p++)
+                emit_prune(inner.get(p, c1), muts[c1], nomuts[c1],
+                           inner.get(p, c2), muts[c2], nomuts[c2],
+                           inner.get(p, j));
+        }
+    }
+}
+
+
+// calculate outer partial likelihoods of all nodes below 'maintree_root'
+static void calc_outer_packs(const LocalTree *tree, int maintree_root,
+                             const double *muts, const double *nomuts,
+                             LikelihoodPacks &inner, LikelihoodPacks &outer)
+{
+    const LocalNode *nodes = tree->nodes;
+    int queue[tree->nnodes];
+    int top = 0;
+
+    // process in preorder
+    queue[top++] = maintree_root;
+    while (top > 0) {
+        const int node = queue[--top];
+
+        if (node == maintree_root) {
+            for (int p=0; p<outer.npacks; p++)
+                fill(outer.get(p, node), outer.get(p, node) + EMIT_PACK, 1.0);
+        } else {
+            const int sib = tree->get_sibling(node);
+            const int parent = nodes[node].parent;
+            for (int p=0; p<outer.npacks; p++) {
+                if (parent != maintree_root)
+                    emit_prune(inner.get(p, sib), muts[sib], nomuts[sib],
+                               outer.get(p, parent), muts[parent],
+                               nomuts[parent], outer.get(p, node));
+                else
+                    emit_prune(inner.get(p, sib), muts[sib], nomuts[sib],
+                               NULL, 0.0, 0.0, outer.get(p, node));
+            }
+        }
+
+        // recurse
+        if (!nodes[node].is_leaf()) {
+            queue[top++] = nodes[node].child[0];
+            queue[top++] = nodes[node].child[1];
+        }
+    }
+}
+
+
+// packed version of calc_inner_outer for the variant sites in 'sites'
+static void calc_inner_outer_packs(
+    const LocalTree *tree, const ArgModel *model, const char *const *seqs,
+    const BaseProbsView &base_probs, const int *sites,
+    bool internal, LikelihoodPacks &inner, LikelihoodPacks &outer)
+{
+    const int nnodes = tree->nnodes;
+    int order[nnodes];
+    tree->get_postorder(order);
+
+    // branches above the root (and removed root) are never used
+    double muts[nnodes];
+    double nomuts[nnodes];
+    fill(muts, muts + nnodes, 0.0);
+    fill(nomuts, nomuts + nnodes, 0.0);
+    prob_tree_mutation(tree, model, muts, nomuts);
+
+    const int maintree_root = internal ?
+        tree->nodes[tree->root].child[1] : tree->root;
+    calc_inner_packs(tree, seqs, base_probs, sites, order, nnodes,
+                     muts, nomuts, inner);
+    calc_outer_packs(tree, maintree_root, muts, nomuts, inner, outer);
+}
+
+
+// calculate the emissions of one state for all packed sites
+static void calc_emit_packs(LikelihoodPacks &in, LikelihoodPacks &out,
+                            LikelihoodPacks &in2, int node1, int node2,
+                            int maintree_root,
+                            const double *mut, const double *nomut,
+                            double *emit)
+{
+    double lk[EMIT_LANES];
+    for (int p=0; p<in.npacks; p++) {
+        emit_join(in2.get(p, node1), in.get(p, node2),
+                  node2 != maintree_root ? out.get(p, node2) : NULL,
+                  mut, nomut, lk);
+        const int nlanes = min(EMIT_LANES, in.nsites - p * EMIT_LANES);
+        for (int l=0; l<nlanes; l++)
+            emit[p * EMIT_LANES + l] = lk[l];
+    }
+}
+
+
+
 void likelihood_sites(const LocalTree *tree, const ArgModel *model,
                       const char *const *seqs,
-                      const vector<vector<BaseProbs> > &base_probs,
+                      const BaseProbsView &base_probs,
                       const int seqlen, const int statei,
                       const bool *variant,
                       double **emit, lk_row **table,
@@ -432,9 +662,62 @@ void likelihood_sites(const LocalTree *tree, const ArgModel *model,
 
 
 
+// packed version of likelihood_tree for the vector SIMD levels
+static double likelihood_tree_packed(
+    const LocalTree *tree, const char *const *seqs,
+    const BaseProbsView &base_probs, const int nseqs,
+    const int start, const int end, const int *order,
+    const double *muts, const double *nomuts)
+{
+    // find sites that need pruning: all variant sites and the first
+    // invariant site, whose likelihood is shared by all invariant sites
+    vector<int> sites;
+    vector<int> site_index(end - start, -1);
+    int invariant_index = -1;
+    for (int i=start; i<end; i++) {
+        bool invariant = is_invariant_site(seqs, nseqs, i, base_probs);
+        if (invariant && seqs[0][i] == 'N')
+            continue;
+
+        if (invariant && invariant_index != -1) {
+            site_index[i-start] = invariant_index;
+        } else {
+            site_index[i-start] = sites.size();
+            if (invariant)
+                invariant_index = sites.size();
+            sites.push_back(i);
+        }
+    }
+    if (sites.size() == 0)
+        return 0.0;
+
+    LikelihoodPacks inner(sites.size(), tree->nnodes);
+    calc_inner_packs(tree, seqs, base_probs, &sites[0], order, tree->nnodes,
+                     muts, nomuts, inner);
+
+    // sum over root node
+    const int root = tree->root;
+    vector<double> lks(sites.size());
+    for (unsigned int k=0; k<sites.size(); k++) {
+        const double *lk = inner.get(k / EMIT_LANES, root);
+        const int l = k % EMIT_LANES;
+        double p = 0.0;
+        for (int a=0; a<4; a++)
+            p += lk[a*EMIT_LANES + l] * .25;
+        lks[k] = p;
+    }
+
+    double lnl = 0.0;
+    for (int i=start; i<end; i++)
+        if (site_index[i-start] != -1)
+            lnl += log(lks[site_index[i-start]]);
+    return lnl;
+}
+
+
 double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs,
-                       const vector<vector<BaseProbs> > &base_probs,
+                       const BaseProbsView &base_probs,
                        const int nseqs,
                        const int start, const int end)
 {
@@ -463,6 +746,10 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
 
 
     // calculate emissions for tree at each site
+    if (get_simd_level() != SIMD_SCALAR)
+        return likelihood_tree_packed(tree, seqs, base_probs, nseqs,
+                                      start, end, order, muts, nomuts);
+
     double lnl = 0.0;
     for (int i=start; i<end; i++) {
         double lk;
@@ -689,7 +976,7 @@ double calc_emit(lk_row *in, lk_row *out, lk_row *in2,
 // calculate emissions for external branch resampling
 void calc_emissions(const States &states, const LocalTree *tree,
                     const char *const *seqs,
-                    const vector<vector<BaseProbs> > &base_probs,
+                    const BaseProbsView &base_probs,
                     int nseqs, int seqlen,
                     const ArgModel *model, bool internal, double **emit,
 		    PhaseProbs *phase_pr)
@@ -716,17 +1003,66 @@ void calc_emissions(const States &states, const LocalTree *tree,
     find_variant_sites(seqs, nseqs, seqlen, variant, base_probs);
     find_masked_sites(seqs, nseqs, seqlen, masked, variant);
 
+    // Variant sites with the same pattern across all sequences have the
+    // same emissions, so only the first site of each pattern is computed.
+    int *pattern = new int [seqlen];
+    vector<int> sites;
+    find_site_patterns(seqs, nseqs, seqlen, variant, base_probs,
+                       pattern, sites);
+    const int nsites = sites.size();
+    bool *unique = new bool [seqlen];
+    fill(unique, unique + seqlen, false);
+    for (int k=0; k<nsites; k++)
+        unique[sites[k]] = true;
+
+    // heterozygous sites of an unphased new individual need emissions
+    // with its two haplotypes swapped
+    const bool swap_phase = (
+        model->unphased && phase_pr != NULL &&
+        phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
+        phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs);
+    bool *het = NULL;
+    bool *unique_het = NULL;
+    if (swap_phase) {
+	het = new bool[seqlen];
+        unique_het = new bool[seqlen];
+	for (int i=0; i < seqlen; i++) {
+	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
+            if (base_probs.size() > 0 && !het[i])
+                het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
+                            base_probs[phase_pr->treemap2][i]));
+            unique_het[i] = unique[i] && het[i];
+        }
+    }
+
+    // the vector SIMD levels compute the patterns in packs
+    const bool packed = (get_simd_level() != SIMD_SCALAR);
+    const int npacked = (packed ? nsites : 0);
+    const int nunpacked = (packed ? 0 : seqlen);
+
 
     // compute inner and outer likelihood tables
-    LikelihoodTable inner(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree(seqlen, 1);
-    LikelihoodTable outer(seqlen, tree->nnodes);
-    calc_inner_outer(tree, model, seqs, base_probs, seqlen, variant, internal,
-                     inner.data, outer.data);
+    LikelihoodTable inner(nunpacked, tree->nnodes, unique);
+    LikelihoodTable inner_subtree(nunpacked, 1, unique);
+    LikelihoodTable outer(nunpacked, tree->nnodes, unique);
+    LikelihoodPacks inner_packs(npacked, tree->nnodes);
+    LikelihoodPacks inner_subtree_packs(npacked, 1);
+    LikelihoodPacks outer_packs(npacked, tree->nnodes);
+    if (packed && nsites > 0) {
+        calc_inner_outer_packs(tree, model, seqs, base_probs, &sites[0],
+                               internal, inner_packs, outer_packs);
+        if (!internal)
+            set_leaf_packs(seqs, base_probs, &sites[0], newleaf, 0,
+                           inner_subtree_packs);
+    } else if (!packed) {
+        calc_inner_outer(tree, model, seqs, base_probs, seqlen, unique,
+                         internal, inner.data, outer.data);
+    }
 
-    if (!internal) {
+    if (!internal && !packed) {
         // compute inner table for new leaf
-        for (int i=0; i<seqlen; i++) {
+        for (int k=0; k<nsites; k++) {
+            const int i = sites[k];
             const char c = seqs[newleaf][i];
             if (c == 'N') {
                 inner_subtree.data[i][0][0] = 1.0;
@@ -734,8 +1070,9 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 inner_subtree.data[i][0][2] = 1.0;
                 inner_subtree.data[i][0][3] = 1.0;
             } else if (base_probs.size() > 0) {
+                const BaseProbs bp = base_probs[newleaf][i];
                 for (int j=0; j < 4; j++)
-                    inner_subtree.data[i][0][j] = base_probs[newleaf][i].prob[j];
+                    inner_subtree.data[i][0][j] = bp.prob[j];
             } else {
                 inner_subtree.data[i][0][0] = 0.0;
                 inner_subtree.data[i][0][1] = 0.0;
@@ -746,42 +1083,45 @@ void calc_emissions(const States &states, const LocalTree *tree,
         }
     }
 
-    LikelihoodTable inner2(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree2(seqlen, 1);
-    LikelihoodTable outer2(seqlen, tree->nnodes);
-    bool *het = NULL;
-    if (model->unphased && phase_pr != NULL &&
-	phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
-	phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs) {
+    LikelihoodTable inner2(swap_phase ? nunpacked : 0, tree->nnodes,
+                           unique_het);
+    LikelihoodTable inner_subtree2(swap_phase ? nunpacked : 0, 1, unique_het);
+    LikelihoodTable outer2(swap_phase ? nunpacked : 0, tree->nnodes,
+                           unique_het);
+    LikelihoodPacks inner2_packs(swap_phase ? npacked : 0, tree->nnodes);
+    LikelihoodPacks inner_subtree2_packs(swap_phase ? npacked : 0, 1);
+    LikelihoodPacks outer2_packs(swap_phase ? npacked : 0, tree->nnodes);
+    if (swap_phase) {
 	const char *subseqs[nseqs];
 	for (int i=0; i < nseqs; i++)
 	    subseqs[i] = seqs[i];
 	subseqs[phase_pr->treemap1] = seqs[phase_pr->treemap2];
 	subseqs[phase_pr->treemap2] = seqs[phase_pr->treemap1];
-	het = new bool[seqlen];
-	for (int i=0; i < seqlen; i++) {
-	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
-            if (base_probs.size() > 0 && !het[i])
-                het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
-                            base_probs[phase_pr->treemap2][i]));
-        }
-        vector<vector<BaseProbs> > base_probs2;
-        if (base_probs.size() > 0) {
-            for (int i=0; i < nseqs; i++) {
-                if (i == phase_pr->treemap1)
-                    base_probs2.push_back(base_probs[phase_pr->treemap2]);
-                else if (i == phase_pr->treemap2)
-                    base_probs2.push_back(base_probs[phase_pr->treemap1]);
-                else base_probs2.push_back(base_probs[i]);
-            }
+        int order[nseqs], rows2[nseqs];
+        for (int i=0; i < nseqs; i++)
+            order[i] = i;
+        order[phase_pr->treemap1] = phase_pr->treemap2;
+        order[phase_pr->treemap2] = phase_pr->treemap1;
+        const BaseProbsView base_probs2 = base_probs.reorder(order, rows2);
+
+        if (packed && nsites > 0) {
+            // het sites are a subset of the variant sites
+            calc_inner_outer_packs(tree, model, subseqs, base_probs2,
+                                   &sites[0], internal,
+                                   inner2_packs, outer2_packs);
+            if (!internal)
+                set_leaf_packs(subseqs, base_probs2, &sites[0], newleaf, 0,
+                               inner_subtree2_packs);
+        } else if (!packed) {
+            calc_inner_outer(tree, model, subseqs, base_probs2, seqlen,
+                             unique_het, internal, inner2.data, outer2.data);
         }
 
-	calc_inner_outer(tree, model, subseqs, base_probs2, seqlen, het,
-			 internal, inner2.data, outer2.data);
-
-	if (!internal) {
+	if (!internal && !packed) {
 	    // compute inner table for new leaf
 	    for (int i=0; i<seqlen; i++) {
+                if (!unique_het[i])
+                    continue;
 		const char c = subseqs[newleaf][i];
 		if (c == 'N') {
 		    inner_subtree2.data[i][0][0] = 1.0;
@@ -838,6 +1178,8 @@ void calc_emissions(const States &states, const LocalTree *tree,
 
 
     // populate emission table
+    vector<double> pattern_emit(nsites);
+    vector<double> pattern_emit2(het ? nsites : 0);
     for (int j=0; j<nstates; j++) {
         State state = states[j];
 
@@ -882,6 +1224,32 @@ void calc_emissions(const States &states, const LocalTree *tree,
         // calculate invariant_lk
         double invariant_lk = .25 * exp(- model->mu * treelen);
 
+        // calculate emissions of each site pattern
+        if (packed && nsites > 0) {
+            calc_emit_packs(inner_packs, outer_packs,
+                            internal ? inner_packs : inner_subtree_packs,
+                            node1, node2, maintree_root, mut, nomut,
+                            &pattern_emit[0]);
+            if (het)
+                calc_emit_packs(inner2_packs, outer2_packs,
+                                internal ? inner2_packs : inner_subtree2_packs,
+                                node1, node2, maintree_root, mut, nomut,
+                                &pattern_emit2[0]);
+        } else if (!packed) {
+            for (int k=0; k<nsites; k++) {
+                const int i = sites[k];
+                pattern_emit[k] = calc_emit(
+                    inner.data[i], outer.data[i],
+                    internal ? inner.data[i] : inner_subtree.data[i],
+                    i, node1, node2, maintree_root, nomut, mut);
+                if (het != NULL && het[i])
+                    pattern_emit2[k] = calc_emit(
+                        inner2.data[i], outer2.data[i],
+                        internal ? inner2.data[i] : inner_subtree2.data[i],
+                        i, node1, node2, maintree_root, nomut, mut);
+            }
+        }
+
         // fill in row of emission table
         for (int i=0; i<seqlen; i++) {
             if (masked[i]) {
@@ -891,16 +1259,10 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 // invariant site
                 emit[i][j] = invariant_lk;
             } else {
-		emit[i][j] = calc_emit(inner.data[i], outer.data[i],
-				       internal ? inner.data[i] : inner_subtree.data[i],
-				       i, node1, node2, maintree_root,
-				       nomut, mut);
+		emit[i][j] = pattern_emit[pattern[i]];
                 assert(!isnan(emit[i][j]));
 		if (het != NULL && het[i]) {
-		    double emit2 = calc_emit(inner2.data[i], outer2.data[i],
-					    internal ? inner2.data[i] : inner_subtree2.data[i],
-					    i, node1, node2, maintree_root,
-					    nomut, mut);
+		    double emit2 = pattern_emit2[pattern[i]];
 		    phase_pr->add(i, j, emit[i][j]/(emit[i][j] + emit2), nstates);
 		    emit[i][j] += emit2;
 		    emit[i][j] *= 0.5;
@@ -931,13 +1293,16 @@ void calc_emissions(const States &states, const LocalTree *tree,
     // clean up
     delete [] variant;
     delete [] masked;
+    delete [] pattern;
+    delete [] unique;
     if (het != NULL) delete [] het;
+    if (unique_het != NULL) delete [] unique_het;
 }
 
 // calculate emissions for external branch resampling
 void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char *const *seqs,
-                             const vector<vector<BaseProbs> > &base_probs,
+                             const BaseProbsView &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
 			     PhaseProbs *phase_pr)
@@ -949,7 +1314,7 @@ void calc_emissions_external(const States &states, const LocalTree *tree,
 // calculate emissions for internal branch resampling
 void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const char *const *seqs,
-                             const vector<vector<BaseProbs> > &base_probs,
+                             const BaseProbsView &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
                              PhaseProbs *phase_pr)
@@ -1234,7 +1599,7 @@ int count_noncompat(const LocalTrees *trees, const Sequences *sequences,
 
 void calc_emissions_external_slow(
     const States &states, const LocalTree *tree,
-    const char *const *seqs, const vector<vector<BaseProbs> > &base_probs,
+    const char *const *seqs, const BaseProbsView &base_probs,
     int nseqs, int seqlen,
     const ArgModel *model, double **emit)
 {
@@ -1267,7 +1632,7 @@ void calc_emissions_external_slow(
 
 void calc_emissions_internal_slow(
     const States &states, const LocalTree *tree,
-    const char *const *seqs, const vector<vector<BaseProbs> > &base_probs,
+    const char *const *seqs, const BaseProbsView &base_probs,
     int nseqs, int seqlen, const ArgModel *model, double **emit)
 {
     const int nstates = states.size();
@@ -1319,7 +1684,7 @@ void calc_emissions_internal_slow(
 
 bool assert_emissions(const States &states, const LocalTree *tree,
                       const char *const *seqs,
-                      const vector<vector<BaseProbs> > &base_probs,
+                      const BaseProbsView &base_probs,
                       int nseqs, int seqlen,
                       const ArgModel *model)
 {
@@ -1354,7 +1719,7 @@ bool assert_emissions(const States &states, const LocalTree *tree,
 
 bool assert_emissions_internal(const States &states, const LocalTree *tree,
                                const char *const *seqs,
-                               const vector<vector<BaseProbs> > &base_probs,
+                               const BaseProbsView &base_probs,
                                int nseqs, int seqlen,
                                const ArgModel *model)
 {
@@ -1401,8 +1766,7 @@ double **new_emissions(intstate *istates, int nstates,
     ArgModel model(ntimes, times, NULL, 0.0, mu);
 
     double **emit = new_matrix<double>(seqlen, nstates);
-    vector<vector<BaseProbs> > base_probs;
-    base_probs.clear();
+    BaseProbsView base_probs;
     calc_emissions_external(states, &tree, seqs, base_probs,
                             nseqs, seqlen, &model, emit, NULL);
 
@@ -1422,8 +1786,7 @@ bool arghmm_assert_emit(
 {
     ArgModel model(ntimes, times, NULL, 0.0, mu);
     States states;
-    vector<vector<BaseProbs> > base_probs;
-    base_probs.clear();
+    BaseProbsView base_probs;
 
     int end = trees->start_coord;
     for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
@@ -1455,8 +1818,7 @@ bool arghmm_assert_emit_internal(
     const int maxtime = model.ntimes + 1;
     States states;
     int *removal_path = new int [trees->get_num_trees()];
-    vector<vector<BaseProbs> > base_probs;
-    base_probs.clear();
+    BaseProbsView base_probs;
 
     // randomly choose branch to remove
     LocalTrees trees2(*trees);
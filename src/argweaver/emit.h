@@ -21,23 +21,26 @@ int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
                        int nseqs, int pos, int *postorder);
 void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char * const *seqs,
-                             const vector<vector<BaseProbs> > &base_probs,
+                             const BaseProbsView &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
                              PhaseProbs *phase_pr);
 void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const char *const *seqs,
-                             const vector<vector<BaseProbs> > &base_probs,
+                             const BaseProbsView &base_probs,
                              int nseqs, int seqlen,
                              const ArgModel *model, double **emit,
                              PhaseProbs *phase_pr=NULL);
 
 double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs,
-                       const vector<vector<BaseProbs> > &base_probs,
+                       const BaseProbsView &base_probs,
                        const int nseqs,
                        const int start, const int end);
 
+int count_noncompat(const LocalTree *tree, const char * const *seqs,
+                    int nseqs, int block_start, int block_len, int *postorder);
+
 int count_noncompat(const LocalTrees *trees, const char * const *seqs,
                     int nseqs, int seqlen, int start_coord=-1, int end_coord=-1);
 
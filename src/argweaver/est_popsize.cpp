@@ -7,12 +7,16 @@
 #include <map>
 
 #include "est_popsize.h"
+#include "parsing.h"
 #include "total_prob.h"
 #include "logging.h"
 #include "model.h"
 
 #define POPSIZE_UPPER_BOUND 1e10
 
+// leapfrog steps per Hamiltonian MC popsize update
+#define POPSIZE_HMC_STEPS 10
+
 namespace argweaver {
 
 using namespace std;
@@ -374,54 +378,125 @@ void numeric_deriv_check(double log_popsize, struct popsize_data *data, double d
 }
 
 
+// Adds to *like the log likelihood of the counts of time interval t of
+// population pop, given popsizes n1 and n2 for the two halves of the
+// interval.  Adds to *dlike and *dlike2 its derivatives with respect to a
+// log popsize shared by the halves in 'halves' (bit 0 for the first half,
+// bit 1 for the second).
+static void interval_like_and_dlike(const struct popsize_data *data,
+                                    const ArgModel *model, int pop, int t,
+                                    double n1, double n2, int halves,
+                                    double *like, double *dlike,
+                                    double *dlike2)
+{
+    const double t1 = (t == 0 ? 0.0 : model->coal_time_steps[2*t-1]);
+    const double t2 = model->coal_time_steps[2*t];
+    const int nlineages = data->numleaf + 1;
+    double **coal_counts = data->coal_counts[pop][t];
+    double **nocoal_counts = data->nocoal_counts[pop][t];
+    double l=0.0, d=0.0, d2=0.0;
+
+    for (int i=0; i < nlineages; i++) {
+        const double rate1 = t1 * i / (2.0 * n1);
+        for (int j=0; j < nlineages; j++) {
+            const double coal = coal_counts[i][j];
+            const double nocoal = nocoal_counts[i][j];
+            if (coal == 0 && nocoal == 0)
+                continue;
+            const double rate2 = t2 * j / (2.0 * n2);
+            const double rate = rate1 + rate2;
+            // minus the derivative of rate with respect to the log popsize,
+            // which is also its second derivative
+            const double drate = ((halves & 1) ? rate1 : 0.0) +
+                ((halves & 2) ? rate2 : 0.0);
+            if (coal > 0) {
+                // probability of coalescing, 1 - exp(-rate)
+                const double erate1 = -expm1(-rate);
+                const double g = exp(-rate) / erate1;
+                l += coal * log(erate1);
+                d -= coal * g * drate;
+                d2 += coal * (g * drate - (1.0 + g) * g * drate * drate);
+            }
+            if (nocoal > 0) {
+                l -= nocoal * rate;
+                d += nocoal * drate;
+                d2 -= nocoal * drate;
+            }
+        }
+    }
+
+    *like += l;
+    *dlike += d;
+    *dlike2 += d2;
+}
+
+
+// likelihood of a single popsize for both halves of time interval t
 void one_popsize_like_and_dlike(int t, double log_popsize, struct popsize_data *data,
-				double *likelihood, double *dlikelihood, double *dlikelihood2) {
+				double *likelihood, double *dlikelihood, double *dlikelihood2,
+                                int pop) {
     if (data->popsize_idx != t) {
 	set_data_time(data, t);
     }
 
     double popsize = exp(log_popsize);
-    double t1 = data->t1;
-    double t2 = data->t2;
-    int numleaf = data->numleaf;
-    double **coal_counts = data->coal_counts[data->popsize_idx];
-    double **nocoal_counts = data->nocoal_counts[data->popsize_idx];
     double like=0.0, dlike=0.0, dlike2=0.0;
-    bool do_like = (likelihood != NULL);
-    bool do_dlike = (dlikelihood != NULL);
-    bool do_dlike2 = (dlikelihood2 != NULL);
-    /*    if (log_popsize < 0) {
-	*likelihood = -INFINITY;
-	*dlikelihood = 100.0; //want to go up from here
-	}*/
-    for (int i=0; i < numleaf; i++) {
-	for (int j=0; j < numleaf; j++) {
-	    double rate = (t1*i + t2*j)/(2.0*popsize);
-	    double erate=exp(-rate);
-	    double erate1 = 1.0-erate;
-            if (j==0) assert(coal_counts[i][j] == 0 && nocoal_counts[i][j]==0);
-	    if (coal_counts[i][j] > 0) {
-		if (do_like) like += coal_counts[i][j]*log(erate1);
-		// NOTE: we are optimizing log_popsize so need to take this into consideration for derivative computations
-		if (do_dlike) dlike -= coal_counts[i][j]/(erate1)*erate*rate;
-		if (do_dlike2) dlike2 -= coal_counts[i][j]*
-				   ((erate*rate/erate1)*(erate*rate/erate1)
-				    + erate*rate*(rate - 1.0)/erate1);
-	    }
-	    if (nocoal_counts[i][j] > 0) {
-		if (do_like) like -= nocoal_counts[i][j]*rate;
-		if (do_dlike) dlike += nocoal_counts[i][j]*rate;
-		if (do_dlike2) dlike2 -= nocoal_counts[i][j]*rate;
-	    }
-	}
+    interval_like_and_dlike(data, data->model, pop, t, popsize, popsize, 3,
+                            &like, &dlike, &dlike2);
+    if (likelihood) *likelihood = like;
+    if (dlikelihood) *dlikelihood = dlike;
+    if (dlikelihood2) *dlikelihood2 = dlike2;
+}
+
+
+double popsize_data_likelihood(const struct popsize_data *data,
+                               const ArgModel *model)
+{
+    double like=0.0, dlike=0.0, dlike2=0.0;
+    for (int pop=0; pop < data->npop; pop++) {
+        for (int t=0; t < data->ntimes - 1; t++) {
+            double n1 = (t == 0 ? 1.0 : model->popsizes[pop][2*t-1]);
+            interval_like_and_dlike(data, model, pop, t, n1,
+                                    model->popsizes[pop][2*t], 0,
+                                    &like, &dlike, &dlike2);
+        }
     }
-    if (0) {
-	// these values always seem very close, not checking anymore
-	numeric_deriv_check(log_popsize, data, dlike);
+    return like;
+}
+
+
+void popsize_param_like_and_dlike(const struct popsize_data *data,
+                                  ArgModel *model,
+                                  const set<PopTime> &intervals,
+                                  double log_popsize, double *likelihood,
+                                  double *dlikelihood, double *dlikelihood2)
+{
+    const double popsize = exp(log_popsize);
+
+    // halves of each (pop, time interval) that have this popsize
+    map<pair<int, int>, int> halves;
+    for (set<PopTime>::const_iterator it=intervals.begin();
+         it != intervals.end(); ++it) {
+        model->popsizes[it->pop][it->time] = popsize;
+        halves[make_pair(it->pop, (it->time + 1) / 2)] |=
+            (it->time % 2 == 1 ? 1 : 2);
+    }
+
+    double like=0.0, dlike=0.0, dlike2=0.0;
+    for (map<pair<int, int>, int>::iterator it=halves.begin();
+         it != halves.end(); ++it) {
+        const int pop = it->first.first;
+        const int t = it->first.second;
+        if (t >= data->ntimes - 1)
+            continue;
+        double n1 = (t == 0 ? 1.0 : model->popsizes[pop][2*t-1]);
+        interval_like_and_dlike(data, model, pop, t, n1,
+                                model->popsizes[pop][2*t], it->second,
+                                &like, &dlike, &dlike2);
     }
-    if (do_like) *likelihood = like;
-    if (do_dlike) *dlikelihood = dlike;
-    if (do_dlike2) *dlikelihood2 = dlike2;
+    if (likelihood) *likelihood = like;
+    if (dlikelihood) *dlikelihood = dlike;
+    if (dlikelihood2) *dlikelihood2 = dlike2;
 }
 
 
@@ -450,41 +525,56 @@ double one_popsize_dlikelihood(int t, double log_popsize, struct popsize_data *d
 
 
 
-//wrapper to send to newton1d program; assume set_data_time has already been called
-double one_popsize_neg_likelihood(double log_popsize, void *data0) {
-    struct popsize_data *data = (struct popsize_data*) data0;
-    double like=0;
-    for (int t = data->min_t; t <= data->max_t; t++)
-	like += one_popsize_likelihood(t, log_popsize, data);
+// a popsize parameter and the counts it is estimated from
+struct popsize_param_data {
+    const struct popsize_data *data;
+    ArgModel *model;
+    const set<PopTime> *intervals;
+};
+
+
+//wrapper to send to newton1d program
+double popsize_param_neg_likelihood(double log_popsize, void *data0) {
+    struct popsize_param_data *param = (struct popsize_param_data*) data0;
+    double like;
+    popsize_param_like_and_dlike(param->data, param->model, *param->intervals,
+                                 log_popsize, &like, NULL);
     return -like;
 }
 
 
-//gets MLE for time interval start_t through end_t inclusive- one parameter for
-// whole combined interval
-double mle_one_popsize(int start_t, int end_t, double init_popsize, void *data0) {
-    double popsize, log_popsize = log(init_popsize);
-    double likelihood;
+// Sets the popsizes of 'intervals' to their MLE, given the other popsizes
+// of the model
+double mle_popsize_param(ArgModel *model, const struct popsize_data *data,
+                         const set<PopTime> &intervals, const char *name) {
+    double likelihood, dlike2;
     int sigfigs=4;
-    struct popsize_data *data = (struct popsize_data*)data0;
     static double min_popsize = log(100);
     static double max_popsize = log(1e7);
-    data->min_t = start_t;
-    data->max_t = end_t;
-    opt_newton_1d(one_popsize_neg_likelihood, &log_popsize, data0, &likelihood, sigfigs, min_popsize, max_popsize, NULL, NULL, NULL);
-    popsize = exp(log_popsize);
-    double dlike2=0.0;
-    for (int t=start_t; t <= end_t; t++)  {
-	double tmp;
-	one_popsize_like_and_dlike(t, log_popsize, data, NULL, NULL, &tmp);
-	dlike2 += tmp;
-    }
+    const PopTime &first = *intervals.begin();
+    double log_popsize = log(model->popsizes[first.pop][first.time]);
+    log_popsize = max(min_popsize + 0.01, min(max_popsize - 0.01, log_popsize));
+
+    struct popsize_param_data param = {data, model, &intervals};
+    opt_newton_1d(popsize_param_neg_likelihood, &log_popsize, &param, &likelihood, sigfigs, min_popsize, max_popsize, NULL, NULL, NULL);
+    popsize_param_like_and_dlike(data, model, intervals, log_popsize,
+                                 &likelihood, NULL, &dlike2);
+
+    double popsize = exp(log_popsize);
     double sd = sqrt(-1.0/dlike2);
     double popsize_min = exp(log_popsize - 2*sd);
     double popsize_max = exp(log_popsize + 2*sd);
-    for (int t=start_t; t <= end_t; t++) {
-	printLog(LOG_LOW, "mle_popsize %i\t%f\t%f\t%.1f\t%.1f\t%f\t%.1f\t%.1f\n", t, popsize, likelihood, data->coal_totals[t], data->nocoal_totals[t], sqrt(-1.0/dlike2), popsize_min, popsize_max);
+    double coal_total=0.0, nocoal_total=0.0;
+    for (set<PopTime>::const_iterator it=intervals.begin();
+         it != intervals.end(); ++it) {
+        // count each time interval once
+        const int t = (it->time + 1) / 2;
+        if (it->time != 2*t && intervals.count(PopTime(it->pop, 2*t)))
+            continue;
+        coal_total += data->coal_totals[it->pop][t];
+        nocoal_total += data->nocoal_totals[it->pop][t];
     }
+    printLog(LOG_LOW, "mle_popsize %s\t%f\t%f\t%.1f\t%.1f\t%f\t%.1f\t%.1f\n", name, popsize, likelihood, coal_total, nocoal_total, sd, popsize_min, popsize_max);
    return popsize;
 }
 
@@ -614,150 +704,327 @@ double mle_one_popsize(int start_t, int end_t, double init_popsize, void *data0)
     data->t2 = -1;
     }*/
 
-    /*
-void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model,
-                              const LocalTrees *trees, bool add) {
-    int end = trees->start_coord;
-    LineageCounts lineages(model->ntimes);
-    int numleaf = trees->get_num_leaves();
-    //coal_counts[p][i][j][k] gives number of SPRs which coalesce in
-    // population p, time i, with j
-    // lineages in the tree interval before time i, and k lineages in the
-    // interval after time i. If coalescence happens at the same time as
-    // the recombination (which is implied if coal_time==0), then j is always 0
+void init_popsize_data(struct popsize_data *data, ArgModel *model,
+                       int numleaf) {
+    //coal_counts[p][t][i][j] gives number of SPRs which coalesce in
+    // population p, time interval t, with i lineages in the first half of
+    // the interval and j lineages in the second half.  If coalescence
+    // happens in the same interval as the recombination, then i is always 0.
     //nocoal_counts is the same, but for non-coalescing segments; so counted
-    // for each segment from the recomb up until before the coal
-    double ****coal_counts;
-    double ****nocoal_counts;
-    double *coal_totals;
-    double *nocoal_totals;
-
-    if (!add) {
-	int arr_size = 2*(model->ntimes * numleaf * numleaf * model->num_pops()
-                          + model->ntimes);
-	double *arr_alloc = new double[arr_size]();
-	double pseudocount = model->popsize_config.pseudocount;
-	//	printf("pseudocount=%f\n", pseudocount);
-#ifdef ARGWEAVER_MPI
-	//Set pseudocount to zero for all but one MPI, since it will all get combined
-	MPI::Intracomm *comm = model->mc3.group_comm;
-	int rank = comm->Get_rank();
-	if (rank > 0) pseudocount = 0;
-#endif
+    // for each interval from the recomb up until before the coal
+    const int npop = model->num_pops();
+    const int ntimes = model->ntimes;
+    const int nlineages = numleaf + 1;
+    int arr_size = 2*npop*ntimes*(nlineages * nlineages + 1);
+    double *arr_alloc = new double[arr_size]();
+    int pos = 0;
+
+    data->coal_totals = new double*[npop];
+    data->nocoal_totals = new double*[npop];
+    for (int pop=0; pop < npop; pop++) {
+        data->coal_totals[pop] = &arr_alloc[pos];
+        pos += ntimes;
+        data->nocoal_totals[pop] = &arr_alloc[pos];
+        pos += ntimes;
+    }
 
-	int pos=model->ntimes * 2;
+    data->coal_counts = new double***[npop];
+    data->nocoal_counts = new double***[npop];
+    for (int pop=0; pop < npop; pop++) {
+        data->coal_counts[pop] = new double**[ntimes];
+        data->nocoal_counts[pop] = new double**[ntimes];
+        for (int t=0; t < ntimes; t++) {
+            data->coal_counts[pop][t] = new double*[nlineages];
+            data->nocoal_counts[pop][t] = new double*[nlineages];
+            for (int i=0; i < nlineages; i++) {
+                data->coal_counts[pop][t][i] = &arr_alloc[pos];
+                pos += nlineages;
+                data->nocoal_counts[pop][t][i] = &arr_alloc[pos];
+                pos += nlineages;
+            }
+        }
+    }
+    assert(pos == arr_size);
+
+    data->arr_alloc = arr_alloc;
+    data->arr_size = arr_size;
+    data->model = model;
+    data->npop = npop;
+    data->ntimes = ntimes;
+    data->numleaf = numleaf;
+    data->popsize_idx = -1;
+    data->t1 = -1;
+    data->t2 = -1;
+}
 
-	coal_totals = &arr_alloc[0];
-	nocoal_totals = &arr_alloc[model->ntimes];
 
-        // TODO: come back here and check if calculations need to be changed to
-        // reflect probability of each pop. Don't think so so long as
-        // coal_totals/nocoal_totals only used for display purposes
-        const int numpop = model->num_pops();
-        coal_counts = new double***[numpop];
-        nocoal_counts = new double***[numpop];
-        for (int pop=0; pop < numpop; pop++) {
-            coal_counts[pop] = new double**[model->ntimes];
-            nocoal_counts[pop] = new double**[model->ntimes];
-            for (int i=0; i < model->ntimes; i++) {
-                coal_counts[pop][i] = new double*[numleaf];
-                nocoal_counts[pop][i] = new double*[numleaf];
-                for (int j = 0; j < numleaf; j++) {
-                    coal_counts[pop][i][j] = &(arr_alloc[pos]);
-                    pos += numleaf;
-                    nocoal_counts[pop][i][j] = &(arr_alloc[pos]);
-                    pos += numleaf;
-                }
-                if (pseudocount > 0) {
-                    double pr_nocoal;
-                    if (i==0) {
-                        pr_nocoal = exp(-model->coal_time_steps[0] / 20000.0);
-                        coal_counts[pop][i][0][1] = (1.0 - pr_nocoal) * pseudocount;
-                        nocoal_counts[pop][i][0][1] = pr_nocoal * pseudocount;
-                    } else {
-                        pr_nocoal = exp(-(model->coal_time_steps[2*i-1] +
-                                          model->coal_time_steps[2*i]) / 20000.0);
-                        coal_counts[pop][i][1][1] = (1.0 - pr_nocoal) * pseudocount;
-                        nocoal_counts[pop][i][1][1] = pr_nocoal * pseudocount;
-                    }
-                    coal_totals[i] += (1.0 - pr_nocoal) * pseudocount;
-                    nocoal_totals[i] += pr_nocoal * pseudocount;
-                }
-	    }
-	}
-	if (pos != arr_size) {
-	    printf("pos=%i arr_size=%i ntimes=%i numleaf=%i\n",
-                   pos, arr_size, model->ntimes, numleaf);
-	    assert(pos == arr_size);
-	}
-	data->arr_alloc = arr_alloc;
-	data->arr_size = arr_size;
-	data->coal_counts = coal_counts;
-	data->nocoal_counts = nocoal_counts;
-	data->coal_totals = coal_totals;
-	data->nocoal_totals = nocoal_totals;
-	data->numleaf = numleaf;
-	data->model = model;
-	data->popsize_idx = -1;
-	data->t1 = -1;
-	data->t2 = -1;
-    } else {  // add counts to already initialized structure
-	coal_counts = data->coal_counts;
-	nocoal_counts = data->nocoal_counts;
-	coal_totals = data->coal_totals;
-	nocoal_totals = data->nocoal_totals;
-    }
-    // Need to update this section. Population has to be encoded in the tree nodes,
-    // and we need to use that here.
+// Adds the counts of 'spr' on 'tree' to 'data'.  These match the terms of
+// calc_log_spr_prob() that depend on the popsizes.
+static void add_spr_counts(struct popsize_data *data, const ArgModel *model,
+                           const LocalTree *tree, const Spr &spr,
+                           const LineageCounts &lineages)
+{
+    const LocalNode *nodes = tree->nodes;
+    const int k = spr.recomb_time;
+    const int j = spr.coal_time;
+    const int broken_age = nodes[nodes[spr.recomb_node].parent].age;
+
+    // lineages the SPR can coalesce with in each half time interval
+    int nbranches[2*model->ntimes];
+    for (int m=2*k; m <= 2*j; m++) {
+        const int pop_time = (m+1)/2;
+        const int spr_pop = model->get_pop(spr.pop_path, pop_time);
+        const int recomb_parent_pop =
+            model->get_pop(nodes[spr.recomb_node].pop_path, pop_time);
+        nbranches[m] = max(lineages.nbranches_pop[spr_pop][m] -
+                           int(!model->smc_prime && m/2 < broken_age &&
+                               spr_pop == recomb_parent_pop), 0);
+    }
 
+    for (int t=k; t <= j; t++) {
+        const int pop = model->get_pop(spr.pop_path, t);
+        const int n1 = (t > k ? nbranches[2*t-1] : 0);
+        const int n2 = nbranches[2*t];
+        if (t < j) {
+            data->nocoal_counts[pop][t][n1][n2]++;
+            data->nocoal_totals[pop][t]++;
+        } else if (j < model->ntimes - 2) {
+            // coalescing in the last interval is certain
+            data->coal_counts[pop][t][n1][n2]++;
+            data->coal_totals[pop][t]++;
+        }
+    }
+}
+
+
+void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model,
+                              const LocalTrees *trees, bool add) {
+    const int numleaf = trees->get_num_leaves();
+    if (!add)
+        init_popsize_data(data, model, numleaf);
+    assert(data->numleaf == numleaf && data->npop == model->num_pops() &&
+           data->ntimes == model->ntimes);
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
     for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
-	end += it->blocklen;
-	LocalTree *tree = it->tree;
-	if (end >= trees->end_coord) break;
-        ++it;
-        assert(it != trees->end());
-        LocalTree *next_tree = it->tree;
-	const Spr *spr = &it->spr;
-	lineages.count(tree, model->pop_tree);
-	int broken_age = tree->nodes[tree->nodes[spr->recomb_node].parent].age;
-	int nlineage1=0;
-	int nlineage2=lineages.nbranches[spr->recomb_time] - int(spr->recomb_time < broken_age);
-        int pop = next_tree->nodes[spr->recomb_node].pop[spr->recomb_time];
+        const LocalTree *tree = it->tree;
+        if (++it == trees->end())
+            break;
+        const Spr &spr = it->spr;
+        if (spr.is_null() || spr.recomb_node == tree->root)
+            continue;
+        lineages.count(tree, model->pop_tree);
+        add_spr_counts(data, model, tree, spr, lineages);
+    }
+}
 
-	if (spr->recomb_time == spr->coal_time) {
-	    coal_counts[pop][spr->coal_time][0][nlineage2]++;
-	    coal_totals[spr->coal_time]++;
-	} else {
-	    nocoal_counts[pop][spr->recomb_time][0][nlineage2]++;
-	    nocoal_totals[spr->recomb_time]++;
-	}
-	for (int i=spr->recomb_time + 1; i < spr->coal_time; i++) {
-	    nlineage1 = nlineage2;
-	    nlineage2 = lineages.nbranches[i] - int(i < broken_age);
-	    nocoal_counts[i][nlineage1][nlineage2]++;
-	    nocoal_totals[i]++;
-	}
-	if (spr->recomb_time != spr->coal_time) {
-	    nlineage1 = nlineage2;
-	    nlineage2 = lineages.nbranches[spr->coal_time] - int(spr->coal_time < broken_age);
-	    coal_counts[spr->coal_time][nlineage1][nlineage2]++;
-	    coal_totals[spr->coal_time]++;
-	}
+
+bool add_popsize_data(struct popsize_data *data,
+                      const struct popsize_data *other) {
+    if (data->npop != other->npop || data->ntimes != other->ntimes ||
+        data->numleaf != other->numleaf)
+        return false;
+    for (int i=0; i < data->arr_size; i++)
+        data->arr_alloc[i] += other->arr_alloc[i];
+    return true;
+}
+
+
+// Adds 'pseudocount' events to each time interval, as if from a population
+// of size 10000, so that intervals with few events have a finite MLE
+void add_popsize_pseudocounts(struct popsize_data *data, double pseudocount) {
+    if (pseudocount <= 0)
+        return;
+    const double *coal_time_steps = data->model->coal_time_steps;
+    for (int pop=0; pop < data->npop; pop++) {
+        for (int t=0; t < data->ntimes; t++) {
+            double pr_nocoal;
+            if (t == 0) {
+                pr_nocoal = exp(-coal_time_steps[0] / 20000.0);
+                data->coal_counts[pop][t][0][1] += (1.0 - pr_nocoal) * pseudocount;
+                data->nocoal_counts[pop][t][0][1] += pr_nocoal * pseudocount;
+            } else {
+                pr_nocoal = exp(-(coal_time_steps[2*t-1] +
+                                  coal_time_steps[2*t]) / 20000.0);
+                data->coal_counts[pop][t][1][1] += (1.0 - pr_nocoal) * pseudocount;
+                data->nocoal_counts[pop][t][1][1] += pr_nocoal * pseudocount;
+            }
+            data->coal_totals[pop][t] += (1.0 - pr_nocoal) * pseudocount;
+            data->nocoal_totals[pop][t] += pr_nocoal * pseudocount;
+        }
     }
-    } */
+}
+
 
 void delete_popsize_data(struct popsize_data *data) {
-    int ntimes = data->model->ntimes;
-    for (int i=0; i < ntimes; i++) {
-	delete [] data->coal_counts[i];
-	delete [] data->nocoal_counts[i];
+    for (int pop=0; pop < data->npop; pop++) {
+        for (int t=0; t < data->ntimes; t++) {
+            delete [] data->coal_counts[pop][t];
+            delete [] data->nocoal_counts[pop][t];
+        }
+        delete [] data->coal_counts[pop];
+        delete [] data->nocoal_counts[pop];
     }
     delete [] data->coal_counts;
     delete [] data->nocoal_counts;
+    delete [] data->coal_totals;
+    delete [] data->nocoal_totals;
     delete [] data->arr_alloc;
 }
 
 
+//=============================================================================
+// reading and writing counts
+
+void write_popsize_data_header(FILE *stream, const struct popsize_data *data) {
+    fprintf(stream, "TIMES");
+    for (int i=0; i < data->ntimes; i++)
+        fprintf(stream, "\t%f", data->model->times[i]);
+    fprintf(stream, "\n");
+    fprintf(stream, "NPOP\t%d\n", data->npop);
+    fprintf(stream, "NUMLEAF\t%d\n", data->numleaf);
+}
+
+
+void write_popsize_data(FILE *stream, const struct popsize_data *data,
+                        int rep) {
+    const int nlineages = data->numleaf + 1;
+    fprintf(stream, "REP\t%d\n", rep);
+    for (int pop=0; pop < data->npop; pop++) {
+        for (int t=0; t < data->ntimes; t++) {
+            for (int i=0; i < nlineages; i++) {
+                for (int j=0; j < nlineages; j++) {
+                    const double coal = data->coal_counts[pop][t][i][j];
+                    const double nocoal = data->nocoal_counts[pop][t][i][j];
+                    if (coal != 0 || nocoal != 0)
+                        fprintf(stream, "%d\t%d\t%d\t%d\t%.10g\t%.10g\n",
+                                pop, t, i, j, coal, nocoal);
+                }
+            }
+        }
+    }
+}
+
+
+PopsizeDataReader::PopsizeDataReader(const char *filename, ArgModel *model) :
+    filename(filename),
+    model(model),
+    stream(filename, "r"),
+    npop(0),
+    numleaf(0),
+    line(NULL),
+    lineno(0),
+    error(false)
+{
+    if (!stream.stream) {
+        printError("cannot read popsize stats '%s'", filename);
+        error = true;
+        return;
+    }
+    error = !read_header();
+}
+
+
+PopsizeDataReader::~PopsizeDataReader()
+{
+    delete [] line;
+}
+
+
+// Reads the header lines, leaving the first REP line in 'line'
+bool PopsizeDataReader::read_header()
+{
+    bool have_times = false;
+    while ((line = fgetline(stream.stream))) {
+        lineno++;
+        chomp(line);
+        vector<string> tokens;
+        split(line, "\t", tokens);
+        if (tokens.size() == 0) {
+        } else if (tokens[0] == "REP") {
+            break;
+        } else if (tokens[0] == "TIMES") {
+            if ((int) tokens.size() != model->ntimes + 1) {
+                printError("%s:%d: expected %d times", filename.c_str(),
+                           lineno, model->ntimes);
+                return false;
+            }
+            for (int i=0; i < model->ntimes; i++) {
+                if (!fequal(atof(tokens[i+1].c_str()), model->times[i])) {
+                    printError("%s:%d: times do not match the model",
+                               filename.c_str(), lineno);
+                    return false;
+                }
+            }
+            have_times = true;
+        } else if (tokens[0] == "NPOP" && tokens.size() == 2) {
+            npop = atoi(tokens[1].c_str());
+            if (npop != model->num_pops()) {
+                printError("%s:%d: expected %d populations", filename.c_str(),
+                           lineno, model->num_pops());
+                return false;
+            }
+        } else if (tokens[0] == "NUMLEAF" && tokens.size() == 2) {
+            numleaf = atoi(tokens[1].c_str());
+        } else {
+            printError("%s:%d: unknown line", filename.c_str(), lineno);
+            return false;
+        }
+        delete [] line;
+        line = NULL;
+    }
+
+    if (!have_times || npop <= 0 || numleaf <= 0) {
+        printError("%s: incomplete header", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool PopsizeDataReader::next(struct popsize_data *data, int *rep)
+{
+    if (error || !line)
+        return false;
+    if (sscanf(line, "REP\t%d", rep) != 1) {
+        printError("%s:%d: expected 'REP <rep>'", filename.c_str(), lineno);
+        error = true;
+        return false;
+    }
+    delete [] line;
+
+    init_popsize_data(data, model, numleaf);
+    while ((line = fgetline(stream.stream))) {
+        lineno++;
+        chomp(line);
+        if (strncmp(line, "REP\t", 4) == 0)
+            break;
+        if (line[0] == '\0') {
+            delete [] line;
+            continue;
+        }
+
+        int pop, t, i, j;
+        double coal, nocoal;
+        if (sscanf(line, "%d\t%d\t%d\t%d\t%lf\t%lf",
+                   &pop, &t, &i, &j, &coal, &nocoal) != 6 ||
+            pop < 0 || pop >= npop || t < 0 || t >= model->ntimes ||
+            i < 0 || i > numleaf || j < 0 || j > numleaf) {
+            printError("%s:%d: bad count line", filename.c_str(), lineno);
+            delete_popsize_data(data);
+            error = true;
+            return false;
+        }
+        data->coal_counts[pop][t][i][j] += coal;
+        data->nocoal_counts[pop][t][i][j] += nocoal;
+        data->coal_totals[pop][t] += coal;
+        data->nocoal_totals[pop][t] += nocoal;
+        delete [] line;
+    }
+    return true;
+}
+
+
 void set_data_time(struct popsize_data *data, int t) {
     data->popsize_idx = t;
     data->t2 = data->model->coal_time_steps[2*t];
@@ -900,6 +1167,266 @@ void hmc_update_nuts(struct popsize_data *data, ArgModel *model) {
 */
 
 
+void mle_popsize(ArgModel *model, const struct popsize_data *data, double min_total) {
+    const list<PopsizeConfigParam> &params = model->popsize_config.params;
+    if (params.size() > 0) {
+        // one estimate for each sampled parameter of the popsize config
+        for (list<PopsizeConfigParam>::const_iterator it=params.begin();
+             it != params.end(); ++it) {
+            if (it->sample && it->intervals.size() > 0)
+                mle_popsize_param(model, data, it->intervals, it->name.c_str());
+        }
+        return;
+    }
+
+    // otherwise merge whole time intervals until they have min_total events
+    for (int pop=0; pop < data->npop; pop++) {
+        int start_time = 0;
+        double curr_total = 0.0;
+        for (int i=0; i < model->ntimes-1; i++) {
+            curr_total += data->coal_totals[pop][i] + data->nocoal_totals[pop][i];
+            if (curr_total < min_total && i < model->ntimes - 2) continue;
+            set<PopTime> intervals;
+            for (int j = start_time; j <= i; j++) {
+                intervals.insert(PopTime(pop, 2*j));
+                if (j > 0) intervals.insert(PopTime(pop, 2*j-1));
+            }
+            char name[100];
+            if (data->npop == 1)
+                snprintf(name, sizeof(name), "N%d", start_time);
+            else snprintf(name, sizeof(name), "N%d.%d", pop, start_time);
+            mle_popsize_param(model, data, intervals, name);
+            start_time = i+1;
+            curr_total = 0.0;
+        }
+    }
+}
+
+
+void mle_popsize(ArgModel *model, const LocalTrees *trees, double min_total) {
+    struct popsize_data data;
+    popsize_sufficient_stats(&data, model, trees);
+#ifdef ARGWEAVER_MPI
+    MPI::Intracomm *comm = model->mc3.group_comm;
+    int rank = comm->Get_rank();
+    comm->Reduce(rank == 0 ? MPI_IN_PLACE : data.arr_alloc, data.arr_alloc, data.arr_size, MPI::DOUBLE, MPI_SUM, 0);
+    if (rank == 0) {
+#endif
+        add_popsize_pseudocounts(&data, model->popsize_config.pseudocount);
+	mle_popsize(model, &data, min_total);
+#ifdef ARGWEAVER_MPI
+    }
+    for (int pop=0; pop < model->num_pops(); pop++)
+        comm->Bcast(model->popsizes[pop], model->ntimes*2-1, MPI::DOUBLE, 0);
+#endif
+    delete_popsize_data(&data);
+}
+
+
+void popsize_tree_stats(struct popsize_data *data, ArgModel *model,
+                        const LocalTree *tree) {
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    lineages.count(tree, model->pop_tree);
+    for (int pop=0; pop < data->npop; pop++) {
+        for (int i=0; i < data->ntimes-1; i++) {
+            // lineages at the start and end of the interval, as in
+            // calc_log_tree_prior()
+            int a = (lineages.ncoals_pop[pop][i] +
+                     lineages.nbranches_pop[pop][2*i])/2;
+            int b = lineages.nbranches_pop[pop][2*i];
+            data->coal_counts[pop][i][a][b]++;
+            data->coal_totals[pop][i]++;
+        }
+    }
+}
+
+
+double popsize_tree_likelihood(const struct popsize_data *data,
+                               const ArgModel *model, CoalCountsMemo *memo) {
+    const int nlineages = data->numleaf + 1;
+    double like = 0.0;
+    for (int pop=0; pop < data->npop; pop++) {
+        for (int i=0; i < data->ntimes-1; i++) {
+            double t = model->coal_time_steps[2*i];
+            if (i > 0) t += model->coal_time_steps[2*i-1];
+            const double n = 2.0 * model->popsizes[pop][2*i];
+            for (int a=0; a < nlineages; a++) {
+                for (int b=0; b <= a; b++) {
+                    const double count = data->coal_counts[pop][i][a][b];
+                    if (count != 0)
+                        like += count * memo->get(pop, i, a, b, t, n);
+                }
+            }
+        }
+    }
+    return like;
+}
+
+
+// Sets the popsizes of a parameter to exp(log_popsize)
+static void set_param_popsize(ArgModel *model, const PopsizeConfigParam *param,
+                              double log_popsize) {
+    const set<PopTime> &intervals = param->intervals;
+    for (set<PopTime>::const_iterator it=intervals.begin();
+         it != intervals.end(); ++it)
+        model->popsizes[it->pop][it->time] = exp(log_popsize);
+}
+
+
+// Sets the popsizes of the parameters to exp(theta)
+static void set_param_popsizes(ArgModel *model,
+                               const vector<const PopsizeConfigParam*> &params,
+                               const double *theta) {
+    for (unsigned int p=0; p < params.size(); p++)
+        set_param_popsize(model, params[p], theta[p]);
+}
+
+
+void popsize_params_dlike(
+    const struct popsize_data *data, const struct popsize_data *tree_data,
+    ArgModel *model, const vector<const PopsizeConfigParam*> &params,
+    const double *theta, double heat, CoalCountsMemo *memo, double *grad) {
+    // step for the central differences of the first tree's likelihood
+    const double h = 1e-5;
+
+    for (unsigned int p=0; p < params.size(); p++) {
+        double dlike;
+        popsize_param_like_and_dlike(data, model, params[p]->intervals,
+                                     theta[p], NULL, &dlike);
+
+        set_param_popsize(model, params[p], theta[p] + h);
+        const double tree_like1 = popsize_tree_likelihood(tree_data, model,
+                                                          memo);
+        set_param_popsize(model, params[p], theta[p] - h);
+        const double tree_like0 = popsize_tree_likelihood(tree_data, model,
+                                                          memo);
+        set_param_popsize(model, params[p], theta[p]);
+
+        grad[p] = heat * (dlike + (tree_like1 - tree_like0) / (2.0 * h));
+    }
+}
+
+
+// One Hamiltonian MC trajectory of the log popsizes of 'params'.  The
+// target is the popsize-dependent part of the ARG prior, from the counts
+// of the SPRs ('data') and of the first tree ('tree_data'), raised to
+// 'heat', with a uniform prior on log popsizes.
+// Returns whether the trajectory was accepted.
+static bool hmc_update(ArgModel *model, const struct popsize_data *data,
+                       const struct popsize_data *tree_data,
+                       const vector<const PopsizeConfigParam*> &params,
+                       double heat, CoalCountsMemo *memo) {
+    const int nparams = params.size();
+    const double epsilon = model->popsize_config.epsilon;
+    const double max_log_popsize = log(POPSIZE_UPPER_BOUND);
+    double theta0[nparams], theta[nparams], momentum[nparams], grad[nparams];
+
+    double current_K = 0.0;
+    for (int p=0; p < nparams; p++) {
+        const PopTime &first = *params[p]->intervals.begin();
+        theta0[p] = theta[p] = log(model->popsizes[first.pop][first.time]);
+        momentum[p] = rand_norm(0, 1);
+        current_K += momentum[p] * momentum[p] / 2.0;
+    }
+    set_param_popsizes(model, params, theta);
+    double current_U = -heat * (popsize_data_likelihood(data, model) +
+                                popsize_tree_likelihood(tree_data, model, memo));
+
+    // leapfrog steps
+    bool in_bounds = true;
+    popsize_params_dlike(data, tree_data, model, params, theta, heat,
+                         memo, grad);
+    for (int p=0; p < nparams; p++)
+        momentum[p] += epsilon * grad[p] / 2.0;
+    for (int step=1; step <= POPSIZE_HMC_STEPS && in_bounds; step++) {
+        for (int p=0; p < nparams; p++) {
+            theta[p] += epsilon * momentum[p];
+            if (theta[p] <= 0.0 || theta[p] > max_log_popsize)
+                in_bounds = false;
+        }
+        if (!in_bounds)
+            break;
+        set_param_popsizes(model, params, theta);
+        popsize_params_dlike(data, tree_data, model, params, theta, heat,
+                         memo, grad);
+        const double scale = (step == POPSIZE_HMC_STEPS ? 0.5 : 1.0);
+        for (int p=0; p < nparams; p++)
+            momentum[p] += scale * epsilon * grad[p];
+    }
+
+    double lr = -INFINITY;
+    double proposed_U = INFINITY;
+    if (in_bounds) {
+        double proposed_K = 0.0;
+        for (int p=0; p < nparams; p++)
+            proposed_K += momentum[p] * momentum[p] / 2.0;
+        proposed_U = -heat * (popsize_data_likelihood(data, model) +
+                              popsize_tree_likelihood(tree_data, model, memo));
+        lr = current_U - proposed_U + current_K - proposed_K;
+    }
+    const bool accept = (lr > 0 || frand() < exp(lr));
+
+    printLog(LOG_MEDIUM, "%s HMC update %f (%f %f)\n",
+             accept ? "accept" : "reject", lr, -current_U, -proposed_U);
+    for (int p=0; p < nparams; p++)
+        printLog(LOG_MEDIUM, "%s\t%f\t%f\t%s\n", params[p]->name.c_str(),
+                 exp(theta0[p]), exp(theta[p]), accept ? "accept" : "reject");
+
+    if (!accept)
+        set_param_popsizes(model, params, theta0);
+    return accept;
+}
+
+
+//use Hamiltonian MC to update popsize
+void update_popsize_hmc(ArgModel *model, const LocalTrees *trees,
+                        double heat) {
+    struct popsize_data data, tree_data;
+
+    //compute all the coal_counts and nocoal_counts to be used for likelihood
+    // calculations, once for all the HMC steps
+    popsize_sufficient_stats(&data, model, trees);
+    init_popsize_data(&tree_data, model, trees->get_num_leaves());
+    popsize_tree_stats(&tree_data, model, trees->front().tree);
+
+#ifdef ARGWEAVER_MPI
+    MPI::Intracomm *comm = model->mc3.group_comm;
+    int rank = comm->Get_rank();
+    comm->Reduce(rank == 0 ? MPI_IN_PLACE : data.arr_alloc, data.arr_alloc, data.arr_size, MPI::DOUBLE, MPI_SUM, 0);
+    comm->Reduce(rank == 0 ? MPI_IN_PLACE : tree_data.arr_alloc, tree_data.arr_alloc, tree_data.arr_size, MPI::DOUBLE, MPI_SUM, 0);
+    if (rank == 0) {
+#endif
+        // no pseudocounts here: they regularize the MLE, but would change
+        // the posterior that is sampled
+        const list<PopsizeConfigParam> &l = model->popsize_config.params;
+        vector<const PopsizeConfigParam*> params;
+        for (list<PopsizeConfigParam>::const_iterator it=l.begin();
+             it != l.end(); ++it) {
+            if (it->sample && it->intervals.size() > 0)
+                params.push_back(&*it);
+        }
+
+        if (params.size() > 0) {
+            CoalCountsMemo memo;
+            int naccept = 0;
+            for (int rep=0; rep < model->popsize_config.numsample; rep++)
+                naccept += hmc_update(model, &data, &tree_data, params, heat,
+                                      &memo);
+            printLog(LOG_LOW, "popsize HMC: accepted %d of %d\n",
+                     naccept, model->popsize_config.numsample);
+        }
+
+#ifdef ARGWEAVER_MPI
+    }
+    for (int pop=0; pop < model->num_pops(); pop++)
+        comm->Bcast(model->popsizes[pop], model->ntimes*2-1, MPI::DOUBLE, 0);
+#endif
+
+    delete_popsize_data(&data);
+    delete_popsize_data(&tree_data);
+}
+
+
 //use Hamiltonian MC to update popsize
 /* void hmc_update(struct popsize_data *data) {
     ArgModel *model = data->model;
@@ -994,67 +1521,6 @@ void no_update_popsize(ArgModel *model, const LocalTrees *trees) {
     delete_popsize_data(&data);
 }
 
-//use Hamiltonian MC to update popsize
-void update_popsize_hmc(ArgModel *model, const LocalTrees *trees) {
-    struct popsize_data data;
-
-    //compute all the coal_counts and nocoal_counts to be used for likelihood calculations
-    popsize_sufficient_stats(&data, model, trees);
-
-#ifdef ARGWEAVER_MPI
-    MPI::Intracomm *comm = model->mc3.group_comm;
-    int rank = comm->Get_rank();
-    comm->Reduce(rank == 0 ? MPI_IN_PLACE : data.arr_alloc, data.arr_alloc, data.arr_size, MPI::DOUBLE, MPI_SUM, 0);
-    if (rank == 0) {
-#endif
-	hmc_update(&data);
-
-#ifdef ARGWEAVER_MPI
-    }
-    comm->Bcast(model->popsizes, model->ntimes*2-1, MPI::DOUBLE, 0);
-#endif
-
-    delete_popsize_data(&data);
-}
-
-
-
-void mle_popsize(ArgModel *model, const struct popsize_data *data, double min_total) {
-    int start_time = 0;
-    double curr_total = 0.0;
-    for (int i=0; i < model->ntimes-1; i++) {
-	curr_total += data->coal_totals[i] + data->nocoal_totals[i];
-	if (curr_total < min_total && i < model->ntimes - 2) continue;
-	double popsize = mle_one_popsize(start_time, i, model->popsizes[2*i], (void*)data);
-	for (int j = start_time; j <= i; j++) {
-	    model->popsizes[2*j] = popsize;
-	    if (j > 0) model->popsizes[2*j-1] = popsize;
-	}
-	start_time = i+1;
-	curr_total = 0.0;
-    }
-}
-
-
-void mle_popsize(ArgModel *model, const LocalTrees *trees, double min_total) {
-    struct popsize_data data;
-    popsize_sufficient_stats(&data, model, trees);
-#ifdef ARGWEAVER_MPI
-    MPI::Intracomm *comm = model->mc3.group_comm;
-    int rank = comm->Get_rank();
-    comm->Reduce(rank == 0 ? MPI_IN_PLACE : data.arr_alloc, data.arr_alloc, data.arr_size, MPI::DOUBLE, MPI_SUM, 0);
-    if (rank == 0) {
-#endif
-	mle_popsize(model, &data, min_total);
-#ifdef ARGWEAVER_MPI
-    }
-    comm->Bcast(model->popsizes, model->ntimes*2-1, MPI::DOUBLE, 0);
-#endif
-    delete_popsize_data(&data);
-}
-
-
-
 void est_popsize_trees2(const ArgModel *model, const LocalTree *const *trees,
                         int ntrees, double *popsizes)
 {
@@ -1,20 +1,31 @@
 #ifndef ARGWEAVER_EST_POPSIZE_H
 #define ARGWEAVER_EST_POPSIZE_H
 
+#include "compress.h"
 #include "local_tree.h"
 #include "model.h"
+#include "total_prob.h"
 
 namespace argweaver {
 
 
+// Counts of the coalescences of the SPRs of one or more ARGs, from which
+// the ARG prior can be computed for any population sizes (up to terms that
+// do not depend on them).  coal_counts[pop][t][i][j] is the number of SPRs
+// that re-coalesce in time interval t of population pop, with i lineages
+// in the first half of the interval and j in the second half.
+// nocoal_counts counts the time intervals that SPRs pass without
+// coalescing in the same way.
  struct popsize_data {
      double *arr_alloc;
      int arr_size;
-     double ***coal_counts;
-     double ***nocoal_counts;
-     double *coal_totals;
-     double *nocoal_totals;
+     double ****coal_counts;
+     double ****nocoal_counts;
+     double **coal_totals;
+     double **nocoal_totals;
      ArgModel *model;
+     int npop;
+     int ntimes;
      int popsize_idx;
      int numleaf;
      double t1, t2;
@@ -26,7 +37,8 @@ void est_popsize_local_trees(const ArgModel *model, const LocalTrees *trees,
 void mle_popsize(ArgModel *model, const struct popsize_data *data, double min_total=0);
 void mle_popsize(ArgModel *model, const LocalTrees *trees, double min_total=0);
 void one_popsize_like_and_dlike(int t, double log_popsize, struct popsize_data *data,
-				double *likelihood, double *dlikelihood, double *dlikelihood2=NULL);
+				double *likelihood, double *dlikelihood, double *dlikelihood2=NULL,
+                                int pop=0);
 double one_popsize_likelihood(int t, double log_popsize, struct popsize_data *data);
 
 //note log_popsize should be length ntimes-1 (one for each whole time interval)
@@ -35,10 +47,70 @@ double popsize_likelihood(double *log_popsize, struct popsize_data *data);
 double one_popsize_likelihood(int t, double log_popsize, struct popsize_data *data);
 double one_popsize_dlikelihood(int t, double log_popsize, struct popsize_data *data);
 
+void init_popsize_data(struct popsize_data *data, ArgModel *model, int numleaf);
 void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model, const LocalTrees *trees, bool add=false);
+bool add_popsize_data(struct popsize_data *data, const struct popsize_data *other);
+void add_popsize_pseudocounts(struct popsize_data *data, double pseudocount);
 void delete_popsize_data(struct popsize_data *data);
 
-void update_popsize_hmc(ArgModel *model, const LocalTrees *trees);
+// log likelihood of the popsizes of 'model' given the counts
+double popsize_data_likelihood(const struct popsize_data *data, const ArgModel *model);
+
+// Sets the popsizes of 'intervals' to exp(log_popsize) and returns the log
+// likelihood of the counts, and its derivatives with respect to log_popsize
+void popsize_param_like_and_dlike(const struct popsize_data *data, ArgModel *model,
+                                  const set<PopTime> &intervals, double log_popsize,
+                                  double *likelihood, double *dlikelihood,
+                                  double *dlikelihood2=NULL);
+
+// Counts are written as blocks of lines 'pop t i j coal nocoal', one block
+// for each MCMC rep, after a header that describes the model
+void write_popsize_data_header(FILE *stream, const struct popsize_data *data);
+void write_popsize_data(FILE *stream, const struct popsize_data *data, int rep);
+
+// Reads the counts written by write_popsize_data() one rep at a time
+class PopsizeDataReader
+{
+public:
+    PopsizeDataReader(const char *filename, ArgModel *model);
+    ~PopsizeDataReader();
+
+    // Reads the counts of the next rep into 'data', which should not be
+    // initialized.  Returns false at the end of the file or on error.
+    bool next(struct popsize_data *data, int *rep);
+
+    string filename;
+    ArgModel *model;
+    CompressStream stream;
+    int npop;
+    int numleaf;
+    char *line;
+    int lineno;
+    bool error;
+
+protected:
+    bool read_header();
+};
+
+// Lineage counts of 'tree' at the ends of each time interval, kept in
+// coal_counts[pop][t][a][b] of 'data': the terms of calc_log_tree_prior()
+// that depend on the popsizes
+void popsize_tree_stats(struct popsize_data *data, ArgModel *model, const LocalTree *tree);
+double popsize_tree_likelihood(const struct popsize_data *data, const ArgModel *model,
+                               CoalCountsMemo *memo);
+
+// Gradient of the Hamiltonian MC target, the log likelihood of the SPR
+// counts 'data' and the first tree counts 'tree_data' raised to 'heat',
+// with respect to the log popsizes 'theta' of 'params'.  The popsizes
+// must already be set in the model.
+void popsize_params_dlike(
+    const struct popsize_data *data, const struct popsize_data *tree_data,
+    ArgModel *model, const vector<const PopsizeConfigParam*> &params,
+    const double *theta, double heat, CoalCountsMemo *memo, double *grad);
+
+// Resamples the popsizes of the popsize config by Hamiltonian MC on counts
+// taken from 'trees' once
+void update_popsize_hmc(ArgModel *model, const LocalTrees *trees, double heat=1.0);
 void set_data_time(struct popsize_data *data, int t);
 void no_update_popsize(ArgModel *model, const LocalTrees *trees);
 
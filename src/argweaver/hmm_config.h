@@ -0,0 +1,53 @@
+//=============================================================================
+// Options for evaluating the threading HMM
+
+#ifndef ARGWEAVER_HMM_CONFIG_H
+#define ARGWEAVER_HMM_CONFIG_H
+
+
+namespace argweaver {
+
+// Settings that control how the threading HMM is computed.  None of these
+// change the model itself, only the time and memory spent evaluating it.
+class HmmConfig
+{
+ public:
+
+    HmmConfig() :
+        matrix_cache_size(256000000L),
+        nthreads(1),
+        forward_segments(0),
+        forward_segments_tol(1e-12),
+        forward_table_size(0),
+        forward_table_float(false)
+    {}
+
+    // Byte budget for keeping transition matrices from the forward pass
+    // for reuse by the traceback (0 disables caching).
+    long matrix_cache_size;
+
+    // Number of threads used to compute the matrices of upcoming blocks
+    // during the forward pass (1 computes everything serially).
+    int nthreads;
+
+    // Number of segments for the experimental segmented forward algorithm
+    // (see arghmm_forward_alg_segments); 0 or 1 uses the sequential one.
+    int forward_segments;
+
+    // Relative tolerance at which a corrected forward column is considered
+    // equal to the one it replaces.
+    double forward_segments_tol;
+
+    // Byte budget for the forward table (0 keeps every column).  If the
+    // full table does not fit, only some columns are stored and the rest
+    // are recomputed during the traceback (see ArgHmmForwardCheckpoints).
+    long forward_table_size;
+
+    // Store the checkpointed columns of the forward table in single
+    // precision.
+    bool forward_table_float;
+};
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_HMM_CONFIG_H
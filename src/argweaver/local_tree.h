@@ -5,6 +5,7 @@
 #define ARGWEAVER_LOCAL_TREES_H
 
 // c++ includes
+#include <algorithm>
 #include <assert.h>
 #include <list>
 #include <vector>
@@ -592,6 +593,18 @@ public:
     // Copy trees from another set of local trees
     void copy(const LocalTrees &other);
 
+    // Exchange trees with another set of local trees without copying.
+    // Used to restore a saved copy when an MCMC proposal is rejected.
+    void swap(LocalTrees &other)
+    {
+        chrom.swap(other.chrom);
+        std::swap(start_coord, other.start_coord);
+        std::swap(end_coord, other.end_coord);
+        std::swap(nnodes, other.nnodes);
+        trees.swap(other.trees);
+        seqids.swap(other.seqids);
+    }
+
     // deallocate local trees
     void clear()
     {
@@ -854,7 +867,9 @@ bool write_newick_tree(const char *filename, const LocalTree *tree,
                        bool oneline, bool pop_model=false);
 void write_local_trees(FILE *out, const LocalTrees *trees,
                        const char *const *names, const double *times,
-                       bool pop_model=false);
+                       bool pop_model=false,
+                       const vector<int> &self_recomb_pos=vector<int>(),
+                       const vector<Spr> &self_recombs=vector<Spr>());
 bool write_local_trees(const char *filename, const LocalTrees *trees,
                        const char *const *names, const double *times,
                        bool pop_model=false,
@@ -870,6 +885,7 @@ bool write_local_trees(const char *filename, const LocalTrees *trees,
                        bool pop_model=false,
                        const vector<int> &self_recomb_pos=vector<int>(),
                        const vector<Spr> &self_recombs=vector<Spr>());
+int find_time(double time, const double *times, int ntimes);
 bool parse_local_tree(const char* newick, LocalTree *tree,
                       const double *times, int ntimes);
 bool read_local_trees(FILE *infile, const double *times, int ntimes,
@@ -0,0 +1,940 @@
+//=============================================================================
+// Binary format for local trees
+
+#include <stdint.h>
+#include <zlib.h>
+
+#include "local_tree_binary.h"
+#include "logging.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+// records per compressed block
+static const int BINARY_BLOCK_RECORDS = 4096;
+
+// header flags
+static const int BINARY_FLAG_NAMES = 1;
+static const int BINARY_FLAG_POP_MODEL = 2;
+static const int BINARY_FLAG_INDEX = 4;
+
+// magic at the end of files with an index
+static const char *BINARY_INDEX_MAGIC = "ARGI";
+static const int BINARY_INDEX_FOOTER = 12;
+
+
+//=============================================================================
+// encoding helpers (all integers are little-endian)
+
+
+static void put_uint32(string &buf, uint32_t x)
+{
+    for (int i=0; i<4; i++)
+        buf += char((x >> (8 * i)) & 0xff);
+}
+
+static void put_uint64(string &buf, uint64_t x)
+{
+    put_uint32(buf, x & 0xffffffff);
+    put_uint32(buf, x >> 32);
+}
+
+static void put_double(string &buf, double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    for (int i=0; i<8; i++)
+        buf += char((bits >> (8 * i)) & 0xff);
+}
+
+static void put_string(string &buf, const string &text)
+{
+    put_uint32(buf, text.size());
+    buf += text;
+}
+
+// unsigned LEB128
+static void put_varint(string &buf, uint32_t x)
+{
+    while (x >= 0x80) {
+        buf += char((x & 0x7f) | 0x80);
+        x >>= 7;
+    }
+    buf += char(x);
+}
+
+
+class BinaryReader
+{
+public:
+    BinaryReader(FILE *infile) :
+        infile(infile),
+        error(false)
+    {}
+
+    uint32_t get_uint32() {
+        unsigned char buf[4];
+        if (!read(buf, 4))
+            return 0;
+        return buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+            (uint32_t(buf[3]) << 24);
+    }
+
+    int32_t get_int32() {
+        return int32_t(get_uint32());
+    }
+
+    uint64_t get_uint64() {
+        uint64_t lo = get_uint32();
+        return lo | (uint64_t(get_uint32()) << 32);
+    }
+
+    double get_double() {
+        unsigned char buf[8];
+        if (!read(buf, 8))
+            return 0.0;
+        uint64_t bits = 0;
+        for (int i=7; i>=0; i--)
+            bits = (bits << 8) | buf[i];
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        return x;
+    }
+
+    string get_string() {
+        uint32_t len = get_uint32();
+        string text(len, '\0');
+        if (len > 0 && !read(&text[0], len))
+            return string();
+        return text;
+    }
+
+    bool read(void *buf, size_t len) {
+        if (error || fread(buf, 1, len, infile) != len) {
+            error = true;
+            return false;
+        }
+        return true;
+    }
+
+    FILE *infile;
+    bool error;
+};
+
+
+// Decodes the varints of a block.
+class VarintReader
+{
+public:
+    VarintReader(const string &buf) :
+        buf(buf),
+        pos(0),
+        error(false)
+    {}
+
+    uint32_t get() {
+        uint32_t x = 0;
+        for (int shift=0; shift<35; shift+=7) {
+            if (pos >= buf.size()) {
+                error = true;
+                return 0;
+            }
+            unsigned char c = buf[pos++];
+            x |= uint32_t(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return x;
+        }
+        error = true;
+        return 0;
+    }
+
+    const string &buf;
+    size_t pos;
+    bool error;
+};
+
+
+//=============================================================================
+// SPR records
+
+
+// SPRs of consecutive trees in the node ids of the file
+class SprRecords
+{
+public:
+    SprRecords() {}
+
+    void add(int _pos, const Spr &spr) {
+        pos.push_back(_pos);
+        sprs.push_back(spr);
+        ndiffs.push_back(0);
+    }
+
+    // record that 'node' has population path 'path' after the last SPR
+    void add_path(int node, int path) {
+        ndiffs.back()++;
+        diffs.push_back(node);
+        diffs.push_back(path);
+    }
+
+    int size() const {
+        return pos.size();
+    }
+
+    vector<int> pos;
+    vector<Spr> sprs;
+    vector<int> ndiffs;  // number of path changes for each record
+    vector<int> diffs;   // (node, path) pairs of all records
+};
+
+
+// Writes records in compressed blocks.  The size of each block is added
+// to 'block_sizes' (if given).
+static bool write_spr_records(FILE *out, const SprRecords &records,
+                              int start_coord, bool pop_model,
+                              vector<uint64_t> *block_sizes=NULL)
+{
+    int last_pos = start_coord;
+    int diff = 0;
+    const int n = records.size();
+    for (int start=0; start<n; start+=BINARY_BLOCK_RECORDS) {
+        const int end = min(start + BINARY_BLOCK_RECORDS, n);
+
+        // columns
+        string raw;
+        for (int i=start; i<end; i++) {
+            put_varint(raw, records.pos[i] - last_pos);
+            last_pos = records.pos[i];
+        }
+        for (int i=start; i<end; i++)
+            put_varint(raw, records.sprs[i].recomb_node);
+        for (int i=start; i<end; i++)
+            put_varint(raw, records.sprs[i].recomb_time);
+        for (int i=start; i<end; i++)
+            put_varint(raw, records.sprs[i].coal_node);
+        for (int i=start; i<end; i++)
+            put_varint(raw, records.sprs[i].coal_time);
+        if (pop_model) {
+            for (int i=start; i<end; i++)
+                put_varint(raw, records.sprs[i].pop_path);
+            for (int i=start; i<end; i++)
+                put_varint(raw, records.ndiffs[i]);
+            for (int i=start; i<end; i++)
+                for (int j=0; j<2*records.ndiffs[i]; j++)
+                    put_varint(raw, records.diffs[diff++]);
+        }
+
+        uLongf len = compressBound(raw.size());
+        string block(len, '\0');
+        if (compress2((Bytef*) &block[0], &len, (const Bytef*) raw.data(),
+                      raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+            return false;
+
+        string header;
+        put_uint32(header, end - start);
+        put_uint32(header, raw.size());
+        put_uint32(header, len);
+        if (fwrite(header.data(), 1, header.size(), out) != header.size() ||
+            fwrite(block.data(), 1, len, out) != len)
+            return false;
+        if (block_sizes)
+            block_sizes->push_back(header.size() + len);
+    }
+    return true;
+}
+
+
+static bool read_spr_records(BinaryReader &reader, int nrecords,
+                             int start_coord, bool pop_model,
+                             SprRecords &records)
+{
+    int last_pos = start_coord;
+    while (records.size() < nrecords) {
+        const int n = reader.get_uint32();
+        const uint32_t raw_len = reader.get_uint32();
+        const uint32_t len = reader.get_uint32();
+        if (reader.error || n <= 0 || records.size() + n > nrecords)
+            return false;
+        string block(len, '\0');
+        string raw(raw_len, '\0');
+        uLongf raw_len2 = raw_len;
+        if (!reader.read(&block[0], len) ||
+            uncompress((Bytef*) &raw[0], &raw_len2,
+                       (const Bytef*) block.data(), len) != Z_OK ||
+            raw_len2 != raw_len)
+            return false;
+
+        VarintReader column(raw);
+        const int start = records.size();
+        Spr spr(-1, -1, -1, -1, 0);
+        for (int i=0; i<n; i++) {
+            last_pos += column.get();
+            records.add(last_pos, spr);
+        }
+        for (int i=start; i<start+n; i++)
+            records.sprs[i].recomb_node = column.get();
+        for (int i=start; i<start+n; i++)
+            records.sprs[i].recomb_time = column.get();
+        for (int i=start; i<start+n; i++)
+            records.sprs[i].coal_node = column.get();
+        for (int i=start; i<start+n; i++)
+            records.sprs[i].coal_time = column.get();
+        if (pop_model) {
+            for (int i=start; i<start+n; i++)
+                records.sprs[i].pop_path = column.get();
+            for (int i=start; i<start+n; i++)
+                records.ndiffs[i] = column.get();
+            for (int i=start; i<start+n; i++)
+                for (int j=0; j<2*records.ndiffs[i]; j++)
+                    records.diffs.push_back(column.get());
+        }
+        if (column.error)
+            return false;
+    }
+    return true;
+}
+
+
+//=============================================================================
+// writing
+
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes,
+                              bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    const int nnodes = trees->nnodes;
+    const int nleaves = trees->get_num_leaves();
+    assert(self_recomb_pos.size() == self_recombs.size());
+
+    // header
+    string header = LOCAL_TREES_BINARY_MAGIC;
+    put_uint32(header, LOCAL_TREES_BINARY_VERSION);
+    put_uint32(header, (names ? BINARY_FLAG_NAMES : 0) |
+               (pop_model ? BINARY_FLAG_POP_MODEL : 0) | BINARY_FLAG_INDEX);
+    put_string(header, trees->chrom);
+    put_uint32(header, trees->start_coord);
+    put_uint32(header, trees->end_coord);
+    put_uint32(header, nleaves);
+    put_uint32(header, nnodes);
+    if (names)
+        for (int i=0; i<nleaves; i++)
+            put_string(header, names[trees->seqids[i]]);
+    put_uint32(header, ntimes);
+    for (int i=0; i<ntimes; i++)
+        put_double(header, times[i]);
+
+    // SPRs in the node ids of the first tree (see write_local_trees)
+    int *total_mapping = new int [nnodes];
+    int *tmp_mapping = new int [nnodes];
+    for (int i=0; i<nnodes; i++)
+        total_mapping[i] = i;
+
+    // the file is decoded by applying each SPR to the previous tree;
+    // 'decoded' follows the reader to find the changed population paths
+    // and to record the keyframes of the index
+    const LocalTree *first = trees->front().tree;
+    LocalTree decoded(*first);
+    SprRecords records;
+    string keyframes;
+    int nkeyframes = 0;
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it) {
+        end += it->blocklen;
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        if (it2 == trees->end())
+            break;
+
+        // keyframe at the start of each block of records
+        if (records.size() > 0 && records.size() % BINARY_BLOCK_RECORDS == 0) {
+            put_uint32(keyframes, records.size());
+            put_uint32(keyframes, records.pos.back());
+            for (int i=0; i<nnodes; i++)
+                put_uint32(keyframes, decoded.nodes[i].parent);
+            for (int i=0; i<nnodes; i++)
+                put_uint32(keyframes, decoded.nodes[i].age);
+            for (int i=0; i<nnodes; i++)
+                put_uint32(keyframes, decoded.nodes[i].pop_path);
+            nkeyframes++;
+        }
+
+        const Spr &spr = it2->spr;
+        Spr spr2(total_mapping[spr.recomb_node], spr.recomb_time,
+                 total_mapping[spr.coal_node], spr.coal_time,
+                 pop_model ? spr.pop_path : 0);
+        records.add(end, spr2);
+
+        // update total mapping
+        int *mapping = it2->mapping;
+        for (int i=0; i<nnodes; i++)
+            tmp_mapping[i] = total_mapping[i];
+        for (int i=0; i<nnodes; i++) {
+            if (mapping[i] != -1)
+                total_mapping[mapping[i]] = tmp_mapping[i];
+            else
+                total_mapping[get_recoal_node(it->tree, spr, mapping)] =
+                    tmp_mapping[i];
+        }
+
+        if (spr2.recomb_node != spr2.coal_node)
+            apply_spr(&decoded, spr2, NULL);
+        if (pop_model) {
+            const LocalNode *nodes = it2->tree->nodes;
+            for (int i=0; i<nnodes; i++) {
+                LocalNode &node = decoded.nodes[total_mapping[i]];
+                if (node.pop_path != nodes[i].pop_path) {
+                    node.pop_path = nodes[i].pop_path;
+                    records.add_path(total_mapping[i], nodes[i].pop_path);
+                }
+            }
+        }
+    }
+
+    // invisible recombinations
+    SprRecords invisible;
+    for (unsigned int i=0; i<self_recombs.size(); i++)
+        invisible.add(self_recomb_pos[i], self_recombs[i]);
+
+    put_uint32(header, records.size());
+    put_uint32(header, invisible.size());
+
+    // first tree
+    for (int i=0; i<nnodes; i++)
+        put_uint32(header, first->nodes[i].parent);
+    for (int i=0; i<nnodes; i++)
+        put_uint32(header, first->nodes[i].age);
+    for (int i=0; i<nnodes; i++)
+        put_uint32(header, first->nodes[i].pop_path);
+
+    fwrite(header.data(), 1, header.size(), out);
+    vector<uint64_t> block_sizes;
+    write_spr_records(out, records, trees->start_coord, pop_model,
+                      &block_sizes);
+    write_spr_records(out, invisible, 0, true, &block_sizes);
+
+    // index: the i-th keyframe is the tree at the start of block i+1
+    vector<uint64_t> block_offsets;
+    uint64_t offset = header.size();
+    for (unsigned int i=0; i<block_sizes.size(); i++) {
+        block_offsets.push_back(offset);
+        offset += block_sizes[i];
+    }
+    string index;
+    put_uint32(index, nkeyframes);
+    for (int i=0; i<nkeyframes; i++)
+        put_uint64(index, block_offsets[i+1]);
+    index += keyframes;
+    put_uint64(index, offset);
+    index += BINARY_INDEX_MAGIC;
+    fwrite(index.data(), 1, index.size(), out);
+
+    delete [] total_mapping;
+    delete [] tmp_mapping;
+}
+
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const vector<string> &seqnames,
+                              const double *times, int ntimes,
+                              bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    const char **names = NULL;
+    if (seqnames.size() > 0) {
+        names = new const char* [seqnames.size()];
+        for (unsigned int i=0; i<seqnames.size(); i++)
+            names[i] = seqnames[i].c_str();
+    }
+    write_local_trees_binary(out, trees, names, times, ntimes, pop_model,
+                             self_recomb_pos, self_recombs);
+    delete [] names;
+}
+
+
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const vector<string> &seqnames,
+                              const double *times, int ntimes,
+                              bool pop_model)
+{
+    FILE *out = NULL;
+
+    if ((out = fopen(filename, "wb")) == NULL) {
+        printError("cannot write file '%s'\n", filename);
+        return false;
+    }
+
+    write_local_trees_binary(out, trees, seqnames, times, ntimes, pop_model);
+    fclose(out);
+    return true;
+}
+
+
+//=============================================================================
+// reading
+
+
+// Reads the node parents, ages and paths of a tree.  Ages are mapped to
+// the times of the reader.
+static bool read_tree_arrays(BinaryReader &reader,
+                             const LocalTreesBinaryHeader &header,
+                             vector<int> &ptree, vector<int> &ages,
+                             vector<int> &paths)
+{
+    const int nnodes = header.nnodes;
+    ptree.resize(nnodes);
+    ages.resize(nnodes);
+    paths.resize(nnodes);
+    for (int i=0; i<nnodes; i++)
+        ptree[i] = reader.get_int32();
+    for (int i=0; i<nnodes; i++)
+        ages[i] = reader.get_int32();
+    for (int i=0; i<nnodes; i++)
+        paths[i] = reader.get_int32();
+    if (reader.error)
+        return false;
+    for (int i=0; i<nnodes; i++) {
+        if (ptree[i] < -1 || ptree[i] >= nnodes ||
+            ages[i] < 0 || ages[i] >= int(header.times.size()))
+            return false;
+        ages[i] = header.time_map[ages[i]];
+    }
+    return true;
+}
+
+
+static bool read_binary_header(BinaryReader &reader, const double *times,
+                               int ntimes, LocalTreesBinaryHeader &header)
+{
+    char magic[4];
+    if (!reader.read(magic, 4) ||
+        strncmp(magic, LOCAL_TREES_BINARY_MAGIC, 4) != 0) {
+        printError("not a binary local trees file");
+        return false;
+    }
+    const int version = reader.get_uint32();
+    if (version != LOCAL_TREES_BINARY_VERSION) {
+        printError("unsupported binary local trees version %d", version);
+        return false;
+    }
+
+    const int flags = reader.get_uint32();
+    header.pop_model = flags & BINARY_FLAG_POP_MODEL;
+    header.has_index = flags & BINARY_FLAG_INDEX;
+    header.chrom = reader.get_string();
+    header.start_coord = reader.get_int32();
+    header.end_coord = reader.get_int32();
+    const int nleaves = reader.get_int32();
+    header.nnodes = reader.get_int32();
+    header.names.clear();
+    if (flags & BINARY_FLAG_NAMES)
+        for (int i=0; i<nleaves; i++)
+            header.names.push_back(reader.get_string());
+    const int file_ntimes = reader.get_int32();
+    if (reader.error || header.nnodes != 2 * nleaves - 1 ||
+        file_ntimes <= 0) {
+        printError("bad binary local trees header");
+        return false;
+    }
+    header.times.resize(file_ntimes);
+    for (int i=0; i<file_ntimes; i++)
+        header.times[i] = reader.get_double();
+
+    // match times of the file to the given times
+    header.time_map.resize(file_ntimes);
+    for (int i=0; i<file_ntimes; i++)
+        header.time_map[i] = (times ? find_time(header.times[i], times, ntimes)
+                              : i);
+
+    header.nsprs = reader.get_int32();
+    header.ninvisible = reader.get_int32();
+
+    if (!read_tree_arrays(reader, header, header.ptree, header.ages,
+                          header.paths)) {
+        printError("bad binary local trees header");
+        return false;
+    }
+    return true;
+}
+
+
+// Rebuilds local trees by applying SPR records to a starting tree.  Trees
+// overlapping the region [region_start, region_end) are appended to
+// 'trees' and, if 'clip' is true, their blocks are clipped to the region.
+class TreeDecoder
+{
+public:
+    TreeDecoder(const LocalTreesBinaryHeader &header, LocalTree *tree,
+                int start, int region_start, int region_end, bool clip,
+                LocalTrees *trees) :
+        header(header),
+        tree(tree),
+        mapping(NULL),
+        start(start),
+        region_start(region_start),
+        region_end(region_end),
+        clip(clip),
+        trees(trees),
+        added(false)
+    {
+        spr.set_null();
+    }
+
+    ~TreeDecoder()
+    {
+        if (!added) {
+            delete tree;
+            delete [] mapping;
+        }
+    }
+
+    // ends the current tree at 'end'
+    void end_tree(int end)
+    {
+        if (start < region_end && end > region_start) {
+            const int blocklen = (clip ? min(end, region_end) -
+                                  max(start, region_start) : end - start);
+            if (trees->trees.size() == 0)
+                trees->start_coord = (clip ? max(start, region_start) : start);
+            trees->trees.push_back(LocalTreeSpr(tree, spr, blocklen, mapping));
+            added = true;
+        }
+        start = end;
+    }
+
+    // applies record 'i' to get the next tree
+    bool next_tree(const SprRecords &records, int i, int &diff)
+    {
+        const int nnodes = header.nnodes;
+        const int ntimes = header.times.size();
+        Spr spr2 = records.sprs[i];
+        if (spr2.recomb_node < 0 || spr2.recomb_node >= nnodes ||
+            spr2.coal_node < 0 || spr2.coal_node >= nnodes ||
+            spr2.recomb_time >= ntimes || spr2.coal_time >= ntimes)
+            return false;
+        spr2.recomb_time = header.time_map[spr2.recomb_time];
+        spr2.coal_time = header.time_map[spr2.coal_time];
+
+        // trees before the region are updated in place
+        if (added) {
+            tree = new LocalTree(*tree);
+            mapping = new int [nnodes];
+            for (int j=0; j<nnodes; j++)
+                mapping[j] = j;
+            spr = spr2;
+            added = false;
+        } else {
+            delete [] mapping;
+            mapping = NULL;
+        }
+
+        if (spr2.recomb_node != spr2.coal_node) {
+            if (mapping)
+                mapping[tree->nodes[spr2.recomb_node].parent] = -1;
+            apply_spr(tree, spr2, NULL);
+        }
+        for (int j=0; j<records.ndiffs[i]; j++, diff+=2)
+            tree->nodes[records.diffs[diff]].pop_path = records.diffs[diff+1];
+        return true;
+    }
+
+    bool apply_records(const SprRecords &records)
+    {
+        int diff = 0;
+        for (int i=0; i<records.size(); i++) {
+            end_tree(records.pos[i]);
+            if (!next_tree(records, i, diff))
+                return false;
+        }
+        return true;
+    }
+
+    // start of the current tree
+    int get_start() const {
+        return start;
+    }
+
+    bool past_region() const {
+        return start >= region_end;
+    }
+
+protected:
+    const LocalTreesBinaryHeader &header;
+    LocalTree *tree;  // current tree
+    Spr spr;          // SPR and mapping leading to the current tree
+    int *mapping;
+    int start;
+    int region_start;
+    int region_end;
+    bool clip;
+    LocalTrees *trees;
+    bool added;       // whether the current tree is in 'trees'
+};
+
+
+static void set_trees_info(const LocalTreesBinaryHeader &header,
+                           LocalTrees *trees, int end_coord)
+{
+    trees->chrom = header.chrom;
+    trees->end_coord = end_coord;
+    trees->nnodes = header.nnodes;
+    trees->set_default_seqids();
+}
+
+
+bool read_local_trees_binary(FILE *infile, const double *times, int ntimes,
+                             LocalTrees *trees, vector<string> &seqnames,
+                             vector<int> *invisible_recomb_pos,
+                             vector<Spr> *invisible_recombs,
+                             vector<double> *file_times,
+                             bool *pop_model)
+{
+    BinaryReader reader(infile);
+    LocalTreesBinaryHeader header;
+    trees->clear();
+    if (!read_binary_header(reader, times, ntimes, header))
+        return false;
+    seqnames = header.names;
+    if (file_times)
+        *file_times = header.times;
+    if (pop_model)
+        *pop_model = header.pop_model;
+
+    SprRecords records, invisible;
+    if (!read_spr_records(reader, header.nsprs, header.start_coord,
+                          header.pop_model, records) ||
+        !read_spr_records(reader, header.ninvisible, 0, true, invisible)) {
+        printError("bad binary local trees records");
+        return false;
+    }
+
+    {
+        TreeDecoder decoder(header, new LocalTree(&header.ptree[0],
+                                                  header.nnodes,
+                                                  &header.ages[0],
+                                                  &header.paths[0]),
+                            header.start_coord, header.start_coord,
+                            header.end_coord, false, trees);
+        if (!decoder.apply_records(records)) {
+            printError("bad binary local trees records");
+            return false;
+        }
+        decoder.end_tree(header.end_coord);
+    }
+    trees->start_coord = header.start_coord;
+    set_trees_info(header, trees, header.end_coord);
+
+    if (invisible_recombs) {
+        for (int i=0; i<header.ninvisible; i++) {
+            Spr ispr = invisible.sprs[i];
+            ispr.recomb_time = header.time_map[ispr.recomb_time];
+            ispr.coal_time = header.time_map[ispr.coal_time];
+            invisible_recombs->push_back(ispr);
+            invisible_recomb_pos->push_back(invisible.pos[i]);
+        }
+    }
+
+    return true;
+}
+
+
+bool read_local_trees_binary(const char *filename, const double *times,
+                             int ntimes, LocalTrees *trees,
+                             vector<string> &seqnames)
+{
+    FILE *infile = NULL;
+
+    if ((infile = fopen(filename, "rb")) == NULL) {
+        printError("cannot read file '%s'\n", filename);
+        return false;
+    }
+
+    bool result = read_local_trees_binary(infile, times, ntimes, trees,
+                                          seqnames);
+
+    fclose(infile);
+    return result;
+}
+
+
+bool is_local_trees_binary(const char *filename)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+    char magic[4];
+    bool binary = (fread(magic, 1, 4, infile) == 4 &&
+                   strncmp(magic, LOCAL_TREES_BINARY_MAGIC, 4) == 0);
+    fclose(infile);
+    return binary;
+}
+
+
+//=============================================================================
+// random access through the index
+
+
+LocalTreesIndex::LocalTreesIndex() :
+    infile(NULL)
+{}
+
+
+LocalTreesIndex::~LocalTreesIndex()
+{
+    close();
+}
+
+
+bool LocalTreesIndex::open(const char *filename, const double *times,
+                           int ntimes)
+{
+    close();
+    if ((infile = fopen(filename, "rb")) == NULL) {
+        printError("cannot read file '%s'\n", filename);
+        return false;
+    }
+
+    BinaryReader reader(infile);
+    if (!read_binary_header(reader, times, ntimes, header)) {
+        close();
+        return false;
+    }
+
+    // the first tree is the first keyframe
+    Keyframe first;
+    first.first_spr = 0;
+    first.start = header.start_coord;
+    first.offset = ftello(infile);
+    first.ptree = header.ptree;
+    first.ages = header.ages;
+    first.paths = header.paths;
+    keyframes.push_back(first);
+
+    if (!header.has_index)
+        return true;
+
+    // find index from the footer
+    char magic[4];
+    if (fseeko(infile, -BINARY_INDEX_FOOTER, SEEK_END) != 0) {
+        printError("bad binary local trees index");
+        close();
+        return false;
+    }
+    const uint64_t index_offset = reader.get_uint64();
+    if (!reader.read(magic, 4) ||
+        strncmp(magic, BINARY_INDEX_MAGIC, 4) != 0 ||
+        fseeko(infile, index_offset, SEEK_SET) != 0) {
+        printError("bad binary local trees index");
+        close();
+        return false;
+    }
+
+    const int nkeyframes = reader.get_int32();
+    if (reader.error || nkeyframes < 0) {
+        printError("bad binary local trees index");
+        close();
+        return false;
+    }
+    keyframes.resize(nkeyframes + 1);
+    for (int i=1; i<=nkeyframes; i++)
+        keyframes[i].offset = reader.get_uint64();
+    for (int i=1; i<=nkeyframes; i++) {
+        Keyframe &key = keyframes[i];
+        key.first_spr = reader.get_int32();
+        key.start = reader.get_int32();
+        if (!read_tree_arrays(reader, header, key.ptree, key.ages,
+                              key.paths) ||
+            key.first_spr <= keyframes[i-1].first_spr ||
+            key.first_spr > header.nsprs || key.start < keyframes[i-1].start) {
+            printError("bad binary local trees index");
+            close();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void LocalTreesIndex::close()
+{
+    if (infile) {
+        fclose(infile);
+        infile = NULL;
+    }
+    keyframes.clear();
+}
+
+
+bool LocalTreesIndex::read_region(int start, int end, LocalTrees *trees,
+                                  bool clip)
+{
+    trees->clear();
+    start = max(start, header.start_coord);
+    end = min(end, header.end_coord);
+    if (!infile || start >= end) {
+        printError("bad region for binary local trees");
+        return false;
+    }
+
+    // last keyframe starting at or before the region
+    int k = keyframes.size() - 1;
+    while (k > 0 && keyframes[k].start > start)
+        k--;
+    Keyframe &key = keyframes[k];
+    if (fseeko(infile, key.offset, SEEK_SET) != 0) {
+        printError("bad binary local trees index");
+        return false;
+    }
+
+    BinaryReader reader(infile);
+    TreeDecoder decoder(header, new LocalTree(&key.ptree[0], header.nnodes,
+                                              &key.ages[0], &key.paths[0]),
+                        key.start, start, end, clip, trees);
+    int nsprs = key.first_spr;
+    while (nsprs < header.nsprs && !decoder.past_region()) {
+        // decode one block at a time
+        SprRecords records;
+        const int n = min(BINARY_BLOCK_RECORDS, header.nsprs - nsprs);
+        if (!read_spr_records(reader, n, decoder.get_start(),
+                              header.pop_model, records) ||
+            !decoder.apply_records(records)) {
+            printError("bad binary local trees records");
+            return false;
+        }
+        nsprs += n;
+    }
+    if (!decoder.past_region())
+        decoder.end_tree(header.end_coord);
+
+    int end_coord = trees->start_coord;
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it)
+        end_coord += it->blocklen;
+    set_trees_info(header, trees, end_coord);
+    return true;
+}
+
+
+LocalTree *LocalTreesIndex::get_tree(int pos, int *start, int *end)
+{
+    LocalTrees trees;
+    if (!read_region(pos, pos + 1, &trees, false))
+        return NULL;
+    LocalTree *tree = trees.front().tree;
+    trees.front().tree = NULL;
+    if (start)
+        *start = trees.start_coord;
+    if (end)
+        *end = trees.end_coord;
+    return tree;
+}
+
+
+} // namespace argweaver
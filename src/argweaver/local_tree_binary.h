@@ -0,0 +1,154 @@
+//=============================================================================
+// Binary format for local trees
+//
+// A compact alternative to the text (.smc) format written by
+// write_local_trees().  A file holds:
+//
+//   header:   magic "ARGB", version, flags, chrom, region, leaf names
+//             and the discretized times of the model
+//   tree:     parent, age and population path of every node of the first
+//             local tree
+//   SPRs:     one record per following local tree (start position,
+//             recomb node/time, coal node/time and, for population
+//             models, the SPR path and the nodes whose paths changed),
+//             stored by column in zlib-compressed blocks
+//   SPR-INVIS records in the same layout, if any
+//   index:    keyframes, i.e. the full tree at the start of every block
+//             of SPRs after the first, with the file offset of the block,
+//             followed by the offset of the index and the magic "ARGI"
+//
+// Node ids follow the same convention as the text format: the nodes of
+// each tree keep their ids and the broken node becomes the recoalescing
+// node, so every tree is obtained by applying its SPR to the previous one.
+
+#ifndef ARGWEAVER_LOCAL_TREE_BINARY_H
+#define ARGWEAVER_LOCAL_TREE_BINARY_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "local_tree.h"
+
+namespace argweaver {
+
+using namespace std;
+
+
+#define LOCAL_TREES_BINARY_MAGIC "ARGB"
+#define LOCAL_TREES_BINARY_VERSION 1
+
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes,
+                              bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const vector<string> &seqnames,
+                              const double *times, int ntimes,
+                              bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const vector<string> &seqnames,
+                              const double *times, int ntimes,
+                              bool pop_model=false);
+
+// Reads local trees.  Times are matched to the closest of 'times'; if
+// 'times' is NULL, the times of the file are used.  The times of the file
+// and whether it has population paths are returned in 'file_times' and
+// 'pop_model' (if given).
+bool read_local_trees_binary(FILE *infile, const double *times, int ntimes,
+                             LocalTrees *trees, vector<string> &seqnames,
+                             vector<int> *invisible_recomb_pos=NULL,
+                             vector<Spr> *invisible_recombs=NULL,
+                             vector<double> *file_times=NULL,
+                             bool *pop_model=NULL);
+bool read_local_trees_binary(const char *filename, const double *times,
+                             int ntimes, LocalTrees *trees,
+                             vector<string> &seqnames);
+
+// returns true if the file starts like a binary local trees file
+bool is_local_trees_binary(const char *filename);
+
+
+// header of a binary local trees file
+struct LocalTreesBinaryHeader
+{
+    bool pop_model;
+    bool has_index;
+    string chrom;
+    int start_coord;
+    int end_coord;
+    int nnodes;
+    vector<string> names;
+    vector<double> times;   // times of the file
+    vector<int> time_map;   // index of each file time in the reader's times
+    int nsprs;
+    int ninvisible;
+
+    // first tree (ages are indexes into the reader's times)
+    vector<int> ptree;
+    vector<int> ages;
+    vector<int> paths;
+};
+
+
+// Random access to the local trees of a binary file.  The trees of a
+// region are decoded from the nearest keyframe at or before the region,
+// so a query reads at most one block of SPRs before the region.
+//
+// Example:
+//   LocalTreesIndex index;
+//   index.open("out.10.bin", model.times, model.ntimes);
+//   index.read_region(1000000, 2000000, &trees);
+class LocalTreesIndex
+{
+public:
+    LocalTreesIndex();
+    ~LocalTreesIndex();
+
+    // Opens a binary file.  Times are matched as in
+    // read_local_trees_binary().
+    bool open(const char *filename, const double *times=NULL, int ntimes=0);
+    void close();
+
+    // Reads the local trees overlapping [start, end).  If 'clip' is true,
+    // the first and last blocks are clipped to the region, otherwise
+    // trees->start_coord and trees->end_coord are set to the start and
+    // end of those blocks.
+    bool read_region(int start, int end, LocalTrees *trees, bool clip=true);
+
+    // Returns the local tree containing 'pos' (owned by the caller) and
+    // the [start, end) coordinates of its block, or NULL on error.
+    LocalTree *get_tree(int pos, int *start=NULL, int *end=NULL);
+
+    const LocalTreesBinaryHeader &get_header() const {
+        return header;
+    }
+
+    int get_num_keyframes() const {
+        return keyframes.size();
+    }
+
+protected:
+    struct Keyframe
+    {
+        int first_spr;      // index of the first SPR after the keyframe
+        int start;          // start coordinate of the keyframe tree
+        long long offset;   // file offset of the SPR block
+        vector<int> ptree;
+        vector<int> ages;
+        vector<int> paths;
+    };
+
+    FILE *infile;
+    LocalTreesBinaryHeader header;
+    vector<Keyframe> keyframes;
+};
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_LOCAL_TREE_BINARY_H
@@ -15,6 +15,7 @@ namespace argweaver {
 // Errors and Logging
 
 Logger g_logger(stderr, LOG_QUIET);
+__thread Logger *g_thread_logger = NULL;
 
 
 void Logger::printTimerLog(const Timer &timer, int level, const char *fmt, ...)
@@ -64,14 +65,15 @@ void Logger::printTimerLog(const Timer &timer, int level, const char *fmt,
 void printLog(int level, const char *fmt, ...)
 {
     va_list ap;
+    Logger &root = get_logger();
 
-    if (g_logger.isLogLevel(level)) {
+    if (root.isLogLevel(level)) {
         va_start(ap, fmt);
-        g_logger.printLog(level, fmt, ap);
+        root.printLog(level, fmt, ap);
         va_end(ap);
     }
 
-    Logger *logger = g_logger.getChain();
+    Logger *logger = root.getChain();
     if (logger && logger->isLogLevel(level)) {
         va_start(ap, fmt);
         logger->printLog(level, fmt, ap);
@@ -83,14 +85,15 @@ void printLog(int level, const char *fmt, ...)
 void printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
     va_list ap;
+    Logger &root = get_logger();
 
-    if (g_logger.isLogLevel(level)) {
+    if (root.isLogLevel(level)) {
         va_start(ap, fmt);
-        g_logger.printTimerLog(timer, level, fmt, ap);
+        root.printTimerLog(timer, level, fmt, ap);
         va_end(ap);
     }
 
-    Logger *logger = g_logger.getChain();
+    Logger *logger = root.getChain();
     if (logger && logger->isLogLevel(level)) {
         va_start(ap, fmt);
         logger->printTimerLog(timer, level, fmt, ap);
@@ -105,7 +108,7 @@ void printError(const char *fmt, va_list ap)
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
 
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    get_logger().printLog(LOG_HIGH, fmt, ap);
 }
 
 void printWarning(const char *fmt, va_list ap)
@@ -114,7 +117,7 @@ void printWarning(const char *fmt, va_list ap)
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
 
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    get_logger().printLog(LOG_HIGH, fmt, ap);
 }
 
 
@@ -128,7 +131,7 @@ void printError(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    get_logger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
 }
 
@@ -142,7 +145,7 @@ void printWarning(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    get_logger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
 }
 
@@ -164,7 +167,7 @@ void exitError(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    get_logger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
     exit(1);
 }
@@ -176,7 +179,7 @@ void exitError(const char *fmt, ...)
 extern "C" {
 
 void setLogLevel(int level)
-{ return g_logger.setLogLevel(level); }
+{ return get_logger().setLogLevel(level); }
 
 } // extern "C"
 
@@ -224,26 +224,39 @@ protected:
 
 extern Logger g_logger;
 
+// logger used by the calling thread (NULL uses g_logger)
+extern __thread Logger *g_thread_logger;
+
+// Log from the calling thread to 'logger' instead of g_logger, so that
+// threads running separate chains keep separate logs and log levels.
+// Pass NULL to return to g_logger.
+inline void set_thread_logger(Logger *logger)
+{ g_thread_logger = logger; }
+
+// the logger of the calling thread
+inline Logger &get_logger()
+{ return g_thread_logger ? *g_thread_logger : g_logger; }
+
 inline bool openLogFile(const char *filename, const char* mode="w")
-{ return g_logger.openLogFile(filename, mode); }
+{ return get_logger().openLogFile(filename, mode); }
 
 inline void openLogFile(FILE *stream)
-{ return g_logger.openLogFile(stream); }
+{ return get_logger().openLogFile(stream); }
 
 inline void closeLogFile()
-{ g_logger.closeLogFile(); }
+{ get_logger().closeLogFile(); }
 
 inline FILE *getLogFile()
-{ return g_logger.getLogFile(); }
+{ return get_logger().getLogFile(); }
 
 inline bool isLogLevel(int level)
-{ return g_logger.isLogLevel(level); }
+{ return get_logger().isLogLevel(level); }
 
 inline int incLogLevel()
-{ return g_logger.incLogLevel(); }
+{ return get_logger().incLogLevel(); }
 
 inline int decLogLevel()
-{ return g_logger.decLogLevel(); }
+{ return get_logger().decLogLevel(); }
 
 
 // global function API
@@ -9,7 +9,8 @@ void calc_arghmm_matrices_internal(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, int minage,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr,
+    TransMatrixCache *transmat_cache, int model_index)
 {
     const bool internal = true;
 
@@ -35,17 +36,8 @@ void calc_arghmm_matrices_internal(
         matrices->emit = new_matrix<double>(blocklen, max(nstates, 1));
         if (model->unphased && phase_pr != NULL)
             phase_pr->offset = start;
-        vector<vector<BaseProbs> > sub_base_probs;
-        sub_base_probs.clear();
-        if (seqs->base_probs.size() > 0) {
-            for (int i=0; i < nleaves; i++) {
-                vector<BaseProbs>::const_iterator first =
-                    seqs->base_probs[trees->seqids[i]].begin() + start;
-                vector<BaseProbs>::const_iterator last =
-                    seqs->base_probs[trees->seqids[i]].begin() + end;
-                sub_base_probs.push_back(vector<BaseProbs>(first,last));
-            }
-        }
+        BaseProbsView sub_base_probs(seqs->base_probs, &trees->seqids[0],
+                                     nleaves, start);
 	calc_emissions_internal(states, tree, subseqs, sub_base_probs, nleaves,
                                 blocklen, model, matrices->emit, phase_pr);
     } else {
@@ -80,9 +72,16 @@ void calc_arghmm_matrices_internal(
     lineages.count(tree, model->pop_tree, internal);
 
     // calculate transmat and use it for rest of block
-    matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                          internal, matrices->states_model.minage);
+    if (transmat_cache) {
+        matrices->transmat = transmat_cache->get(
+            model, model_index, tree, states, &lineages,
+            internal, matrices->states_model.minage);
+    } else {
+        matrices->transmat = new TransMatrix(model, nstates);
+        matrices->transmat->calc_transition_probs(
+            tree, model, states, &lineages,
+            internal, matrices->states_model.minage);
+    }
 }
 
 
@@ -92,7 +91,8 @@ void calc_arghmm_matrices_external(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
-    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop)
+    ArgHmmMatrices *matrices, PhaseProbs *phase_pr, int start_pop,
+    TransMatrixCache *transmat_cache, int model_index)
 {
     // get block information
     const int blocklen = end - start;
@@ -117,16 +117,12 @@ void calc_arghmm_matrices_external(
         matrices->emit = new_matrix<double>(blocklen, nstates);
 	if (model->unphased)
 	    phase_pr->offset = start;
-        vector<vector<BaseProbs> > sub_base_probs;
-        sub_base_probs.clear();
-        if (seqs->base_probs.size() > 0) {
-            for (int i=0; i <= nleaves; i++) {
-                int idx = ( i < nleaves ? trees->seqids[i] : new_chrom );
-                vector<BaseProbs>::const_iterator first = seqs->base_probs[idx].begin() + start;
-                vector<BaseProbs>::const_iterator last = seqs->base_probs[idx].begin() + end;
-                sub_base_probs.push_back(vector<BaseProbs>(first,last));
-            }
-        }
+        int subseqids[nleaves + 1];
+        for (int i=0; i<nleaves; i++)
+            subseqids[i] = trees->seqids[i];
+        subseqids[nleaves] = new_chrom;
+        BaseProbsView sub_base_probs(seqs->base_probs, subseqids,
+                                     nleaves + 1, start);
         calc_emissions_external(states, tree, subseqs, sub_base_probs,
                                 nleaves + 1, blocklen,
                                 model, matrices->emit, phase_pr);
@@ -162,10 +158,16 @@ void calc_arghmm_matrices_external(
     lineages.count(tree, model->pop_tree);
 
     // calculate transmat and use it for rest of block
-    matrices->transmat = new TransMatrix(model, nstates);
-    matrices->transmat->calc_transition_probs(tree, model, states, &lineages,
-                                              false,
-                                              matrices->states_model.minage);
+    if (transmat_cache) {
+        matrices->transmat = transmat_cache->get(
+            model, model_index, tree, states, &lineages,
+            false, matrices->states_model.minage);
+    } else {
+        matrices->transmat = new TransMatrix(model, nstates);
+        matrices->transmat->calc_transition_probs(
+            tree, model, states, &lineages,
+            false, matrices->states_model.minage);
+    }
 }
 
 
@@ -175,19 +177,144 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop)
+    PhaseProbs *phase_pr, int start_pop,
+    TransMatrixCache *transmat_cache, int model_index)
 {
     if (states_model.internal)
         calc_arghmm_matrices_internal(
             model, seqs, trees, last_tree_spr, tree_spr,
             start, end, states_model.minage, matrices,
-            phase_pr);
+            phase_pr, transmat_cache, model_index);
     else
         calc_arghmm_matrices_external(
             model, seqs, trees, last_tree_spr,  tree_spr,
-            start, end, new_chrom, matrices, phase_pr, start_pop);
+            start, end, new_chrom, matrices, phase_pr, start_pop,
+            transmat_cache, model_index);
+}
+
+//=============================================================================
+// prefetching of matrices by worker threads
+
+
+void ArgHmmMatrixCache::start_prefetch()
+{
+    const int nblocks = blocks.size();
+    prefetched.assign(nblocks, NULL);
+    prefetch_next = 0;
+    prefetch_current = 0;
+    prefetch_stop = false;
+    pthread_mutex_init(&prefetch_lock, NULL);
+    pthread_cond_init(&prefetch_cond, NULL);
+
+    // the caller acts as one of the threads
+    const int nworkers = min(nthreads - 1, nblocks);
+    workers.clear();
+    for (int i=0; i<nworkers; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL,
+                           &ArgHmmMatrixCache::prefetch_worker_main,
+                           this) != 0) {
+            printError("could not start matrix thread");
+            break;
+        }
+        workers.push_back(worker);
+    }
+    prefetching = true;
+}
+
+
+void ArgHmmMatrixCache::stop_prefetch()
+{
+    if (!prefetching)
+        return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_stop = true;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    for (unsigned int i=0; i<workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    workers.clear();
+
+    // discard blocks that were computed but never used
+    for (unsigned int i=0; i<prefetched.size(); i++)
+        delete prefetched[i];
+    prefetched.clear();
+
+    pthread_cond_destroy(&prefetch_cond);
+    pthread_mutex_destroy(&prefetch_lock);
+    prefetching = false;
 }
 
 
+// Move the matrices of the current block into 'mat', computing them on
+// this thread if no worker has claimed the block yet.
+void ArgHmmMatrixCache::take_prefetched()
+{
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_current = block_index;
+    pthread_cond_broadcast(&prefetch_cond);
+
+    if (prefetch_next <= block_index) {
+        prefetch_next = block_index + 1;
+        pthread_mutex_unlock(&prefetch_lock);
+        calc_matrices(&mat);
+        return;
+    }
+
+    while (!prefetched[block_index])
+        pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    ArgHmmMatrices *matrices = prefetched[block_index];
+    prefetched[block_index] = NULL;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    mat.nstates1 = matrices->nstates1;
+    mat.nstates2 = matrices->nstates2;
+    mat.blocklen = matrices->blocklen;
+    mat.states_model = matrices->states_model;
+    mat.transmat = matrices->transmat;
+    mat.transmat_switch = matrices->transmat_switch;
+    mat.emit = matrices->emit;
+    matrices->detach();
+    delete matrices;
+}
+
+
+void ArgHmmMatrixCache::prefetch_worker()
+{
+    const int nblocks = blocks.size();
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (true) {
+        // wait until the next block is within the window
+        while (!prefetch_stop && prefetch_next < nblocks &&
+               prefetch_next > prefetch_current + prefetch_window)
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        if (prefetch_stop || prefetch_next >= nblocks)
+            break;
+
+        const int index = prefetch_next++;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        ArgHmmMatrices *matrices = new ArgHmmMatrices();
+        calc_block_matrices(index, matrices);
+
+        pthread_mutex_lock(&prefetch_lock);
+        prefetched[index] = matrices;
+        pthread_cond_broadcast(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+
+void *ArgHmmMatrixCache::prefetch_worker_main(void *iter)
+{
+    ((ArgHmmMatrixCache*) iter)->prefetch_worker();
+    return NULL;
+}
+
+
+
 } // namespace argweaver
 
@@ -6,11 +6,14 @@
 
 
 // c++ includes
+#include <deque>
 #include <list>
 #include <vector>
+#include <pthread.h>
 #include <string.h>
 
 // arghmm includes
+#include "arena.h"
 #include "common.h"
 #include "emit.h"
 #include "local_tree.h"
@@ -61,7 +64,7 @@ public:
     void clear()
     {
         if (transmat) {
-            delete transmat;
+            TransMatrix::release(transmat);
             transmat = NULL;
         }
         if (transmat_switch) {
@@ -104,7 +107,8 @@ void calc_arghmm_matrices(
     const LocalTreeSpr *last_tree_spr, const LocalTreeSpr *tree_spr,
     const int start, const int end, const int new_chrom,
     const StatesModel &states_model, ArgHmmMatrices *matrices,
-    PhaseProbs *phase_pr, int start_pop);
+    PhaseProbs *phase_pr, int start_pop,
+    TransMatrixCache *transmat_cache=NULL, int model_index=0);
 
 
 
@@ -223,7 +227,8 @@ public:
         seqs(seqs),
         trees(trees),
         new_chrom(_new_chrom),
-        blocks(model, trees)
+        blocks(model, trees),
+        transmat_cache(new TransMatrixCache())
     {
         if (new_chrom == -1)
             new_chrom = trees->get_num_leaves();
@@ -234,11 +239,13 @@ public:
     virtual ~ArgHmmMatrixIter()
     {
         mat.clear();
+        delete transmat_cache;
     }
 
     virtual void setup() {
         // determine all blocks
         blocks.setup();
+        transmat_cache->clear();
     }
 
     virtual void clear() {}
@@ -346,23 +353,59 @@ public:
         states_model.get_coal_states(get_tree_spr()->tree, states);
     }
 
+    // set the sequences used for emissions (NULL skips emissions)
+    virtual void set_seqs(const Sequences *_seqs) {
+        seqs = _seqs;
+    }
 
-    StatesModel states_model;
 
-protected:
+    //==================================================
+    // random access to blocks (requires begin() to have been called)
 
-    void calc_matrices(ArgHmmMatrices *matrices, PhaseProbs *phase_pr = NULL)
+    int get_num_blocks() const {
+        return blocks.size();
+    }
+
+    const ArgModelBlock &get_block(int index) const {
+        return blocks.at(index);
+    }
+
+    // calculate the matrices of any block; only reads the iterator state
+    // so it may be called from several threads at once
+    void calc_block_matrices(int index, ArgHmmMatrices *matrices,
+                             PhaseProbs *phase_pr = NULL) const
     {
         ArgModel local_model;
-        ArgModelBlock &block = blocks.at(block_index);
+        const ArgModelBlock &block = blocks.at(index);
 
         model->get_local_model_index(block.model_index, local_model);
-        const LocalTreeSpr * last_tree_spr = get_last_tree_spr();
+        const LocalTreeSpr * last_tree_spr =
+            (index > 0 ? blocks.at(index-1).tree_spr : NULL);
 
         argweaver::calc_arghmm_matrices(
             &local_model, seqs, trees, last_tree_spr, block.tree_spr,
             block.start, block.end, new_chrom, states_model, matrices,
-	    phase_pr, start_pop);
+	    phase_pr, start_pop, transmat_cache, block.model_index);
+    }
+
+    // transition matrices shared between blocks
+    const TransMatrixCache *get_transmat_cache() const {
+        return transmat_cache;
+    }
+
+    // scratch memory for the forward algorithm of the current block
+    ScratchArena *get_arena() {
+        return &arena;
+    }
+
+
+    StatesModel states_model;
+
+protected:
+
+    void calc_matrices(ArgHmmMatrices *matrices, PhaseProbs *phase_pr = NULL)
+    {
+        calc_block_matrices(block_index, matrices, phase_pr);
     }
 
 
@@ -378,6 +421,15 @@ protected:
     // record of common blocks
     ArgModelBlocks blocks;
     int block_index;
+
+    // blocks with the same transition matrix inputs share one matrix
+    TransMatrixCache *transmat_cache;
+
+    ScratchArena arena;
+
+private:
+    ArgHmmMatrixIter(const ArgHmmMatrixIter &other);
+    ArgHmmMatrixIter &operator=(const ArgHmmMatrixIter &other);
 };
 
 
@@ -460,6 +512,238 @@ protected:
 };
 
 
+
+// Computes matrices block by block like ArgHmmMatrixIter, but keeps the
+// transition matrices of each block so that later passes over the same
+// ARG (stochastic traceback, recombination sampling) can reuse them.
+// Emission matrices are never cached.  Blocks are evicted oldest first
+// once the cache grows beyond 'max_bytes'.
+//
+// If more than one thread is requested (see set_threads), the matrices of
+// the blocks ahead of the iterator are computed by worker threads while
+// the caller works on the current block.  This is only done for a forward
+// pass over the blocks that needs emissions and no phasing probabilities.
+// The matrices themselves are identical to the ones computed serially.
+class ArgHmmMatrixCache : public ArgHmmMatrixIter
+{
+public:
+    ArgHmmMatrixCache(const ArgModel *model, const Sequences *seqs,
+                      const LocalTrees *trees, int new_chrom=-1,
+                      long max_bytes=0) :
+        ArgHmmMatrixIter(model, seqs, trees, new_chrom),
+        max_bytes(max_bytes),
+        nbytes(0),
+        nhits(0),
+        nmisses(0),
+        borrowed(false),
+        nthreads(1),
+        prefetch_window(0),
+        prefetching(false),
+        prefetch_pending(false)
+    {}
+
+    virtual ~ArgHmmMatrixCache()
+    {
+        stop_prefetch();
+        release_matrices();
+        clear();
+    }
+
+    // Use 'nthreads' threads in total (including the caller) during the
+    // forward pass.  At most 'window' blocks are computed ahead of the
+    // current block (default: two per thread).
+    void set_threads(int _nthreads, int window=0)
+    {
+        nthreads = max(_nthreads, 1);
+        prefetch_window = (window > 0 ? window : 2 * nthreads);
+    }
+
+    //==================================================
+    // iteration methods
+
+    virtual void begin()
+    {
+        stop_prefetch();
+        ArgHmmMatrixIter::begin();
+        prefetch_pending = true;
+    }
+
+    virtual void rbegin()
+    {
+        stop_prefetch();
+        prefetch_pending = false;
+        ArgHmmMatrixIter::rbegin();
+    }
+
+    virtual bool prev()
+    {
+        stop_prefetch();
+        prefetch_pending = false;
+        return ArgHmmMatrixIter::prev();
+    }
+
+    virtual void setup()
+    {
+        ArgHmmMatrixIter::setup();
+        cache.resize(blocks.size(), NULL);
+        cache_bytes.resize(blocks.size(), 0);
+    }
+
+    // free all cached matrices
+    virtual void clear()
+    {
+        for (unsigned int i=0; i<cache.size(); i++) {
+            if (cache[i]) {
+                delete cache[i];
+                cache[i] = NULL;
+            }
+        }
+        stored.clear();
+        nbytes = 0;
+    }
+
+    //==================================================
+    // accessors
+
+    // Cached matrices are only used when emissions are not needed
+    // (see set_seqs).
+    virtual ArgHmmMatrices &ref_matrices(PhaseProbs *phase_pr = NULL)
+    {
+        release_matrices();
+
+        // prefetch only when iterating forward from begin()
+        if (prefetch_pending) {
+            prefetch_pending = false;
+            if (nthreads > 1 && seqs && !phase_pr)
+                start_prefetch();
+        }
+
+        ArgHmmMatrices *entry = cache[block_index];
+        if (prefetching) {
+            nmisses++;
+            take_prefetched();
+            if (!entry)
+                store_matrices();
+            if (block_index == int(blocks.size()) - 1)
+                stop_prefetch();
+            return mat;
+        }
+
+        if (entry && !seqs) {
+            nhits++;
+            mat.nstates1 = entry->nstates1;
+            mat.nstates2 = entry->nstates2;
+            mat.blocklen = entry->blocklen;
+            mat.states_model = entry->states_model;
+            mat.transmat = entry->transmat;
+            mat.transmat_switch = entry->transmat_switch;
+            mat.emit = NULL;
+            borrowed = true;
+            return mat;
+        }
+
+        nmisses++;
+        calc_matrices(&mat, phase_pr);
+        if (!entry)
+            store_matrices();
+        return mat;
+    }
+
+    int get_hits() const {
+        return nhits;
+    }
+
+    int get_misses() const {
+        return nmisses;
+    }
+
+    long get_nbytes() const {
+        return nbytes;
+    }
+
+    // set the sequences used for emissions (NULL skips emissions)
+    virtual void set_seqs(const Sequences *_seqs) {
+        stop_prefetch();
+        seqs = _seqs;
+    }
+
+protected:
+
+    void start_prefetch();
+    void stop_prefetch();
+    void take_prefetched();
+    void prefetch_worker();
+    static void *prefetch_worker_main(void *iter);
+
+    // give up the current matrices, which may be owned by the cache
+    void release_matrices()
+    {
+        if (borrowed) {
+            if (mat.emit) {
+                delete_matrix<double>(mat.emit, mat.blocklen);
+                mat.emit = NULL;
+            }
+            mat.detach();
+            borrowed = false;
+        } else {
+            mat.clear();
+        }
+    }
+
+    // move the transition matrices of the current block into the cache
+    void store_matrices()
+    {
+        long size = mat.transmat->get_nbytes();
+        if (mat.transmat_switch)
+            size += mat.transmat_switch->get_nbytes();
+        if (size > max_bytes)
+            return;
+
+        // evict oldest blocks until there is room
+        while (nbytes + size > max_bytes && !stored.empty()) {
+            int i = stored.front();
+            stored.pop_front();
+            nbytes -= cache_bytes[i];
+            delete cache[i];
+            cache[i] = NULL;
+        }
+
+        ArgHmmMatrices *entry = new ArgHmmMatrices(
+            mat.nstates1, mat.nstates2, mat.blocklen,
+            mat.transmat, mat.transmat_switch, NULL);
+        entry->states_model = mat.states_model;
+        cache[block_index] = entry;
+        cache_bytes[block_index] = size;
+        stored.push_back(block_index);
+        nbytes += size;
+        borrowed = true;
+    }
+
+    long max_bytes;
+    long nbytes;
+    int nhits;
+    int nmisses;
+    bool borrowed; // true if 'mat' points to matrices owned by the cache
+
+    vector<ArgHmmMatrices*> cache;
+    vector<long> cache_bytes;
+    deque<int> stored;
+
+    // prefetching of upcoming blocks by worker threads
+    int nthreads;
+    int prefetch_window;
+    bool prefetching;
+    bool prefetch_pending;  // begin() was called and no block used yet
+    bool prefetch_stop;
+    int prefetch_next;     // next block to be claimed
+    int prefetch_current;  // block currently used by the caller
+    vector<ArgHmmMatrices*> prefetched;
+    vector<pthread_t> workers;
+    pthread_mutex_t prefetch_lock;
+    pthread_cond_t prefetch_cond;
+};
+
+
 } // namespace argweaver
 
 
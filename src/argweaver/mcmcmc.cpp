@@ -3,16 +3,18 @@
 #endif
 
 #include "mcmcmc.h"
+#include "local_tree.h"
+#include "model.h"
 
 namespace argweaver {
 
  Mc3Config::Mc3Config(int group, double heat_interval) :
-        group(group), heat_interval(heat_interval) {
+        group(group), max_group(0), heat_interval(heat_interval),
+        heat(1.0 - heat_interval * group), exchange(NULL) {
 #ifdef ARGWEAVER_MPI
     int numthread=MPI::COMM_WORLD.Get_size();
     int *groups = (int*)malloc(numthread*sizeof(int));
     MPI::COMM_WORLD.Allgather(&group, 1, MPI::INT, groups, 1, MPI::INT);
-    heat = 1.0 - heat_interval * group;
     group_comm = new MPI::Intracomm(MPI::COMM_WORLD.Split(group, 0));
 
     //check that configuration makes sense.
@@ -43,4 +45,92 @@ namespace argweaver {
     free(groups);
 #endif
 }
+
+
+//=============================================================================
+// (MC)^3 chains on threads
+
+Mc3Exchange::Mc3Exchange(int nchains, unsigned long long seed) :
+    nchains(nchains),
+    models(nchains, NULL),
+    trees(nchains, NULL),
+    lnls(nchains, 0.0),
+    swap_ratio(0.0),
+    swap_accept(false),
+    rand(seed),
+    narrived(0),
+    generation(0)
+{
+    swap_groups[0] = swap_groups[1] = 0;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+
+Mc3Exchange::~Mc3Exchange()
+{
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+}
+
+
+void Mc3Exchange::add_chain(int group, ArgModel *model, LocalTrees *trees)
+{
+    assert(group >= 0 && group < nchains);
+    models[group] = model;
+    this->trees[group] = trees;
+}
+
+
+bool Mc3Exchange::swap(int group, double lnl)
+{
+    pthread_mutex_lock(&lock);
+    lnls[group] = lnl;
+    if (++narrived == nchains) {
+        // all other chains are waiting, so their states can be swapped
+        propose_swap();
+        narrived = 0;
+        generation++;
+        pthread_cond_broadcast(&cond);
+    } else {
+        const int gen = generation;
+        while (gen == generation)
+            pthread_cond_wait(&cond, &lock);
+    }
+    const int group1 = swap_groups[0];
+    const int group2 = swap_groups[1];
+    const double ratio = swap_ratio;
+    const bool accept = swap_accept;
+    pthread_mutex_unlock(&lock);
+
+    printLog(LOG_LOW, "swap\t%i\t%i\t%f\t%f\t%f\t%s\n",
+             group1, group2, models[group1]->mc3.heat,
+             models[group2]->mc3.heat, ratio, accept ? "accept" : "reject");
+
+    return accept && (group == group1 || group == group2);
+}
+
+
+void Mc3Exchange::propose_swap()
+{
+    // pick two chains
+    const int a = int(rand.next() / (RAND_MAX + 1.0) * nchains);
+    int b = int(rand.next() / (RAND_MAX + 1.0) * (nchains - 1));
+    if (b >= a)
+        b++;
+
+    const double heat_a = models[a]->mc3.heat;
+    const double heat_b = models[b]->mc3.heat;
+    swap_groups[0] = a;
+    swap_groups[1] = b;
+    swap_ratio = (heat_a - heat_b) * lnls[b] + (heat_b - heat_a) * lnls[a];
+    swap_accept = (swap_ratio >= 0.0 ||
+                   rand.next() / double(RAND_MAX) < exp(swap_ratio));
+
+    if (swap_accept) {
+        trees[a]->swap(*trees[b]);
+        std::swap(models[a]->popsizes, models[b]->popsizes);
+    }
+}
+
 }
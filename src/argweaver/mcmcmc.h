@@ -1,6 +1,10 @@
 #ifndef ARGWEAVER_MCMCMC_H
 #define ARGWEAVER_MCMCMC_H
 
+#include <pthread.h>
+#include <vector>
+
+#include "common.h"
 #include "logging.h"
 
 #ifdef ARGWEAVER_MPI
@@ -12,6 +16,10 @@ namespace MPI {
 
 namespace argweaver {
 
+class ArgModel;
+class LocalTrees;
+class Mc3Exchange;
+
 class Mc3Config
 {
  public:
@@ -21,6 +29,7 @@ class Mc3Config
         max_group=0;
         heat_interval=0.05;
         heat=1.0;
+        exchange=NULL;
     }
 
     Mc3Config(int group, double heat_interval);
@@ -29,11 +38,57 @@ class Mc3Config
     int max_group;
     double heat_interval;
     double heat;
+    // chains running on threads of this process (NULL if none)
+    Mc3Exchange *exchange;
 #ifdef ARGWEAVER_MPI
     MPI::Intracomm *group_comm;
 #endif
 };
 
+
+// Exchanges states between (MC)^3 chains that run on threads of one
+// process.  The chain of group k runs at heat 1 - k * heat_interval.
+// Instead of exchanging heats (and output files), two chains swap their
+// ARGs and population sizes, which is equivalent and only swaps pointers.
+class Mc3Exchange
+{
+ public:
+    Mc3Exchange(int nchains, unsigned long long seed);
+    ~Mc3Exchange();
+
+    // Registers the state of the chain of 'group'.  All chains must be
+    // added before any of them calls swap().
+    void add_chain(int group, ArgModel *model, LocalTrees *trees);
+
+    // Every chain calls swap() once per iteration with the log posterior
+    // (prior + likelihood) of its current state.  The call waits until all
+    // chains have arrived, then the last one proposes swapping the states
+    // of two random chains.  Returns true if the state of 'group' was
+    // swapped.
+    bool swap(int group, double lnl);
+
+    int get_num_chains() const { return nchains; }
+
+ protected:
+    void propose_swap();
+
+    int nchains;
+    std::vector<ArgModel*> models;
+    std::vector<LocalTrees*> trees;
+    std::vector<double> lnls;
+
+    // the last proposed swap
+    int swap_groups[2];
+    double swap_ratio;
+    bool swap_accept;
+
+    RandStream rand;
+    int narrived;
+    int generation;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
 } //namespace argweaver
 
 #endif
@@ -16,6 +16,7 @@
 // arghmm includes
 #include "track.h"
 #include "common.h"
+#include "hmm_config.h"
 #include "mcmcmc.h"
 #include "pop_model.h"
 #include "sequences.h"
@@ -243,6 +244,7 @@ class ArgModel
     unphased_file(other.unphased_file),
     popsize_config(other.popsize_config),
     mc3(other.mc3),
+    hmm_config(other.hmm_config),
     pop_tree(other.pop_tree),
     smc_prime(other.smc_prime) {}
 
@@ -260,6 +262,7 @@ class ArgModel
         unphased_file(other.unphased_file),
         popsize_config(other.popsize_config),
         mc3(other.mc3),
+        hmm_config(other.hmm_config),
         smc_prime(other.smc_prime)
     {
         copy(other);
@@ -590,6 +593,7 @@ protected:
     string unphased_file;
     PopsizeConfig popsize_config;
     Mc3Config mc3;
+    HmmConfig hmm_config;    // options for evaluating the threading HMM
     Track<double> mutmap;    // mutation map
     Track<double> recombmap; // recombination map
     PopulationTree *pop_tree;
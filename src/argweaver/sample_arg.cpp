@@ -3,6 +3,7 @@
 //
 
 // c++ includes
+#include <pthread.h>
 #include <vector>
 
 // arghmm includes
@@ -172,7 +173,7 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
     double accept_prob = exp(npaths - npaths2);
     bool accept = (frand() < accept_prob);
     if (!accept)
-        trees->copy(trees2);
+        trees->swap(trees2);
 
     // logging
     printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
@@ -190,7 +191,7 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat,
-                           bool no_resample_mig)
+                           bool no_resample_mig, bool parallel_windows)
 {
     if (do_leaf) {
         resample_arg_random_leaf(model, sequences, trees);
@@ -231,7 +232,8 @@ void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                      time_interval, sequences->names[hap].c_str(), num_break);
         } else {
             double accept_rate = resample_arg_regions(
-              model, sequences, trees, window, niters, heat);
+              model, sequences, trees, window, niters, heat,
+              parallel_windows);
             printLog(LOG_LOW, "resample_arg_regions: accept=%f\n", accept_rate);
         }
     }
@@ -466,6 +468,36 @@ State find_state_sub_tree_internal(const ArgModel *model,
 
 
 
+// Copy the blocks containing sites break_coords[i]-1 and break_coords[i]
+// into 'blocks' (two per break).  'break_coords' must be sorted.
+static void copy_region_end_blocks(const LocalTrees *trees,
+                                  const vector<int> &break_coords,
+                                  vector<LocalTreeSpr> &blocks)
+{
+    LocalTrees::const_iterator it = trees->begin();
+    int end = trees->start_coord + it->blocklen;
+    for (unsigned int i=0; i<break_coords.size(); i++) {
+        for (int site=break_coords[i]-1; site<=break_coords[i]; site++) {
+            while (end <= site) {
+                ++it;
+                end += it->blocklen;
+            }
+
+            const int nnodes = it->tree->nnodes;
+            LocalTree *tree = new LocalTree();
+            tree->copy(*it->tree);
+            int *mapping = NULL;
+            if (it->mapping) {
+                mapping = new int [nnodes];
+                std::copy(it->mapping, it->mapping + nnodes, mapping);
+            }
+            blocks.push_back(LocalTreeSpr(tree, it->spr, it->blocklen,
+                                          mapping));
+        }
+    }
+}
+
+
 int resample_arg_by_time_and_hap(
     const ArgModel *model, Sequences *sequences,
     LocalTrees *trees, int time_interval, int hap)
@@ -473,9 +505,7 @@ int resample_arg_by_time_and_hap(
     const int maxtime = model->get_removed_root_time();
     static int count=0;
     const bool open_ended=true;
-    LocalTrees orig_trees;
     decLogLevel();
-    orig_trees.copy(*trees);
 
     int orig_numtree = trees->get_num_trees();
     int *removal_path = new int[orig_numtree];
@@ -487,6 +517,12 @@ int resample_arg_by_time_and_hap(
                                          removal_path,
                                          break_coords);
     int num_break = (int)break_coords.size();
+
+    // save the original blocks at the end of each region, which are
+    // needed after the trees before them have been resampled
+    vector<LocalTreeSpr> end_blocks;
+    copy_region_end_blocks(trees, break_coords, end_blocks);
+
     for (int i=0; i <= num_break; i++) {
         count++;
         int region_start, region_end;
@@ -499,13 +535,8 @@ int resample_arg_by_time_and_hap(
             region_end = trees->end_coord;
         } else region_end = break_coords[i]+1;
 
-        LocalTrees otrees;
-        otrees.copy(*trees);
-
         // partion trees into three segments
         LocalTrees *trees2 = partition_local_trees(trees, region_start, true);
-        LocalTrees otrees2;
-        otrees2.copy(*trees2);
         LocalTrees *trees3 = partition_local_trees(trees2, region_end, true);
         Spr stub_spr;
         int *stub_mapping=NULL;
@@ -530,8 +561,8 @@ int resample_arg_by_time_and_hap(
                                                  i==0 || trees2->front().blocklen > 1);
 
             if (i != num_break) {
-                const LocalTrees::iterator it = orig_trees.get_block(region_end-1);
-                const LocalTrees::iterator it2 = orig_trees.get_block(region_end-2);
+                const LocalTreeSpr *it = &end_blocks[2*i+1];
+                const LocalTreeSpr *it2 = &end_blocks[2*i];
                 int next_nodes[2];
                 get_next_removal_nodes(it2->tree, it->tree, it->spr, it->mapping,
                                        curr_removal_path[curr_numtree-2],
@@ -614,37 +645,27 @@ int resample_arg_by_time_and_hap(
         delete trees2;
         delete trees3;
     }
+    for (unsigned int i=0; i<end_blocks.size(); i++)
+        end_blocks[i].clear();
     delete [] removal_path;
     incLogLevel();
     return num_break;
 }
 
 
-// resample an ARG only for a given region
-// all branches are possible to resample
-// open_ended -- If true and region touches start or end of local trees do not
-//               conditioned on state.
-double resample_arg_region(
-    const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int region_start, int region_end, int niters,
-    bool open_ended, double heat)
+// Resample the threadings of the local trees 'trees2' of a region with
+// 'niters' MCMC iterations.  The threading is conditioned on the first
+// (last) tree unless 'open_start' ('open_end') is set.  If 'threaded' is
+// true the log level is left unchanged, since other threads may be
+// sampling other regions.  Returns the acceptance rate.
+static double resample_arg_window(
+    const ArgModel *model, Sequences *sequences, LocalTrees *trees2,
+    bool open_start, bool open_end, int niters, double heat,
+    bool threaded=false)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
-
-    // special case: zero length region
-    if (region_start == region_end)
-        return 1.0;
-
-    // assert region is within trees
-    assert(region_start >= trees->start_coord);
-    assert(region_end <= trees->end_coord);
-    assert(region_start < region_end);
-
-    // partion trees into three segments
-    LocalTrees *trees2 = partition_local_trees(trees, region_start);
-    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
-    assert(trees2->length() == region_end - region_start);
+    const int region_start = trees2->start_coord;
+    const int region_end = trees2->end_coord;
 
     // TODO: refactor
     // extend stub (zero length block) if it happens to exist
@@ -658,7 +679,6 @@ double resample_arg_region(
     // perform several iterations of resampling
     int accepts = 0;
     for (int i=0; i<niters; i++) {
-        count++;
         printLog(LOG_LOW, "region sample: iter=%d, region=(%d, %d)\n",
                  i, region_start, region_end);
 
@@ -687,17 +707,18 @@ double resample_arg_region(
             &end_tree, end_tree_partial, maxtime);
 
         // set start/end state to null if open ended is requested
-        if (open_ended) {
-            if (region_start == trees->start_coord)
-                start_state.set_null();
-            if (region_end == trees3->end_coord)
-                end_state.set_null();
-        }
+        if (open_start)
+            start_state.set_null();
+        if (open_end)
+            end_state.set_null();
+
         // sample new ARG conditional on start and end states
-        decLogLevel();
+        if (!threaded)
+            decLogLevel();
         cond_sample_arg_thread_internal(model, sequences, trees2,
                                         start_state, end_state);
-        incLogLevel();
+        if (!threaded)
+            incLogLevel();
         assert_trees(trees2, model->pop_tree);
 
         double npaths2 = count_total_arg_removal_paths(trees2);
@@ -707,7 +728,7 @@ double resample_arg_region(
         bool accept = (frand() < accept_prob);
 
         if (!accept) {
-            trees2->copy(old_trees2);
+            trees2->swap(old_trees2);
         } else {
             accepts++;
         }
@@ -725,6 +746,38 @@ double resample_arg_region(
         trees2->end_coord--;
     }
 
+    return accepts / double(niters);
+}
+
+
+// resample an ARG only for a given region
+// all branches are possible to resample
+// open_ended -- If true and region touches start or end of local trees do not
+//               conditioned on state.
+double resample_arg_region(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_ended, double heat)
+{
+    // special case: zero length region
+    if (region_start == region_end)
+        return 1.0;
+
+    // assert region is within trees
+    assert(region_start >= trees->start_coord);
+    assert(region_end <= trees->end_coord);
+    assert(region_start < region_end);
+
+    // partion trees into three segments
+    LocalTrees *trees2 = partition_local_trees(trees, region_start);
+    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
+    assert(trees2->length() == region_end - region_start);
+
+    double accept_rate = resample_arg_window(
+        model, sequences, trees2,
+        open_ended && region_start == trees->start_coord,
+        open_ended && region_end == trees3->end_coord, niters, heat);
+
     // rejoin trees
     append_local_trees(trees, trees2, true, model->pop_tree);
     append_local_trees(trees, trees3, true, model->pop_tree);
@@ -733,17 +786,179 @@ double resample_arg_region(
     delete trees2;
     delete trees3;
 
-    return accepts / double(niters);
+    return accept_rate;
 }
 
 
+// Windows of an ARG that are resampled concurrently
+class ArgWindowJobs
+{
+public:
+    ArgWindowJobs(const ArgModel *model, Sequences *sequences,
+                  vector<LocalTrees*> &windows, int chrom_start,
+                  int chrom_end, int niters, double heat) :
+        accept_rates(windows.size(), 0.0),
+        model(model),
+        sequences(sequences),
+        windows(windows),
+        chrom_start(chrom_start),
+        chrom_end(chrom_end),
+        niters(niters),
+        heat(heat),
+        logger(g_thread_logger),
+        next_job(0)
+    {
+        // each window draws from its own stream
+        const unsigned long long seed = rand_stream().next_seed();
+        for (unsigned int i=0; i<windows.size(); i++)
+            streams.push_back(RandStream(seed, i));
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~ArgWindowJobs()
+    {
+        pthread_mutex_destroy(&lock);
+    }
+
+    void run(int nthreads)
+    {
+        // the calling thread is one of the threads
+        const int nworkers = min(nthreads, int(windows.size())) - 1;
+        vector<pthread_t> workers;
+        for (int i=0; i<nworkers; i++) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL,
+                               &ArgWindowJobs::work_main, this) != 0) {
+                printError("could not start window resampling thread");
+                break;
+            }
+            workers.push_back(worker);
+        }
+        work();
+        for (unsigned int i=0; i<workers.size(); i++)
+            pthread_join(workers[i], NULL);
+    }
+
+    vector<double> accept_rates;
+
+protected:
+    void work()
+    {
+        // the calling thread may already have its own stream (a chain)
+        RandStream *caller_stream = g_thread_rand_stream;
+        while (true) {
+            pthread_mutex_lock(&lock);
+            if (next_job >= int(windows.size())) {
+                pthread_mutex_unlock(&lock);
+                break;
+            }
+            const int k = next_job++;
+            pthread_mutex_unlock(&lock);
+
+            LocalTrees *trees = windows[k];
+            set_thread_rand_stream(&streams[k]);
+            accept_rates[k] = resample_arg_window(
+                model, sequences, trees,
+                trees->start_coord == chrom_start,
+                trees->end_coord == chrom_end, niters, heat, true);
+        }
+        set_thread_rand_stream(caller_stream);
+    }
+
+    static void *work_main(void *jobs)
+    {
+        // log like the thread that started the jobs
+        set_thread_logger(((ArgWindowJobs*) jobs)->logger);
+        ((ArgWindowJobs*) jobs)->work();
+        return NULL;
+    }
+
+    const ArgModel *model;
+    Sequences *sequences;
+    vector<LocalTrees*> &windows;
+    int chrom_start;
+    int chrom_end;
+    int niters;
+    double heat;
+    Logger *logger;
+
+    vector<RandStream> streams;
+    int next_job;
+    pthread_mutex_t lock;
+};
+
+
+// Resample an ARG in non-overlapping windows of about 'window' sites that
+// are resampled concurrently on 'nthreads' threads.  Each window is
+// conditioned on the trees at its boundaries, which stay fixed, so the
+// windows are independent.  The boundaries are offset by half a window at
+// random so that they move between calls.
+static double resample_arg_windows_parallel(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int window, int niters, double heat, int nthreads)
+{
+    const int chrom_start = trees->start_coord;
+    const int chrom_end = trees->end_coord;
+    const int currwindow = irand(window - window/4, window + window/4);
+
+    // choose window boundaries
+    vector<int> starts;
+    starts.push_back(chrom_start);
+    int pos = chrom_start + (frand() < 0.5 ? currwindow/2 : currwindow);
+    for (; pos < chrom_end; pos += currwindow) {
+        // merge a short final window into the previous one
+        if (chrom_end - pos < currwindow / 4)
+            break;
+        starts.push_back(pos);
+    }
+
+    // partition the trees into windows
+    vector<LocalTrees*> windows;
+    windows.push_back(trees);
+    for (unsigned int i=1; i<starts.size(); i++)
+        windows.push_back(partition_local_trees(windows.back(), starts[i]));
+
+    // every thread samples with its own HMM evaluation
+    ArgModel window_model(*model);
+    window_model.hmm_config.nthreads = 1;
+    ArgWindowJobs jobs(&window_model, sequences, windows, chrom_start,
+                       chrom_end, niters, heat);
+    jobs.run(nthreads);
+
+    // rejoin trees
+    double accept_rate = 0.0;
+    for (unsigned int i=0; i<windows.size(); i++) {
+        if (i > 0) {
+            append_local_trees(trees, windows[i], true, model->pop_tree);
+            delete windows[i];
+        }
+        accept_rate += jobs.accept_rates[i];
+    }
+
+    printLog(LOG_LOW, "resampled %d windows of %d sites in parallel\n",
+             (int) windows.size(), currwindow);
+
+    return accept_rate / windows.size();
+}
 
 
 // resample an ARG a region at a time in a sliding window
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int window, int niters, double heat)
+    LocalTrees *trees, int window, int niters, double heat, bool parallel)
 {
+    // unphased sampling changes the sequences, so it stays sequential
+    if (parallel && !model->unphased) {
+        decLogLevel();
+        decLogLevel();
+        double accept_rate = resample_arg_windows_parallel(
+            model, sequences, trees, window, niters, heat,
+            model->hmm_config.nthreads);
+        incLogLevel();
+        incLogLevel();
+        return accept_rate;
+    }
+
     decLogLevel();
     double accept_rate = 0.0;
     int nwindows = 0;
@@ -39,7 +39,8 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
 void resample_arg_mcmc_all(const ArgModel *model, Sequences *sequences,
                            LocalTrees *trees, bool do_leaf,
                            int window, int niters, double heat=1.0,
-                           bool no_resample_mig=false);
+                           bool no_resample_mig=false,
+                           bool parallel_windows=false);
 
 void resample_arg_climb(const ArgModel *model, Sequences *sequences,
                         LocalTrees *trees, double recomb_preference);
@@ -72,7 +73,7 @@ double resample_arg_cut(
 double resample_arg_regions(
     const ArgModel *model, Sequences *sequences,
     LocalTrees *trees, int window, int niters=1,
-    double heat=1.0);
+    double heat=1.0, bool parallel=false);
 
 int resample_arg_by_time_and_hap(
     const ArgModel *model, Sequences *sequences,
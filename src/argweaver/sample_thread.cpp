@@ -15,6 +15,7 @@
 #include "sample_thread.h"
 #include "sequences.h"
 #include "sequences.h"
+#include "simd.h"
 #include "states.h"
 #include "thread.h"
 #include "trans.h"
@@ -36,12 +37,20 @@ void arghmm_forward_block(const ArgModel *model,
                           const int blocklen, const States &states,
                           const LineageCounts &lineages,
                           const TransMatrix *matrix,
-                          const double* const *emit, double **fw)
+                          const double* const *emit, double **fw,
+                          ScratchArena *arena)
 {
     const int nstates = states.size();
     const LocalNode *nodes = tree->nodes;
     const int ntimes = model->ntimes;
 
+    // temporary arrays are taken from the arena, since they can be too
+    // large for the stack
+    ScratchArena local_arena;
+    if (!arena)
+        arena = &local_arena;
+    arena->reset();
+
     //  handle internal branch resampling special cases
     int minage = matrix->minage;
     int maintree_root = 0;
@@ -63,9 +72,9 @@ void arghmm_forward_block(const ArgModel *model,
             maxtime = states[k].time;
 
     int numpath = model->num_pop_paths();
-    int numpath_per_time[ntimes];
-    int paths_per_time[ntimes][numpath];
-    int path_map[states.size()];
+    int *numpath_per_time = arena->alloc<int>(ntimes);
+    int **paths_per_time = arena->alloc_matrix<int>(ntimes, numpath);
+    int *path_map = arena->alloc<int>(nstates);
     int max_numpath = 1;
     if (numpath > 1) {
         for (int i=0; i < ntimes; i++) {
@@ -103,8 +112,8 @@ void arghmm_forward_block(const ArgModel *model,
     // set ages1[i] to age of each branch
     // set ages2[i] to age of each branch's parent
     // set indexes[i] to index for state (node[i], ages1[i])
-    int ages1[tree->nnodes];
-    int ages2[tree->nnodes];
+    int *ages1 = arena->alloc<int>(tree->nnodes);
+    int *ages2 = arena->alloc<int>(tree->nnodes);
     for (int i=0; i<tree->nnodes; i++) {
         ages1[i] = max(nodes[i].age, minage);
         if (matrix->internal)
@@ -115,28 +124,48 @@ void arghmm_forward_block(const ArgModel *model,
     }
 
     // compute ntimes*ntimes and ntime*nstates temp matrices
-    double tmatrix[ntimes-1][max_numpath][ntimes-1][max_numpath];
+    //
+    // The (time, path) pairs with time < ntimes-1 are packed into a dense
+    // index so that the time transitions form one square matrix.  It is
+    // stored column-major (column = source group, row = destination group)
+    // with a padded leading dimension for the vectorized kernels.
+    int **group_index = arena->alloc_matrix<int>(ntimes, max_numpath);
+    int ngroups = 0;
+    for (int a=0; a<ntimes; a++)
+        for (int pa=0; pa < numpath_per_time[a]; pa++)
+            group_index[a][pa] = (a < ntimes-1 ? ngroups++ : -1);
+    const int ld = simd_pad(ngroups);
+
+    double *tmatrix = arena->alloc<double>(ngroups * ld);
+    fill(tmatrix, tmatrix + ngroups * ld, 0.0);
     for (int b=0; b<ntimes-1; b++) {
         for (int pb=0; pb < numpath_per_time[b]; pb++) {
+            const int row = group_index[b][pb];
             for (int a=0; a<ntimes-1; a++) {
                 for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                    tmatrix[b][pb][a][pa] =
-                        matrix->get_time(a, b, 0,
-                                         paths_per_time[a][pa],
-                                         paths_per_time[b][pb],
-                                         -1, minage, false);
-                    //                    printf("tmatrix %i %i = %e\n", a, b, tmatrix[pa][pb][a][b]);
-                    assert(!isnan(tmatrix[b][pb][a][pa]));
-                    assert(!isinf(tmatrix[b][pb][a][pa]));
+                    double &entry = tmatrix[group_index[a][pa] * ld + row];
+                    entry = matrix->get_time(a, b, 0,
+                                             paths_per_time[a][pa],
+                                             paths_per_time[b][pb],
+                                             -1, minage, false);
+                    assert(!isnan(entry));
+                    assert(!isinf(entry));
                 }
             }
         }
     }
 
+    // group of each state
+    int *state_group = arena->alloc<int>(nstates);
+    for (int k=0; k<nstates; k++) {
+        state_group[k] = group_index[states[k].time][path_map[k]];
+        assert(state_group[k] >= 0);
+    }
+
     // take advantage of fact that same branch case is only special
     // if path a and path b are same; otherwise there must be recomb
     // on branch being threaded and same branch case is not special
-    double tmatrix2[nstates][ntimes];
+    double **tmatrix2 = arena->alloc_matrix<double>(nstates, ntimes);
     for (int k=0; k<nstates; k++) {
         for (int a=0; a < ntimes; a++) tmatrix2[k][a]=0.0;
         const int b = states[k].time;
@@ -160,7 +189,7 @@ void arghmm_forward_block(const ArgModel *model,
     }
 
     // there is one more special case for different path, same time, same node
-    double tmatrix3[nstates][max_numpath];
+    double **tmatrix3 = arena->alloc_matrix<double>(nstates, max_numpath);
     if (max_numpath > 1) {
         for (int k=0; k < nstates; k++) {
             for (int i=0; i <max_numpath; i++) tmatrix3[k][i]=0.0;
@@ -179,9 +208,9 @@ void arghmm_forward_block(const ArgModel *model,
 
     NodeStateLookup state_lookup(states, minage, model->pop_tree);
     int max_idx = ntimes*nstates + max_numpath*nstates;
-    int nextState[max_idx];
+    int *nextState = arena->alloc<int>(max_idx);
     int idx=0;
-    int age1_state[nstates];
+    int *age1_state = arena->alloc<int>(nstates);
     for (int k=0; k<nstates; k++) {
         const int b = states[k].time;
         const int node2 = states[k].node;
@@ -218,8 +247,8 @@ void arghmm_forward_block(const ArgModel *model,
     assert(idx <= max_idx);
 
 
-    double tmatrix_fgroups[max_numpath][ntimes];
-    double fgroups[max_numpath][ntimes];
+    double *tmatrix_fgroups = arena->alloc<double>(ld);
+    double *fgroups = arena->alloc<double>(ngroups);
     for (int i=1; i<blocklen; i++) {
         const double *col1 = fw[i-1];
         double *col2 = fw[i];
@@ -227,34 +256,21 @@ void arghmm_forward_block(const ArgModel *model,
         idx = 0;
 
         // precompute the fgroup sums
-        for (int p=0; p < max_numpath; p++)
-            fill(fgroups[p], fgroups[p]+ntimes, 0.0);
+        fill(fgroups, fgroups + ngroups, 0.0);
         for (int j=0; j<nstates; j++) {
-            const int a = states[j].time;
-            fgroups[path_map[j]][a] += col1[j];
+            fgroups[state_group[j]] += col1[j];
             assert(!isinf(col1[j]));
         }
 
         // multiply tmatrix and fgroups together
-        for (int b=0; b<ntimes-1; b++) {
-            for (int pb=0; pb < numpath_per_time[b]; pb++) {
-                double sum = 0.0;
-                for (int a=0; a<ntimes-1; a++) {
-                    for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                        sum += tmatrix[b][pb][a][pa] * fgroups[pa][a];
-                    }
-                }
-                tmatrix_fgroups[pb][b] = sum;
-            }
-        }
+        fw_matvec(tmatrix, ld, ngroups, ngroups, fgroups, tmatrix_fgroups);
 
         // fill in one column of forward table
-        double norm = 0.0;
         for (int k=0; k<nstates; k++) {
             const int b = states[k].time;
             const int node2 = states[k].node;
             const int age2 = ages2[node2];
-            double sum = tmatrix_fgroups[path_map[k]][b];
+            double sum = tmatrix_fgroups[state_group[k]];
 
             // same branch case
             for (int a=age1_state[k]; a <= age2; a++) {
@@ -273,19 +289,17 @@ void arghmm_forward_block(const ArgModel *model,
                     }
                 }
             }
-            col2[k] = sum * emit2[k];
-            norm += col2[k];
-            if (isnan(col2[k]))
-                assert(false);
+            col2[k] = sum;
         }
+
+        // apply emissions
+        double norm = fw_emit_sum(col2, emit2, nstates);
         assert(norm > 0);
         assert(!isnan(norm));
         assert(!isinf(norm));
 
         // normalize column for numerical stability
-        for (int k=0; k<nstates; k++)
-            col2[k] /= norm;
-
+        fw_normalize(col2, nstates, norm);
     }
 }
 
@@ -419,94 +433,468 @@ void arghmm_forward_switch(const double *col1, double* col2,
 
 
 
+// Run forward algorithm for one block whose forward columns have already
+// been allocated.  'prev' is the last column of the previous block.  If it
+// is NULL, the block starts from the prior of its first state (which is
+// given for the first block of the ARG if 'prior_given' is true).
+static void arghmm_forward_alg_block(
+    const LocalTrees *trees, const ArgModel *model, const LocalTree *tree,
+    ArgHmmMatrices &matrices, int pos, const double *prev, double **fw,
+    bool prior_given, bool internal, bool slow,
+    States &states, LineageCounts &lineages, ScratchArena *arena)
+{
+    int blocklen = matrices.blocklen;
+    double **emit = matrices.emit;
+    double **fw_block = &fw[pos];
+    vector<double*> cols;
+
+    matrices.states_model.get_coal_states(tree, states);
+    lineages.count(tree, model->pop_tree, internal);
+
+    // use switch matrix for first column of forward table
+    // if we have a previous state space (i.e. not first block)
+    if (!prev) {
+        // calculate prior of first state
+        int minage = matrices.states_model.minage;
+        if (!prior_given || pos > trees->start_coord) {
+            if (internal) {
+                int subtree_root = tree->nodes[tree->root].child[0];
+                if (subtree_root != -1)
+                    minage = max(minage, tree->nodes[subtree_root].age);
+            }
+            ArgModel local_model;
+            model->get_local_model(pos, local_model);
+            calc_state_priors(states, &lineages, &local_model,
+                              fw[pos], minage);
+        }
+    } else if (matrices.transmat_switch) {
+        // perform one column of forward algorithm with transmat_switch
+        arghmm_forward_switch(prev, fw[pos],
+            matrices.transmat_switch, matrices.emit[0]);
+    } else {
+        // we are still inside the same ARG block, therefore the
+        // state-space does not change and no switch matrix is needed
+        if (prev == fw[pos-1]) {
+            fw_block = &fw[pos-1];
+        } else {
+            // previous column is stored outside of the table
+            cols.resize(blocklen + 1);
+            cols[0] = const_cast<double*>(prev);
+            for (int i=0; i<blocklen; i++)
+                cols[i+1] = fw[pos+i];
+            fw_block = &cols[0];
+        }
+        emit--;
+        blocklen++;
+    }
+
+    int nstates = max(matrices.transmat->nstates, 1);
+    double top = max_array(fw_block[0], nstates);
+    for (int i=0; i < nstates; i++) assert(!isnan(fw_block[0][i]));
+    assert(!isnan(top));
+    assert(top > 0.0);
+
+    // calculate rest of block
+    if (slow)
+        arghmm_forward_block_slow(tree, model->ntimes, blocklen,
+                                  states, lineages, matrices.transmat,
+                                  emit, fw_block);
+    else
+        arghmm_forward_block(model, tree, blocklen,
+                             states, lineages, matrices.transmat,
+                             emit, fw_block, arena);
+
+    // safety check
+    double top2 = max_array(fw[pos + matrices.blocklen - 1], nstates);
+    assert(top2 > 0.0);
+}
+
+
+// Restricts 'matrices' to the columns [start, end) of its block.  The
+// result shares the matrices of 'matrices' and must be detached after use.
+static void get_chunk_matrices(const ArgHmmMatrices &matrices,
+                               int start, int end, ArgHmmMatrices &chunk)
+{
+    chunk.nstates1 = (start == 0 ? matrices.nstates1 : matrices.nstates2);
+    chunk.nstates2 = matrices.nstates2;
+    chunk.blocklen = end - start;
+    chunk.states_model = matrices.states_model;
+    chunk.transmat = matrices.transmat;
+    chunk.transmat_switch = (start == 0 ? matrices.transmat_switch : NULL);
+    chunk.emit = (matrices.emit ? &matrices.emit[start] : NULL);
+}
+
+
+// Run forward algorithm for one block in chunks of the table's interval,
+// so that the table only needs to keep the last column of every chunk.
+static void arghmm_forward_alg_chunks(
+    const LocalTrees *trees, const ArgModel *model, const LocalTree *tree,
+    ArgHmmMatrices &matrices, int pos, ArgHmmForwardTable *forward,
+    bool prior_given, bool internal, bool slow,
+    States &states, LineageCounts &lineages, ScratchArena *arena)
+{
+    double **fw = forward->get_table();
+    const int interval = forward->get_interval();
+    const int end = pos + matrices.blocklen;
+
+    for (int start=pos; start<end; start+=interval) {
+        const int stop = min(start + interval, end);
+        if (start > trees->start_coord || !prior_given)
+            forward->new_block(start, stop, matrices.nstates2);
+
+        ArgHmmMatrices chunk;
+        get_chunk_matrices(matrices, start - pos, stop - pos, chunk);
+        arghmm_forward_alg_block(
+            trees, model, tree, chunk, start,
+            start > trees->start_coord ? fw[start-1] : NULL, fw,
+            prior_given, internal, slow, states, lineages, arena);
+        chunk.detach();
+
+        forward->end_block(start, stop, matrices.nstates2);
+    }
+}
+
+
+// Recompute the columns [start, stop) of a block whose matrices are
+// 'matrices' from the columns kept by the forward table.
+static void restore_forward_chunk(
+    const LocalTrees *trees, const ArgModel *model, const LocalTree *tree,
+    ArgHmmMatrices &matrices, int pos, int start, int stop,
+    ArgHmmForwardTable *forward, bool internal,
+    States &states, LineageCounts &lineages, ScratchArena *arena)
+{
+    double **fw = forward->get_table();
+    forward->new_block(start, stop, matrices.nstates2);
+
+    // the first column of the table is always kept
+    const double *prev = NULL;
+    if (start > trees->start_coord) {
+        prev = forward->get_checkpoint(start - 1);
+    } else {
+        const double *col = forward->get_checkpoint(start);
+        copy(col, col + max(matrices.nstates2, 1), fw[start]);
+    }
+
+    ArgHmmMatrices chunk;
+    get_chunk_matrices(matrices, start - pos, stop - pos, chunk);
+    arghmm_forward_alg_block(trees, model, tree, chunk, start, prev, fw,
+                             true, internal, false, states, lineages, arena);
+    chunk.detach();
+}
+
+
 // Run forward algorithm for all blocks
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
     ArgHmmForwardTable *forward, PhaseProbs *phase_pr,
     bool prior_given, bool internal, bool slow)
 {
+    if (model->hmm_config.forward_segments > 1 && !phase_pr && !slow &&
+        forward->get_interval() == 0) {
+        arghmm_forward_alg_segments(trees, model, matrix_iter, forward,
+                                    prior_given, internal);
+        return;
+    }
+
     LineageCounts lineages(model->ntimes, model->num_pops());
     States states;
-    ArgModel local_model;
-    int mu_idx=0, rho_idx=0;
-    LocalTree *tree;
-#ifdef DEBUG
-    LocalTree *last_tree = NULL;
-#endif
 
     double **fw = forward->get_table();
     // forward algorithm over local trees
     for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
         // get block information
-        tree = matrix_iter->get_tree_spr()->tree;
+        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
         ArgHmmMatrices &matrices = matrix_iter->ref_matrices(phase_pr);
         int pos = matrix_iter->get_block_start();
-        int blocklen = matrices.blocklen;
-        model->get_local_model(pos, local_model, &mu_idx, &rho_idx);
-        double **emit = matrices.emit;
+
+        if (forward->get_interval() > 0) {
+            arghmm_forward_alg_chunks(trees, model, tree, matrices, pos,
+                                      forward, prior_given, internal, slow,
+                                      states, lineages,
+                                      matrix_iter->get_arena());
+            continue;
+        }
 
         // allocate the forward table
         if (pos > trees->start_coord || !prior_given)
             forward->new_block(pos, pos+matrices.blocklen, matrices.nstates2);
-        double **fw_block = &fw[pos];
-
-        matrices.states_model.get_coal_states(tree, states);
-        lineages.count(tree, model->pop_tree, internal);
-
-        // use switch matrix for first column of forward table
-        // if we have a previous state space (i.e. not first block)
-        if (pos == trees->start_coord) {
-            // calculate prior of first state
-            int minage = matrices.states_model.minage;
-            if (!prior_given) {
-                if (internal) {
-                    int subtree_root = tree->nodes[tree->root].child[0];
-                    if (subtree_root != -1)
-                        minage = max(minage, tree->nodes[subtree_root].age);
-                }
-                calc_state_priors(states, &lineages, &local_model,
-                                  fw[pos], minage);
+
+        arghmm_forward_alg_block(
+            trees, model, tree, matrices, pos,
+            pos > trees->start_coord ? fw[pos-1] : NULL, fw,
+            prior_given, internal, slow, states, lineages,
+            matrix_iter->get_arena());
+    }
+}
+
+
+//=============================================================================
+// Segmented forward algorithm
+//
+// The blocks of the ARG are split into segments whose forward tables are
+// computed independently (and in parallel), each segment starting from the
+// prior of its first state.  Since the HMM quickly forgets where it started, each
+// segment is then corrected by re-running it from the last column of the
+// previous segment, block by block, until the recomputed columns agree
+// with the old ones (see HmmConfig::forward_segments_tol).  Corrections are
+// repeated until no segment boundary changes anymore, so the final table
+// agrees with arghmm_forward_alg() to within the tolerance.
+
+
+// Work shared by the threads of the segmented forward algorithm
+class ArgHmmForwardSegments
+{
+public:
+    ArgHmmForwardSegments(const LocalTrees *trees, const ArgModel *model,
+                          ArgHmmMatrixIter *matrix_iter,
+                          ArgHmmForwardTable *forward,
+                          bool prior_given, bool internal) :
+        trees(trees),
+        model(model),
+        matrix_iter(matrix_iter),
+        forward(forward),
+        prior_given(prior_given),
+        internal(internal),
+        matrices(matrix_iter->get_num_blocks(), NULL)
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~ArgHmmForwardSegments()
+    {
+        for (unsigned int i=0; i<matrices.size(); i++)
+            delete matrices[i];
+        pthread_mutex_destroy(&lock);
+    }
+
+    // split the blocks into at most 'nsegments' segments of similar length
+    void split(int nsegments)
+    {
+        const int nblocks = matrix_iter->get_num_blocks();
+        const double seglen = double(trees->length()) / nsegments;
+
+        first_blocks.clear();
+        first_blocks.push_back(0);
+        for (int i=1; i<nblocks; i++) {
+            int offset = matrix_iter->get_block(i).start - trees->start_coord;
+            if (offset >= first_blocks.size() * seglen)
+                first_blocks.push_back(i);
+        }
+        first_blocks.push_back(nblocks);
+
+        start_cols.resize(size());
+        changed.resize(size());
+    }
+
+    int size() const {
+        return first_blocks.size() - 1;
+    }
+
+    // last forward column of a segment
+    const double *last_col(int k, int *nstates) const {
+        const int b = first_blocks[k+1] - 1;
+        *nstates = max(matrices[b]->nstates2, 1);
+        return forward->get_table()[matrix_iter->get_block(b).end - 1];
+    }
+
+    // Run the given segments with 'nthreads' threads.  If 'correct' is
+    // true, segments are re-run from the columns in 'start_cols',
+    // otherwise they are run from scratch.
+    void run(const vector<int> &_jobs, int nthreads, bool _correct)
+    {
+        jobs = _jobs;
+        next_job = 0;
+        correct = _correct;
+
+        // the calling thread is one of the threads
+        const int nworkers = min(nthreads, int(jobs.size())) - 1;
+        vector<pthread_t> workers;
+        for (int i=0; i<nworkers; i++) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL,
+                               &ArgHmmForwardSegments::work_main, this) != 0) {
+                printError("could not start forward thread");
+                break;
             }
-        } else if (matrices.transmat_switch) {
-            // perform one column of forward algorithm with transmat_switch
-            arghmm_forward_switch(fw[pos-1], fw[pos],
-                matrices.transmat_switch, matrices.emit[0]);
-        } else {
-            // we are still inside the same ARG block, therefore the
-            // state-space does not change and no switch matrix is needed
-            fw_block = &fw[pos-1];
-            emit--;
-            blocklen++;
+            workers.push_back(worker);
         }
+        work();
+        for (unsigned int i=0; i<workers.size(); i++)
+            pthread_join(workers[i], NULL);
+    }
 
-        int nstates = max(matrices.transmat->nstates, 1);
-        double top = max_array(fw_block[0], nstates);
-        //        printf("%i %i top =%f nstates=%i\n", count, pos, top, nstates);
-        for (int i=0; i < nstates; i++) assert(!isnan(fw_block[0][i]));
-        assert(!isnan(top));
-        assert(top > 0.0);
-
-        // calculate rest of block
-        if (slow)
-            arghmm_forward_block_slow(tree, model->ntimes, blocklen,
-                                      states, lineages, matrices.transmat,
-                                      emit, fw_block);
-        else
-            arghmm_forward_block(model, tree, blocklen,
-                                 states, lineages, matrices.transmat,
-                                 emit, fw_block);
-
-        // safety check
-        double top2 = max_array(fw[pos + matrices.blocklen - 1], nstates);
-        //        printf("%i %i top2=%f\n", count++, pos, top2);
-        assert(top2 > 0.0);
-#ifdef DEBUG
-        last_tree = tree;
-#endif
+    vector<vector<double> > start_cols; // column preceding each segment
+    vector<bool> changed; // whether a correction changed the last column
+
+protected:
+
+    void work()
+    {
+        while (true) {
+            pthread_mutex_lock(&lock);
+            if (next_job >= int(jobs.size())) {
+                pthread_mutex_unlock(&lock);
+                return;
+            }
+            const int k = jobs[next_job++];
+            pthread_mutex_unlock(&lock);
+
+            if (correct)
+                correct_segment(k);
+            else
+                run_segment(k);
+        }
+    }
+
+    static void *work_main(void *segments)
+    {
+        ((ArgHmmForwardSegments*) segments)->work();
+        return NULL;
+    }
+
+    // compute matrices and forward table of a segment
+    void run_segment(int k)
+    {
+        LineageCounts lineages(model->ntimes, model->num_pops());
+        States states;
+        ScratchArena arena;
+        double **fw = forward->get_table();
+
+        for (int b=first_blocks[k]; b<first_blocks[k+1]; b++) {
+            const ArgModelBlock &block = matrix_iter->get_block(b);
+            ArgHmmMatrices *mat = new ArgHmmMatrices();
+            matrix_iter->calc_block_matrices(b, mat);
+            matrices[b] = mat;
+
+            const int pos = block.start;
+            if (pos > trees->start_coord || !prior_given) {
+                pthread_mutex_lock(&lock);
+                forward->new_block(pos, block.end, mat->nstates2);
+                pthread_mutex_unlock(&lock);
+            }
+
+            // the first block of a segment starts from the prior
+            const double *prev = NULL;
+            if (b > first_blocks[k])
+                prev = fw[pos-1];
+
+            arghmm_forward_alg_block(
+                trees, model, block.tree_spr->tree, *mat, pos, prev, fw,
+                prior_given, internal, false, states, lineages, &arena);
+        }
     }
-}
 
+    // re-run a segment from 'start_cols' until a block ends with the same
+    // column as before
+    void correct_segment(int k)
+    {
+        LineageCounts lineages(model->ntimes, model->num_pops());
+        States states;
+        ScratchArena arena;
+        double **fw = forward->get_table();
+        const double tol = model->hmm_config.forward_segments_tol;
+        vector<double> old_col;
+
+        changed[k] = true;
+        for (int b=first_blocks[k]; b<first_blocks[k+1]; b++) {
+            const ArgModelBlock &block = matrix_iter->get_block(b);
+            ArgHmmMatrices *mat = matrices[b];
+            const int pos = block.start;
+            const double *prev = (b == first_blocks[k] ?
+                                  &start_cols[k][0] : fw[pos-1]);
+
+            const int nstates = max(mat->nstates2, 1);
+            const double *col = fw[block.end - 1];
+            old_col.assign(col, col + nstates);
+
+            arghmm_forward_alg_block(
+                trees, model, block.tree_spr->tree, *mat, pos, prev, fw,
+                prior_given, internal, false, states, lineages, &arena);
+
+            // the rest of the segment is unaffected once a column agrees
+            double maxdiff = 0.0;
+            for (int i=0; i<nstates; i++)
+                maxdiff = max(maxdiff, fabs(col[i] - old_col[i]));
+            if (maxdiff <= tol * max_array(col, nstates)) {
+                changed[k] = false;
+                return;
+            }
+        }
+    }
+
+    const LocalTrees *trees;
+    const ArgModel *model;
+    ArgHmmMatrixIter *matrix_iter;
+    ArgHmmForwardTable *forward;
+    bool prior_given;
+    bool internal;
+
+    vector<int> first_blocks; // first block of each segment (and nblocks)
+    vector<ArgHmmMatrices*> matrices;
+
+    vector<int> jobs;
+    int next_job;
+    bool correct;
+    pthread_mutex_t lock;
+};
+
+
+// Run forward algorithm for all blocks using independent segments.
+// Phase probabilities are not supported.
+void arghmm_forward_alg_segments(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    bool prior_given, bool internal)
+{
+    const int nthreads = model->hmm_config.nthreads;
+
+    matrix_iter->begin();
+    ArgHmmForwardSegments segments(trees, model, matrix_iter, forward,
+                                   prior_given, internal);
+    segments.split(model->hmm_config.forward_segments);
+    const int nsegments = segments.size();
+
+    // compute all segments independently
+    vector<int> jobs;
+    for (int k=0; k<nsegments; k++)
+        jobs.push_back(k);
+    segments.run(jobs, nthreads, false);
+
+    // Correct each segment from the end of the previous one.  A segment
+    // needs another correction only if its predecessor changed.  Only as
+    // many segments as there are threads are corrected at once, since
+    // corrections that start from an unsettled predecessor may be wasted.
+    vector<bool> pending(nsegments, true);
+    pending[0] = false;
+    int nrounds = 0;
+    while (true) {
+        jobs.clear();
+        for (int k=1; k<nsegments && int(jobs.size())<nthreads; k++) {
+            if (!pending[k])
+                continue;
+            int nstates;
+            const double *col = segments.last_col(k-1, &nstates);
+            segments.start_cols[k].assign(col, col + nstates);
+            jobs.push_back(k);
+        }
+        if (jobs.size() == 0)
+            break;
+
+        segments.run(jobs, nthreads, true);
+        nrounds++;
+
+        for (unsigned int i=0; i<jobs.size(); i++)
+            pending[jobs[i]] = false;
+        for (unsigned int i=0; i<jobs.size(); i++) {
+            const int k = jobs[i];
+            if (segments.changed[k] && k + 1 < nsegments)
+                pending[k+1] = true;
+        }
+    }
 
+    printLog(LOG_HIGH, "forward segments: %d segments, %d correction rounds\n",
+             nsegments, nrounds);
+}
 
 
 //=============================================================================
@@ -618,17 +1006,165 @@ double stochastic_traceback(
 }
 
 
+// Stochastic traceback for a forward table that may only keep some of its
+// columns.  The other columns are recomputed chunk by chunk from right to
+// left, which requires the matrix iterator to compute emissions.  With
+// columns kept in double precision, the sampled path is the same as with a
+// full table.
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int *path, bool last_state_given, bool internal)
+{
+    const int interval = forward->get_interval();
+    if (interval == 0)
+        return stochastic_traceback(trees, model, matrix_iter,
+                                    forward->get_table(), path,
+                                    last_state_given, internal);
+
+    double **fw = forward->get_table();
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    States states;
+    double lnl = 0.0;
+
+    // iterate backward through blocks
+    matrix_iter->rbegin();
+    int end = trees->end_coord;
+    for (; matrix_iter->more(); matrix_iter->prev()) {
+        ArgHmmMatrices &mat = matrix_iter->ref_matrices();
+        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
+        const int pos = end - mat.blocklen;
+        assert(mat.emit);
+
+        // iterate backward through the chunks of the block
+        const int last = pos + (mat.blocklen - 1) / interval * interval;
+        for (int start=last; start>=pos; start-=interval) {
+            const int stop = min(start + interval, end);
+            restore_forward_chunk(trees, model, tree, mat, pos, start, stop,
+                                  forward, internal, states, lineages,
+                                  matrix_iter->get_arena());
+
+            // choose last column first
+            if (stop == trees->end_coord && !last_state_given) {
+                path[stop-1] = sample(fw[stop-1], max(mat.nstates2, 1));
+                lnl = fw[stop-1][path[stop-1]];
+            }
+
+            // path[stop] is sampled already, except for the last chunk
+            const int len = (stop == end ? stop - start : stop - start + 1);
+            lnl += sample_hmm_posterior(len, tree, states, mat.transmat,
+                                        &fw[start], &path[start]);
+        }
+
+        // fill in last col of next block
+        if (pos > trees->start_coord) {
+            const double *col = forward->get_checkpoint(pos - 1);
+            if (mat.transmat_switch) {
+                // use switch matrix
+                int i = pos - 1;
+                path[i] = sample_hmm_posterior_step(
+                    mat.transmat_switch, col, path[i+1]);
+                lnl += log(col[path[i]] *
+                           mat.transmat_switch->get(path[i], path[i+1]));
+            } else {
+                // use normal matrix
+                const double *cols[2] = {col, NULL};
+                lnl += sample_hmm_posterior(2, tree, states,
+                    mat.transmat, cols, &path[pos-1]);
+            }
+        }
+
+        end = pos;
+    }
+
+    return lnl;
+}
+
+
+
+// Allocate the forward table for threading a chromosome into 'trees'.
+// If the full table is estimated to exceed HmmConfig::forward_table_size,
+// only some columns are kept (see ArgHmmForwardCheckpoints).
+ArgHmmForwardTable *new_forward_table(
+    const LocalTrees *trees, const ArgModel *model, bool internal,
+    int minage)
+{
+    const HmmConfig &config = model->hmm_config;
+    const int seqlen = trees->length();
+
+    // the segmented forward algorithm and phasing need all columns
+    if (config.forward_table_size <= 0 || config.forward_segments > 1 ||
+        model->unphased)
+        return new ArgHmmForwardTable(trees->start_coord, seqlen);
+
+    // estimate the size of the full table
+    double ncells = 0.0;
+    int max_nstates = 1;
+    int nblocks = 0;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it) {
+        int nstates = (internal ?
+            get_num_coal_states_internal(it->tree, model->ntimes, minage) :
+            get_num_coal_states(it->tree, model->ntimes));
+        ncells += double(it->blocklen) * max(nstates, 1);
+        max_nstates = max(max_nstates, nstates);
+        nblocks++;
+    }
+    const double budget = config.forward_table_size;
+    if (ncells * sizeof(double) <= budget)
+        return new ArgHmmForwardTable(trees->start_coord, seqlen);
+
+    // With interval I, the table needs about
+    //   (seqlen / I + nblocks) * col_bytes + 2 * I * scratch_bytes
+    // bytes.  Use the largest interval that fits (the fewest chunks), or
+    // the one needing the least memory if none fits.
+    const double col_bytes = ncells / seqlen * (
+        config.forward_table_float ? sizeof(float) : sizeof(double));
+    const double scratch_bytes = max_nstates * sizeof(double);
+    const double avail = budget - nblocks * col_bytes;
+    const double disc = avail * avail - 8.0 * scratch_bytes * seqlen * col_bytes;
+    double interval;
+    if (avail > 0 && disc >= 0) {
+        interval = (avail + sqrt(disc)) / (4.0 * scratch_bytes);
+    } else {
+        interval = sqrt(seqlen * col_bytes / (2.0 * scratch_bytes));
+        printLog(LOG_LOW, "forward table does not fit in %.1f MB\n",
+                 budget / 1e6);
+    }
+    interval = min(max(interval, 1.0), double(seqlen));
+
+    printLog(LOG_MEDIUM, "forward table: keeping every %d-th column\n",
+             int(interval));
+    return new ArgHmmForwardCheckpoints(trees->start_coord, seqlen,
+                                        int(interval),
+                                        config.forward_table_float);
+}
+
+
 
 //=============================================================================
 // ARG sampling
 
 
+// log usage of the transition matrix cache
+static void log_matrix_cache(const ArgHmmMatrixCache *matrix_iter)
+{
+    printLog(LOG_LOW, "matrix cache: %d hits, %d misses, %.1f MB\n",
+             matrix_iter->get_hits(), matrix_iter->get_misses(),
+             matrix_iter->get_nbytes() / 1e6);
+    const TransMatrixCache *transmat_cache = matrix_iter->get_transmat_cache();
+    printLog(LOG_MEDIUM, "shared transition matrices: %d of %d\n",
+             transmat_cache->get_hits(),
+             transmat_cache->get_hits() + transmat_cache->get_misses());
+}
+
+
 // sample the thread of the last chromosome
 void sample_arg_thread(const ArgModel *model, Sequences *sequences,
                        LocalTrees *trees, int new_chrom)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTable *forward = new_forward_table(trees, model);
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     int start_pop = sequences->get_pop(new_chrom);
@@ -643,12 +1179,14 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
       printf("treemap = %i %i\n", phase_pr.treemap1, phase_pr.treemap2);
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
+    ArgHmmMatrixCache matrix_iter(model, sequences, trees, new_chrom,
+                                  model->hmm_config.matrix_cache_size);
     matrix_iter.set_start_pop(start_pop);
+    matrix_iter.set_threads(model->hmm_config.nthreads);
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
 		       model->unphased ? &phase_pr : NULL);
     int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
     printTimerLog(time, LOG_LOW,
@@ -657,10 +1195,9 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
-    matrix_iter2.set_start_pop(start_pop);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path);
+    if (forward->get_interval() == 0)
+        matrix_iter.set_seqs(NULL);
+    stochastic_traceback(trees, model, &matrix_iter, forward, thread_path);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
 
@@ -672,8 +1209,9 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
     // sample recombination points
     vector<int> recomb_pos;
     vector<Spr> recombs;
-    sample_recombinations(trees, model, &matrix_iter2,
+    sample_recombinations(trees, model, &matrix_iter,
                           thread_path, recomb_pos, recombs);
+    log_matrix_cache(&matrix_iter);
     assert_trees(trees, model->pop_tree);
 
     // add thread to ARG
@@ -686,6 +1224,7 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
                   "add thread:                         ");
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -698,13 +1237,17 @@ void sample_arg_thread_internal(
     const bool internal = true;
 
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTable *forward = (phase_pr == NULL ?
+        new_forward_table(trees, model, internal, minage) :
+        new ArgHmmForwardTable(trees->start_coord, trees->length()));
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixCache matrix_iter(model, sequences, trees, -1,
+                                  model->hmm_config.matrix_cache_size);
     matrix_iter.set_internal(internal, minage);
+    matrix_iter.set_threads(model->hmm_config.nthreads);
 
     if (phase_pr != NULL)
         printLog(LOG_HIGH, "treemap = %i %i\n",
@@ -712,7 +1255,7 @@ void sample_arg_thread_internal(
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
                        phase_pr, false, internal);
     int nstates = get_num_coal_states_internal(
            trees->front().tree, model->ntimes, minage);
@@ -722,10 +1265,9 @@ void sample_arg_thread_internal(
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
-    matrix_iter2.set_internal(internal, minage);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
+    if (forward->get_interval() == 0)
+        matrix_iter.set_seqs(NULL);
+    stochastic_traceback(trees, model, &matrix_iter, forward, thread_path,
                          false, internal);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
@@ -737,8 +1279,9 @@ void sample_arg_thread_internal(
     time.start();
     vector<int> recomb_pos;
     vector<Spr> recombs;
-    sample_recombinations(trees, model, &matrix_iter2,
+    sample_recombinations(trees, model, &matrix_iter,
                           thread_path, recomb_pos, recombs, internal);
+    log_matrix_cache(&matrix_iter);
 
     // add thread to ARG
     add_arg_thread_path(trees, matrix_iter.states_model,
@@ -748,6 +1291,7 @@ void sample_arg_thread_internal(
                   "add thread:                         ");
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -831,9 +1375,9 @@ void cond_sample_arg_thread_internal(
     const State start_state, const State end_state)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    ArgHmmForwardTable *forward = new_forward_table(trees, model, true);
     States states;
-    double **fw = forward.get_table();
+    double **fw = forward->get_table();
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     const bool internal = true;
@@ -846,13 +1390,15 @@ void cond_sample_arg_thread_internal(
     assert_trees(trees, model->pop_tree, true);
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixCache matrix_iter(model, sequences, trees, -1,
+                                  model->hmm_config.matrix_cache_size);
     matrix_iter.set_internal(internal);
+    matrix_iter.set_threads(model->hmm_config.nthreads);
 
     // fill in first column of forward table
     matrix_iter.begin();
     matrix_iter.get_coal_states(states);
-    forward.new_block(matrix_iter.get_block_start(),
+    forward->new_block(matrix_iter.get_block_start(),
                       matrix_iter.get_block_end(), states.size());
 
     if (states.size() > 0) {
@@ -878,7 +1424,7 @@ void cond_sample_arg_thread_internal(
 
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward, NULL,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward, NULL,
                        prior_given, internal);
 
     // TODO: Check that we don't need more arguments here!
@@ -911,21 +1457,23 @@ void cond_sample_arg_thread_internal(
 
     // traceback
     time.start();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
-    matrix_iter2.set_internal(internal);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
+    if (forward->get_interval() == 0)
+        matrix_iter.set_seqs(NULL);
+    stochastic_traceback(trees, model, &matrix_iter, forward, thread_path,
                          last_state_given, internal);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
     if (!start_state.is_null())
-        assert(fw[trees->start_coord][thread_path[trees->start_coord]] == 1.0);
+        assert(forward->get_checkpoint(trees->start_coord)
+               [thread_path[trees->start_coord]] == 1.0);
 
     // sample recombination points
     time.start();
     vector<int> recomb_pos;
     vector<Spr> recombs;
-    sample_recombinations(trees, model, &matrix_iter2,
+    sample_recombinations(trees, model, &matrix_iter,
                           thread_path, recomb_pos, recombs, internal);
+    log_matrix_cache(&matrix_iter);
 
     // add thread to ARG
     assert_trees(trees, model->pop_tree, true);
@@ -937,6 +1485,7 @@ void cond_sample_arg_thread_internal(
                   "add thread:                         ");
 
     // clean up
+    delete forward;
     delete [] thread_path_alloc;
 }
 
@@ -68,6 +68,9 @@ public:
         }
     }
 
+    // called once the columns [start, end) have been computed
+    virtual void end_block(int start, int end, int nstates) {}
+
     // delete all blocks
     virtual void delete_blocks()
     {
@@ -76,6 +79,20 @@ public:
         blocks.clear();
     }
 
+    // Maximum number of columns computed at once by the forward algorithm
+    // (0 for no limit).  Tables with a limit only keep some columns.
+    virtual int get_interval() const
+    {
+        return 0;
+    }
+
+    // Returns a column that is kept after the forward algorithm.  Tables
+    // with an interval only keep the last column of every chunk.
+    virtual const double *get_checkpoint(int pos)
+    {
+        return fw[pos-start_coord];
+    }
+
     virtual double **get_table()
     {
         return &fw[-start_coord];
@@ -124,19 +141,196 @@ public:
 };
 
 
+// Forward table that only keeps some of its columns.  The forward
+// algorithm computes each block in chunks of at most 'interval' columns
+// and only the last column of every chunk (and the first column of the
+// table) is stored.  The other columns are recomputed from the stored ones
+// during the traceback, which therefore needs the emissions again.
+// Stored columns may be kept in single precision, scaled by their maximum.
+class ArgHmmForwardCheckpoints : public ArgHmmForwardTable
+{
+public:
+    ArgHmmForwardCheckpoints(int start_coord, int seqlen, int interval,
+                             bool single=false) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        interval(max(interval, 1)),
+        single(single),
+        scratch_index(0),
+        nbytes(0)
+    {}
+
+    virtual ~ArgHmmForwardCheckpoints()
+    {
+        delete_blocks();
+    }
+
+    // Link the columns [start, end) to a scratch buffer.  Two buffers are
+    // used in turn, so that the last column of the previous chunk is still
+    // valid while the next chunk is computed.
+    virtual void new_block(int start, int end, int nstates)
+    {
+        nstates = max(nstates, 1);
+        scratch_index = 1 - scratch_index;
+        vector<double> &scratch = scratches[scratch_index];
+        const unsigned int size = (end - start) * nstates;
+        if (scratch.size() < size)
+            scratch.resize(size);
+
+        for (int i=start; i<end; i++) {
+            assert(i-start_coord >= 0 && i-start_coord < seqlen);
+            fw[i-start_coord] = &scratch[(i-start)*nstates];
+        }
+    }
+
+    // store the last column of a chunk (and the first column of the table)
+    virtual void end_block(int start, int end, int nstates)
+    {
+        nstates = max(nstates, 1);
+        if (start == start_coord && end - 1 > start)
+            store(start, nstates);
+        store(end - 1, nstates);
+    }
+
+    virtual void delete_blocks()
+    {
+        for (unsigned int i=0; i<checkpoints.size(); i++) {
+            delete [] checkpoints[i].col;
+            delete [] checkpoints[i].single_col;
+        }
+        checkpoints.clear();
+        nbytes = 0;
+    }
+
+    virtual int get_interval() const
+    {
+        return interval;
+    }
+
+    // Returns stored column 'pos' in double precision.  The returned
+    // pointer is only valid until the next call.
+    virtual const double *get_checkpoint(int pos)
+    {
+        const Checkpoint &checkpoint = find_checkpoint(pos);
+        if (!single)
+            return checkpoint.col;
+
+        buffer.resize(checkpoint.nstates);
+        for (int k=0; k<checkpoint.nstates; k++)
+            buffer[k] = checkpoint.single_col[k] * checkpoint.scale;
+        return &buffer[0];
+    }
+
+    // number of bytes used by stored columns
+    long get_nbytes() const
+    {
+        return nbytes;
+    }
+
+protected:
+
+    class Checkpoint
+    {
+    public:
+        int pos;
+        int nstates;
+        double scale;
+        double *col;
+        float *single_col;
+    };
+
+    void store(int pos, int nstates)
+    {
+        const double *col = fw[pos-start_coord];
+        Checkpoint checkpoint;
+        checkpoint.pos = pos;
+        checkpoint.nstates = nstates;
+        checkpoint.scale = 1.0;
+        checkpoint.col = NULL;
+        checkpoint.single_col = NULL;
+
+        if (single) {
+            double top = max_array(col, nstates);
+            if (top > 0.0)
+                checkpoint.scale = top;
+            checkpoint.single_col = new float [nstates];
+            for (int k=0; k<nstates; k++)
+                checkpoint.single_col[k] = col[k] / checkpoint.scale;
+            nbytes += nstates * sizeof(float);
+        } else {
+            checkpoint.col = new double [nstates];
+            copy(col, col + nstates, checkpoint.col);
+            nbytes += nstates * sizeof(double);
+        }
+
+        // columns are stored from left to right
+        assert(checkpoints.empty() || checkpoints.back().pos < pos);
+        checkpoints.push_back(checkpoint);
+    }
+
+    const Checkpoint &find_checkpoint(int pos) const
+    {
+        int low = 0, high = checkpoints.size();
+        while (high - low > 1) {
+            int mid = (low + high) / 2;
+            if (checkpoints[mid].pos <= pos)
+                low = mid;
+            else
+                high = mid;
+        }
+        assert(low < int(checkpoints.size()) && checkpoints[low].pos == pos);
+        return checkpoints[low];
+    }
+
+    int interval;
+    bool single;
+    int scratch_index;
+    vector<double> scratches[2];
+    vector<Checkpoint> checkpoints;
+    vector<double> buffer;
+    long nbytes;
+};
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
+void arghmm_forward_block(const ArgModel *model, const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          const double* const *emit, double **fw,
+                          ScratchArena *arena=NULL);
+
+void arghmm_forward_block_slow(const LocalTree *tree, const int ntimes,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw);
+
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
     ArgHmmForwardTable *forward, PhaseProbs *phase_pr=NULL,
     bool prior_given=false, bool internal=false, bool slow=false);
 
+void arghmm_forward_alg_segments(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    bool prior_given=false, bool internal=false);
+
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
     double **fw, int *path, bool last_state_given=false, bool internal=false);
 
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    int *path, bool last_state_given=false, bool internal=false);
+
+ArgHmmForwardTable *new_forward_table(
+    const LocalTrees *trees, const ArgModel *model, bool internal=false,
+    int minage=0);
+
 //=============================================================================
 // ARG thread sampling
 
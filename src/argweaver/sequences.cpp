@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "common.h"
 #include "logging.h"
 #include "parsing.h"
@@ -14,6 +16,194 @@
 namespace argweaver {
 
 
+//=============================================================================
+// compact base probabilities
+
+
+// entries that are not a certain base
+static const int PACKED_MASKED = -1;
+static const int PACKED_UNCERTAIN = -2;
+
+// returns the base of a certain entry, or PACKED_MASKED/PACKED_UNCERTAIN
+static int classify_base_probs(const BaseProbs &bp)
+{
+    int nones = 0, nzeros = 0, base = 0;
+    for (int k=0; k<4; k++) {
+        if (bp.prob[k] == 1.0) {
+            nones++;
+            base = k;
+        } else if (bp.prob[k] == 0.0) {
+            nzeros++;
+        }
+    }
+    if (nones == 4)
+        return PACKED_MASKED;
+    if (nones == 1 && nzeros == 3)
+        return base;
+    return PACKED_UNCERTAIN;
+}
+
+
+uint16_t PackedBaseProbs::double_to_half(double x)
+{
+    // probabilities are never negative
+    if (!(x > 0.0))
+        return 0;
+    if (x >= 65504.0)
+        return 0x7bff;
+
+    float f = x;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    const int exp = int((bits >> 23) & 0xff) - 127 + 15;
+    const uint32_t mant = bits & 0x7fffff;
+
+    if (exp <= 0) {
+        // subnormal; keep nonzero probabilities nonzero so a leaf can
+        // never give a site zero likelihood
+        if (exp < -10)
+            return 1;
+        const uint32_t full = mant | 0x800000;
+        const int shift = 14 - exp;
+        return (full >> shift) + ((full >> (shift - 1)) & 1);
+    }
+    // rounding may carry into the exponent, which is still correct
+    return ((exp << 10) | (mant >> 13)) + ((mant >> 12) & 1);
+}
+
+
+void PackedBaseProbs::reserve(int n)
+{
+    bases.reserve((n + 31) / 32);
+    mask.reserve((n + 63) / 64);
+    uncertain.reserve((n + 63) / 64);
+    rank.reserve((n + 63) / 64);
+}
+
+
+void PackedBaseProbs::push_back(const BaseProbs &bp)
+{
+    const int i = len++;
+    if ((i & 31) == 0)
+        bases.push_back(0);
+    if ((i & 63) == 0) {
+        mask.push_back(0);
+        uncertain.push_back(0);
+        rank.push_back(probs.size() / 4);
+    }
+    set(i, bp);
+}
+
+
+void PackedBaseProbs::set(int i, const BaseProbs &bp)
+{
+    assert(i >= 0 && i < len);
+    const int word = i >> 6;
+    const uint64_t bit = uint64_t(1) << (i & 63);
+    const bool was_uncertain = uncertain[word] & bit;
+    const int code = classify_base_probs(bp);
+    const int r = uncertain_rank(i);
+
+    if (code == PACKED_UNCERTAIN) {
+        if (!was_uncertain) {
+            probs.insert(probs.begin() + 4 * r, 4, 0);
+            for (unsigned int w=word+1; w<rank.size(); w++)
+                rank[w]++;
+            uncertain[word] |= bit;
+        }
+        for (int k=0; k<4; k++)
+            probs[4 * r + k] = double_to_half(bp.prob[k]);
+    } else if (was_uncertain && code != PACKED_MASKED) {
+        // masking leaves the stored probabilities in place (the mask bit
+        // hides them), so masking many entries does not shift 'probs'
+        probs.erase(probs.begin() + 4 * r, probs.begin() + 4 * r + 4);
+        for (unsigned int w=word+1; w<rank.size(); w++)
+            rank[w]--;
+        uncertain[word] &= ~bit;
+    }
+
+    if (code == PACKED_MASKED)
+        mask[word] |= bit;
+    else
+        mask[word] &= ~bit;
+
+    const int shift = 2 * (i & 31);
+    bases[i >> 5] &= ~(uint64_t(3) << shift);
+    if (code >= 0)
+        bases[i >> 5] |= uint64_t(code) << shift;
+}
+
+
+// give entry i stored probabilities (contents are left zero)
+void PackedBaseProbs::add_slot(int i)
+{
+    const int word = i >> 6;
+    probs.insert(probs.begin() + 4 * uncertain_rank(i), 4, 0);
+    for (unsigned int w=word+1; w<rank.size(); w++)
+        rank[w]++;
+    uncertain[word] |= uint64_t(1) << (i & 63);
+}
+
+
+void PackedBaseProbs::swap(int i, PackedBaseProbs &other)
+{
+    assert(i >= 0 && i < len && i < other.len);
+    const int word = i >> 6;
+    const uint64_t bit = uint64_t(1) << (i & 63);
+
+    // mask bits and base codes
+    const uint64_t mask1 = mask[word] & bit;
+    mask[word] = (mask[word] & ~bit) | (other.mask[word] & bit);
+    other.mask[word] = (other.mask[word] & ~bit) | mask1;
+    const int shift = 2 * (i & 31);
+    const uint64_t code_bits = uint64_t(3) << shift;
+    const uint64_t code1 = bases[i >> 5] & code_bits;
+    bases[i >> 5] = (bases[i >> 5] & ~code_bits) |
+        (other.bases[i >> 5] & code_bits);
+    other.bases[i >> 5] = (other.bases[i >> 5] & ~code_bits) | code1;
+
+    const bool slot1 = uncertain[word] & bit;
+    const bool slot2 = other.uncertain[word] & bit;
+    if (!slot1 && !slot2)
+        return;
+
+    // Only one side has stored probabilities.  Give the other side a slot
+    // too, and keep both afterwards: a certain entry is stored exactly
+    // (ones and zeros are exact halfs), so repeated switches of this
+    // site stay O(1) instead of inserting and erasing each time.
+    if (!slot1)
+        add_slot(i);
+    else if (!slot2)
+        other.add_slot(i);
+
+    uint16_t *p1 = &probs[4 * uncertain_rank(i)];
+    uint16_t *p2 = &other.probs[4 * other.uncertain_rank(i)];
+    if (slot1 && slot2) {
+        std::swap_ranges(p1, p1 + 4, p2);
+        return;
+    }
+
+    // the side that had no slot held a certain (or masked) entry
+    uint16_t *from = slot1 ? p1 : p2;
+    uint16_t *to = slot1 ? p2 : p1;
+    const PackedBaseProbs &certain = slot1 ? *this : other;
+    copy(from, from + 4, to);
+    fill(from, from + 4, 0);
+    if (!(certain.mask[word] & bit))
+        from[(certain.bases[i >> 5] >> shift) & 3] = double_to_half(1.0);
+}
+
+
+PackedBaseProbs PackedBaseProbs::slice(int start, int end) const
+{
+    PackedBaseProbs probs2;
+    probs2.reserve(end - start);
+    for (int i=start; i<end; i++)
+        probs2.push_back((*this)[i]);
+    return probs2;
+}
+
+
 //=============================================================================
 // input/output: FASTA
 
@@ -368,7 +558,7 @@ bool read_sites(FILE *infile, Sites *sites,
                         sscanf(fields[pos++].c_str(), "%lf", &bp.prob[j]);
                     bp_vec.push_back(bp);
                 }
-                sites->base_probs.push_back(bp_vec);
+                sites->base_probs.push_back(PackedBaseProbs(bp_vec));
             }
 
         }
@@ -423,25 +613,67 @@ public:
 };
 
 
+// Splits 'str' in place at each 'delim'.  Like split(), but the tokens
+// point into 'str' instead of being copied.
+static void split_in_place(char *str, char delim, vector<char*> &tokens)
+{
+    tokens.clear();
+    tokens.push_back(str);
+    for (char *p = str; *p; p++) {
+        if (*p == delim) {
+            *p = '\0';
+            tokens.push_back(p + 1);
+        }
+    }
+}
+
+
+// Returns the length of token 'idx' of 'str' split at 'delim', or -1 if
+// there are not enough tokens.  'str' is not modified.
+static int token_length(const char *str, char delim, int idx)
+{
+    for (int i=0; i<idx; i++) {
+        str = strchr(str, delim);
+        if (!str)
+            return -1;
+        str++;
+    }
+    const char *end = strchr(str, delim);
+    return end ? end - str : strlen(str);
+}
+
+
 bool read_vcf(FILE *infile, Sites *sites, double min_qual,
               const char *genotype_filter, bool parse_genotype_probs,
               double min_base_prob, bool add_ref, const set<string> keep_inds) {
-    const char *delim = "\t";
-    char *line=NULL;
+    const char delim = '\t';
+    int linesize = 64 * 1024;
+    char *line = new char [linesize];
     int nseqs = 0, nsample=0;
-    bool error = false;
     const char *headerStart = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t";
     string chrname = "";
     vector<GenoFilter> gf;
     int num_masked=0, total=0;
     int numIndel=0;
-    static bool warnRefLen=false;
-    static bool warnProbs=false;
+    // warn once per file; files may be read on several threads
+    bool warnRefLen=false;
+    bool warnProbs=false;
+    bool badAlleleWarn=false;
     vector<bool> keep_ind;
     vector<string> sample_names;
     vector<int> ploidy;
     ploidy.clear();
 
+    // fields of the current line and of the current sample; these point
+    // into 'line', which is reused for every line
+    vector<char*> fields, alt, seqfields;
+    vector<char*> format;
+    string last_format;
+    int nformat=0;
+    int gt_idx=-1, pl_idx=-1, gl_idx=-1, pp_idx=-1;
+    double scores[10];
+    vector<BaseProbs> base_probs;
+
     if (genotype_filter != NULL && strlen(genotype_filter) > 0) {
         vector<string> tmp;
         split(genotype_filter, ";", tmp);
@@ -454,43 +686,45 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
     sites->clear();
 
     int lineno = 1;
-    while (!error) {
-        if (line != NULL) delete [] line;
-        line = fgetline(infile);
-        if (line == NULL) break;
+    while (true) {
+        fgetline(&line, &linesize, infile);
+        if (line[0] == '\0' && feof(infile))
+            break;
         chomp(line);
         lineno++;
         if (strncmp(line, "##", 2) == 0) {
             continue;
         }
         if (strncmp(line, headerStart, strlen(headerStart)) == 0) {
-            split(&line[strlen(headerStart)], delim, sample_names);
+            split(&line[strlen(headerStart)], "\t", sample_names);
             nsample = (int)sample_names.size();
             continue;
         }
 
-        vector<string> fields;
-        split(line, delim, fields);
+        split_in_place(line, delim, fields);
         if ((int)fields.size() != 9 + nsample) {
             printError("Not enough fields in line %i of VCF file", lineno);
+            delete [] line;
             return false;
         }
         if (chrname == "")
             chrname = fields[0];
-        else if (chrname != fields[0]) {
+        else if (strcmp(chrname.c_str(), fields[0]) != 0) {
             printError("VCF file contains multiple chromosomes. Must supply region str (chr:start-end)");
+            delete [] line;
             return false;
         }
         int position;
-        if (1 != sscanf(fields[1].c_str(), "%i", &position)) {
+        if (1 != sscanf(fields[1], "%i", &position)) {
             printError("Error parsing position field in VCF\n");
+            delete [] line;
             return false;
         }
         position--;  //convert to 0-index
-        double qual = atof(fields[5].c_str());
+        double qual = atof(fields[5]);
         char alleles[5];  // alleles can only be A,C,G,T,N
         int num_alleles=1;
-        if (fields[3].length() != 1) {
+        if (strlen(fields[3]) != 1) {
             if (!warnRefLen) {
                 printWarning("Reference allele is not length one on line %i of VCF... skipping this and future similar lines",
                              lineno);
@@ -499,10 +733,8 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
             numIndel++;
             continue;
         }
-        alleles[0] = fields[3].c_str()[0];
-        vector<string> alt;
-        split(fields[4].c_str(), ",", alt);
-        static bool badAlleleWarn=false;
+        alleles[0] = fields[3][0];
+        split_in_place(fields[4], ',', alt);
         if (alt.size() > 4) {
             if (!badAlleleWarn) {
                 printError("length of ALT allele should not be more than 4 on line %i of VCF\n",
@@ -513,84 +745,83 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
         }
         bool badAllele=false;
         for (int i=0; i < (int)alt.size(); i++) {
-            if (alt[i].length() != 1) {
+            if (strlen(alt[i]) != 1) {
                 if (!badAlleleWarn) {
                     printWarning("ReadVCF can only handle alleles A,C,G,T,N currently;"
                                  " got allele %s on line %i; skipping this line and"
                                  " other similar ones",
-                               alt[i].c_str(), lineno);
+                               alt[i], lineno);
                     badAlleleWarn=true;
                 }
                 badAllele=true;
                 numIndel++;
                 break;
             }
-            alleles[num_alleles++] = alt[i].c_str()[0];
+            alleles[num_alleles++] = alt[i][0];
         }
         if (badAllele) continue;
+
         // next: parse FORMAT in fields[8] and figure out where to find
-        // GT
-        vector<string> format;
-        split(fields[8].c_str(), ":", format);
-        int gt_idx=-1;
-        int pl_idx=-1;
-        int gl_idx=-1;
-        int pp_idx=-1;
-        for (int i=0; i < (int)format.size(); i++) {
-            if (strcmp(format[i].c_str(), "GT")==0) {
-                gt_idx=i;
-            }
-            if (parse_genotype_probs) {
-                if (strcmp(format[i].c_str(), "PL")==0) {
-                    pl_idx = i;
+        // GT.  The FORMAT is usually the same on every line.
+        if (last_format != fields[8]) {
+            last_format = fields[8];
+            split_in_place(fields[8], ':', format);
+            nformat = format.size();
+            gt_idx = pl_idx = gl_idx = pp_idx = -1;
+            for (int i=0; i < (int)format.size(); i++) {
+                if (strcmp(format[i], "GT")==0) {
+                    gt_idx=i;
                 }
-                if (strcmp(format[i].c_str(), "GL")==0) {
-                    gl_idx = i;
+                if (parse_genotype_probs) {
+                    if (strcmp(format[i], "PL")==0) {
+                        pl_idx = i;
+                    }
+                    if (strcmp(format[i], "GL")==0) {
+                        gl_idx = i;
+                    }
+                    if (strcmp(format[i], "PP")==0) {
+                        pp_idx = i;
+                    }
                 }
-                if (strcmp(format[i].c_str(), "PP")==0) {
-                    pp_idx = i;
+            }
+            // PL and GL are the same except GL is float;
+            // set_by_pl treats input as float anyway
+            if (gl_idx >= 0) pl_idx = gl_idx;
+
+            // get positions for genotype filter(s)
+            for (int i=0; i < (int)gf.size(); i++) {
+                gf[i].index = -1;
+                for (int j=0; j < (int)format.size(); j++) {
+                    if (gf[i].code == format[j]) {
+                        gf[i].index = j;
+                        break;
+                    }
                 }
             }
         }
         if (gt_idx == -1) {
             printError("Did not find GT in format field in VCF file line %i",
                        lineno);
+            delete [] line;
             return false;
         }
 
-        vector<BaseProbs> base_probs;
-        // get positions for genotype filter(s)
-        for (int i=0; i < (int)gf.size(); i++) {
-            gf[i].index = -1;
-            for (int j=0; j < (int)format.size(); j++) {
-                if (format[j] == gf[i].code) {
-                    gf[i].index = j;
-                    break;
-                }
-            }
-        }
-
-
-        vector<string> seqfields;
-        string gtstr;
         // on first input line, process sample names and figure out ploidy
         // (only ploidy 1 or two supported)
         if (ploidy.size() == 0) {
             nseqs = 0;
             for (int i=0; i < nsample; i++) {
-                if (keep_inds.size() > 0 && keep_inds.find(sample_names[i]) == keep_inds.end()) {
-                    keep_ind.push_back(false);
-                }
-                keep_ind.push_back(true);
-                split(fields[9+i].c_str(), ":", seqfields);
-                gtstr = seqfields[gt_idx];
-                if (gtstr.length() == 1) {
+                keep_ind.push_back(keep_inds.size() == 0 ||
+                                   keep_inds.find(sample_names[i]) !=
+                                   keep_inds.end());
+                const int gtlen = token_length(fields[9+i], ':', gt_idx);
+                if (gtlen == 1) {
                     ploidy.push_back(1);
                     if (keep_ind[i]) {
                         nseqs++;
                         sites->names.push_back(sample_names[i]);
                     }
-                } else if (gtstr.length() == 3) {
+                } else if (gtlen == 3) {
                     ploidy.push_back(2);
                     if (keep_ind[i]) {
                         nseqs += 2;
@@ -602,6 +833,7 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
                     }
                 } else {
                     printError("Bad genotype on line %i of VCF", lineno);
+                    delete [] line;
                     return false;
                 }
             }
@@ -614,28 +846,33 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
         }
         if (nseqs - add_ref  <= 0) {
             printError("Did not find sequences to keep in VCF file\n");
+            delete [] line;
             return false;
         }
 
         char col[nseqs+1];
         col[nseqs] = '\0';
+        if (parse_genotype_probs)
+            base_probs.assign(nseqs, BaseProbs('N'));
         int idx=0;
         for (int i=0; i < nsample; i++) {
             if (!keep_ind[i]) continue;
             bool masked = ( num_alleles > 2 || qual < min_qual );
-            split(fields[9+i].c_str(), ":", seqfields);
-            if (seqfields.size() != format.size()) {
-                if (gt_idx < (int)seqfields.size() && seqfields[gt_idx] == "./.")
+            split_in_place(fields[9+i], ':', seqfields);
+            if ((int)seqfields.size() != nformat) {
+                if (gt_idx < (int)seqfields.size() &&
+                    strcmp(seqfields[gt_idx], "./.") == 0)
                     masked=true;
                 else {
                     printError("Field %i does not match format string on line %i of VCF file\n",
                                9+i+1, lineno);
+                    delete [] line;
                     return false;
                 }
             } else {
                 for (int j=0; j < (int)gf.size(); j++) {
                     if (gf[j].index >= 0) {
-                        int val = atoi(seqfields[gf[j].index].c_str());
+                        int val = atoi(seqfields[gf[j].index]);
                         if ((  gf[j].is_min  && val < gf[j].cutoff) ||
                             ((!gf[j].is_min) && val > gf[j].cutoff)) {
                             masked=true;
@@ -645,11 +882,6 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
                 }
             }
 
-            if (parse_genotype_probs) {
-                BaseProbs bp = BaseProbs('N');
-                base_probs.push_back(bp);
-                if (ploidy[i] == 2) base_probs.push_back(bp);
-            }
             total++;
             if (masked) {
                 col[idx] = 'N';
@@ -658,35 +890,56 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
                 num_masked+= ploidy[i];
                 continue;
             }
-            if (parse_genotype_probs && pl_idx == -1 &&
-                gl_idx == -1 && pp_idx == -1) {
+            if (parse_genotype_probs && pl_idx == -1 && pp_idx == -1) {
                 if (!warnProbs) {
                     printWarning("Did not find PL, GL, or PP in format field in VCF file line %i",
                                  lineno);
                     warnProbs=true;
                 }
             }
-            gtstr = seqfields[gt_idx];
-            if (ploidy[i]==2 && gtstr.length() != 3) {
+            const char *gtstr = seqfields[gt_idx];
+            const int gtlen = strlen(gtstr);
+            if (ploidy[i]==2 && gtlen != 3) {
                 printError("genotype not length three on line %i of VCF",
                            lineno);
+                delete [] line;
                 return false;
             }
-            if (ploidy[i]==1 && gtstr.length() != 1) {
+            if (ploidy[i]==1 && gtlen != 1) {
                 printError("genotype not length one on line %i of VCF for haploid sample",
                            lineno);
+                delete [] line;
                 return false;
             }
             if (ploidy[i] == 2) {
-                if (gtstr.c_str()[1] != '|' &&
-                    gtstr.c_str()[1] != '/') {
+                if (gtstr[1] != '|' &&
+                    gtstr[1] != '/') {
                     printError("genotype middle character not '|' or '/' on line %i",
                                lineno);
+                    delete [] line;
+                    return false;
+                }
+            }
+
+            // genotype scores are shared by the haplotypes of the sample
+            if (parse_genotype_probs) {
+                if (pl_idx >= 0 &&
+                    !BaseProbs::parse_scores(seqfields[pl_idx], scores, 3)) {
+                    printError("Error parsing PL string %s on line %i of VCF\n",
+                               seqfields[pl_idx], lineno);
+                    delete [] line;
+                    return false;
+                } else if (pl_idx < 0 && pp_idx >= 0 &&
+                    !BaseProbs::parse_scores(seqfields[pp_idx], scores, 10)) {
+                    printError("Error parsing PP string %s on line %i of VCF\n",
+                               seqfields[pp_idx], lineno);
+                    delete [] line;
                     return false;
                 }
             }
+
             for (int j=0; j < ploidy[i]; j++) {
-                char allele = gtstr.c_str()[j*2];
+                char allele = gtstr[j*2];
                 if (allele == '.') {
                     col[idx] = 'N';
                     if (parse_genotype_probs)
@@ -696,22 +949,20 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
                     if (ia < 0 || ia >= num_alleles) {
                         printError("Bad GT in field %i,line %i of VCF",
                                    i+9+1, lineno);
+                        delete [] line;
                         return false;
                     }
                     col[idx] = alleles[ia];
                     if (parse_genotype_probs) {
-                        // PL and GL are the same except GL is float;
-                        // set_by_pl treats input as float anyway
-                        if (gl_idx >= 0) pl_idx = gl_idx;
+                        BaseProbs &bp = base_probs[idx];
                         if (pl_idx >= 0)
-                            base_probs[idx].set_by_pl(alleles[0], alleles[1],
-                                                      seqfields[pl_idx], j);
+                            bp.set_by_pl(alleles[0], alleles[1], scores, j);
                         else if (pp_idx >= 0)
-                            base_probs[idx].set_by_pp(seqfields[pp_idx], j);
-                        else base_probs[idx].set_certain(alleles[ia]);
-                        if (base_probs[idx].maxProb() < min_base_prob) {
+                            bp.set_by_pp(scores, j);
+                        else bp.set_certain(alleles[ia]);
+                        if (bp.maxProb() < min_base_prob) {
                             col[idx] = 'N';
-                            base_probs[idx].set_mask();
+                            bp.set_mask();
                             num_masked++;
                         }
                     }
@@ -723,17 +974,18 @@ bool read_vcf(FILE *infile, Sites *sites, double min_qual,
             assert(idx == nseqs-1);
             col[idx] = alleles[0];
             if (parse_genotype_probs)
-                base_probs.push_back(BaseProbs(alleles[0]));
+                base_probs[idx] = BaseProbs(alleles[0]);
         }
         sites->append(position, col, true);
         if (parse_genotype_probs)
-            sites->base_probs.push_back(base_probs);
+            sites->base_probs.push_back(PackedBaseProbs(base_probs));
     }
 
     printLog(LOG_LOW, "Read %i sites from %i lines of VCF file (num skipped indels=%i)\n",
              sites->get_num_sites(), lineno, numIndel);
     if (gf.size() > 0) printLog(LOG_LOW, "Masked %.1f out of %i genotypes\n",
                                 (double)num_masked/2, total);
+    delete [] line;
     return true;
 }
 
@@ -782,26 +1034,106 @@ bool read_vcf(const string filename, Sites *sites, const string region,
                     min_base_prob, add_ref, tabixdir.c_str(), keep_inds);
 }
 
+// arguments and result of reading one file in read_vcfs()
+class ReadVcfJob
+{
+public:
+    const char *filename;
+    const char *region;
+    double min_qual;
+    const char *genotype_filter;
+    bool parse_genotype_probs;
+    double min_base_prob;
+    const char *tabixdir;
+    const set<string> *keep_inds;
+    Sites *sites;
+    bool result;
+};
+
+
+class ReadVcfQueue
+{
+public:
+    vector<ReadVcfJob> jobs;
+    int next;
+    pthread_mutex_t lock;
+};
+
+
+static void *read_vcf_worker(void *arg)
+{
+    ReadVcfQueue *queue = (ReadVcfQueue*) arg;
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (i >= (int) queue->jobs.size())
+            break;
+
+        ReadVcfJob &job = queue->jobs[i];
+        job.result = read_vcf(job.filename, job.sites, job.region,
+                              job.min_qual, job.genotype_filter,
+                              job.parse_genotype_probs, job.min_base_prob,
+                              true, job.tabixdir, *job.keep_inds);
+    }
+    return NULL;
+}
+
+
+// Reads the files with up to 'nthreads' threads, then merges them in order
 bool read_vcfs(const vector<string> filenames, Sites* sites, const string region,
                double min_qual, const string genotype_filter,
                bool parse_genotype_probs, double min_base_prob,
-               const string tabixdir, const set<string> keep_inds) {
+               const string tabixdir, const set<string> keep_inds,
+               int nthreads) {
     if (filenames.size() == 0) {
         fprintf(stderr, "Read_vcfs expects at least one filename\n");
         return false;
     }
-    if (!read_vcf(filenames[0], sites, region, min_qual,
-                  genotype_filter, parse_genotype_probs, min_base_prob,
-                  true, tabixdir, keep_inds))
-        return false;
-    for (int i=1; i < (int)filenames.size(); i++) {
-        Sites s;
-        if (!read_vcf(filenames[i], &s, region, min_qual,
-                      genotype_filter, parse_genotype_probs, min_base_prob,
-                      true, tabixdir, keep_inds))
-            return false;
-        if (!sites->merge(s)) return false;
+    const int nfiles = filenames.size();
+    vector<Sites*> file_sites(nfiles);
+    ReadVcfQueue queue;
+    queue.next = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    for (int i=0; i < nfiles; i++) {
+        file_sites[i] = (i == 0 ? sites : new Sites());
+        ReadVcfJob job;
+        job.filename = filenames[i].c_str();
+        job.region = region.c_str();
+        job.min_qual = min_qual;
+        job.genotype_filter = genotype_filter.c_str();
+        job.parse_genotype_probs = parse_genotype_probs;
+        job.min_base_prob = min_base_prob;
+        job.tabixdir = tabixdir.c_str();
+        job.keep_inds = &keep_inds;
+        job.sites = file_sites[i];
+        job.result = false;
+        queue.jobs.push_back(job);
+    }
+
+    // the caller acts as one of the threads
+    vector<pthread_t> workers;
+    for (int i=0; i < min(nthreads, nfiles) - 1; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, read_vcf_worker, &queue) != 0)
+            break;
+        workers.push_back(worker);
     }
+    read_vcf_worker(&queue);
+    for (unsigned int i=0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&queue.lock);
+
+    bool ok = true;
+    for (int i=0; i < nfiles; i++) {
+        if (ok)
+            ok = queue.jobs[i].result && (i == 0 || sites->merge(*file_sites[i]));
+        if (i > 0)
+            delete file_sites[i];
+    }
+    if (!ok)
+        return false;
+
     // need to remove REF
     vector<int> keep;
     for (int i=0; i < sites->get_num_seqs(); i++) {
@@ -958,11 +1290,11 @@ int Sites::subset(vector<int> keep) {
     }
     vector<int> new_positions;
     vector<char*> new_cols;
-    vector<vector<BaseProbs> > new_base_probs;
+    BaseProbsTable new_base_probs;
     for (unsigned int i=0; i < positions.size(); i++) {
         char *tmp = new char[keep.size()+1];
         bool variant=false;
-        vector<BaseProbs> bp;
+        PackedBaseProbs bp;
         for (unsigned int j=0; j < keep.size(); j++) {
             tmp[j] = cols[i][keep[j]];
             if (have_base_probs) {
@@ -1145,7 +1477,7 @@ bool Sites::merge(const Sites &other) {
 
     vector<int> old_positions = positions;
     vector<char*> old_cols = cols;
-    vector<vector<BaseProbs> > old_base_probs = base_probs;
+    BaseProbsTable old_base_probs = base_probs;
     bool have_base_probs=false;
     if (old_base_probs.size() > 0 || other.base_probs.size() > 0)  {
         if ((int)old_base_probs.size() != old_num_sites ||
@@ -1163,10 +1495,10 @@ bool Sites::merge(const Sites &other) {
     int num_seq = names.size();
     char col[num_seq + 1];
     col[num_seq] = '\0';
-    vector<BaseProbs>bp;
+    PackedBaseProbs bp;
     while (i1 < old_num_sites || i2 < other_num_sites) {
         int pos=-1;
-        bp.clear();
+        bp = PackedBaseProbs();
         if (i1 == old_num_sites ||
             (i2 < other_num_sites && other.positions[i2] < old_positions[i1])) {
             // next site is from "other"
@@ -1324,7 +1656,7 @@ void apply_mask_sequences(Sequences *sequences,
             for (int j=0; j < num_mask; j++) {
                 sequences->seqs[maskind[j]][i] = maskchar;
                 if (have_base_probs)
-                    sequences->base_probs[maskind[j]][i].set_mask();
+                    sequences->base_probs[maskind[j]].set(i, BaseProbs('N'));
             }
         }
     }
@@ -1393,7 +1725,8 @@ void apply_mask_sites(Sites *sites,
                 for (int j=0; j < num_mask; j++) {
                     sites->cols[last_pos][maskind[j]] = maskchar;
                     if (have_base_probs)
-                        sites->base_probs[last_pos][maskind[j]].set_mask();
+                        sites->base_probs[last_pos].set(maskind[j],
+                                                        BaseProbs('N'));
                 }
             }
             last_mask_pos = i;
@@ -1436,7 +1769,7 @@ void make_sites_from_sequences(const Sequences *sequences, Sites *sites)
             col[j] = seqs[j][i];
         sites->append(i, col);
         if (have_base_probs) {
-            vector<BaseProbs> bp;
+            PackedBaseProbs bp;
             for (int j=0; j < nseqs; j++)
                 bp.push_back(sequences->base_probs[j][i]);
             sites->base_probs.push_back(bp);
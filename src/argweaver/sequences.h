@@ -12,6 +12,8 @@
 #define ARGWEAVER_SEQUENCES_H
 
 // c++ includes
+#include <math.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <map>
@@ -71,19 +73,23 @@ class BaseProbs
     // in VCF 4.2 specification is that PL is integers
     void set_by_pl(const char refAllele, const char altAllele,
                    const string &pl, int hap_id) {
-        assert(hap_id == 0 || hap_id == 1);
-        for (int i=0; i < 4; i++) prob[i]=0.0;
-        vector<string> pl_score_strings;
         double pl_scores[3];
-        split(pl.c_str(), ",", pl_score_strings);
-        if (pl_score_strings.size() != 3) {
+        if (!parse_scores(pl.c_str(), pl_scores, 3)) {
             printError("Error parsing PL string %s\n", pl.c_str());
             assert(0);
         }
+        set_by_pl(refAllele, altAllele, pl_scores, hap_id);
+    }
+
+    // same as above with the three scores already parsed
+    void set_by_pl(const char refAllele, const char altAllele,
+                   const double pl[3], int hap_id) {
+        assert(hap_id == 0 || hap_id == 1);
+        for (int i=0; i < 4; i++) prob[i]=0.0;
+        double pl_scores[3];
         double sum=0.0;
         for (int i=0; i < 3; i++) {
-            pl_scores[i] = atof(pl_score_strings[i].c_str());
-            pl_scores[i] = pow(10, -pl_scores[i]/10.0);
+            pl_scores[i] = pow(10, -pl[i]/10.0);
             sum += pl_scores[i];
         }
         int refNum = dna2int[(int)refAllele];
@@ -108,19 +114,21 @@ class BaseProbs
     }
 
     void set_by_pp(const string &pp, int hap_id) {
-        assert(hap_id == 0 || hap_id == 1);
-        for (int i=0; i < 4; i++) prob[i]=0.0;
-        vector<string> pp_score_strings;
         double pp_scores[10];
-        split(pp.c_str(), ",", pp_score_strings);
-        if (pp_score_strings.size() != 10) {
+        if (!parse_scores(pp.c_str(), pp_scores, 10)) {
             printError("Error parsing PP string %s\n", pp.c_str());
             assert(0);
         }
+        set_by_pp(pp_scores, hap_id);
+    }
+
+    void set_by_pp(const double pp[10], int hap_id) {
+        assert(hap_id == 0 || hap_id == 1);
+        for (int i=0; i < 4; i++) prob[i]=0.0;
+        double pp_scores[10];
         double sum=0.0;
         for (int i=0; i < 10; i++) {
-            pp_scores[i] = atof(pp_score_strings[i].c_str());
-            pp_scores[i] = pow(10, -pp_scores[i]/10.0);
+            pp_scores[i] = pow(10, -pp[i]/10.0);
             sum += pp_scores[i];
         }
         // pp_score is given for genotypes:
@@ -131,6 +139,21 @@ class BaseProbs
             prob[dna2int[(int)alleles[i]]] += pp_scores[i] / sum;
     }
 
+    // Parses a comma-separated list of exactly n scores (as atof() would)
+    static bool parse_scores(const char *str, double *scores, int n) {
+        int count = 0;
+        while (true) {
+            if (count < n)
+                scores[count] = atof(str);
+            count++;
+            str = strchr(str, ',');
+            if (!str)
+                break;
+            str++;
+        }
+        return count == n;
+    }
+
     double maxProb() {
         double rv = prob[0];
         for (int i=1; i < 4; i++)
@@ -177,6 +200,165 @@ class BaseProbs
 };
 
 
+// A sequence of BaseProbs stored compactly.  Most entries are either
+// a certain base or masked ('N'), and these only take their 2-bit base
+// code and a bit in the mask bitplane.  The probabilities of the other
+// (uncertain) entries are stored as 16-bit floats, in order, and found by
+// counting the uncertain entries before them.  This is about 3.5 bits per
+// certain entry and 12 bytes per uncertain one, instead of 32 bytes.
+// Stored probabilities have a relative error of at most about 5e-4, and
+// nonzero ones below the smallest half (~6e-8, a PL of about 72) are
+// stored as that value, so no allele with positive probability becomes
+// impossible.
+//
+// Entries are returned by value; use set() to change one.
+class PackedBaseProbs
+{
+public:
+    PackedBaseProbs() : len(0) {}
+
+    explicit PackedBaseProbs(const vector<BaseProbs> &probs) : len(0)
+    {
+        reserve(probs.size());
+        for (unsigned int i=0; i<probs.size(); i++)
+            push_back(probs[i]);
+    }
+
+    inline int size() const {
+        return len;
+    }
+
+    inline const BaseProbs operator[](int i) const
+    {
+        BaseProbs bp;
+        const uint64_t bit = uint64_t(1) << (i & 63);
+        if (mask[i >> 6] & bit) {
+            bp.set_mask();
+        } else if (uncertain[i >> 6] & bit) {
+            const uint16_t *p = &probs[4 * uncertain_rank(i)];
+            for (int k=0; k<4; k++)
+                bp.prob[k] = half_to_double(p[k]);
+        } else {
+            const int base = (bases[i >> 5] >> (2 * (i & 31))) & 3;
+            for (int k=0; k<4; k++)
+                bp.prob[k] = 0.0;
+            bp.prob[base] = 1.0;
+        }
+        return bp;
+    }
+
+    void reserve(int n);
+    void push_back(const BaseProbs &bp);
+    void set(int i, const BaseProbs &bp);
+
+    // exchange entry i with entry i of 'other' (used for phase switches)
+    void swap(int i, PackedBaseProbs &other);
+
+    // entries [start, end) as a new sequence
+    PackedBaseProbs slice(int start, int end) const;
+
+    // number of entries with stored probabilities
+    int get_num_uncertain() const {
+        return probs.size() / 4;
+    }
+
+    // bytes used by the entries
+    size_t get_nbytes() const {
+        return (bases.capacity() + mask.capacity() + uncertain.capacity()) *
+            sizeof(uint64_t) + rank.capacity() * sizeof(uint32_t) +
+            probs.capacity() * sizeof(uint16_t);
+    }
+
+    static uint16_t double_to_half(double x);
+
+    static inline double half_to_double(uint16_t h) {
+        const int exp = (h >> 10) & 0x1f;
+        const int mant = h & 0x3ff;
+        if (exp == 0)
+            return ldexp(double(mant), -24);
+        return ldexp(double(mant | 0x400), exp - 25);
+    }
+
+protected:
+    // uncertain entries before entry i
+    inline int uncertain_rank(int i) const {
+        const uint64_t before = (uint64_t(1) << (i & 63)) - 1;
+        return rank[i >> 6] + __builtin_popcountll(uncertain[i >> 6] & before);
+    }
+
+    void add_slot(int i);
+
+    int len;
+    vector<uint64_t> bases;      // 2-bit base codes, 32 per word
+    vector<uint64_t> mask;       // masked entries
+    vector<uint64_t> uncertain;  // entries with stored probabilities
+    vector<uint32_t> rank;       // uncertain entries before each word
+    vector<uint16_t> probs;      // 4 probabilities per uncertain entry
+};
+
+
+// base probabilities of each sequence (or of each site for Sites)
+typedef vector<PackedBaseProbs> BaseProbsTable;
+
+
+// Read-only view of some rows of a BaseProbsTable, starting at a column
+// offset.  view[j][i] is table[rows[j]][offset + i], so the emission
+// functions can read the probabilities of a block without copying them.
+// An empty view (size() == 0) means there are no base probabilities.
+class BaseProbsView
+{
+public:
+    class Row
+    {
+    public:
+        Row(const PackedBaseProbs *row, int offset) :
+            row(row), offset(offset) {}
+
+        inline const BaseProbs operator[](int i) const {
+            return (*row)[offset + i];
+        }
+
+    protected:
+        const PackedBaseProbs *row;
+        int offset;
+    };
+
+    BaseProbsView() :
+        table(NULL), rows(NULL), nrows(0), offset(0) {}
+
+    // all rows of 'table' if 'rows' is NULL
+    BaseProbsView(const BaseProbsTable &table, const int *rows=NULL,
+                  int nrows=0, int offset=0) :
+        table(&table), rows(rows),
+        nrows(table.size() == 0 ? 0 : (rows ? nrows : int(table.size()))),
+        offset(offset) {}
+
+    inline int size() const {
+        return nrows;
+    }
+
+    inline Row operator[](int j) const {
+        return Row(&(*table)[rows ? rows[j] : j], offset);
+    }
+
+    // View whose row j is row order[j] of this view.  'buf' holds the
+    // row indexes of the new view and must outlive it.
+    BaseProbsView reorder(const int *order, int *buf) const {
+        if (nrows == 0)
+            return BaseProbsView();
+        for (int j=0; j<nrows; j++)
+            buf[j] = rows ? rows[order[j]] : order[j];
+        return BaseProbsView(*table, buf, nrows, offset);
+    }
+
+protected:
+    const BaseProbsTable *table;
+    const int *rows;
+    int nrows;
+    int offset;
+};
+
+
  // The alignment of sequences
 class Sequences
 {
@@ -218,9 +400,9 @@ public:
         }
 	ages = sequences->ages;
         if (sequences->base_probs.size() > 0) {
-            for (int i=0; i < (int)base_probs.size(); i++) {
-                base_probs.push_back(sequences->base_probs[i]);
-            }
+            for (int i=0; i < nseqs; i++)
+                base_probs.push_back(sequences->base_probs[i].slice(
+                    offset, offset + seqlen));
         }
     }
 
@@ -294,7 +476,7 @@ public:
             else assert(bp.size() == 0);
         }
         seqs.push_back(seq);
-        if (bp.size() > 0) base_probs.push_back(bp);
+        if (bp.size() > 0) base_probs.push_back(PackedBaseProbs(bp));
         names.push_back(name);
         pops.push_back(pop);
 	if (pairs.size() > 0) pairs.push_back(-1);
@@ -375,9 +557,7 @@ public:
       seqs[seq1][coord] = seqs[seq2][coord];
       seqs[seq2][coord] = tmp;
       if (base_probs.size() > 0) {
-          BaseProbs tmp = base_probs[seq1][coord];
-          base_probs[seq1][coord] = base_probs[seq2][coord];
-          base_probs[seq2][coord] = tmp;
+          base_probs[seq1].swap(coord, base_probs[seq2]);
       }
     }
 
@@ -398,7 +578,7 @@ public:
     vector <bool> non_singleton_snp;  //true if snp w frequency > 1
     vector <int> ages; // set to non-zero for ancient samples
     vector <double> real_ages;
-    vector<vector<BaseProbs> > base_probs;
+    BaseProbsTable base_probs;  // one row per sequence (optional)
 
 protected:
     int seqlen;
@@ -480,7 +660,7 @@ public:
         for (int i=0; i < n; i++) col[i] = 'N';
         cols.push_back(col);
         if (have_base_probs) {
-            vector<BaseProbs> bp;
+            PackedBaseProbs bp;
             for (int i=0; i < n; i++)
                 bp.push_back(BaseProbs('N'));
             base_probs.push_back(bp);
@@ -552,7 +732,7 @@ public:
     vector<int> pops;
     vector<int> positions;
     vector<char*> cols;
-    vector<vector<BaseProbs> > base_probs;
+    BaseProbsTable base_probs;  // one row per site (optional)
 };
 
 
@@ -720,7 +900,8 @@ bool read_vcf(const string filename, Sites *sites, const string region,
 bool read_vcfs(const vector<string> filenames, Sites* sites, const string region,
                double min_qual, const string genotype_filter,
                bool parse_genotype_probs, double min_base_prob,
-               const string tabixdir, set<string> keep_inds=set<string>());
+               const string tabixdir, set<string> keep_inds=set<string>(),
+               int nthreads=1);
 void make_sequences_from_sites(const Sites *sites, Sequences *sequencess,
                                char default_char='A');
 void make_sites_from_sequences(const Sequences *sequences, Sites *sites);
@@ -0,0 +1,438 @@
+//=============================================================================
+// Vectorized kernels for the threading HMM
+
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_X86_SIMD
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// scalar kernels
+
+static void fw_matvec_scalar(const double *mat, int ld, int nrows, int ncols,
+                             const double *vec, double *out)
+{
+    for (int r=0; r<nrows; r++)
+        out[r] = 0.0;
+    for (int c=0; c<ncols; c++) {
+        const double v = vec[c];
+        if (v == 0.0)
+            continue;
+        const double *col = &mat[c * ld];
+        for (int r=0; r<nrows; r++)
+            out[r] += col[r] * v;
+    }
+}
+
+
+static double fw_emit_sum_scalar(double *col, const double *emit, int n)
+{
+    double sum = 0.0;
+    for (int k=0; k<n; k++) {
+        col[k] *= emit[k];
+        sum += col[k];
+    }
+    return sum;
+}
+
+
+static void fw_normalize_scalar(double *col, int n, double norm)
+{
+    for (int k=0; k<n; k++)
+        col[k] /= norm;
+}
+
+
+//=============================================================================
+// emission kernels
+//
+// The generic kernels are always inlined into one wrapper per instruction
+// set, so that the compiler vectorizes the lane loops for each of them.
+
+#define EMIT_INLINE static inline __attribute__((always_inline))
+
+
+// p = P(x) for one branch
+EMIT_INLINE void emit_branch_generic(const double *x, double mut,
+                                     double nomut, double *p)
+{
+    const int L = EMIT_LANES;
+    const double diff = nomut - mut;
+    double sum[L];
+    for (int l=0; l<L; l++)
+        sum[l] = mut * ((x[l] + x[L+l]) + (x[2*L+l] + x[3*L+l]));
+    for (int a=0; a<4; a++)
+        for (int l=0; l<L; l++)
+            p[a*L+l] = sum[l] + diff * x[a*L+l];
+}
+
+
+EMIT_INLINE void emit_prune_generic(
+    const double *x, double mutx, double nomutx,
+    const double *y, double muty, double nomuty, double *out)
+{
+    if (!y) {
+        emit_branch_generic(x, mutx, nomutx, out);
+        return;
+    }
+
+    double px[EMIT_PACK], py[EMIT_PACK];
+    emit_branch_generic(x, mutx, nomutx, px);
+    emit_branch_generic(y, muty, nomuty, py);
+    for (int k=0; k<EMIT_PACK; k++)
+        out[k] = px[k] * py[k];
+}
+
+
+EMIT_INLINE void emit_join_generic(const double *x, const double *y,
+                                   const double *z, const double *mut,
+                                   const double *nomut, double *lk)
+{
+    const int L = EMIT_LANES;
+    double px[EMIT_PACK], py[EMIT_PACK];
+    emit_branch_generic(x, mut[0], nomut[0], px);
+    emit_branch_generic(y, mut[1], nomut[1], py);
+    for (int k=0; k<EMIT_PACK; k++)
+        px[k] *= py[k];
+    if (z) {
+        emit_branch_generic(z, mut[2], nomut[2], py);
+        for (int k=0; k<EMIT_PACK; k++)
+            px[k] *= py[k];
+    }
+    for (int l=0; l<L; l++)
+        lk[l] = ((px[l] + px[L+l]) + (px[2*L+l] + px[3*L+l])) * .25;
+}
+
+
+static void emit_prune_scalar(const double *x, double mutx, double nomutx,
+                              const double *y, double muty, double nomuty,
+                              double *out)
+{
+    emit_prune_generic(x, mutx, nomutx, y, muty, nomuty, out);
+}
+
+
+static void emit_join_scalar(const double *x, const double *y,
+                             const double *z, const double *mut,
+                             const double *nomut, double *lk)
+{
+    emit_join_generic(x, y, z, mut, nomut, lk);
+}
+
+
+#ifdef ARGWEAVER_X86_SIMD
+
+__attribute__((target("avx2")))
+static void emit_prune_avx2(const double *x, double mutx, double nomutx,
+                            const double *y, double muty, double nomuty,
+                            double *out)
+{
+    emit_prune_generic(x, mutx, nomutx, y, muty, nomuty, out);
+}
+
+
+__attribute__((target("avx2")))
+static void emit_join_avx2(const double *x, const double *y,
+                           const double *z, const double *mut,
+                           const double *nomut, double *lk)
+{
+    emit_join_generic(x, y, z, mut, nomut, lk);
+}
+
+
+__attribute__((target("avx512f")))
+static void emit_prune_avx512(const double *x, double mutx, double nomutx,
+                              const double *y, double muty, double nomuty,
+                              double *out)
+{
+    emit_prune_generic(x, mutx, nomutx, y, muty, nomuty, out);
+}
+
+
+__attribute__((target("avx512f")))
+static void emit_join_avx512(const double *x, const double *y,
+                             const double *z, const double *mut,
+                             const double *nomut, double *lk)
+{
+    emit_join_generic(x, y, z, mut, nomut, lk);
+}
+
+#endif // ARGWEAVER_X86_SIMD
+
+
+//=============================================================================
+// AVX2 kernels
+
+#ifdef ARGWEAVER_X86_SIMD
+
+__attribute__((target("avx2")))
+static void fw_matvec_avx2(const double *mat, int ld, int nrows, int ncols,
+                           const double *vec, double *out)
+{
+    // rows beyond nrows (up to ld) are padding and may be overwritten
+    const int nrows4 = (nrows + 3) & ~3;
+    for (int r=0; r<nrows4; r+=4)
+        _mm256_storeu_pd(&out[r], _mm256_setzero_pd());
+
+    for (int c=0; c<ncols; c++) {
+        const double v = vec[c];
+        if (v == 0.0)
+            continue;
+        const __m256d vv = _mm256_set1_pd(v);
+        const double *col = &mat[c * ld];
+        for (int r=0; r<nrows4; r+=4) {
+            __m256d x = _mm256_mul_pd(_mm256_loadu_pd(&col[r]), vv);
+            _mm256_storeu_pd(&out[r],
+                             _mm256_add_pd(_mm256_loadu_pd(&out[r]), x));
+        }
+    }
+}
+
+
+__attribute__((target("avx2")))
+static double fw_emit_sum_avx2(double *col, const double *emit, int n)
+{
+    __m256d acc = _mm256_setzero_pd();
+    int k = 0;
+    for (; k+4<=n; k+=4) {
+        __m256d x = _mm256_mul_pd(_mm256_loadu_pd(&col[k]),
+                                  _mm256_loadu_pd(&emit[k]));
+        _mm256_storeu_pd(&col[k], x);
+        acc = _mm256_add_pd(acc, x);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; k<n; k++) {
+        col[k] *= emit[k];
+        sum += col[k];
+    }
+    return sum;
+}
+
+
+__attribute__((target("avx2")))
+static void fw_normalize_avx2(double *col, int n, double norm)
+{
+    const __m256d vnorm = _mm256_set1_pd(norm);
+    int k = 0;
+    for (; k+4<=n; k+=4)
+        _mm256_storeu_pd(&col[k],
+                         _mm256_div_pd(_mm256_loadu_pd(&col[k]), vnorm));
+    for (; k<n; k++)
+        col[k] /= norm;
+}
+
+
+//=============================================================================
+// AVX-512 kernels
+
+__attribute__((target("avx512f")))
+static void fw_matvec_avx512(const double *mat, int ld, int nrows, int ncols,
+                             const double *vec, double *out)
+{
+    // rows beyond nrows (up to ld) are padding and may be overwritten
+    const int nrows8 = (nrows + 7) & ~7;
+    for (int r=0; r<nrows8; r+=8)
+        _mm512_storeu_pd(&out[r], _mm512_setzero_pd());
+
+    for (int c=0; c<ncols; c++) {
+        const double v = vec[c];
+        if (v == 0.0)
+            continue;
+        const __m512d vv = _mm512_set1_pd(v);
+        const double *col = &mat[c * ld];
+        for (int r=0; r<nrows8; r+=8)
+            _mm512_storeu_pd(&out[r], _mm512_fmadd_pd(
+                _mm512_loadu_pd(&col[r]), vv, _mm512_loadu_pd(&out[r])));
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static double fw_emit_sum_avx512(double *col, const double *emit, int n)
+{
+    __m512d acc = _mm512_setzero_pd();
+    int k = 0;
+    for (; k+8<=n; k+=8) {
+        __m512d x = _mm512_mul_pd(_mm512_loadu_pd(&col[k]),
+                                  _mm512_loadu_pd(&emit[k]));
+        _mm512_storeu_pd(&col[k], x);
+        acc = _mm512_add_pd(acc, x);
+    }
+
+    double lanes[8];
+    _mm512_storeu_pd(lanes, acc);
+    double sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+        ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (; k<n; k++) {
+        col[k] *= emit[k];
+        sum += col[k];
+    }
+    return sum;
+}
+
+
+__attribute__((target("avx512f")))
+static void fw_normalize_avx512(double *col, int n, double norm)
+{
+    const __m512d vnorm = _mm512_set1_pd(norm);
+    int k = 0;
+    for (; k+8<=n; k+=8)
+        _mm512_storeu_pd(&col[k],
+                         _mm512_div_pd(_mm512_loadu_pd(&col[k]), vnorm));
+    for (; k<n; k++)
+        col[k] /= norm;
+}
+
+#endif // ARGWEAVER_X86_SIMD
+
+
+//=============================================================================
+// runtime dispatch
+
+typedef void (*MatvecFunc)(const double *, int, int, int,
+                           const double *, double *);
+typedef double (*EmitSumFunc)(double *, const double *, int);
+typedef void (*NormalizeFunc)(double *, int, double);
+typedef void (*EmitPruneFunc)(const double *, double, double,
+                              const double *, double, double, double *);
+typedef void (*EmitJoinFunc)(const double *, const double *, const double *,
+                             const double *, const double *, double *);
+
+static int g_simd_level = SIMD_SCALAR;
+static MatvecFunc g_matvec = fw_matvec_scalar;
+static EmitSumFunc g_emit_sum = fw_emit_sum_scalar;
+static NormalizeFunc g_normalize = fw_normalize_scalar;
+static EmitPruneFunc g_emit_prune = emit_prune_scalar;
+static EmitJoinFunc g_emit_join = emit_join_scalar;
+
+// select the best kernels before main() runs
+static int g_simd_init = set_simd_level(SIMD_AUTO);
+
+
+int detect_simd_level()
+{
+#ifdef ARGWEAVER_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+
+int set_simd_level(int level)
+{
+    const int best = detect_simd_level();
+    if (level == SIMD_AUTO || level > best)
+        level = best;
+
+    g_simd_level = level;
+    switch (level) {
+#ifdef ARGWEAVER_X86_SIMD
+    case SIMD_AVX512:
+        g_matvec = fw_matvec_avx512;
+        g_emit_sum = fw_emit_sum_avx512;
+        g_normalize = fw_normalize_avx512;
+        g_emit_prune = emit_prune_avx512;
+        g_emit_join = emit_join_avx512;
+        break;
+    case SIMD_AVX2:
+        g_matvec = fw_matvec_avx2;
+        g_emit_sum = fw_emit_sum_avx2;
+        g_normalize = fw_normalize_avx2;
+        g_emit_prune = emit_prune_avx2;
+        g_emit_join = emit_join_avx2;
+        break;
+#endif
+    default:
+        g_simd_level = SIMD_SCALAR;
+        g_matvec = fw_matvec_scalar;
+        g_emit_sum = fw_emit_sum_scalar;
+        g_normalize = fw_normalize_scalar;
+        g_emit_prune = emit_prune_scalar;
+        g_emit_join = emit_join_scalar;
+    }
+
+    return g_simd_level;
+}
+
+
+int get_simd_level()
+{
+    return g_simd_level;
+}
+
+
+const char *simd_level_name(int level)
+{
+    switch (level) {
+    case SIMD_AUTO:   return "auto";
+    case SIMD_SCALAR: return "scalar";
+    case SIMD_AVX2:   return "avx2";
+    case SIMD_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+
+bool parse_simd_level(const char *name, int *level)
+{
+    const int levels[] = {SIMD_AUTO, SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+    for (unsigned int i=0; i<sizeof(levels)/sizeof(levels[0]); i++) {
+        if (strcmp(name, simd_level_name(levels[i])) == 0) {
+            *level = levels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void fw_matvec(const double *mat, int ld, int nrows, int ncols,
+               const double *vec, double *out)
+{
+    g_matvec(mat, ld, nrows, ncols, vec, out);
+}
+
+
+double fw_emit_sum(double *col, const double *emit, int n)
+{
+    return g_emit_sum(col, emit, n);
+}
+
+
+void fw_normalize(double *col, int n, double norm)
+{
+    g_normalize(col, n, norm);
+}
+
+
+
+void emit_prune(const double *x, double mutx, double nomutx,
+                const double *y, double muty, double nomuty, double *out)
+{
+    g_emit_prune(x, mutx, nomutx, y, muty, nomuty, out);
+}
+
+
+void emit_join(const double *x, const double *y, const double *z,
+               const double *mut, const double *nomut, double *lk)
+{
+    g_emit_join(x, y, z, mut, nomut, lk);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,98 @@
+//=============================================================================
+// Vectorized kernels for the threading HMM
+//
+// The kernels below are selected once at runtime according to the
+// instruction sets supported by the CPU (AVX-512, AVX2 or plain scalar
+// code).  The scalar kernels perform their arithmetic in exactly the same
+// order as the original loops in arghmm_forward_block, so results are
+// bit-identical when the scalar level is chosen.  The vector kernels only
+// reorder the column normalization sum and may use fused multiply-adds,
+// so they agree with the scalar kernels up to rounding.
+//
+// The emission code keeps its original per-site loops at the scalar level
+// and only switches to the packed emission kernels below for the vector
+// levels, which again agree with the per-site loops up to rounding.
+
+#ifndef ARGWEAVER_SIMD_H
+#define ARGWEAVER_SIMD_H
+
+
+namespace argweaver {
+
+enum SimdLevel {
+    SIMD_AUTO = -1,
+    SIMD_SCALAR = 0,
+    SIMD_AVX2 = 1,
+    SIMD_AVX512 = 2
+};
+
+
+// Returns the best SIMD level supported by the running CPU.
+int detect_simd_level();
+
+// Select the kernels to use.  If the requested level is not supported by
+// the CPU, the best supported level below it is used instead.  Returns the
+// level that was actually selected.
+int set_simd_level(int level);
+
+// Returns the currently selected SIMD level.
+int get_simd_level();
+
+// Returns a human readable name of a SIMD level.
+const char *simd_level_name(int level);
+
+// Parse a SIMD level name ("auto", "scalar", "avx2", "avx512").
+// Returns false if the name is not recognized.
+bool parse_simd_level(const char *name, int *level);
+
+// Round 'n' up to the vector padding used by the kernels.  Matrices passed
+// to fw_matvec() should use a leading dimension padded this way.
+inline int simd_pad(int n)
+{
+    return (n + 7) & ~7;
+}
+
+
+// Dense matrix-vector product with a column-major matrix:
+//   out[r] = sum_c mat[c*ld + r] * vec[c]   for r in [0, nrows)
+// The sum for each row is accumulated in order of increasing c.
+void fw_matvec(const double *mat, int ld, int nrows, int ncols,
+               const double *vec, double *out);
+
+// Multiply a forward column by its emissions and return the column sum:
+//   col[k] *= emit[k];  return sum_k col[k]
+double fw_emit_sum(double *col, const double *emit, int n);
+
+// Divide a forward column by its normalization constant.
+void fw_normalize(double *col, int n, double norm);
+
+
+//=============================================================================
+// Emission kernels
+//
+// The emission kernels work on packs of EMIT_LANES sites.  The partial
+// likelihoods of one node for a pack store the 4 bases one after another,
+// each as a row of EMIT_LANES sites: lk[base * EMIT_LANES + lane].
+// Since the mutation matrix only has two distinct entries, carrying a
+// partial likelihood 'x' along a branch reduces to
+//   P(x)[a] = mut * sum_b x[b] + (nomut - mut) * x[a]
+
+const int EMIT_LANES = 8;
+const int EMIT_PACK = 4 * EMIT_LANES;
+
+// Partial likelihood of a parent from two branches:
+//   out = P(x) * P(y)
+// If 'y' is NULL only the first branch is used: out = P(x)
+void emit_prune(const double *x, double mutx, double nomutx,
+                const double *y, double muty, double nomuty, double *out);
+
+// Likelihood of each site of a pack when joining three branches at a node:
+//   lk[lane] = sum_a P(x)[a] * P(y)[a] * P(z)[a] * .25
+// If 'z' is NULL only the first two branches are used.
+void emit_join(const double *x, const double *y, const double *z,
+               const double *mut, const double *nomut, double *lk);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_SIMD_H
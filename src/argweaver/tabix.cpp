@@ -1,6 +1,15 @@
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
 #include <string>
+#include <vector>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <zlib.h>
 
 #include "tabix.h"
 #include "parsing.h"
@@ -11,6 +20,670 @@ namespace argweaver {
 using namespace std;
 
 
+//=============================================================================
+// tabix indexes
+//
+// Region queries are answered from the .tbi or .csi index of a BGZF file
+// without running tabix.  Open files and their indexes are kept, so that
+// repeated queries of the same file only read the blocks of each region.
+
+
+// a file offset in BGZF: compressed block offset << 16 | offset in block
+typedef uint64_t VirtualOffset;
+
+struct TabixChunk {
+    VirtualOffset beg;
+    VirtualOffset end;
+
+    bool operator<(const TabixChunk &other) const {
+        return beg < other.beg;
+    }
+};
+
+
+// Reads a whole BGZF (or gzip) file into memory.
+static bool read_gzip_file(const char *filename, string &data)
+{
+    gzFile file = gzopen(filename, "rb");
+    if (!file)
+        return false;
+    char buf[1 << 16];
+    int n;
+    while ((n = gzread(file, buf, sizeof(buf))) > 0)
+        data.append(buf, n);
+    gzclose(file);
+    return n == 0;
+}
+
+
+// Little-endian reader for index files.
+class IndexReader
+{
+public:
+    IndexReader(const string &data) : error(false), data(data), pos(0) {}
+
+    int32_t read_int32() {
+        return int32_t(read_uint(4));
+    }
+    uint32_t read_uint32() {
+        return uint32_t(read_uint(4));
+    }
+    uint64_t read_uint64() {
+        return read_uint(8);
+    }
+    string read_bytes(size_t n) {
+        if (n > data.size() - pos) {
+            error = true;
+            pos = data.size();
+            return string();
+        }
+        pos += n;
+        return data.substr(pos - n, n);
+    }
+    bool error;
+
+protected:
+    uint64_t read_uint(int nbytes) {
+        if (pos + nbytes > data.size()) {
+            error = true;
+            pos = data.size();
+            return 0;
+        }
+        uint64_t x = 0;
+        for (int i=nbytes-1; i>=0; i--)
+            x = (x << 8) | (unsigned char) data[pos + i];
+        pos += nbytes;
+        return x;
+    }
+
+    const string &data;
+    size_t pos;
+};
+
+
+class TabixIndex
+{
+public:
+    // tabix column formats
+    enum {
+        FORMAT_GENERIC = 0,
+        FORMAT_SAM = 1,
+        FORMAT_VCF = 2,
+        FORMAT_UCSC = 0x10000
+    };
+
+    TabixIndex() :
+        min_shift(14),
+        depth(5)
+    {}
+
+    bool read(const char *filename, bool csi)
+    {
+        string data;
+        if (!read_gzip_file(filename, data))
+            return false;
+        IndexReader reader(data);
+
+        string magic = reader.read_bytes(4);
+        if (magic != (csi ? string("CSI\1") : string("TBI\1")))
+            return false;
+        if (csi) {
+            min_shift = reader.read_int32();
+            depth = reader.read_int32();
+            int32_t l_aux = reader.read_int32();
+            string aux = reader.read_bytes(l_aux);
+            IndexReader aux_reader(aux);
+            if (l_aux < 28 || !read_header(aux_reader))
+                return false;
+            int32_t nrefs = reader.read_int32();
+            if (nrefs != int32_t(names.size()))
+                return false;
+        } else {
+            int32_t nrefs = reader.read_int32();
+            if (!read_header(reader) || nrefs != int32_t(names.size()))
+                return false;
+        }
+
+        const unsigned int pseudo_bin = ((1 << ((depth + 1) * 3)) - 1) / 7
+            + 1;
+        bins.resize(names.size());
+        linear.resize(names.size());
+        for (unsigned int i=0; i<names.size(); i++) {
+            int32_t nbins = reader.read_int32();
+            for (int32_t j=0; j<nbins && !reader.error; j++) {
+                uint32_t bin = reader.read_uint32();
+                if (csi)
+                    reader.read_uint64();  // loffset
+                int32_t nchunks = reader.read_int32();
+                vector<TabixChunk> chunks(max(nchunks, 0));
+                for (int32_t k=0; k<nchunks; k++) {
+                    chunks[k].beg = reader.read_uint64();
+                    chunks[k].end = reader.read_uint64();
+                }
+                if (bin != pseudo_bin)
+                    bins[i][bin].swap(chunks);
+            }
+            if (!csi) {
+                int32_t nintervals = reader.read_int32();
+                linear[i].resize(max(nintervals, 0));
+                for (int32_t j=0; j<nintervals; j++)
+                    linear[i][j] = reader.read_uint64();
+            }
+        }
+        return !reader.error;
+    }
+
+    // Chunks that may contain records of [beg, end) on reference 'tid',
+    // sorted and merged.
+    void query(int tid, int beg, int end, vector<TabixChunk> &chunks) const
+    {
+        chunks.clear();
+        if (tid < 0 || tid >= int(bins.size()) || beg >= end)
+            return;
+
+        // no record of the region starts before this offset
+        VirtualOffset min_offset = 0;
+        const vector<VirtualOffset> &intervals = linear[tid];
+        if (intervals.size() > 0) {
+            unsigned int i = beg >> min_shift;
+            min_offset = (i < intervals.size() ? intervals[i] :
+                          intervals.back());
+        }
+
+        // bins overlapping the region at each level
+        const map<unsigned int, vector<TabixChunk> > &ref_bins = bins[tid];
+        const int64_t last = int64_t(end) - 1;
+        unsigned int offset = 0;
+        for (int level=0, shift=min_shift + depth * 3; level<=depth;
+             level++, shift-=3) {
+            const unsigned int first_bin = offset + (beg >> shift);
+            const unsigned int last_bin = offset + (last >> shift);
+            map<unsigned int, vector<TabixChunk> >::const_iterator it =
+                ref_bins.lower_bound(first_bin);
+            for (; it != ref_bins.end() && it->first <= last_bin; ++it) {
+                for (unsigned int k=0; k<it->second.size(); k++)
+                    if (it->second[k].end > min_offset)
+                        chunks.push_back(it->second[k]);
+            }
+            offset += 1 << (level * 3);
+        }
+
+        sort(chunks.begin(), chunks.end());
+        unsigned int n = 0;
+        for (unsigned int i=0; i<chunks.size(); i++) {
+            if (n > 0 && chunks[i].beg <= chunks[n-1].end)
+                chunks[n-1].end = max(chunks[n-1].end, chunks[i].end);
+            else
+                chunks[n++] = chunks[i];
+        }
+        chunks.resize(n);
+    }
+
+    int get_tid(const string &name) const {
+        map<string, int>::const_iterator it = tids.find(name);
+        return it == tids.end() ? -1 : it->second;
+    }
+
+    int format;
+    int col_seq;
+    int col_beg;
+    int col_end;
+    char meta;
+    int skip;
+    vector<string> names;
+
+protected:
+    bool read_header(IndexReader &reader)
+    {
+        format = reader.read_int32();
+        col_seq = reader.read_int32();
+        col_beg = reader.read_int32();
+        col_end = reader.read_int32();
+        meta = char(reader.read_int32());
+        skip = reader.read_int32();
+        int32_t len = reader.read_int32();
+        string buf = reader.read_bytes(max(len, 0));
+        if (reader.error)
+            return false;
+
+        for (size_t start=0; start<buf.size(); ) {
+            size_t stop = buf.find('\0', start);
+            if (stop == string::npos)
+                stop = buf.size();
+            tids[buf.substr(start, stop - start)] = names.size();
+            names.push_back(buf.substr(start, stop - start));
+            start = stop + 1;
+        }
+        return true;
+    }
+
+    int min_shift;
+    int depth;
+    vector<map<unsigned int, vector<TabixChunk> > > bins;
+    vector<vector<VirtualOffset> > linear;
+    map<string, int> tids;
+};
+
+
+// A BGZF file with its index.  Blocks are read with pread() so that
+// several streams can share the file descriptor.
+class TabixFile
+{
+public:
+    TabixFile() : fd(-1), nrefs(0), mtime(0), size(0) {}
+
+    ~TabixFile()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool open(const char *filename)
+    {
+        struct stat st;
+        if (stat(filename, &st) != 0)
+            return false;
+        mtime = st.st_mtime;
+        size = st.st_size;
+
+        string tbi = string(filename) + ".tbi";
+        string csi = string(filename) + ".csi";
+        if (access(tbi.c_str(), F_OK) == 0) {
+            if (!index.read(tbi.c_str(), false))
+                return false;
+        } else if (access(csi.c_str(), F_OK) == 0) {
+            if (!index.read(csi.c_str(), true))
+                return false;
+        } else {
+            return false;
+        }
+
+        fd = ::open(filename, O_RDONLY);
+        return fd >= 0;
+    }
+
+    // whether the file changed since it was opened
+    bool is_stale(const char *filename) const
+    {
+        struct stat st;
+        return stat(filename, &st) != 0 || st.st_mtime != mtime ||
+            st.st_size != size;
+    }
+
+    // Decompresses the block at 'offset'.  Returns the offset of the next
+    // block, or -1 at the end of the file or on error.
+    off_t read_block(off_t offset, string &block) const
+    {
+        unsigned char header[18];
+        block.clear();
+        if (pread(fd, header, sizeof(header), offset) != sizeof(header))
+            return -1;
+        if (header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4) ||
+            header[12] != 'B' || header[13] != 'C')
+            return -1;
+        const int bsize = (header[16] | (header[17] << 8)) + 1;
+        if (bsize < 26)
+            return -1;
+
+        unsigned char buf[1 << 16];
+        const int len = bsize - sizeof(header);
+        if (pread(fd, buf, len, offset + sizeof(header)) != len)
+            return -1;
+        const unsigned int isize = buf[len-4] | (buf[len-3] << 8) |
+            (buf[len-2] << 16) | (unsigned(buf[len-1]) << 24);
+        block.resize(isize);
+        if (isize > 0) {
+            z_stream zs;
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            zs.next_in = buf;
+            zs.avail_in = len - 8;
+            if (inflateInit2(&zs, -15) != Z_OK)
+                return -1;
+            zs.next_out = (Bytef*) &block[0];
+            zs.avail_out = isize;
+            int status = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+            if (status != Z_STREAM_END)
+                return -1;
+        }
+        return offset + bsize;
+    }
+
+    int fd;
+    TabixIndex index;
+    int nrefs;
+
+protected:
+    time_t mtime;
+    off_t size;
+};
+
+
+// open tabix files by file name
+static map<string, TabixFile*> tabix_files;
+static pthread_mutex_t tabix_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static const unsigned int MAX_TABIX_FILES = 16;
+
+
+static TabixFile *open_tabix_file(const char *filename)
+{
+    pthread_mutex_lock(&tabix_files_lock);
+    map<string, TabixFile*>::iterator it = tabix_files.find(filename);
+    if (it != tabix_files.end() && it->second->nrefs == 0 &&
+        it->second->is_stale(filename)) {
+        delete it->second;
+        tabix_files.erase(it);
+        it = tabix_files.end();
+    }
+
+    TabixFile *file = NULL;
+    if (it != tabix_files.end()) {
+        file = it->second;
+    } else {
+        file = new TabixFile();
+        if (!file->open(filename)) {
+            delete file;
+            pthread_mutex_unlock(&tabix_files_lock);
+            return NULL;
+        }
+
+        // close unused files
+        for (it = tabix_files.begin();
+             it != tabix_files.end() &&
+                 tabix_files.size() >= MAX_TABIX_FILES; ) {
+            if (it->second->nrefs == 0) {
+                delete it->second;
+                tabix_files.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        tabix_files[filename] = file;
+    }
+    file->nrefs++;
+    pthread_mutex_unlock(&tabix_files_lock);
+    return file;
+}
+
+
+static void release_tabix_file(TabixFile *file)
+{
+    pthread_mutex_lock(&tabix_files_lock);
+    file->nrefs--;
+    pthread_mutex_unlock(&tabix_files_lock);
+}
+
+
+// Parses a region "chrom", "chrom:start" or "chrom:start-end" with
+// 1-based inclusive coordinates into a 0-based half-open interval.
+static bool parse_region(const char *region, string &chrom, int &beg,
+                         int &end)
+{
+    string text;
+    for (const char *c=region; *c; c++)
+        if (*c != ',')
+            text += *c;
+    beg = 0;
+    end = INT_MAX;
+
+    size_t colon = text.rfind(':');
+    if (colon == string::npos) {
+        chrom = text;
+        return chrom.size() > 0;
+    }
+    chrom = text.substr(0, colon);
+    const char *coords = text.c_str() + colon + 1;
+    char *rest;
+    long start = strtol(coords, &rest, 10);
+    if (rest == coords)
+        return false;
+    beg = max(start - 1, 0L);
+    if (*rest == '-') {
+        const char *stop_str = rest + 1;
+        long stop = strtol(stop_str, &rest, 10);
+        if (rest == stop_str)
+            return false;
+        end = int(min(stop, long(INT_MAX)));
+    }
+    return *rest == '\0' && chrom.size() > 0;
+}
+
+
+// Streams the header and the records of one region of a tabix file.
+class TabixQuery
+{
+public:
+    TabixQuery(TabixFile *file, int tid, int beg, int end) :
+        file(file),
+        tid(tid),
+        beg(beg),
+        end(end),
+        in_header(true),
+        nheader(0),
+        chunk(0),
+        block_offset(0),
+        next_block(0),
+        pos(0),
+        out_pos(0),
+        done(false)
+    {
+        file->index.query(tid, beg, end, chunks);
+    }
+
+    ~TabixQuery()
+    {
+        release_tabix_file(file);
+    }
+
+    ssize_t read(char *buf, size_t size)
+    {
+        while (out.size() - out_pos < size && !done)
+            next_line();
+        size = min(size, out.size() - out_pos);
+        copy(out.begin() + out_pos, out.begin() + out_pos + size, buf);
+        out_pos += size;
+        if (out_pos == out.size()) {
+            out.clear();
+            out_pos = 0;
+        }
+        return size;
+    }
+
+protected:
+    // Reads the line at the current position into 'line'.  Returns the
+    // offset of the line, or false at the end of the file.
+    bool read_line(string &line, VirtualOffset &line_offset)
+    {
+        line.clear();
+        line_offset = (VirtualOffset(block_offset) << 16) | pos;
+        while (true) {
+            if (pos >= block.size()) {
+                if (next_block < 0)
+                    return line.size() > 0;
+                block_offset = next_block;
+                next_block = file->read_block(block_offset, block);
+                pos = 0;
+                if (line.size() == 0)
+                    line_offset = VirtualOffset(block_offset) << 16;
+                if (block.size() == 0)
+                    continue;
+            }
+            size_t stop = block.find('\n', pos);
+            if (stop == string::npos) {
+                line.append(block, pos, string::npos);
+                pos = block.size();
+            } else {
+                line.append(block, pos, stop + 1 - pos);
+                pos = stop + 1;
+                return true;
+            }
+        }
+    }
+
+    void seek(VirtualOffset offset)
+    {
+        block_offset = offset >> 16;
+        next_block = file->read_block(block_offset, block);
+        pos = offset & 0xffff;
+    }
+
+    // 0-based half-open interval of a record, or false if it has no
+    // coordinates
+    bool get_interval(const string &line, string &chrom, int &rbeg,
+                      int &rend) const
+    {
+        const TabixIndex &index = file->index;
+        const int preset = index.format & 0xffff;
+        int col = 1;
+        size_t start = 0;
+        rbeg = rend = -1;
+        string ref;
+        while (start <= line.size()) {
+            size_t stop = line.find_first_of("\t\n", start);
+            if (stop == string::npos)
+                stop = line.size();
+            const char *field = line.c_str() + start;
+            if (col == index.col_seq) {
+                chrom.assign(line, start, stop - start);
+            } else if (col == index.col_beg) {
+                rbeg = atoi(field);
+                if (!(index.format & TabixIndex::FORMAT_UCSC))
+                    rbeg--;
+            } else if (col == index.col_end && preset == 0) {
+                rend = atoi(field);
+            } else if (preset == TabixIndex::FORMAT_VCF && col == 4) {
+                ref.assign(line, start, stop - start);
+            }
+            if (stop >= line.size() || line[stop] == '\n')
+                break;
+            start = stop + 1;
+            col++;
+        }
+        if (rbeg < 0)
+            return false;
+        if (preset == TabixIndex::FORMAT_VCF)
+            rend = rbeg + max(int(ref.size()), 1);
+        if (rend <= rbeg)
+            rend = rbeg + 1;
+        return true;
+    }
+
+    void next_line()
+    {
+        string chrom;
+        VirtualOffset offset;
+
+        // header lines at the start of the file
+        if (in_header) {
+            if (nheader == 0)
+                seek(0);
+            if (read_line(line, offset) &&
+                ((line.size() > 0 && line[0] == file->index.meta) ||
+                 nheader < file->index.skip)) {
+                nheader++;
+                out += line;
+                return;
+            }
+            in_header = false;
+            if (chunks.size() == 0) {
+                done = true;
+                return;
+            }
+            seek(chunks[0].beg);
+        }
+
+        while (true) {
+            if (!read_line(line, offset)) {
+                done = true;
+                return;
+            }
+            if (offset >= chunks[chunk].end) {
+                if (++chunk >= chunks.size()) {
+                    done = true;
+                    return;
+                }
+                seek(chunks[chunk].beg);
+                continue;
+            }
+            if (line[0] == file->index.meta)
+                continue;
+
+            int rbeg, rend;
+            if (!get_interval(line, chrom, rbeg, rend) ||
+                file->index.get_tid(chrom) != tid)
+                continue;
+            if (rbeg >= end) {
+                // records are sorted, so the rest is past the region
+                done = true;
+                return;
+            }
+            if (rend > beg) {
+                out += line;
+                return;
+            }
+        }
+    }
+
+    TabixFile *file;
+    int tid;
+    int beg;
+    int end;
+    vector<TabixChunk> chunks;
+
+    bool in_header;
+    int nheader;
+    unsigned int chunk;
+    off_t block_offset;
+    off_t next_block;
+    string block;
+    size_t pos;   // position in 'block'
+    string line;
+    string out;   // lines not yet read by the caller
+    size_t out_pos;
+    bool done;
+};
+
+
+static ssize_t tabix_query_read(void *cookie, char *buf, size_t size)
+{
+    return ((TabixQuery*) cookie)->read(buf, size);
+}
+
+static int tabix_query_close(void *cookie)
+{
+    delete (TabixQuery*) cookie;
+    return 0;
+}
+
+
+// Opens a region query of a file with an index.  Returns NULL if the
+// file has no index or the region cannot be parsed.
+static FILE *read_tabix_index(const char *filename, const char *region)
+{
+    string chrom;
+    int beg, end;
+    if (!parse_region(region, chrom, beg, end))
+        return NULL;
+
+    TabixFile *file = open_tabix_file(filename);
+    if (!file)
+        return NULL;
+    TabixQuery *query = new TabixQuery(file, file->index.get_tid(chrom),
+                                       beg, end);
+    FILE *stream = open_read_stream(query, tabix_query_read,
+                                    tabix_query_close);
+    if (!stream)
+        delete query;
+    return stream;
+}
+
+
+//=============================================================================
+// tabix streams
+
+
 FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir) {
     FILE *pipe;
@@ -19,6 +692,10 @@ FILE *read_tabix(const char *filename, const char *region,
         return read_compress(filename);
     }
 
+    pipe = read_tabix_index(filename, region);
+    if (pipe)
+        return pipe;
+
     string cmd = "tabix -h " + quote_arg(filename) + " " +  region;
     if (tabix_dir != NULL && strlen(tabix_dir) > 0)
         cmd = string(tabix_dir) + "/" + cmd;
@@ -32,8 +709,9 @@ FILE *read_tabix(const char *filename, const char *region,
 }
 
 
+// streams without a region are opened by read_compress
 int close_tabix(FILE *stream) {
-    return pclose(stream);
+    return close_compress(stream);
 }
 
 }
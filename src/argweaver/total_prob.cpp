@@ -49,7 +49,9 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
 
         //note: this is approximate, uses mu/rho from center of block
         model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, sequences->base_probs,
+        lnl += likelihood_tree(tree, &local_model, seqs,
+                               BaseProbsView(sequences->base_probs,
+                                             &trees->seqids[0], nseqs),
                                nseqs, start, end);
     }
 
@@ -57,8 +59,76 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
 }
 
 
+// Likelihood of the uncompressed block [start, end) of 'tree', filling
+// in the sites that were compressed away.
+static double calc_block_likelihood(const ArgModel *local_model,
+                                    const Sequences *sequences,
+                                    const LocalTrees *trees,
+                                    const LocalTree *tree, int start, int end,
+                                    const SitesMapping* sites_mapping,
+                                    const TrackNullValue *maskmap_uncompressed,
+                                    int *mask_pos, bool mask_sorted)
+{
     // TODO: This fills in compressed sites with A's... should
     // take mask into account!
+    int nseqs = sequences->get_num_seqs();
+    const char default_char = 'A';
+    int blocklen = end - start;
+
+    bool have_base_probs = ( sequences->base_probs.size() > 0 );
+    BaseProbsTable base_probs;
+    if (have_base_probs)
+        base_probs.resize(nseqs);
+
+    // get sequences for trees
+    char *seqs[nseqs];
+    char *matrix = new char [blocklen*nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = &matrix[j*blocklen];
+    if (have_base_probs) {
+        for (int j=0; j < nseqs; j++)
+            base_probs[j].reserve(blocklen);
+    }
+
+    // find first site within this block
+    unsigned int i2 = lower_bound(sites_mapping->all_sites.begin(),
+                                  sites_mapping->all_sites.end(), start) -
+        sites_mapping->all_sites.begin();
+
+    // copy sites into new alignment
+    for (int i=start; i<end; i++) {
+        while (i2 < sites_mapping->all_sites.size() &&
+               sites_mapping->all_sites[i2] < i)
+            i2++;
+        if (i2 < sites_mapping->all_sites.size() &&
+            i == sites_mapping->all_sites[i2]) {
+            // copy site
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
+            }
+        } else {
+            // copy non-variant site
+            char c=default_char;
+            if (maskmap_uncompressed->find(i, mask_pos, mask_sorted))
+                c='N';
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = c;
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(default_char));
+            }
+        }
+    }
+
+    double lnl = likelihood_tree(tree, local_model, seqs,
+                                 BaseProbsView(base_probs),
+                                 nseqs, 0, end-start);
+    delete [] matrix;
+    return lnl;
+}
+
+
 // NOTE: trees should be uncompressed and sequences compressed
 //start_coord and end_coord uncompressed, 0 based
 double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
@@ -71,8 +141,6 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
         return calc_arg_likelihood(model, sequences, trees, start_coord, end_coord);
 
     double lnl = 0.0;
-    int nseqs = sequences->get_num_seqs();
-    const char default_char = 'A';
 
     if (start_coord < trees->start_coord)
         start_coord = trees->start_coord;
@@ -83,14 +151,6 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     if (trees->nnodes < 3)
         return lnl += log(.25) * (end_coord - start_coord);
 
-    bool have_base_probs = ( sequences->base_probs.size() > 0 );
-    vector<vector<BaseProbs> > base_probs;
-    if (have_base_probs) {
-        for (int j=0; j < nseqs; j++) {
-            base_probs.push_back(vector<BaseProbs>());
-        }
-    }
-
     int end = trees->start_coord;
     int mu_idx = 0;
     int rho_idx = 0;
@@ -105,56 +165,14 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int blocklen = end - start;
-        LocalTree *tree = it->tree;
-
-
-        // get sequences for trees
-        char *seqs[nseqs];
-        char *matrix = new char [blocklen*nseqs];
-        for (int j=0; j<nseqs; j++)
-            seqs[j] = &matrix[j*blocklen];
-        if (have_base_probs) {
-            for (int j=0; j < nseqs; j++) base_probs[j].clear();
-        }
-
-
-        // find first site within this block
-        unsigned int i2 = 0;
-
-        // copy sites into new alignment
-        for (int i=start; i<end; i++) {
-            while (i2 < sites_mapping->all_sites.size() &&
-                   sites_mapping->all_sites[i2] < i)
-                i2++;
-            if (i2 < sites_mapping->all_sites.size() &&
-                i == sites_mapping->all_sites[i2]) {
-                // copy site
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
-                }
-            } else {
-                // copy non-variant site
-                char c=default_char;
-                if (maskmap_uncompressed->find(i, &mask_pos, mask_sorted))
-                    c='N';
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = c;
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(default_char));
-                }
-            }
-        }
 
         ArgModel local_model;
         model->get_local_model((start+end)/2, local_model,
                                &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, base_probs,
-                               nseqs, 0, end-start);
-
-        delete [] matrix;
+        lnl += calc_block_likelihood(&local_model, sequences, trees, it->tree,
+                                     start, end, sites_mapping,
+                                     maskmap_uncompressed,
+                                     &mask_pos, mask_sorted);
     }
 
     return lnl;
@@ -231,8 +249,31 @@ double prob_coal_counts(int a, int b, double t, double n)
     return s;
 }
 
+double CoalCountsMemo::get(int pop, int i, int a, int b, double t, double n)
+{
+    if (pop >= (int) intervals.size())
+        intervals.resize(pop + 1);
+    if (i >= (int) intervals[pop].size())
+        intervals[pop].resize(i + 1);
+    Interval &interval = intervals[pop][i];
+    if (interval.t != t || interval.n != n) {
+        interval.t = t;
+        interval.n = n;
+        interval.values.clear();
+    }
+
+    const unsigned int idx = a*(a+1)/2 + b;
+    if (idx >= interval.values.size())
+        interval.values.resize((a+1)*(a+2)/2, NAN);
+    double &value = interval.values[idx];
+    if (isnan(value))
+        value = log_prob_coal_counts(a, b, t, n);
+    return value;
+}
+
+
 double calc_log_tree_prior(const ArgModel *model, const LocalTree *tree,
-                           LineageCounts &lineages)
+                           LineageCounts &lineages, CoalCountsMemo *memo)
 {
     lineages.count(tree, model->pop_tree);
     double lnl = 0.0;
@@ -256,7 +297,11 @@ double calc_log_tree_prior(const ArgModel *model, const LocalTree *tree,
             assert(b <= a);
             double t = model->coal_time_steps[2*i];
             if (i > 0) t += model->coal_time_steps[2*i-1];
-            lnl += log_prob_coal_counts(a, b, t, 2.0 * model->popsizes[pop][2*i]);
+            const double n = 2.0 * model->popsizes[pop][2*i];
+            if (memo)
+                lnl += memo->get(pop, i, a, b, t, n);
+            else
+                lnl += log_prob_coal_counts(a, b, t, n);
             assert(!isnan(lnl));
             assert(!isinf(lnl));
         }
@@ -472,6 +517,50 @@ double calc_log_self_recomb_prob(const ArgModel *model, LocalTree *tree,
 }
 
 
+// Log probability of the recombinations within the block [start, end) of
+// 'tree' and of the SPR 'spr' that ends the block (NULL for the last
+// block).  Invisible recombinations within the block are at 'self_pos'.
+double calc_block_prior(const ArgModel *local_model,
+                        const LocalTree *tree, LineageCounts &lineages,
+                        int start, int end, const Spr *spr,
+                        const int *self_pos, const Spr *self_sprs, int nself,
+                        double **num_coal, double **num_nocoal)
+{
+    double lnl = 0.0;
+    int last_pos = start;
+    double treelen = get_treelen(tree, local_model->times,
+                                 local_model->ntimes, false);
+    lineages.count(tree, local_model->pop_tree);
+
+    // not sure what this is for but it is only used for non-SMC' calcs
+    lineages.nrecombs[tree->nodes[tree->root].age]--;
+
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(local_model->rho * treelen, local_model->rho);
+
+    for (int i=0; i<nself; i++) {
+        lnl += log(recomb_rate) - recomb_rate * (self_pos[i] - last_pos);
+        last_pos = self_pos[i];
+        lnl += calc_log_spr_prob(local_model, tree, self_sprs[i],
+                                 lineages, treelen, num_coal, num_nocoal,
+                                 1.0, true);
+    }
+
+    if (spr) {
+        // not last block
+        // probability of recombining after blocklen
+        lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
+        lnl += calc_log_spr_prob(local_model, tree, *spr, lineages, treelen,
+                                 num_coal, num_nocoal, 1.0, true);
+    } else {
+        // last block
+        // probability of not recombining after blocklen
+        lnl += - recomb_rate * (end - last_pos);
+    }
+    return lnl;
+}
+
+
 // calculate the probability of an ARG given the model parameters
 double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
 		      double **num_coal, double **num_nocoal,
@@ -496,17 +585,10 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
     if (end_coord < 0 || end_coord > trees->end_coord)
         end_coord = trees->end_coord;
 
-    int next_self_pos = ( num_invis == 0 ?
-                          trees->end_coord + 1 : invisible_recomb_pos[0] );
     int self_idx = 0;
-    while (start_coord > next_self_pos) {
+    while (self_idx < num_invis &&
+           invisible_recomb_pos[self_idx] < start_coord)
         self_idx++;
-        if (self_idx == num_invis) {
-            next_self_pos = trees->end_coord + 1;
-            break;
-        }
-        next_self_pos = invisible_recomb_pos[self_idx];
-    }
 
     // first tree prior
         if (start_coord <= trees->start_coord)
@@ -524,54 +606,177 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int last_pos = start;
         LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
         ArgModel local_model;
         model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lineages.count(tree, model->pop_tree);
 
-        // not sure what this is for but it is only used for non-SMC' calcs
-        lineages.nrecombs[tree->nodes[tree->root].age]--;
+        // invisible recombinations within this block
+        int nself = 0;
+        while (self_idx + nself < num_invis &&
+               invisible_recomb_pos[self_idx + nself] < end)
+            nself++;
+
+        // get SPR move information
+        ++it;
+        const Spr *spr = (end < end_coord ? &it->spr : NULL);
+        lnl += calc_block_prior(&local_model, tree, lineages, start, end, spr,
+                                nself ? &invisible_recomb_pos[self_idx] : NULL,
+                                nself ? &invisible_recombs[self_idx] : NULL,
+                                nself, num_coal, num_nocoal);
+        self_idx += nself;
+    }
+    return lnl;
+ }
+
 
-        // calculate probability P(blocklen | T_{i-1})
-        double recomb_rate = max(local_model.rho * treelen, local_model.rho);
+// Log probability of 'blocklen' sites of 'tree' without a change of
+// topology, followed by the SPR 'real_spr' (NULL for the last block),
+// summing over all recombinations that give the same topology.
+double calc_block_prior_recomb_integrate(
+    const ArgModel *model, LocalTree *tree, LineageCounts &lineages,
+    int blocklen, const Spr *real_spr, double rho,
+    double **num_coal, double **num_nocoal)
+{
+    double lnl = 0.0;
+    double treelen = get_treelen(tree, model->times, model->ntimes, false);
+    lineages.count(tree, model->pop_tree);
+    const int root_age = tree->nodes[tree->root].age;
+    lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
 
-        while (next_self_pos < end) {
-            lnl += log(recomb_rate) - recomb_rate * (next_self_pos - last_pos);
-            last_pos = next_self_pos;
-            lnl += calc_log_spr_prob(&local_model, tree, invisible_recombs[self_idx],
-                                     lineages, treelen, num_coal, num_nocoal, 1.0, true);
-            self_idx++;
-            if (self_idx == num_invis) {
-                next_self_pos = end_coord + 1;
-            } else {
-                next_self_pos = invisible_recomb_pos[self_idx];
-            }
-        }
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(rho * treelen, rho);
 
 
+    //for single site, probability of no recomb
+    double pr_no_recomb = exp(-recomb_rate);
+    double pr_recomb = 1.0 - pr_no_recomb;
+    double pr_self = 0.0;
 
-        if (end < end_coord) {
-            // not last block
-            // probability of recombining after blocklen
-	    lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
+    // only do this for smc_prime because under non-smc-prime, recombs to
+    // parent/sister branch that do not change topology are still in ARG
+    if (model->smc_prime)
+        pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
+    double log_pr_nochange  = log(pr_no_recomb + pr_self);
 
-            // get SPR move information
-            ++it;
-            const Spr *spr = &it->spr;
-            lnl += calc_log_spr_prob(&local_model, tree, *spr, lineages, treelen,
-                                     num_coal, num_nocoal, 1.0, true);
 
-        } else {
-            // last block
-            // probability of not recombining after blocklen
-            lnl += - recomb_rate * (end - last_pos);
-            ++it;
+    if (blocklen > 1) {
+        lnl += ((double)blocklen - 1.0)*log_pr_nochange;
+    }
+
+    if (!real_spr)
+        return lnl;
+
+    // not last block, add probability of any recomb that results in
+    // same topology as sampled SPR
+    int node = real_spr->recomb_node;
+    int parent = tree->nodes[node].parent;
+    int sib = tree->nodes[parent].child[0] == node ?
+        tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
+    int max_age = min(tree->nodes[parent].age,
+                      real_spr->coal_time);
+    assert(tree->nodes[node].age <= max_age);
+    assert(real_spr->recomb_time >= tree->nodes[node].age &&
+           real_spr->recomb_time <= max_age);
+    if (real_spr->coal_time == tree->nodes[parent].age &&
+        (real_spr->coal_node == parent ||
+         real_spr->coal_node == sib) &&
+        model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                           real_spr->recomb_time, real_spr->coal_time)) {
+        lnl += log_pr_nochange;
+        return lnl;
+    }
+
+    // from here we assume that the SPR changes the tree
+    double recomb_sum = 0.0;
+    int target_path = model->consistent_path(tree->nodes[node].pop_path,
+                                             real_spr->pop_path,
+                                             tree->nodes[node].age,
+                                             real_spr->recomb_time,
+                                             real_spr->coal_time);
+    double coal_rates[2*model->ntimes];
+    int minage = tree->nodes[node].age;
+    bool coalToSib = false;
+    bool coalToParent = false;
+    if (real_spr->coal_node == sib) {
+        if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                               real_spr->recomb_time, real_spr->coal_time)) {
+            coalToSib = true;
+            if (tree->nodes[sib].age < minage)
+                minage = tree->nodes[sib].age;
+        }
+    } else if (real_spr->coal_node == parent) {
+        int path = model->consistent_path(tree->nodes[node].pop_path,
+                                          tree->nodes[parent].pop_path,
+                                          tree->nodes[node].age,
+                                          tree->nodes[parent].age,
+                                          real_spr->coal_time);
+        if (model->paths_equal(path, real_spr->pop_path,
+                               real_spr->recomb_time, real_spr->coal_time)) {
+            coalToParent = true;
+            if (tree->nodes[sib].age < minage)
+                minage = tree->nodes[sib].age;
         }
     }
+
+    calc_coal_rates_spr(model, tree,
+                        Spr(node, minage, real_spr->coal_node,
+                            real_spr->coal_time, target_path),
+                        lineages, coal_rates);
+    int this_max_age = min(max_age,
+                           model->max_matching_path(tree->nodes[node].pop_path,
+                                                    target_path, tree->nodes[node].age));
+    for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
+        Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
+                target_path);
+        double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                           treelen, num_coal, num_nocoal,
+                                           age == real_spr->recomb_time
+                                           ? 1.0 : 0.0, true, coal_rates));
+        recomb_sum += val;
+    }
+    if (coalToSib) {
+        if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
+                         tree->nodes[sib].age, real_spr->coal_time)) {
+            calc_coal_rates_spr(model, tree,
+                                Spr(sib, tree->nodes[sib].age,
+                                    node, real_spr->coal_time,
+                                    tree->nodes[sib].pop_path),
+                                lineages, coal_rates);
+        }
+        for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+            Spr spr(sib, age, node, real_spr->coal_time,
+                    tree->nodes[sib].pop_path);
+            double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                               treelen, num_coal, num_nocoal,
+                                               0, true, coal_rates));
+            recomb_sum += val;
+        }
+    } else if (coalToParent) {
+        int path = model->consistent_path(tree->nodes[sib].pop_path,
+                                          tree->nodes[parent].pop_path,
+                                          tree->nodes[sib].age,
+                                          tree->nodes[parent].age,
+                                          real_spr->coal_time);
+        if (! model->paths_equal(path, tree->nodes[sib].pop_path,
+                         tree->nodes[sib].age, real_spr->coal_time)) {
+            calc_coal_rates_spr(model, tree,
+                                Spr(sib, tree->nodes[sib].age,
+                                    parent, real_spr->coal_time, path),
+                                lineages, coal_rates);
+        }
+        for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+            Spr spr(sib, age, parent, real_spr->coal_time, path);
+            recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                                treelen, num_coal, num_nocoal,
+                                                0, true, coal_rates));
+        }
+    }
+    lnl += log(pr_recomb * recomb_sum);
+    if (isinf(lnl))
+        assert(0);
     return lnl;
- }
+}
+
 
 double calc_arg_prior_recomb_integrate(const ArgModel *model,
                                        const LocalTrees *trees,
@@ -611,151 +816,17 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
         if (end > end_coord)
             end = end_coord;
         int blocklen = end - start;
-        LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        lineages.count(tree, model->pop_tree);
-        const int root_age = tree->nodes[tree->root].age;
-        lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
-
-        // calculate probability P(blocklen | T_{i-1})
-        double rho = model->get_local_rho(trees->start_coord, &rho_idx);
-        double recomb_rate = max(rho * treelen, rho);
-
-
-        //for single site, probability of no recomb
-        double pr_no_recomb = exp(-recomb_rate);
-        double pr_recomb = 1.0 - pr_no_recomb;
-        double pr_self = 0.0;
-
-        // only do this for smc_prime because under non-smc-prime, recombs to
-        // parent/sister branch that do not change topology are still in ARG
-        if (model->smc_prime)
-            pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
-        double log_pr_nochange  = log(pr_no_recomb + pr_self);
-
-
         if (end >= end_coord)
             blocklen++;
-        if (blocklen > 1) {
-            lnl += ((double)blocklen - 1.0)*log_pr_nochange;
-        }
-
-        if (end < end_coord) {
-            // not last block, add probability of any recomb that results in
-            // same topology as sampled SPR
-
-            // get SPR move information
-            ++it;
-            const Spr *real_spr = &it->spr;
-            int node = real_spr->recomb_node;
-            int parent = tree->nodes[node].parent;
-            int sib = tree->nodes[parent].child[0] == node ?
-                tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
-            int max_age = min(tree->nodes[parent].age,
-                              real_spr->coal_time);
-            assert(tree->nodes[node].age <= max_age);
-            assert(real_spr->recomb_time >= tree->nodes[node].age &&
-                   real_spr->recomb_time <= max_age);
-            if (real_spr->coal_time == tree->nodes[parent].age &&
-                (real_spr->coal_node == parent ||
-                 real_spr->coal_node == sib) &&
-                model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                   real_spr->recomb_time, real_spr->coal_time)) {
-                lnl += log_pr_nochange;
-                continue;
-            }
-
-            // from here we assume that the SPR changes the tree
-            double recomb_sum = 0.0;
-            int target_path = model->consistent_path(tree->nodes[node].pop_path,
-                                                     real_spr->pop_path,
-                                                     tree->nodes[node].age,
-                                                     real_spr->recomb_time,
-                                                     real_spr->coal_time);
-            double coal_rates[2*model->ntimes];
-            int minage = tree->nodes[node].age;
-            bool coalToSib = false;
-            bool coalToParent = false;
-            if (real_spr->coal_node == sib) {
-                if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToSib = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            } else if (real_spr->coal_node == parent) {
-                int path = model->consistent_path(tree->nodes[node].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[node].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (model->paths_equal(path, real_spr->pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToParent = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            }
+        LocalTree *tree = it->tree;
+        double rho = model->get_local_rho(trees->start_coord, &rho_idx);
 
-            calc_coal_rates_spr(model, tree,
-                                Spr(node, minage, real_spr->coal_node,
-                                    real_spr->coal_time, target_path),
-                                lineages, coal_rates);
-            int this_max_age = min(max_age,
-                                   model->max_matching_path(tree->nodes[node].pop_path,
-                                                            target_path, tree->nodes[node].age));
-            for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
-                Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
-                        target_path);
-                double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                   treelen, num_coal, num_nocoal,
-                                                   age == real_spr->recomb_time
-                                                   ? 1.0 : 0.0, true, coal_rates));
-                recomb_sum += val;
-            }
-            if (coalToSib) {
-                if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            node, real_spr->coal_time,
-                                            tree->nodes[sib].pop_path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, node, real_spr->coal_time,
-                            tree->nodes[sib].pop_path);
-                    double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                       treelen, num_coal, num_nocoal,
-                                                       0, true, coal_rates));
-                    recomb_sum += val;
-                }
-            } else if (coalToParent) {
-                int path = model->consistent_path(tree->nodes[sib].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[sib].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (! model->paths_equal(path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            parent, real_spr->coal_time, path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, parent, real_spr->coal_time, path);
-                    recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                        treelen, num_coal, num_nocoal,
-                                                        0, true, coal_rates));
-                }
-            }
-            lnl += log(pr_recomb * recomb_sum);
-	    if (isinf(lnl))
-		assert(0);
-        } else {
-            ++it;
-        }
+        // get SPR move information
+        ++it;
+        const Spr *spr = (end < end_coord ? &it->spr : NULL);
+        lnl += calc_block_prior_recomb_integrate(model, tree, lineages,
+                                                 blocklen, spr, rho,
+                                                 num_coal, num_nocoal);
     }
     assert(!isnan(lnl));
     assert(!isinf(lnl));
@@ -782,6 +853,496 @@ double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
 
 
 
+//=============================================================================
+// incremental ARG probabilities
+
+
+static inline unsigned long long hash_mix(unsigned long long h,
+                                          unsigned long long x)
+{
+    // splitmix64 finalizer
+    unsigned long long z = h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static inline unsigned long long hash_mix_double(unsigned long long h,
+                                                 double x)
+{
+    unsigned long long bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return hash_mix(h, bits);
+}
+
+
+static unsigned long long hash_tree(const LocalTree *tree)
+{
+    unsigned long long h = hash_mix(tree->nnodes, tree->root);
+    for (int i=0; i<tree->nnodes; i++) {
+        const LocalNode &node = tree->nodes[i];
+        h = hash_mix(h, node.parent);
+        h = hash_mix(h, node.child[0]);
+        h = hash_mix(h, node.child[1]);
+        h = hash_mix(h, node.age);
+        h = hash_mix(h, node.pop_path);
+    }
+    return h;
+}
+
+
+static unsigned long long hash_spr(const Spr *spr)
+{
+    if (!spr)
+        return 0;
+    unsigned long long h = hash_mix(spr->recomb_node, spr->recomb_time);
+    h = hash_mix(h, spr->coal_node);
+    h = hash_mix(h, spr->coal_time);
+    return hash_mix(h, spr->pop_path);
+}
+
+
+static unsigned long long hash_seqids(const LocalTrees *trees)
+{
+    unsigned long long h = hash_mix(0, trees->seqids.size());
+    for (unsigned int i=0; i<trees->seqids.size(); i++)
+        h = hash_mix(h, trees->seqids[i]);
+    return h;
+}
+
+
+// hash of the model parameters that the prior of a block depends on,
+// other than its recombination rate
+static unsigned long long hash_prior_model(const ArgModel *model)
+{
+    unsigned long long h = hash_mix(model->ntimes, model->smc_prime);
+    for (int i=0; i<model->ntimes; i++)
+        h = hash_mix_double(h, model->times[i]);
+    for (int i=0; i<2*model->ntimes; i++)
+        h = hash_mix_double(h, model->coal_time_steps[i]);
+    for (int pop=0; pop<model->num_pops(); pop++)
+        for (int i=0; i<2*model->ntimes-1; i++)
+            h = hash_mix_double(h, model->popsizes[pop][i]);
+    return h;
+}
+
+
+// hash of the model parameters that the likelihood of a block depends
+// on, other than its mutation rate
+static unsigned long long hash_likelihood_model(const ArgModel *model)
+{
+    unsigned long long h = hash_mix_double(model->ntimes,
+                                           model->infsites_penalty);
+    for (int i=0; i<model->ntimes; i++)
+        h = hash_mix_double(h, model->times[i]);
+    return h;
+}
+
+
+void ArgProbCache::clear()
+{
+    prior_terms.clear();
+    prior2_terms.clear();
+    likelihood_terms.clear();
+    noncompat_terms.clear();
+    coal_counts_memo.clear();
+    prior = prior2 = likelihood = 0.0;
+    noncompats = 0;
+}
+
+
+void ArgProbCache::clear_sequence_terms()
+{
+    likelihood_terms.clear();
+    noncompat_terms.clear();
+}
+
+
+int ArgProbCache::update_noncompat(const LocalTrees *trees,
+                                   const Sequences *sequences)
+{
+    int nseqs = trees->get_num_leaves();
+    char *seqs[nseqs];
+    for (int i=0; i<nseqs; i++)
+        seqs[i] = sequences->seqs[trees->seqids[i]];
+    const unsigned long long seqs_hash = hash_seqids(trees);
+
+    Terms terms;
+    noncompats = 0;
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();
+         ++it) {
+        int start = end;
+        end += it->blocklen;
+        unsigned long long key = hash_mix(hash_mix(hash_mix(
+            seqs_hash, hash_tree(it->tree)), start), it->blocklen);
+
+        int count;
+        Terms::iterator term = noncompat_terms.find(key);
+        if (term != noncompat_terms.end()) {
+            count = int(term->second);
+        } else {
+            char const* subseqs[nseqs];
+            for (int i=0; i<nseqs; i++)
+                subseqs[i] = &seqs[i][start];
+            count = count_noncompat(it->tree, subseqs, nseqs, 0,
+                                    it->blocklen, NULL);
+        }
+        terms[key] = count;
+        noncompats += count;
+    }
+    noncompat_terms.swap(terms);
+
+    return noncompats;
+}
+
+
+void ArgProbCache::update(const ArgModel *model, const Sequences *sequences,
+                          const LocalTrees *trees,
+                          const SitesMapping *sites_mapping,
+                          const TrackNullValue *maskmap_uncompressed,
+                          bool calc_likelihood,
+                          const vector<int> &invisible_recomb_pos,
+                          const vector<Spr> &invisible_recombs)
+{
+    // With populations or invisible recombinations the prior of a block
+    // depends on more than its tree, so it is computed in full.
+    const bool cache_prior = (model->pop_tree == NULL &&
+                              invisible_recombs.size() == 0);
+    const bool cache_likelihood = calc_likelihood && trees->nnodes >= 3;
+
+    if (!cache_prior) {
+        prior = calc_arg_prior(model, trees, NULL, NULL, -1, -1,
+                               invisible_recomb_pos, invisible_recombs);
+        prior2 = calc_arg_prior_recomb_integrate(model, trees,
+                                                 NULL, NULL, NULL);
+        prior_terms.clear();
+        prior2_terms.clear();
+    }
+    if (!cache_likelihood) {
+        likelihood = calc_likelihood ?
+            calc_arg_likelihood(model, sequences, trees, sites_mapping,
+                                maskmap_uncompressed) : 0.0;
+        likelihood_terms.clear();
+    }
+    if (!cache_prior && !cache_likelihood)
+        return;
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    const unsigned long long prior_hash = hash_prior_model(model);
+    const unsigned long long prior2_hash = hash_mix(prior_hash, 2);
+    const unsigned long long likelihood_hash =
+        hash_mix(hash_likelihood_model(model), hash_seqids(trees));
+    Terms prior_terms2, prior2_terms2, likelihood_terms2;
+
+    // sequences for the likelihood of uncompressed sequences
+    int nseqs = sequences->get_num_seqs();
+    char *seqs[nseqs];
+    if (!sites_mapping && cache_likelihood) {
+        for (int j=0; j<nseqs; j++)
+            seqs[j] = sequences->seqs[trees->seqids[j]];
+    }
+    int mask_pos = 0;
+    bool mask_sorted = (sites_mapping && maskmap_uncompressed->is_sorted());
+
+    // first tree prior
+    if (cache_prior) {
+        LocalTree *tree = trees->front().tree;
+        unsigned long long key = hash_mix(prior_hash, hash_tree(tree));
+        double lnl;
+        Terms::iterator term = prior_terms.find(key);
+        if (term != prior_terms.end())
+            lnl = term->second;
+        else
+            lnl = calc_log_tree_prior(model, tree, lineages,
+                                      &coal_counts_memo);
+        prior_terms2[key] = lnl;
+        prior = prior2 = lnl;
+    }
+    if (cache_likelihood)
+        likelihood = 0.0;
+
+    // recombination rate used by calc_arg_prior_recomb_integrate()
+    const double rho2 = model->get_local_rho(trees->start_coord);
+
+    int end = trees->start_coord;
+    int mu_idx = 0, rho_idx = 0;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+        int start = end;
+        end += it->blocklen;
+        LocalTree *tree = it->tree;
+        ArgModel local_model;
+        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
+        ++it;
+        const Spr *spr = (it != trees->end() ? &it->spr : NULL);
+        const unsigned long long tree_hash = hash_tree(tree);
+
+        if (cache_prior) {
+            unsigned long long key = hash_mix_double(hash_mix(hash_mix(hash_mix(
+                hash_mix(prior_hash, tree_hash), start), end),
+                hash_spr(spr)), local_model.rho);
+            double lnl;
+            Terms::iterator term = prior_terms.find(key);
+            if (term != prior_terms.end())
+                lnl = term->second;
+            else
+                lnl = calc_block_prior(&local_model, tree, lineages,
+                                       start, end, spr, NULL, NULL, 0,
+                                       NULL, NULL);
+            prior_terms2[key] = lnl;
+            prior += lnl;
+
+            int blocklen = end - start + (spr ? 0 : 1);
+            key = hash_mix_double(hash_mix(hash_mix(hash_mix(
+                prior2_hash, tree_hash), blocklen), hash_spr(spr)), rho2);
+            term = prior2_terms.find(key);
+            if (term != prior2_terms.end())
+                lnl = term->second;
+            else
+                lnl = calc_block_prior_recomb_integrate(
+                    model, tree, lineages, blocklen, spr, rho2, NULL, NULL);
+            prior2_terms2[key] = lnl;
+            prior2 += lnl;
+        }
+
+        if (cache_likelihood) {
+            unsigned long long key = hash_mix_double(hash_mix(hash_mix(
+                hash_mix(likelihood_hash, tree_hash), start), end),
+                local_model.mu);
+            double lnl;
+            Terms::iterator term = likelihood_terms.find(key);
+            if (term != likelihood_terms.end())
+                lnl = term->second;
+            else if (sites_mapping)
+                lnl = calc_block_likelihood(&local_model, sequences, trees,
+                                            tree, start, end, sites_mapping,
+                                            maskmap_uncompressed,
+                                            &mask_pos, mask_sorted);
+            else
+                lnl = likelihood_tree(tree, &local_model, seqs,
+                                      BaseProbsView(sequences->base_probs,
+                                                    &trees->seqids[0], nseqs),
+                                      nseqs, start, end);
+            likelihood_terms2[key] = lnl;
+            likelihood += lnl;
+        }
+    }
+
+    if (cache_prior) {
+        prior_terms.swap(prior_terms2);
+        prior2_terms.swap(prior2_terms2);
+    }
+    if (cache_likelihood)
+        likelihood_terms.swap(likelihood_terms2);
+}
+
+
+
+void calc_region_stats(const ArgModel *model,
+                       const Sequences *sequences,
+                       const LocalTrees *trees,
+                       const vector<Region> &regions,
+                       const vector<int> &invisible_recomb_pos,
+                       const vector<Spr> &invisible_recombs,
+                       const SitesMapping *sites_mapping,
+                       const vector<MigEvent> &migevents,
+                       vector<RegionStats> &stats)
+{
+    const int nregions = regions.size();
+    const int nmigevents = migevents.size();
+    const int num_invis = invisible_recomb_pos.size();
+    stats.assign(nregions, RegionStats(nmigevents));
+    if (nregions == 0)
+        return;
+
+    // region coordinates along the (compressed) local trees
+    vector<int> starts(nregions), ends(nregions), order(nregions);
+    for (int i=0; i<nregions; i++) {
+        if (sites_mapping != NULL) {
+            const vector<int> &site_ends = sites_mapping->all_sites_end;
+            int hint = lower_bound(site_ends.begin(), site_ends.end(),
+                                   regions[i].start) - site_ends.begin();
+            starts[i] = sites_mapping->compress(regions[i].start, 0, hint);
+            hint = lower_bound(site_ends.begin(), site_ends.end(),
+                               regions[i].end-1) - site_ends.begin();
+            ends[i] = sites_mapping->compress(regions[i].end-1, 0, hint)+1;
+        } else {
+            starts[i] = regions[i].start;
+            ends[i] = regions[i].end;
+        }
+        order[i] = i;
+    }
+    ranksort(&order[0], &starts[0], nregions);
+
+    // time interval immediately before each migration event
+    vector<int> prev_times(nmigevents, 0);
+    for (int k=0; k < nmigevents; k++) {
+        for (int j=0; j < model->ntimes; j++) {
+            if (model->times[j] < migevents[k].time)
+                prev_times[k] = j;
+            else break;
+        }
+    }
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    const double rho2 = model->get_local_rho(trees->start_coord);
+
+    // get sequences for trees
+    const int nseqs = sequences->get_num_seqs();
+    const int nleaves = trees->get_num_leaves();
+    char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = sequences->seqs[trees->seqids[j]];
+    BaseProbsView base_probs(sequences->base_probs, &trees->seqids[0], nseqs);
+
+    // regions that include the first tree
+    const LocalTree *first_tree = trees->front().tree;
+    double first_tree_prior = 0.0;
+    bool have_first_tree_prior = false;
+    for (int i=0; i<nregions; i++) {
+        if (starts[i] > trees->start_coord)
+            continue;
+        if (!have_first_tree_prior) {
+            first_tree_prior = calc_log_tree_prior(model, first_tree,
+                                                   lineages);
+            have_first_tree_prior = true;
+        }
+        stats[i].prior += first_tree_prior;
+        stats[i].prior2 += first_tree_prior;
+
+        for (int k=0; k < nmigevents; k++) {
+            const int prev_time = prev_times[k];
+            for (int j=0; j < first_tree->nnodes; j++) {
+                const LocalNode &node = first_tree->nodes[j];
+                if (node.age > prev_time) continue;
+                if (j != first_tree->root &&
+                    first_tree->nodes[node.parent].age <= prev_time)
+                    continue;
+                if (model->get_pop(node.pop_path, prev_time) ==
+                    migevents[k].from_pop) {
+                    if (model->get_pop(node.pop_path, prev_time+1) ==
+                        migevents[k].to_pop)
+                        stats[i].mig_counts[2*k]++;
+                    else stats[i].mig_counts[2*k+1]++;
+                }
+            }
+        }
+    }
+
+    // state of each region along the trees
+    vector<int> mu_idx(nregions, 0), rho_idx(nregions, 0);
+    vector<int> self_idx(nregions, 0);
+    vector<int> active;
+    vector<int> mig_outcome(nmigevents);
+    int postorder[trees->nnodes];
+    int next_region = 0;
+
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();
+         ++it) {
+        const int start = end;
+        end += it->blocklen;
+        LocalTree *tree = it->tree;
+
+        // add regions that start within this block
+        while (next_region < nregions && starts[order[next_region]] < end) {
+            const int i = order[next_region++];
+            if (ends[i] <= start || ends[i] <= starts[i])
+                continue;
+            self_idx[i] = lower_bound(invisible_recomb_pos.begin(),
+                                      invisible_recomb_pos.end(),
+                                      starts[i]) -
+                invisible_recomb_pos.begin();
+            active.push_back(i);
+        }
+        if (active.size() == 0)
+            continue;
+
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        const Spr *next_spr = (it2 != trees->end() ? &it2->spr : NULL);
+        tree->get_postorder(postorder);
+        char const* subseqs[nleaves];
+        for (int j=0; j<nleaves; j++)
+            subseqs[j] = &seqs[j][start];
+
+        // migration events on the SPR into this block:
+        // 1 if it occurs, 0 if it does not, -1 if not counted
+        for (int k=0; k < nmigevents; k++) {
+            const Spr *spr = &it->spr;
+            const int prev_time = prev_times[k];
+            mig_outcome[k] = -1;
+            if (spr->recomb_time <= prev_time &&
+                spr->coal_time >= prev_time+1 &&
+                model->get_pop(spr->pop_path, prev_time) ==
+                migevents[k].from_pop)
+                mig_outcome[k] = int(model->get_pop(spr->pop_path,
+                                                    prev_time+1) ==
+                                     migevents[k].to_pop);
+        }
+
+        for (unsigned int a=0; a<active.size(); a++) {
+            const int i = active[a];
+            RegionStats &st = stats[i];
+            const int region_end = min(ends[i], trees->end_coord);
+            const int s = max(start, starts[i]);
+            const int e = min(end, region_end);
+            const bool last = (e >= region_end);
+            const Spr *spr = (last ? NULL : next_spr);
+
+            ArgModel local_model;
+            model->get_local_model((s+e)/2, local_model,
+                                   &mu_idx[i], &rho_idx[i]);
+
+            // prior
+            int nself = 0;
+            while (self_idx[i] + nself < num_invis &&
+                   invisible_recomb_pos[self_idx[i] + nself] < e)
+                nself++;
+            st.prior += calc_block_prior(
+                &local_model, tree, lineages, s, e, spr,
+                nself ? &invisible_recomb_pos[self_idx[i]] : NULL,
+                nself ? &invisible_recombs[self_idx[i]] : NULL,
+                nself, NULL, NULL);
+            self_idx[i] += nself;
+            st.prior2 += calc_block_prior_recomb_integrate(
+                model, tree, lineages, e - s + (last ? 1 : 0), spr, rho2,
+                NULL, NULL);
+
+            // likelihood
+            if (trees->nnodes < 3)
+                st.likelihood += log(.25) * (e - s);
+            else
+                st.likelihood += likelihood_tree(tree, &local_model, seqs,
+                                                 base_probs, nseqs, s, e);
+
+            st.noncompat += count_noncompat(tree, subseqs, nleaves,
+                                            s - start, e - start, postorder);
+            // count the recombination that ends the block, and the SPR
+            // into the block, only if they fall within the region
+            if (!last)
+                st.nrecomb++;
+            if (start >= starts[i])
+                for (int k=0; k < nmigevents; k++)
+                    if (mig_outcome[k] >= 0)
+                        st.mig_counts[2*k + 1 - mig_outcome[k]]++;
+        }
+
+        // remove regions that end within this block
+        for (unsigned int a=0; a<active.size(); ) {
+            if (ends[active[a]] <= end) {
+                active[a] = active.back();
+                active.pop_back();
+            } else {
+                a++;
+            }
+        }
+    }
+}
+
+
+
 //=============================================================================
 // C interface
 /*
@@ -1,6 +1,8 @@
 #ifndef ARGWEAVER_TOTAL_PROB_H
 #define ARGWEAVER_TOTAL_PROB_H
 
+#include <map>
+
 #include "local_tree.h"
 #include "model.h"
 
@@ -48,6 +50,140 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
 double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees);
 
+// The log probability of going from 'a' lineages to 'b' lineages in time
+// 't' with (haploid) population size 'n'
+double log_prob_coal_counts(int a, int b, double t, double n);
+
+// Memo of log_prob_coal_counts() for the whole time intervals of a model.
+// The values of an interval are dropped when its length or popsize
+// changes, e.g. after the popsizes are resampled.
+class CoalCountsMemo
+{
+public:
+    double get(int pop, int i, int a, int b, double t, double n);
+    void clear() { intervals.clear(); }
+
+protected:
+    struct Interval {
+        Interval() : t(-1.0), n(-1.0) {}
+        double t, n;
+        vector<double> values;  // [a*(a+1)/2 + b], NAN until computed
+    };
+    vector<vector<Interval> > intervals;  // [pop][i]
+};
+
+// terms of calc_arg_prior() and calc_arg_prior_recomb_integrate()
+double calc_log_tree_prior(const ArgModel *model, const LocalTree *tree,
+                           LineageCounts &lineages,
+                           CoalCountsMemo *memo=NULL);
+double calc_block_prior(const ArgModel *local_model,
+                        const LocalTree *tree, LineageCounts &lineages,
+                        int start, int end, const Spr *spr,
+                        const int *self_pos, const Spr *self_sprs, int nself,
+                        double **num_coal, double **num_nocoal);
+double calc_block_prior_recomb_integrate(
+    const ArgModel *model, LocalTree *tree, LineageCounts &lineages,
+    int blocklen, const Spr *real_spr, double rho,
+    double **num_coal, double **num_nocoal);
+
+
+// A migration event counted along an ARG
+class MigEvent
+{
+public:
+    MigEvent(const char *name0, int from_pop, int to_pop, int time) :
+        from_pop(from_pop), to_pop(to_pop), time(time) {
+        name = string(name0);
+    }
+    string name;
+    int from_pop;
+    int to_pop;
+    int time;
+};
+
+
+// Statistics of one region of an ARG
+class RegionStats
+{
+public:
+    RegionStats(int nmigevents=0) :
+        prior(0.0), prior2(0.0), likelihood(0.0),
+        nrecomb(0), noncompat(0), mig_counts(2 * nmigevents, 0)
+    {}
+
+    double prior;
+    double prior2;
+    double likelihood;
+    int nrecomb;
+    int noncompat;
+    // for each migration event, the number that occur and that do not
+    vector<int> mig_counts;
+};
+
+
+// Computes the statistics of all 'regions' in one pass over the local
+// trees, instead of walking the trees from the start for each region.
+// Regions are 0-based and not compressed, and may overlap and come in
+// any order.
+void calc_region_stats(const ArgModel *model,
+                       const Sequences *sequences,
+                       const LocalTrees *trees,
+                       const vector<Region> &regions,
+                       const vector<int> &invisible_recomb_pos,
+                       const vector<Spr> &invisible_recombs,
+                       const SitesMapping *sites_mapping,
+                       const vector<MigEvent> &migevents,
+                       vector<RegionStats> &stats);
+
+
+// The prior, likelihood and number of non-compatible sites of an ARG,
+// updated block by block.
+//
+// The terms of a block depend only on its tree, its coordinates, the SPR
+// that ends it and the model.  The cache keeps the terms of the last ARG
+// it was given under a hash of these, so that after a move only the
+// blocks that changed are recomputed, whatever code changed them.  The
+// sequences must be the same on every call.
+class ArgProbCache
+{
+public:
+    ArgProbCache() :
+        prior(0.0), prior2(0.0), likelihood(0.0), noncompats(0) {}
+
+    // Count the non-compatible sites of compressed 'trees'
+    int update_noncompat(const LocalTrees *trees, const Sequences *sequences);
+
+    // Update prior, prior2 and likelihood of uncompressed 'trees'
+    // NOTE: sequences are compressed, as for calc_arg_likelihood()
+    void update(const ArgModel *model, const Sequences *sequences,
+                const LocalTrees *trees, const SitesMapping *sites_mapping,
+                const TrackNullValue *maskmap_uncompressed,
+                bool calc_likelihood=true,
+                const vector<int> &invisible_recomb_pos=vector<int>(),
+                const vector<Spr> &invisible_recombs=vector<Spr>());
+
+    void clear();
+
+    // Forget the likelihood and non-compatible site terms.  These are
+    // keyed by tree and coordinates only, so call this whenever the
+    // sequences change (e.g. after phase sampling).
+    void clear_sequence_terms();
+
+    double prior;       // calc_arg_prior()
+    double prior2;      // calc_arg_prior_recomb_integrate()
+    double likelihood;  // calc_arg_likelihood()
+    int noncompats;     // count_noncompat()
+
+protected:
+    typedef std::map<unsigned long long, double> Terms;
+
+    Terms prior_terms;
+    Terms prior2_terms;
+    Terms likelihood_terms;
+    Terms noncompat_terms;
+    CoalCountsMemo coal_counts_memo;
+};
+
 
 
 } // namespace argweaver
@@ -2,6 +2,7 @@
 // transitions
 
 #include "matrices.h"
+#include "simd.h"
 #include "total_prob.h"
 #include "thread.h"
 #include "trans.h"
@@ -15,6 +16,11 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     npaths = model->num_pop_paths();
     smc_prime = model->smc_prime;
     pop_tree = model->pop_tree;
+    minage = 0;
+    time_probs = new double* [npaths * npaths];
+    fill(time_probs, time_probs + npaths * npaths, (double*) NULL);
+    time_probs_alloc = NULL;
+    time_probs_ld = simd_pad(ntimes - 1);
     int data_len=0;
     if (smc_prime) {
         data_len = npaths * ntimes + 2 * ntimes;
@@ -85,6 +91,79 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     assert(idx == data_len);
 }
 
+long TransMatrix::get_nbytes() const
+{
+    long nbytes = sizeof(TransMatrix) + npaths * sizeof(double*);
+    nbytes += (C1_prime->matSize + Q1_prime->matSize) * sizeof(double);
+
+    if (smc_prime) {
+        const MultiArray *arrays[] = {
+            B0_prime, B1_prime, B2_prime, C0_prime, Q0_prime,
+            E0_prime, E1_prime, E2_prime, F0_prime, F1_prime, F2_prime,
+            G0_prime, G1_prime, G2_prime, L0_prime, L1_prime, L2_prime,
+            K0_prime, K1_prime, K2_prime, RK0_prime, RK2_prime};
+        for (unsigned int i=0; i<sizeof(arrays)/sizeof(arrays[0]); i++)
+            nbytes += arrays[i]->matSize * sizeof(double);
+        nbytes += (npaths * ntimes + 2 * ntimes + nstates) * sizeof(double);
+    } else {
+        nbytes += (ntimes*2 + npaths*ntimes*4 + npaths*npaths*ntimes*3)
+            * sizeof(double);
+        nbytes += npaths * (3 * npaths + 6) * sizeof(double*);
+    }
+
+    nbytes += npaths * npaths * sizeof(double*);
+    for (int i=0; i<npaths * npaths; i++)
+        if (time_probs[i])
+            nbytes += (ntimes - 1) * time_probs_ld * sizeof(double);
+    return nbytes;
+}
+
+
+// The forward algorithm needs the probabilities of transitions to a
+// different node for every pair of times (and paths) in each block.  They
+// do not depend on the nodes, so they are computed once per matrix.  The
+// tables start on a cache line.
+void TransMatrix::calc_time_probs(const States &states)
+{
+    const int nrows = ntimes - 1;
+    const int table_size = nrows * time_probs_ld;
+
+    bool used[npaths];
+    fill(used, used + npaths, npaths == 1);
+    for (unsigned int i=0; i<states.size(); i++)
+        used[states[i].pop_path] = true;
+    int nused = 0;
+    for (int i=0; i<npaths; i++)
+        nused += used[i];
+
+    delete [] time_probs_alloc;
+    fill(time_probs, time_probs + npaths * npaths, (double*) NULL);
+    const int line = 64 / sizeof(double);
+    time_probs_alloc = new double [nused * nused * table_size + line];
+    double *table = time_probs_alloc;
+    while (((size_t) table) % 64 != 0)
+        table++;
+
+    for (int path_a=0; path_a<npaths; path_a++) {
+        if (!used[path_a])
+            continue;
+        for (int path_b=0; path_b<npaths; path_b++) {
+            if (!used[path_b])
+                continue;
+            for (int a=0; a<nrows; a++) {
+                double *row = &table[a * time_probs_ld];
+                for (int b=0; b<nrows; b++)
+                    row[b] = calc_time(a, b, 0, path_a, path_b, -1,
+                                       minage, false);
+                fill(row + nrows, row + time_probs_ld, 0.0);
+            }
+            time_probs[path_a * npaths + path_b] = table;
+            table += table_size;
+        }
+    }
+}
+
+
 void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                                   const LineageCounts *lineages,
                                   MultiArray *coal_rates,
@@ -755,6 +834,7 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
     }
 
     calc_self_recomb_probs_smcPrime(tree, states);
+    calc_time_probs(states);
 
     if (false) {
         assert_transmat(tree, model, states, lineages, minage0);
@@ -901,11 +981,133 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
             E[path][b] = 1.0 / ncoal;
         }
     }
+    calc_time_probs(states);
+
     if (false) {
         assert_transmat(tree, model, states, lineages, minage0);
     }
 }
 
+//=============================================================================
+// sharing of transition matrices between blocks
+
+
+// The key holds every input of calc_transition_probs() for the SMC model.
+void TransMatrixCache::make_key(
+    const ArgModel *model, int model_index, const LocalTree *tree,
+    const States &states, const LineageCounts *lineages,
+    bool internal, int minage, string &key) const
+{
+    const int ntimes = model->ntimes;
+    const double *times = model->times;
+    const int npaths = model->num_pop_paths();
+    const int npops = lineages->npops;
+
+    int root_age_index;
+    double treelen;
+    if (internal) {
+        const int subtree_root = tree->nodes[tree->root].child[0];
+        const int maintree_root = tree->nodes[tree->root].child[1];
+        root_age_index = tree->nodes[maintree_root].age;
+        treelen = get_treelen_internal(tree, times, ntimes) -
+            times[tree->nodes[subtree_root].age];
+        minage = max(minage, tree->nodes[subtree_root].age);
+    } else {
+        root_age_index = tree->nodes[tree->root].age;
+        treelen = get_treelen(tree, times, ntimes, false);
+    }
+
+    const int header[] = {model_index, int(states.size()), internal, minage,
+                          root_age_index};
+    key.assign((const char*) header, sizeof(header));
+    key.append((const char*) &treelen, sizeof(treelen));
+    key.append((const char*) lineages->nbranches, ntimes * sizeof(int));
+    key.append((const char*) lineages->nrecombs, ntimes * sizeof(int));
+    for (int pop=0; pop<npops; pop++) {
+        key.append((const char*) lineages->nbranches_pop[pop],
+                   2 * ntimes * sizeof(int));
+        key.append((const char*) lineages->ncoals_pop[pop],
+                   ntimes * sizeof(int));
+    }
+
+    // paths of the states and of the tree
+    if (npaths > 1) {
+        const int subtree_root = (internal ?
+                                  tree->nodes[tree->root].child[0] : -1);
+        string state_paths(npaths, '0');
+        string tree_paths(npaths, '0');
+        for (unsigned int i=0; i<states.size(); i++)
+            state_paths[states[i].pop_path] = '1';
+        for (int i=0; i<tree->nnodes; i++)
+            if (i != subtree_root)
+                tree_paths[tree->nodes[i].pop_path] = '1';
+        key += state_paths;
+        key += tree_paths;
+    }
+}
+
+
+TransMatrix *TransMatrixCache::get(
+    const ArgModel *model, int model_index, const LocalTree *tree,
+    const States &states, const LineageCounts *lineages,
+    bool internal, int minage)
+{
+    if (model->smc_prime || max_size <= 0) {
+        TransMatrix *matrix = new TransMatrix(model, states.size());
+        matrix->calc_transition_probs(tree, model, states, lineages,
+                                      internal, minage);
+        return matrix;
+    }
+
+    string key;
+    make_key(model, model_index, tree, states, lineages, internal, minage,
+             key);
+
+    pthread_mutex_lock(&lock);
+    map<string, TransMatrix*>::iterator it = matrices.find(key);
+    if (it != matrices.end()) {
+        TransMatrix *matrix = it->second->acquire();
+        nhits++;
+        pthread_mutex_unlock(&lock);
+        return matrix;
+    }
+    nmisses++;
+    pthread_mutex_unlock(&lock);
+
+    TransMatrix *matrix = new TransMatrix(model, states.size());
+    matrix->calc_transition_probs(tree, model, states, lineages,
+                                  internal, minage);
+
+    // another thread may have added the same matrix meanwhile
+    pthread_mutex_lock(&lock);
+    if (matrices.find(key) == matrices.end()) {
+        while (int(order.size()) >= max_size) {
+            it = matrices.find(order.front());
+            TransMatrix::release(it->second);
+            matrices.erase(it);
+            order.pop_front();
+        }
+        matrices[key] = matrix->acquire();
+        order.push_back(key);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return matrix;
+}
+
+
+void TransMatrixCache::clear()
+{
+    pthread_mutex_lock(&lock);
+    for (map<string, TransMatrix*>::iterator it=matrices.begin();
+         it != matrices.end(); ++it)
+        TransMatrix::release(it->second);
+    matrices.clear();
+    order.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+
     /*inline double TransMatrix::get_time(int a, int b, int c,
                              int path_a, int path_b, int path_c,
                              int minage, bool same_node, int state_a) const
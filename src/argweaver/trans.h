@@ -4,6 +4,11 @@
 #ifndef ARGWEAVER_TRANS_H
 #define ARGWEAVER_TRANS_H
 
+#include <deque>
+#include <map>
+#include <string>
+#include <pthread.h>
+
 #include "common.h"
 #include "local_tree.h"
 #include "model.h"
@@ -25,7 +30,8 @@ public:
     TransMatrix(const ArgModel *model, int nstates) :
         nstates(nstates),
         internal(false),
-        smc_prime(false)
+        smc_prime(false),
+        nrefs(1)
     {
         initialize(model, nstates);
     }
@@ -73,12 +79,31 @@ public:
         }
         delete [] path_prob;
         delete [] data_alloc;
+        delete [] time_probs;
+        delete [] time_probs_alloc;
     }
 
     // allocate space for transition matrix
     // and initialize paths_equal matrix
     void initialize(const ArgModel *model, int nstates);
 
+    // A matrix may be shared by several blocks (see TransMatrixCache).
+    // Every owner holds a reference and the last release() deletes it.
+    TransMatrix *acquire()
+    {
+        __sync_add_and_fetch(&nrefs, 1);
+        return this;
+    }
+
+    static void release(TransMatrix *matrix)
+    {
+        if (__sync_sub_and_fetch(&matrix->nrefs, 1) == 0)
+            delete matrix;
+    }
+
+    // Returns the approximate number of bytes allocated by this matrix
+    long get_nbytes() const;
+
     // Probability of transition from state i to state j.
     inline double get(
         const LocalTree *tree, const States &states, int i, int j) const
@@ -115,6 +140,22 @@ public:
     inline double get_time(int a, int b, int c,
                     int path_a, int path_b, int path_c,
                     int minage, bool same_node, int state_a=-1) const {
+        // transitions to a different node are tabulated
+        // (see calc_time_probs)
+        if (!same_node && minage == this->minage &&
+            a < ntimes - 1 && b < ntimes - 1 && a >= 0 && b >= 0) {
+            const double *probs = time_probs[path_a * npaths + path_b];
+            if (probs)
+                return probs[a * time_probs_ld + b];
+        }
+        return calc_time(a, b, c, path_a, path_b, path_c, minage,
+                         same_node, state_a);
+    }
+
+    // Computes get_time() without using the tabulated probabilities.
+    inline double calc_time(int a, int b, int c,
+                    int path_a, int path_b, int path_c,
+                    int minage, bool same_node, int state_a=-1) const {
     if (a < minage || b < minage)
         return 0.0;
 
@@ -343,6 +384,10 @@ public:
                                bool internal0=false,
                                int minage0=0);
 
+    // Tabulate get_time() for transitions to a different node between the
+    // population paths used by 'states'.
+    void calc_time_probs(const States &states);
+
 
     int ntimes;
     int nstates;
@@ -399,6 +444,15 @@ public:
     double **G2;
     double **G3;
 
+    // Tabulated get_time(a, b, ..., same_node=false) for each pair of
+    // paths (NULL for pairs that are not tabulated).  Each table has a row
+    // for each time 'a' with a padded leading dimension.
+    double **time_probs;
+    double *time_probs_alloc;
+    int time_probs_ld;
+
+    int nrefs;
+
  private:
     double get_l_term(int d, int path_d, int a, int path_a) const;
     double get_k_term(int d, int path_d, int a, int path_a) const;
@@ -418,6 +472,62 @@ public:
 };
 
 
+// Keeps the most recently computed transition matrices, so that blocks
+// whose matrices have the same inputs (local model, lineage counts, tree
+// length and root age) share one matrix.  Only SMC matrices are shared,
+// since SMC' matrices also depend on the branches of the local tree
+// through their self-recombination terms.  Safe to use from several
+// threads.
+class TransMatrixCache
+{
+public:
+    TransMatrixCache(int max_size=16) :
+        max_size(max_size),
+        nhits(0),
+        nmisses(0)
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~TransMatrixCache()
+    {
+        clear();
+        pthread_mutex_destroy(&lock);
+    }
+
+    // Returns the transition matrix of a block with lineage counts
+    // 'lineages', computing it if needed.  The caller owns one reference.
+    TransMatrix *get(const ArgModel *model, int model_index,
+                     const LocalTree *tree, const States &states,
+                     const LineageCounts *lineages,
+                     bool internal, int minage);
+
+    // release all cached matrices
+    void clear();
+
+    int get_hits() const {
+        return nhits;
+    }
+
+    int get_misses() const {
+        return nmisses;
+    }
+
+protected:
+    void make_key(const ArgModel *model, int model_index,
+                  const LocalTree *tree, const States &states,
+                  const LineageCounts *lineages, bool internal, int minage,
+                  string &key) const;
+
+    int max_size;
+    int nhits;
+    int nmisses;
+    map<string, TransMatrix*> matrices;
+    deque<string> order;
+    pthread_mutex_t lock;
+};
+
+
 // A compressed representation of the switch transition matrix.
 //
 // This transition matrix is used in the chromosome threading HMM to go between
@@ -466,6 +576,16 @@ public:
         recoalsrc = new int[max(nstates1, 1)];
     }
 
+    // Returns the approximate number of bytes allocated by this matrix
+    long get_nbytes() const
+    {
+        const long n1 = max(nstates1, 1);
+        const long n2 = max(nstates2, 1);
+        return sizeof(TransMatrixSwitch) +
+            n1 * (3 * sizeof(int) + sizeof(double)) +
+            2 * n2 * npaths * sizeof(double);
+    }
+
     // Log probability of transition from state i to state j.
     inline double get_log(int i, int j) const
     {
@@ -0,0 +1,111 @@
+#include "getopt.h"
+#include <assert.h>
+
+// argweaver includes
+#include "argweaver/local_tree.h"
+#include "argweaver/local_tree_binary.h"
+#include "argweaver/compress.h"
+#include "argweaver/logging.h"
+
+using namespace argweaver;
+
+void print_usage() {
+    printf("bin2smc: This program converts a binary local trees file\n"
+           "  (see smc2bin) back into an smc file.\n\n");
+    printf("Usage: ./bin2smc [OPTIONS] <bin-file> [smc-file]\n"
+           "  smc-file is gzipped if it ends in .gz; if it is not given,\n"
+           "  the smc file is written to stdout.\n"
+           " OPTIONS:\n"
+           " --region START-END\n"
+           "   Output only these coordinates (1-based). The trees are read\n"
+           "   through the index of the binary file, without decoding the\n"
+           "   rest of the file.\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int opt_idx;
+    int region[2]={-1,-1};
+    struct option long_opts[] = {
+        {"region", 1, 0, 'r'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "r:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'r':
+            if (2 != (sscanf(optarg, "%d-%d", &region[0], &region[1]))) {
+                fprintf(stderr, "error parsing region %s\n", optarg);
+                return 1;
+            }
+            region[0]--;  //convert to 0-based
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    Logger *logger = new Logger(stderr, LOG_HIGH);
+    g_logger.setChain(logger);
+
+    LocalTrees trees;
+    vector<string> seqnames;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    vector<double> times;
+    bool pop_model;
+    if (region[0] != -1) {
+        // invisible recombinations are not kept for regions
+        LocalTreesIndex index;
+        if (!index.open(argv[optind]) ||
+            !index.read_region(region[0], region[1], &trees)) {
+            fprintf(stderr, "Error reading region of binary file\n");
+            return 1;
+        }
+        seqnames = index.get_header().names;
+        times = index.get_header().times;
+        pop_model = index.get_header().pop_model;
+    } else {
+        FILE *infile = fopen(argv[optind], "rb");
+        if (!infile) {
+            fprintf(stderr, "Could not open %s\n", argv[optind]);
+            return 1;
+        }
+        if (!read_local_trees_binary(infile, NULL, 0, &trees, seqnames,
+                                     &invisible_recomb_pos, &invisible_recombs,
+                                     &times, &pop_model)) {
+            fprintf(stderr, "Error parsing binary file\n");
+            return 1;
+        }
+        fclose(infile);
+    }
+
+    const char **names = NULL;
+    if (seqnames.size() > 0) {
+        names = new const char* [seqnames.size()];
+        for (unsigned int i=0; i<seqnames.size(); i++)
+            names[i] = seqnames[i].c_str();
+    }
+    if (optind == argc - 2) {
+        CompressStream out(argv[optind+1], "w");
+        if (!out.stream) {
+            fprintf(stderr, "Could not write %s\n", argv[optind+1]);
+            return 1;
+        }
+        write_local_trees(out.stream, &trees, names, &times[0], pop_model,
+                          invisible_recomb_pos, invisible_recombs);
+    } else {
+        write_local_trees(stdout, &trees, names, &times[0], pop_model,
+                          invisible_recomb_pos, invisible_recombs);
+    }
+    delete [] names;
+    return 0;
+}
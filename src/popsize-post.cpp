@@ -1,6 +1,7 @@
 // C/C++ includes
 #include <time.h>
 #include <memory>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -80,6 +81,16 @@ public:
 		   ("", "--mpi", "<number of MPI arg-sample runs to combine>",
 		    &mpi, 0, "Will add \".<n>\" prefixes to n arg-sample outputs,"
 		    " for n from  0 to <mpi-1>"));
+        config.add(new ConfigParam<string>
+                   ("", "--write-stats", "<stats file>", &write_stats, "",
+                    "also write the coalescence counts of each rep, so that"
+                    " counts from several runs can be combined with"
+                    " --read-stats"));
+        config.add(new ConfigParam<string>
+                   ("", "--read-stats", "<file1,file2,...>", &read_stats, "",
+                    "estimate popsizes from counts written by --write-stats"
+                    " instead of reading ARGs. The counts of each rep are"
+                    " summed across the files (e.g. one file per chromosome)"));
 
         // model parameters
         config.add(new ConfigParamComment("Model parameters"));
@@ -90,19 +101,13 @@ public:
         config.add(new ConfigParam<string>
                    ("", "--sample-popsize-config", "<popsize config file>",
                     &popsize_config_file, "",
-                    "optional, for use with --sample-popsize: should have a"
-                    " line for each time interval, starting with the most"
-                    " recent. Each line can have up to three tab-separated"
-                    " columns, but only the first is required. The first column"
-                    " gives the name of the popsize parameter- any time"
-                    " intervals with the same entry here will be constrained"
-                    " to have the same popsize. The second line is the initial"
-                    " value for the parameter, and the third should be a 1 or"
-                    " 0 indicating whether to sample that parameter. The second"
-                    " and third columns are optional; by default all parameters"
-                    " will be sampled when --sample-popsize is used. For rows"
-                    " with the same value in the first column, the second and"
-                    " third columns should also be the same."));
+                    "optional: each line assigns a half time interval to a"
+                    " popsize parameter, with tab-separated columns"
+                    " param_name, time_idx [, pop, sample, init_val]."
+                    " time_idx is in [0, 2*ntimes-2]; time intervals with the"
+                    " same param_name are constrained to have the same popsize."
+                    " Parameters with sample=0 are held at their initial"
+                    " value."));
 	config.add(new ConfigSwitch
                    ("", "--sample-popsize-const", &sample_popsize_const,
 		    "sample popsize, keep constant across times"));
@@ -122,6 +127,9 @@ public:
 		    1.0, "Minimum number of recomb events affecting a time"
 		    " interval; time intervals with fewer events will be"
 		    " combined with adjacent, more ancient time interval (default: 1)"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<number of threads>", &nthreads, 1,
+                    "read ARGs on this many threads (default=1)"));
 
         // sampling
         config.add(new ConfigParamComment("Sampling"));
@@ -187,6 +195,8 @@ public:
     string outfile;
     string arg_dir;
     int mpi;
+    string write_stats;
+    string read_stats;
 
     // model parameters
     double popsize;
@@ -206,6 +216,7 @@ public:
     double pseudocount;
     int arg_start, arg_step;
     double min_events;
+    int nthreads;
 
     // search
     int niters;
@@ -228,6 +239,8 @@ public:
 
     //logging
     FILE *stats_file;
+    CompressStream *popsize_stats_stream;
+    bool popsize_stats_header;
 };
 
 
@@ -276,8 +289,8 @@ void log_model(const ArgModel &model)
     printLog(LOG_LOW, "%f]\n", model.times[model.ntimes-1]);
     printLog(LOG_LOW, "  popsizes = [");
     for (int i=0; i<2*model.ntimes-2; i++)
-        printLog(LOG_LOW, "%f,", model.popsizes[i]);
-    printLog(LOG_LOW, "%f]\n", model.popsizes[2*model.ntimes-2]);
+        printLog(LOG_LOW, "%f,", model.popsizes[0][i]);
+    printLog(LOG_LOW, "%f]\n", model.popsizes[0][2*model.ntimes-2]);
 
     if (isLogLevel(LOG_HIGH)) {
         printLog(LOG_HIGH, "mutmap = [\n");
@@ -308,8 +321,9 @@ void print_stats_header(Config *config) {
 void print_stats_popsizes(Config *config, int iter, ArgModel *model) {
     fprintf(config->stats_file, "popsize_mle\t%i", iter);
     for (int i=0; i < config->model.ntimes-1; i++)
-	fprintf(config->stats_file, "\t%.1lf", model->popsizes[2*i]);
+	fprintf(config->stats_file, "\t%.1lf", model->popsizes[0][2*i]);
     fprintf(config->stats_file, "\n");
+    fflush(config->stats_file);
 }
 
 
@@ -370,6 +384,248 @@ bool read_arg(const char *arg_file, const ArgModel *model,
 
 
 
+//=============================================================================
+// popsize estimation
+
+// Writes the counts of one rep if requested, then estimates and prints its
+// popsizes.  Pseudocounts are added after writing so that saved counts can
+// be combined without counting the prior more than once.
+void finish_rep(Config *c, ArgModel *model, struct popsize_data *data,
+                int rep)
+{
+    if (c->popsize_stats_stream) {
+        if (!c->popsize_stats_header) {
+            write_popsize_data_header(c->popsize_stats_stream->stream, data);
+            c->popsize_stats_header = true;
+        }
+        write_popsize_data(c->popsize_stats_stream->stream, data, rep);
+    }
+    add_popsize_pseudocounts(data, model->popsize_config.pseudocount);
+    mle_popsize(model, data, c->min_events);
+    print_stats_popsizes(c, rep, model);
+}
+
+
+// An ARG file and the index of the rep it belongs to
+class ArgFile
+{
+public:
+    ArgFile(int rep_index, const string &filename) :
+        rep_index(rep_index), filename(filename) {}
+
+    int rep_index;
+    string filename;
+};
+
+
+// Finds the ARG files of each rep from --arg-start on, stopping at the
+// first rep that is missing any of its files
+void find_arg_files(const Config &c, vector<int> &reps,
+                    vector<ArgFile> &files)
+{
+    for (int rep=c.arg_start; ; rep += c.arg_step) {
+        vector<ArgFile> rep_files;
+        for (int mpi=0; mpi==0 || mpi < c.mpi; mpi++) {
+            char file[10000];
+            if (!c.mpi)
+                snprintf(file, sizeof(file), "%s.%i.smc.gz",
+                         c.arg_dir.c_str(), rep);
+            else snprintf(file, sizeof(file), "%s%i.%i.smc.gz",
+                          c.arg_dir.c_str(), mpi, rep);
+            if (access(file, R_OK) != 0)
+                return;
+            rep_files.push_back(ArgFile(reps.size(), file));
+        }
+        reps.push_back(rep);
+        files.insert(files.end(), rep_files.begin(), rep_files.end());
+        if (c.arg_step <= 0)
+            return;
+    }
+}
+
+
+// ARG files read by a pool of threads.  The counts of each rep are merged
+// as its files are read, and reps are finished in order.
+class ArgFileJobs
+{
+public:
+    ArgFileJobs(Config *c, ArgModel *model, const vector<int> &reps,
+                const vector<ArgFile> &files) :
+        c(c), model(model), reps(reps), files(files),
+        data(reps.size()), nread(reps.size(), 0),
+        files_per_rep(max(c->mpi, 1)),
+        next_file(0), next_rep(0), error(false)
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~ArgFileJobs()
+    {
+        for (unsigned int i=next_rep; i<reps.size(); i++)
+            if (nread[i] > 0)
+                delete_popsize_data(&data[i]);
+        pthread_mutex_destroy(&lock);
+    }
+
+    Config *c;
+    ArgModel *model;
+    const vector<int> &reps;
+    const vector<ArgFile> &files;
+
+    vector<struct popsize_data> data;
+    vector<int> nread;
+    int files_per_rep;
+    int next_file;
+    int next_rep;
+    bool error;
+    pthread_mutex_t lock;
+};
+
+
+static void *read_arg_files_thread(void *ptr)
+{
+    ArgFileJobs *jobs = (ArgFileJobs*) ptr;
+    const int nfiles = jobs->files.size();
+    const int nreps = jobs->reps.size();
+
+    while (true) {
+        pthread_mutex_lock(&jobs->lock);
+        const int i = (jobs->error ? nfiles : jobs->next_file++);
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= nfiles)
+            break;
+
+        // counts are taken against the unchanging base model, while the
+        // finished reps update the popsizes of jobs->model
+        const ArgFile &file = jobs->files[i];
+        LocalTrees trees;
+        vector<string> seqnames;
+        struct popsize_data data;
+        bool ok = read_arg(file.filename.c_str(), &jobs->c->model, &trees,
+                           seqnames);
+        if (ok)
+            popsize_sufficient_stats(&data, &jobs->c->model, &trees);
+
+        pthread_mutex_lock(&jobs->lock);
+        const int r = file.rep_index;
+        if (!ok) {
+            jobs->error = true;
+        } else {
+            printLog(LOG_LOW, "read input ARG from %s\n",
+                     file.filename.c_str());
+            if (jobs->nread[r] == 0) {
+                jobs->data[r] = data;
+            } else {
+                if (!add_popsize_data(&jobs->data[r], &data)) {
+                    printError("'%s' does not have the same leaves as the"
+                               " other ARGs of rep %d",
+                               file.filename.c_str(), jobs->reps[r]);
+                    jobs->error = true;
+                }
+                delete_popsize_data(&data);
+            }
+            jobs->nread[r]++;
+        }
+        while (!jobs->error && jobs->next_rep < nreps &&
+               jobs->nread[jobs->next_rep] == jobs->files_per_rep) {
+            const int k = jobs->next_rep++;
+            finish_rep(jobs->c, jobs->model, &jobs->data[k], jobs->reps[k]);
+            delete_popsize_data(&jobs->data[k]);
+        }
+        pthread_mutex_unlock(&jobs->lock);
+    }
+    return NULL;
+}
+
+
+// Estimates popsizes from the ARGs of each rep using c->nthreads threads
+bool read_arg_files(Config *c, ArgModel *model)
+{
+    vector<int> reps;
+    vector<ArgFile> files;
+    find_arg_files(*c, reps, files);
+    if (reps.size() == 0) {
+        printError("no ARG files found for '%s'", c->arg_dir.c_str());
+        return false;
+    }
+
+    ArgFileJobs jobs(c, model, reps, files);
+
+    // the calling thread is one of the workers
+    vector<pthread_t> threads;
+    for (int i=1; i<c->nthreads && i<(int)files.size(); i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, read_arg_files_thread, &jobs) != 0)
+            break;
+        threads.push_back(thread);
+    }
+    read_arg_files_thread(&jobs);
+    for (unsigned int i=0; i<threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    return !jobs.error;
+}
+
+
+// Estimates popsizes from counts written with --write-stats, summing the
+// counts of each rep across files
+bool read_popsize_stats(Config *c, ArgModel *model)
+{
+    vector<string> filenames;
+    split(c->read_stats.c_str(), ",", filenames);
+    vector<PopsizeDataReader*> readers;
+    bool ok = true;
+    for (unsigned int i=0; i<filenames.size(); i++) {
+        readers.push_back(new PopsizeDataReader(filenames[i].c_str(),
+                                                &c->model));
+        if (readers.back()->error)
+            ok = false;
+    }
+
+    while (ok) {
+        struct popsize_data data;
+        int rep;
+        if (!readers[0]->next(&data, &rep)) {
+            ok = !readers[0]->error;
+            for (unsigned int i=1; ok && i<readers.size(); i++) {
+                if (readers[i]->line) {
+                    printError("%s has more reps than %s",
+                               filenames[i].c_str(), filenames[0].c_str());
+                    ok = false;
+                }
+            }
+            break;
+        }
+        for (unsigned int i=1; ok && i<readers.size(); i++) {
+            struct popsize_data other;
+            int rep2;
+            if (!readers[i]->next(&other, &rep2)) {
+                if (!readers[i]->error)
+                    printError("%s: missing rep %d", filenames[i].c_str(),
+                               rep);
+                ok = false;
+                break;
+            }
+            if (rep2 != rep || !add_popsize_data(&data, &other)) {
+                printError("%s: rep %d does not match rep %d of %s",
+                           filenames[i].c_str(), rep2, rep,
+                           filenames[0].c_str());
+                ok = false;
+            }
+            delete_popsize_data(&other);
+        }
+        if (ok)
+            finish_rep(c, model, &data, rep);
+        delete_popsize_data(&data);
+    }
+
+    for (unsigned int i=0; i<readers.size(); i++)
+        delete readers[i];
+    return ok;
+}
+
+
+
 //=============================================================================
 
 
@@ -396,7 +652,7 @@ int main(int argc, char **argv)
     // init random number generator
     if (c.randseed == 0)
         c.randseed = time(NULL);
-    srand(c.randseed);
+    seed_rand(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
     // setup model parameters
@@ -408,7 +664,15 @@ int main(int argc, char **argv)
         c.model.set_log_times(c.maxtime, c.ntimes, c.delta);
     c.model.rho = c.rho;
     c.model.mu = c.mu;
-    c.model.set_popsizes(c.popsize_str, c.model.ntimes);
+    c.model.set_popsizes(c.popsize_str);
+    if (c.popsize_config_file != "") {
+        c.model.popsize_config =
+            PopsizeConfig(c.popsize_config_file, c.model.ntimes,
+                          c.model.num_pops(), c.model.popsizes);
+    } else if (c.sample_popsize_const) {
+        c.model.popsize_config =
+            PopsizeConfig(c.model.ntimes, c.model.num_pops(), true, true);
+    }
     c.model.popsize_config.pseudocount = c.pseudocount;
 
     // log original model
@@ -423,38 +687,25 @@ int main(int argc, char **argv)
         return EXIT_ERROR;
     }
 
-    print_stats_header(&c);
-    //    ExtendArray<struct popsize_data> suff_stats;
-    for (int rep=c.arg_start; ; rep += c.arg_step) {
-	struct popsize_data data;
-	int num_read=0;
-	for (int mpi=0; mpi==0 || mpi < c.mpi; mpi++) {
-	    char file[10000];
-	    if (!c.mpi)
-		sprintf(file, "%s.%i.smc.gz", c.arg_dir.c_str(), rep);
-	    else sprintf(file, "%s%i.%i.smc.gz", c.arg_dir.c_str(), mpi, rep);
-	    LocalTrees *trees = new LocalTrees();
-	    bool new_arg;
-	    vector<string> seqnames;
-	    new_arg = read_arg(file, &c.model, trees, seqnames);
-	    if (new_arg) {
-		printLog(LOG_LOW, "read input ARG from %s\n", file);
-		// TODO: set pseudocount to zero first? Keep that separate?
-		//	    popsize_sufficient_stats(&data, model, trees);
-		//	    suff_stats.push(&data);
-		popsize_sufficient_stats(&data, &model, trees, mpi != 0);
-	    }
-	    delete trees;
-	    if (!new_arg) break;
-	    num_read++;
-	}
-	if (num_read == 0) break;
-	if (c.mpi > 0 && num_read != c.mpi) break;
-	mle_popsize(&model, &data, c.min_events);
-	print_stats_popsizes(&c, rep, &model);
-	delete_popsize_data(&data);
+    // init file of counts
+    c.popsize_stats_stream = NULL;
+    c.popsize_stats_header = false;
+    if (c.write_stats != "") {
+        c.popsize_stats_stream = new CompressStream(c.write_stats.c_str(), "w");
+        if (!c.popsize_stats_stream->stream) {
+            printError("could not open stats file '%s'",
+                       c.write_stats.c_str());
+            return EXIT_ERROR;
+        }
     }
 
+    print_stats_header(&c);
+    bool ok;
+    if (c.read_stats != "")
+        ok = read_popsize_stats(&c, &model);
+    else
+        ok = read_arg_files(&c, &model);
+
     // get memory usage in MB
     double maxrss = get_max_memory_usage() / 1000.0;
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
@@ -467,6 +718,7 @@ int main(int argc, char **argv)
 
     // clean up
     fclose(c.stats_file);
+    delete c.popsize_stats_stream;
 
-    return 0;
+    return ok ? 0 : EXIT_ERROR;
 }
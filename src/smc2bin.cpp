@@ -0,0 +1,109 @@
+#include "getopt.h"
+#include <assert.h>
+
+// argweaver includes
+#include "argweaver/local_tree.h"
+#include "argweaver/local_tree_binary.h"
+#include "argweaver/compress.h"
+#include "argweaver/logging.h"
+#include "argweaver/model.h"
+
+using namespace argweaver;
+
+void print_usage() {
+    printf("smc2bin: This program converts an smc file into the binary\n"
+           "  local trees format, which is smaller and faster to read.\n"
+           "  Use bin2smc to convert it back.\n\n");
+    printf("Usage: ./smc2bin [OPTIONS] <smc-file> <bin-file>\n"
+           "  smc-file can be gzipped\n"
+           " OPTIONS:\n"
+           " --log-file <file.log>\n"
+           "   Log file from arg-sample run; this is used as input to read model"
+           "   parameters. If not provided, smc2bin will look for log file"
+           "   in directory with smc file.\n");
+}
+
+
+bool guess_log_file(char *smc_file, char *log_file) {
+    int len = strlen(smc_file);
+    strcpy(log_file, smc_file);
+    if (len > 7 && strcmp(&smc_file[len-7], ".smc.gz")==0) {
+        int pos=len-8;
+        while (pos >= 0 && smc_file[pos] != '.') pos--;
+        if (pos < 0) return false;
+        strcpy(&log_file[pos], ".log");
+        return true;
+    }
+    return false;
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    char *log_file = NULL;
+    int opt_idx;
+    struct option long_opts[] = {
+        {"log-file", 1, 0, 'l'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "l:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'l':
+            log_file = optarg;
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    Logger *logger = new Logger(stderr, LOG_HIGH);
+    g_logger.setChain(logger);
+
+    if (log_file == NULL) {
+        log_file = (char*)malloc((strlen(argv[optind])+10)*sizeof(char));
+        if (!guess_log_file(argv[optind], log_file)) {
+            fprintf(stderr, "Could not guess log file name, provide with -l\n");
+            return 1;
+        }
+    }
+    ArgModel model(log_file);
+
+    CompressStream instream(argv[optind], "r");
+    if (!instream.stream) {
+        fprintf(stderr, "Could not open %s\n", argv[optind]);
+        return 1;
+    }
+    LocalTrees trees;
+    vector<string> seqnames;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    if (!read_local_trees(instream.stream, model.times, model.ntimes,
+                          &trees, seqnames, &invisible_recomb_pos,
+                          &invisible_recombs)) {
+        fprintf(stderr, "Error parsing SMC file\n");
+        return 1;
+    }
+    instream.close();
+
+    FILE *out = fopen(argv[optind+1], "wb");
+    if (!out) {
+        fprintf(stderr, "Could not write %s\n", argv[optind+1]);
+        return 1;
+    }
+    write_local_trees_binary(out, &trees, seqnames, model.times, model.ntimes,
+                             model.pop_tree != NULL, invisible_recomb_pos,
+                             invisible_recombs);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error writing %s\n", argv[optind+1]);
+        return 1;
+    }
+    return 0;
+}
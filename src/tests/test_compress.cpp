@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/compress.h"
+
+
+namespace argweaver {
+
+// the empty block that ends a BGZF file
+static const unsigned char BGZF_EOF_BLOCK[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00
+};
+
+
+// Reads a whole stream.
+static string read_stream(FILE *stream)
+{
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    return text;
+}
+
+
+static string read_file(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return string();
+    string text = read_stream(file);
+    fclose(file);
+    return text;
+}
+
+
+// Text lines mixed with random bytes, so that blocks compress unevenly.
+static string make_test_data(int size)
+{
+    string data;
+    seed_rand(1);
+    while (int(data.size()) < size) {
+        char line[100];
+        snprintf(line, sizeof(line), "chr1\t%d\t%d\tname%d\n",
+                 int(data.size()), irand(1000000), irand(100));
+        data += line;
+        if (irand(10) == 0)
+            for (int i=0; i<200; i++)
+                data += char(irand(256));
+    }
+    data.resize(size);
+    return data;
+}
+
+
+// Expect 'bytes' to be BGZF blocks holding 'size' bytes in all, with at
+// least 'min_blocks' data blocks, followed by the EOF block.
+static void expect_bgzf_blocks(const string &bytes, size_t size,
+                               int min_blocks)
+{
+    size_t pos = 0, total = 0;
+    int nblocks = 0;
+    while (pos + 18 <= bytes.size()) {
+        const unsigned char *block = (const unsigned char*) &bytes[pos];
+        ASSERT_EQ(0x1f, block[0]);
+        ASSERT_EQ(0x8b, block[1]);
+        ASSERT_TRUE(block[3] & 4);   // extra field
+        ASSERT_EQ('B', block[12]);
+        ASSERT_EQ('C', block[13]);
+        const size_t bsize = (block[16] | (block[17] << 8)) + 1;
+        ASSERT_LE(pos + bsize, bytes.size());
+        const size_t isize = block[bsize-4] | (block[bsize-3] << 8) |
+            (block[bsize-2] << 16) | (size_t(block[bsize-1]) << 24);
+        EXPECT_LE(isize, 0xff00u);
+        if (pos + bsize == bytes.size()) {
+            // the last block is the EOF marker
+            ASSERT_EQ(sizeof(BGZF_EOF_BLOCK), bsize);
+            EXPECT_EQ(0, memcmp(block, BGZF_EOF_BLOCK, bsize));
+        } else {
+            EXPECT_GT(isize, 0u);
+            nblocks++;
+        }
+        total += isize;
+        pos += bsize;
+    }
+    EXPECT_EQ(bytes.size(), pos);
+    EXPECT_EQ(size, total);
+    EXPECT_GE(nblocks, min_blocks);
+}
+
+
+// Write 'data' with write_compress() and read it back with
+// read_compress().
+static void expect_round_trip(const string &data, int nthreads)
+{
+    char filename[] = "/tmp/test_compress_XXXXXX";
+    const int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    set_compress_threads(nthreads);
+    FILE *out = write_compress(filename);
+    ASSERT_TRUE(out != NULL);
+    // uneven writes, some larger than a block
+    for (size_t pos=0; pos<data.size(); ) {
+        const size_t n = min(data.size() - pos, size_t(1 + irand(100000)));
+        ASSERT_EQ(n, fwrite(data.data() + pos, 1, n, out));
+        pos += n;
+    }
+    EXPECT_EQ(0, close_compress(out));
+    set_compress_threads(1);
+
+    expect_bgzf_blocks(read_file(filename), data.size(),
+                       data.size() / 0xff00);
+
+    FILE *in = read_compress(filename);
+    ASSERT_TRUE(in != NULL);
+    EXPECT_TRUE(read_stream(in) == data);
+    EXPECT_EQ(0, close_compress(in));
+
+    remove(filename);
+}
+
+
+// BGZF files written in process should read back unchanged, with full
+// blocks compressed on one thread or several.
+TEST(CompressTest, test_bgzf_round_trip)
+{
+    const string data = make_test_data(300000);
+    expect_round_trip(data, 1);
+    expect_round_trip(data, 3);
+
+    // an empty file is just the EOF block
+    expect_round_trip(string(), 1);
+}
+
+
+// Files that are not compressed are read unchanged, like 'gunzip -f'.
+TEST(CompressTest, test_read_uncompressed)
+{
+    char filename[] = "/tmp/test_compress_XXXXXX";
+    const int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    const string data = make_test_data(100000);
+    ASSERT_EQ(ssize_t(data.size()), write(fd, data.data(), data.size()));
+    close(fd);
+
+    FILE *in = read_compress(filename);
+    ASSERT_TRUE(in != NULL);
+    EXPECT_TRUE(read_stream(in) == data);
+    EXPECT_EQ(0, close_compress(in));
+    remove(filename);
+}
+
+
+// A string read in small pieces through open_read_stream().
+struct StringCookie
+{
+    string data;
+    size_t pos;
+    bool closed;
+};
+
+static ssize_t string_cookie_read(void *cookie, char *buf, size_t size)
+{
+    StringCookie *text = (StringCookie*) cookie;
+    size = min(min(size, size_t(7)), text->data.size() - text->pos);
+    memcpy(buf, text->data.data() + text->pos, size);
+    text->pos += size;
+    return size;
+}
+
+static int string_cookie_close(void *cookie)
+{
+    ((StringCookie*) cookie)->closed = true;
+    return 0;
+}
+
+
+// Streams from open_read_stream() read through their functions and are
+// closed by close_compress().
+TEST(CompressTest, test_open_read_stream)
+{
+    StringCookie cookie;
+    cookie.data = make_test_data(100000);
+    cookie.pos = 0;
+    cookie.closed = false;
+
+    FILE *stream = open_read_stream(&cookie, string_cookie_read,
+                                    string_cookie_close);
+    ASSERT_TRUE(stream != NULL);
+    EXPECT_TRUE(read_stream(stream) == cookie.data);
+    EXPECT_EQ(0, close_compress(stream));
+    EXPECT_TRUE(cookie.closed);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,424 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/arena.h"
+#include "argweaver/common.h"
+#include "argweaver/emit.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/simd.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// The compressed forward algorithm should agree with the dense forward
+// algorithm for every available SIMD kernel.
+TEST(HmmTest, test_forward_block_simd)
+{
+    // Setup model.
+    const int ntimes = 5;
+    double times[] = {0, 10, 20, 30, 40};
+    ArgModel model(ntimes, times, NULL, 1e-9, 2.5e-9);
+    model.smc_prime = false;
+    model.set_popsizes(1e4);
+
+    // Read tree.
+    const char *newick =
+        "((0,1)5[&&NHX:age=10],((2,3)6[&&NHX:age=20],4)7[&&NHX:age=20])8[&&NHX:age=30]";
+    LocalTree tree;
+    ASSERT_TRUE(parse_local_tree(newick, &tree, times, ntimes));
+
+    States states;
+    get_coal_states_external(&tree, ntimes, states);
+    const int nstates = states.size();
+    LineageCounts lineages(ntimes, model.num_pops());
+    lineages.count(&tree, model.pop_tree);
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    // Random emissions and a uniform first column.
+    const int blocklen = 50;
+    seed_rand(1);
+    double **emit = new_matrix<double>(blocklen, nstates);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = frand(.1, 1.0);
+    double **fw_slow = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    for (int k=0; k<nstates; k++)
+        fw_slow[0][k] = fw[0][k] = 1.0 / nstates;
+
+    arghmm_forward_block_slow(&tree, ntimes, blocklen, states, lineages,
+                              &matrix, emit, fw_slow);
+
+    const int levels[] = {SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+    const int orig_level = get_simd_level();
+    for (int l=0; l<3; l++) {
+        set_simd_level(levels[l]);
+        arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                             &matrix, emit, fw);
+        for (int i=0; i<blocklen; i++)
+            for (int k=0; k<nstates; k++)
+                EXPECT_NEAR(fw[i][k], fw_slow[i][k], 1e-12)
+                    << simd_level_name(get_simd_level());
+    }
+    set_simd_level(orig_level);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw_slow, blocklen);
+    delete_matrix<double>(fw, blocklen);
+}
+
+
+// Cached transition matrices should give the same forward table and
+// traceback as computing every block's matrices afresh, whether the
+// cache holds every block, evicts blocks or is filled by worker threads.
+TEST(HmmTest, test_forward_matrix_cache)
+{
+    // Setup model.
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+
+    const int nseqs = 6;
+    const int new_chrom = nseqs - 1;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 2,
+                    nseqs - 1);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    // Uncached forward table and traceback.
+    vector<int> path(trees.length());
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    seed_rand(3);
+    stochastic_traceback(&trees, &model, &matrix_iter, &forward, &path[0]);
+    double **fw = forward.get_table();
+
+    const long max_bytes[] = {1L << 30, 1L << 30, 200000};
+    const int nthreads[] = {1, 3, 1};
+    for (int c=0; c<3; c++) {
+        vector<int> path2(trees.length());
+        ArgHmmForwardTable forward2(trees.start_coord, trees.length());
+        ArgHmmMatrixCache matrix_cache(&model, &sequences, &trees, new_chrom,
+                                       max_bytes[c]);
+        matrix_cache.set_threads(nthreads[c]);
+        arghmm_forward_alg(&trees, &model, &sequences, &matrix_cache,
+                           &forward2);
+
+        // the traceback reuses the cached matrices, as sample_arg_thread()
+        matrix_cache.set_seqs(NULL);
+        seed_rand(3);
+        stochastic_traceback(&trees, &model, &matrix_cache, &forward2,
+                             &path2[0]);
+        if (c < 2)
+            EXPECT_GT(matrix_cache.get_hits(), 0);
+        EXPECT_LE(matrix_cache.get_nbytes(), max_bytes[c]);
+
+        double **fw2 = forward2.get_table();
+        States states;
+        for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+            matrix_iter.get_coal_states(states);
+            const int nstates = max(int(states.size()), 1);
+            for (int i=matrix_iter.get_block_start();
+                 i<matrix_iter.get_block_end(); i++)
+                for (int k=0; k<nstates; k++)
+                    ASSERT_EQ(fw[i][k], fw2[i][k]) << c << " " << i;
+        }
+        for (int i=0; i<trees.length(); i++)
+            ASSERT_EQ(path[i], path2[i]) << c << " " << i;
+    }
+}
+
+
+// A matrix iterator that shares at most 'max_size' transition matrices
+// between blocks (none by default).
+class SharedMatrixIter : public ArgHmmMatrixIter
+{
+public:
+    SharedMatrixIter(const ArgModel *model, const Sequences *seqs,
+                       const LocalTrees *trees, int new_chrom,
+                       int max_size=0) :
+        ArgHmmMatrixIter(model, seqs, trees, new_chrom)
+    {
+        delete transmat_cache;
+        transmat_cache = new TransMatrixCache(max_size);
+    }
+};
+
+
+// Transition matrices shared between blocks should give exactly the
+// forward table of matrices computed for every block.
+TEST(HmmTest, test_forward_transmat_cache)
+{
+    // Setup model.
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+
+    const int nseqs = 6;
+    const int new_chrom = nseqs - 1;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 2,
+                    nseqs - 1);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    SharedMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    EXPECT_EQ(0, matrix_iter.get_transmat_cache()->get_hits());
+    double **fw = forward.get_table();
+
+    // the default cache and one that keeps a single matrix, each run
+    // twice over the same blocks
+    const int max_sizes[] = {16, 1};
+    for (int c=0; c<2; c++) {
+        SharedMatrixIter matrix_iter2(&model, &sequences, &trees,
+                                        new_chrom, max_sizes[c]);
+        for (int pass=0; pass<2; pass++) {
+            ArgHmmForwardTable forward2(trees.start_coord, trees.length());
+            arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter2,
+                               &forward2);
+            EXPECT_GT(matrix_iter2.get_transmat_cache()->get_hits(), 0);
+
+            double **fw2 = forward2.get_table();
+            States states;
+            for (matrix_iter.begin(); matrix_iter.more();
+                 matrix_iter.next()) {
+                matrix_iter.get_coal_states(states);
+                const int nstates = max(int(states.size()), 1);
+                for (int i=matrix_iter.get_block_start();
+                     i<matrix_iter.get_block_end(); i++)
+                    for (int k=0; k<nstates; k++)
+                        ASSERT_EQ(fw[i][k], fw2[i][k])
+                            << max_sizes[c] << " " << pass << " " << i;
+            }
+        }
+    }
+}
+
+
+// The segmented forward algorithm should agree with the sequential one.
+TEST(HmmTest, test_forward_alg_segments)
+{
+    // Setup model.
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+
+    const int nseqs = 6;
+    const int new_chrom = nseqs - 1;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 2,
+                    nseqs - 1);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    // Forward tables for the last sequence.
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    double **fw = forward.get_table();
+
+    model.hmm_config.forward_segments = 8;
+    model.hmm_config.nthreads = 3;
+    ArgHmmForwardTable forward2(trees.start_coord, trees.length());
+    ArgHmmMatrixIter matrix_iter2(&model, &sequences, &trees, new_chrom);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter2, &forward2);
+    double **fw2 = forward2.get_table();
+
+    States states;
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        matrix_iter.get_coal_states(states);
+        const int nstates = max(int(states.size()), 1);
+        for (int i=matrix_iter.get_block_start();
+             i<matrix_iter.get_block_end(); i++)
+            for (int k=0; k<nstates; k++)
+                ASSERT_NEAR(fw[i][k], fw2[i][k], 1e-10) << i << " " << k;
+    }
+}
+
+
+// Expect the packed emission kernels to agree with the per-site pruning
+// for 'seqs'.
+static void expect_emissions_simd(const States &states, const LocalTree *tree,
+                                  char *const *seqs, int nseqs, int seqlen,
+                                  const ArgModel *model)
+{
+    const int nstates = states.size();
+    BaseProbsView base_probs;
+
+    double **emit = new_matrix<double>(seqlen, nstates);
+    double **emit2 = new_matrix<double>(seqlen, nstates);
+    const int orig_level = get_simd_level();
+    set_simd_level(SIMD_SCALAR);
+    calc_emissions_external(states, tree, seqs, base_probs, nseqs, seqlen,
+                            model, emit, NULL);
+    double lnl = likelihood_tree(tree, model, seqs, base_probs, nseqs - 1,
+                                 0, seqlen);
+
+    const int levels[] = {SIMD_AVX2, SIMD_AVX512};
+    for (int l=0; l<2; l++) {
+        set_simd_level(levels[l]);
+        calc_emissions_external(states, tree, seqs, base_probs, nseqs,
+                                seqlen, model, emit2, NULL);
+        for (int i=0; i<seqlen; i++)
+            for (int k=0; k<nstates; k++)
+                EXPECT_NEAR(emit2[i][k] / emit[i][k], 1.0, 1e-12)
+                    << simd_level_name(get_simd_level());
+        EXPECT_NEAR(likelihood_tree(tree, model, seqs, base_probs,
+                                    nseqs - 1, 0, seqlen), lnl, 1e-9)
+            << simd_level_name(get_simd_level());
+    }
+    set_simd_level(orig_level);
+
+    delete_matrix<double>(emit, seqlen);
+    delete_matrix<double>(emit2, seqlen);
+}
+
+
+// The packed emission kernels should agree with the per-site pruning.
+TEST(HmmTest, test_emissions_simd)
+{
+    // Setup model.
+    const int ntimes = 5;
+    double times[] = {0, 10, 20, 30, 40};
+    ArgModel model(ntimes, times, NULL, 1e-9, 2.5e-3);
+    model.set_popsizes(1e4);
+
+    // Read tree.
+    const char *newick =
+        "((0,1)5[&&NHX:age=10],((2,3)6[&&NHX:age=20],4)7[&&NHX:age=20])8[&&NHX:age=30]";
+    LocalTree tree;
+    ASSERT_TRUE(parse_local_tree(newick, &tree, times, ntimes));
+    States states;
+    get_coal_states_external(&tree, ntimes, states);
+
+    // Random sequences for the leaves and the new branch, with masking.
+    const int nseqs = 6;
+    const int seqlen = 203;
+    const char *bases = "ACGTN";
+    seed_rand(3);
+    char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++) {
+        seqs[j] = new char [seqlen];
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = 'A';
+    }
+    for (int i=0; i<seqlen; i++) {
+        if (frand() < .3)
+            for (int j=0; j<nseqs; j++)
+                seqs[j][i] = bases[irand(5)];
+    }
+    expect_emissions_simd(states, &tree, seqs, nseqs, seqlen, &model);
+
+    // A region without variant sites has no patterns to pack.
+    for (int j=0; j<nseqs; j++)
+        for (int i=0; i<seqlen; i++)
+            seqs[j][i] = (i % 10 == 0 ? 'N' : 'A');
+    expect_emissions_simd(states, &tree, seqs, nseqs, seqlen, &model);
+
+    for (int j=0; j<nseqs; j++)
+        delete [] seqs[j];
+}
+
+
+// A forward table that only keeps some columns should give the same
+// traceback as the full table.
+TEST(HmmTest, test_forward_checkpoints)
+{
+    // Setup model.
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+
+    const int nseqs = 6;
+    const int new_chrom = nseqs - 1;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 2,
+                    nseqs - 1);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    // Full table.
+    vector<int> path(trees.length());
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    seed_rand(3);
+    stochastic_traceback(&trees, &model, &matrix_iter, &forward, &path[0]);
+
+    States states;
+    long nbytes = 0;
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        matrix_iter.get_coal_states(states);
+        nbytes += matrix_iter.get_blocklen() * max(int(states.size()), 1) *
+            sizeof(double);
+    }
+
+    // Tables keeping every 37-th column in double and single precision.
+    for (int single=0; single<2; single++) {
+        vector<int> path2(trees.length());
+        ArgHmmForwardCheckpoints forward2(trees.start_coord, trees.length(),
+                                          37, single);
+        ArgHmmMatrixIter matrix_iter2(&model, &sequences, &trees, new_chrom);
+        arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter2,
+                           &forward2);
+        ASSERT_LT(forward2.get_nbytes(), nbytes / 10);
+        seed_rand(3);
+        stochastic_traceback(&trees, &model, &matrix_iter2, &forward2,
+                             &path2[0]);
+
+        int ndiff = 0;
+        for (int i=0; i<trees.length(); i++)
+            ndiff += (path[i] != path2[i]);
+        if (single)
+            EXPECT_LT(ndiff, trees.length() / 100);
+        else
+            EXPECT_EQ(ndiff, 0);
+    }
+}
+
+
+// Arrays from the arena should be aligned and not overlap, and after the
+// chunks of the first block are merged, the same arrays should fit
+// without growing the arena.
+TEST(HmmTest, test_scratch_arena)
+{
+    ScratchArena arena;
+    size_t nbytes = 0;
+    for (int round=0; round<4; round++) {
+        seed_rand(1);
+        vector<int*> arrays;
+        vector<int> sizes;
+        for (int i=0; i<200; i++) {
+            const int n = irand(1, 1000);
+            int *array = arena.alloc<int>(n);
+            EXPECT_EQ(0u, ((size_t) array) % 64);
+            for (int j=0; j<n; j++)
+                array[j] = i;
+            arrays.push_back(array);
+            sizes.push_back(n);
+        }
+        for (unsigned int i=0; i<arrays.size(); i++)
+            for (int j=0; j<sizes[i]; j++)
+                ASSERT_EQ(int(i), arrays[i][j]);
+
+        if (round > 0)
+            EXPECT_EQ(nbytes, arena.get_nbytes()) << round;
+        nbytes = arena.get_nbytes();
+        arena.reset();
+        EXPECT_EQ(nbytes, arena.get_nbytes()) << round;
+    }
+}
+
+
+} // namespace argweaver
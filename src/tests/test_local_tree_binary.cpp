@@ -0,0 +1,344 @@
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/local_tree.h"
+#include "argweaver/local_tree_binary.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// Leaves below each node of 'tree', as a bit mask.  Node ids differ
+// between an ARG and its decoded copy, but the clades do not.
+static vector<unsigned int> get_clades(const LocalTree *tree)
+{
+    vector<unsigned int> clades(tree->nnodes, 0);
+    for (int i=0; i<tree->get_num_leaves(); i++)
+        for (int j=i; j != -1; j=tree->nodes[j].parent)
+            clades[j] |= 1u << i;
+    return clades;
+}
+
+
+// Expect two trees to have the same clades, ages and population paths.
+static void expect_same_tree(const LocalTree *tree1, const LocalTree *tree2)
+{
+    ASSERT_EQ(tree1->nnodes, tree2->nnodes);
+    const vector<unsigned int> clades1 = get_clades(tree1);
+    const vector<unsigned int> clades2 = get_clades(tree2);
+    map<unsigned int, pair<int, int> > nodes1, nodes2;
+    for (int i=0; i<tree1->nnodes; i++) {
+        nodes1[clades1[i]] = make_pair(tree1->nodes[i].age,
+                                       tree1->nodes[i].pop_path);
+        nodes2[clades2[i]] = make_pair(tree2->nodes[i].age,
+                                       tree2->nodes[i].pop_path);
+    }
+    EXPECT_EQ(nodes1, nodes2);
+}
+
+
+// Expect two SPRs, in the node ids of the trees before them, to move the
+// same clades.
+static void expect_same_spr(const Spr &spr1, const LocalTree *last_tree1,
+                            const Spr &spr2, const LocalTree *last_tree2)
+{
+    const vector<unsigned int> clades1 = get_clades(last_tree1);
+    const vector<unsigned int> clades2 = get_clades(last_tree2);
+    EXPECT_EQ(clades1[spr1.recomb_node], clades2[spr2.recomb_node]);
+    EXPECT_EQ(spr1.recomb_time, spr2.recomb_time);
+    EXPECT_EQ(clades1[spr1.coal_node], clades2[spr2.coal_node]);
+    EXPECT_EQ(spr1.coal_time, spr2.coal_time);
+    EXPECT_EQ(spr1.pop_path, spr2.pop_path);
+}
+
+
+// Expect every block, tree and SPR of two ARGs to match.
+static void expect_same_trees(const LocalTrees *trees1,
+                              const LocalTrees *trees2)
+{
+    EXPECT_EQ(trees1->chrom, trees2->chrom);
+    EXPECT_EQ(trees1->start_coord, trees2->start_coord);
+    EXPECT_EQ(trees1->end_coord, trees2->end_coord);
+    ASSERT_EQ(trees1->get_num_trees(), trees2->get_num_trees());
+
+    const LocalTree *last_tree1 = NULL, *last_tree2 = NULL;
+    LocalTrees::const_iterator it2 = trees2->begin();
+    for (LocalTrees::const_iterator it1=trees1->begin();
+         it1 != trees1->end(); ++it1, ++it2) {
+        EXPECT_EQ(it1->blocklen, it2->blocklen);
+        expect_same_tree(it1->tree, it2->tree);
+        if (last_tree1)
+            expect_same_spr(it1->spr, last_tree1, it2->spr, last_tree2);
+        else
+            EXPECT_TRUE(it2->spr.is_null());
+        last_tree1 = it1->tree;
+        last_tree2 = it2->tree;
+    }
+}
+
+
+// Write 'trees' to a temporary file and read them back.
+static void binary_round_trip(const ArgModel *model, const LocalTrees *trees,
+                              const Sequences *sequences, bool pop_model,
+                              LocalTrees *trees2,
+                              const vector<int> &invisible_pos=vector<int>(),
+                              const vector<Spr> &invisible=vector<Spr>())
+{
+    FILE *file = tmpfile();
+    ASSERT_TRUE(file != NULL);
+    write_local_trees_binary(file, trees, sequences->names, model->times,
+                             model->ntimes, pop_model, invisible_pos,
+                             invisible);
+    rewind(file);
+
+    vector<string> seqnames;
+    vector<int> invisible_pos2;
+    vector<Spr> invisible2;
+    vector<double> file_times;
+    bool pop_model2 = !pop_model;
+    ASSERT_TRUE(read_local_trees_binary(file, model->times, model->ntimes,
+                                        trees2, seqnames, &invisible_pos2,
+                                        &invisible2, &file_times,
+                                        &pop_model2));
+    fclose(file);
+
+    EXPECT_EQ(pop_model, pop_model2);
+    EXPECT_EQ(vector<double>(model->times, model->times + model->ntimes),
+              file_times);
+    ASSERT_EQ(int(seqnames.size()), trees->get_num_leaves());
+    for (unsigned int i=0; i<seqnames.size(); i++)
+        EXPECT_EQ(sequences->names[trees->seqids[i]], seqnames[i]);
+
+    ASSERT_EQ(invisible_pos, invisible_pos2);
+    ASSERT_EQ(invisible.size(), invisible2.size());
+    for (unsigned int i=0; i<invisible.size(); i++) {
+        EXPECT_EQ(invisible[i].recomb_node, invisible2[i].recomb_node);
+        EXPECT_EQ(invisible[i].recomb_time, invisible2[i].recomb_time);
+        EXPECT_EQ(invisible[i].coal_node, invisible2[i].coal_node);
+        EXPECT_EQ(invisible[i].coal_time, invisible2[i].coal_time);
+        EXPECT_EQ(invisible[i].pop_path, invisible2[i].pop_path);
+    }
+}
+
+
+// Reading a written ARG should give back every tree and SPR.
+TEST(LocalTreeBinaryTest, test_round_trip)
+{
+    ArgModel model(20, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+    const int nseqs = 6;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 5, nseqs);
+    trees.chrom = "chr1";
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    LocalTrees trees2;
+    binary_round_trip(&model, &trees, &sequences, false, &trees2);
+    expect_same_trees(&trees, &trees2);
+}
+
+
+// Population paths of the nodes and SPRs, and invisible recombinations,
+// should survive a round trip with a population model.
+TEST(LocalTreeBinaryTest, test_round_trip_pop_model)
+{
+    ArgModel model(20, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+    const int nseqs = 6;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 6, nseqs);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    // The format stores paths as given, so arbitrary ones are enough.
+    // Most nodes keep their path between trees, as in a sampled ARG.
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        for (int i=0; i<it->tree->nnodes; i++)
+            if (it == trees.begin() || irand(4) == 0)
+                it->tree->nodes[i].pop_path = irand(3);
+        if (!it->spr.is_null())
+            it->spr.pop_path = irand(3);
+    }
+    vector<int> invisible_pos;
+    vector<Spr> invisible;
+    for (int i=0; i<3; i++) {
+        invisible_pos.push_back(1000 * (i + 1));
+        invisible.push_back(Spr(i, i, i + 1, i + 2, i));
+    }
+
+    LocalTrees trees2;
+    binary_round_trip(&model, &trees, &sequences, true, &trees2,
+                      invisible_pos, invisible);
+    expect_same_trees(&trees, &trees2);
+}
+
+
+// Expect the trees of [start, end) read through 'index' to match the
+// same region of the fully decoded 'full'.
+static void expect_region(LocalTreesIndex *index, const LocalTrees *full,
+                          int start, int end)
+{
+    LocalTrees region;
+    ASSERT_TRUE(index->read_region(start, end, &region));
+    EXPECT_EQ(max(start, full->start_coord), region.start_coord);
+    EXPECT_EQ(min(end, full->end_coord), region.end_coord);
+
+    LocalTrees::const_iterator it2 = region.begin();
+    const LocalTree *last_tree = NULL, *last_tree2 = NULL;
+    int block_end = full->start_coord;
+    for (LocalTrees::const_iterator it=full->begin(); it != full->end();
+         ++it) {
+        const int block_start = block_end;
+        block_end += it->blocklen;
+        if (block_end <= start || block_start >= end) {
+            last_tree = it->tree;
+            continue;
+        }
+        ASSERT_TRUE(it2 != region.end());
+        EXPECT_EQ(min(block_end, end) - max(block_start, start),
+                  it2->blocklen);
+        expect_same_tree(it->tree, it2->tree);
+        if (last_tree2)
+            expect_same_spr(it->spr, last_tree, it2->spr, last_tree2);
+        else
+            EXPECT_TRUE(it2->spr.is_null());
+        last_tree = it->tree;
+        last_tree2 = it2->tree;
+        ++it2;
+    }
+    EXPECT_TRUE(it2 == region.end());
+}
+
+
+// Expect the tree at 'pos' read through 'index' to match 'full'.
+static void expect_tree_at(LocalTreesIndex *index, const LocalTrees *full,
+                           int pos)
+{
+    int start, end;
+    LocalTree *tree = index->get_tree(pos, &start, &end);
+    ASSERT_TRUE(tree != NULL);
+    int block_end = full->start_coord;
+    for (LocalTrees::const_iterator it=full->begin(); it != full->end();
+         ++it) {
+        const int block_start = block_end;
+        block_end += it->blocklen;
+        if (pos < block_end) {
+            EXPECT_EQ(block_start, start);
+            EXPECT_EQ(block_end, end);
+            expect_same_tree(it->tree, tree);
+            break;
+        }
+    }
+    delete tree;
+}
+
+
+// Read regions and single trees around every keyframe through 'index'.
+static void expect_index_queries(LocalTreesIndex *index,
+                                 const LocalTrees *full)
+{
+    // records per block of the binary format; each block after the
+    // first starts at a keyframe
+    const int block_records = 4096;
+
+    vector<int> starts;
+    int pos = full->start_coord;
+    for (LocalTrees::const_iterator it=full->begin(); it != full->end();
+         ++it) {
+        starts.push_back(pos);
+        pos += it->blocklen;
+    }
+
+    vector<int> positions;
+    positions.push_back(full->start_coord);
+    positions.push_back(full->end_coord - 1);
+    for (unsigned int i=block_records; i<starts.size(); i+=block_records) {
+        positions.push_back(starts[i] - 1);
+        positions.push_back(starts[i]);
+        positions.push_back(starts[i] + 1);
+    }
+    for (unsigned int i=0; i<positions.size(); i++) {
+        expect_tree_at(index, full, positions[i]);
+        expect_region(index, full, positions[i], positions[i] + 1);
+        expect_region(index, full, positions[i] - 50, positions[i] + 50);
+    }
+
+    // regions spanning a keyframe, and the whole ARG
+    expect_region(index, full, starts[block_records / 2],
+                  starts[3 * block_records / 2]);
+    expect_region(index, full, full->start_coord, full->end_coord);
+}
+
+
+// Queries through the index should match a full decode, for files with
+// and without an index.
+TEST(LocalTreeBinaryTest, test_index)
+{
+    // a high recombination rate gives several blocks of SPRs
+    ArgModel model(10, 200e3, 1e4, 1e-6, 1.8e-8);
+    model.smc_prime = false;
+    const int nseqs = 4;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 150000, 7, nseqs);
+    ASSERT_GT(trees.get_num_trees(), 3 * 4096);
+
+    char filename[] = "/tmp/test_local_tree_binary_XXXXXX";
+    const int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    ASSERT_TRUE(write_local_trees_binary(filename, &trees, sequences.names,
+                                         model.times, model.ntimes));
+
+    LocalTrees full;
+    vector<string> seqnames;
+    ASSERT_TRUE(read_local_trees_binary(filename, model.times, model.ntimes,
+                                        &full, seqnames));
+    expect_same_trees(&trees, &full);
+
+    LocalTreesIndex index;
+    ASSERT_TRUE(index.open(filename, model.times, model.ntimes));
+    EXPECT_EQ(trees.get_num_trees() / 4096 + 1, index.get_num_keyframes());
+    expect_index_queries(&index, &full);
+    index.close();
+
+    // Drop the index, as in files written before there was one: clear
+    // its flag and cut the file at the offset given by the footer.
+    FILE *file = fopen(filename, "r+b");
+    ASSERT_TRUE(file != NULL);
+    unsigned char footer[8], flags;
+    ASSERT_EQ(0, fseek(file, -12, SEEK_END));
+    ASSERT_EQ(8u, fread(footer, 1, 8, file));
+    long long index_offset = 0;
+    for (int i=7; i>=0; i--)
+        index_offset = (index_offset << 8) | footer[i];
+    ASSERT_EQ(0, fseek(file, 8, SEEK_SET));
+    ASSERT_EQ(1u, fread(&flags, 1, 1, file));
+    flags &= ~4;
+    ASSERT_EQ(0, fseek(file, 8, SEEK_SET));
+    ASSERT_EQ(1u, fwrite(&flags, 1, 1, file));
+    fclose(file);
+    ASSERT_EQ(0, truncate(filename, index_offset));
+
+    LocalTrees full2;
+    ASSERT_TRUE(read_local_trees_binary(filename, model.times, model.ntimes,
+                                        &full2, seqnames));
+    expect_same_trees(&trees, &full2);
+    ASSERT_TRUE(index.open(filename, model.times, model.ntimes));
+    EXPECT_EQ(1, index.get_num_keyframes());
+    expect_index_queries(&index, &full);
+    index.close();
+
+    remove(filename);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,189 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/est_popsize.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+#include "argweaver/total_prob.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// Changing the popsizes should change the likelihood of the coalescence
+// counts by as much as it changes the ARG prior, apart from the prior of
+// the first tree.
+TEST(PopsizeTest, test_popsize_data_likelihood)
+{
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+
+    const int nseqs = 6;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 4,
+                    nseqs);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    struct popsize_data data;
+    popsize_sufficient_stats(&data, &model, &trees);
+    LineageCounts lineages(model.ntimes, model.num_pops());
+    const double prior = calc_arg_prior(&model, &trees);
+    const double tree_prior =
+        calc_log_tree_prior(&model, trees.front().tree, lineages);
+    const double like = popsize_data_likelihood(&data, &model);
+
+    ArgModel model2(model);
+    for (int i=0; i<2*ntimes-1; i++)
+        model2.popsizes[0][i] = 5000.0 + 1000.0 * (i % 7);
+    const double prior2 = calc_arg_prior(&model2, &trees);
+    const double tree_prior2 =
+        calc_log_tree_prior(&model2, trees.front().tree, lineages);
+    const double like2 = popsize_data_likelihood(&data, &model2);
+
+    EXPECT_NEAR(like2 - like, (prior2 - tree_prior2) - (prior - tree_prior),
+                1e-6);
+
+    // the first tree's counts give its prior
+    struct popsize_data tree_data;
+    init_popsize_data(&tree_data, &model, nseqs);
+    popsize_tree_stats(&tree_data, &model, trees.front().tree);
+    CoalCountsMemo memo;
+    EXPECT_NEAR(popsize_tree_likelihood(&tree_data, &model2, &memo),
+                tree_prior2, 1e-9);
+    delete_popsize_data(&tree_data);
+
+    // counts summed over two copies of the ARG give twice the likelihood
+    struct popsize_data data2;
+    popsize_sufficient_stats(&data2, &model, &trees);
+    ASSERT_TRUE(add_popsize_data(&data2, &data));
+    EXPECT_NEAR(popsize_data_likelihood(&data2, &model2), 2 * like2, 1e-6);
+
+    delete_popsize_data(&data);
+    delete_popsize_data(&data2);
+}
+
+
+// The memoized tree prior should match the direct one as popsizes change.
+TEST(PopsizeTest, test_coal_counts_memo)
+{
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+
+    const int nseqs = 6;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 4,
+                    nseqs);
+
+    LineageCounts lineages(model.ntimes, model.num_pops());
+    CoalCountsMemo memo;
+    for (int iter=0; iter<3; iter++) {
+        for (int i=0; i<2*ntimes-1; i++)
+            model.popsizes[0][i] = 5000.0 + 1000.0 * ((i + iter) % 5);
+        for (LocalTrees::const_iterator it=trees.begin(); it != trees.end();
+             ++it) {
+            EXPECT_EQ(calc_log_tree_prior(&model, it->tree, lineages, &memo),
+                      calc_log_tree_prior(&model, it->tree, lineages));
+        }
+    }
+}
+
+
+
+// The Hamiltonian MC target: the log likelihood of the SPR and first tree
+// counts for the popsizes set in the model.
+static double popsize_hmc_target(const struct popsize_data *data,
+                                 const struct popsize_data *tree_data,
+                                 const ArgModel *model, CoalCountsMemo *memo)
+{
+    return popsize_data_likelihood(data, model) +
+        popsize_tree_likelihood(tree_data, model, memo);
+}
+
+
+// The target should change with the popsizes as the ARG prior does, and
+// its gradient should match central differences.
+TEST(PopsizeTest, test_popsize_hmc_gradient)
+{
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.6e-8, 1.8e-8);
+    model.smc_prime = false;
+    model.popsize_config = PopsizeConfig(ntimes, 1, true, false);
+
+    const int nseqs = 6;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 100000, 5,
+                    nseqs);
+
+    struct popsize_data data, tree_data;
+    popsize_sufficient_stats(&data, &model, &trees);
+    init_popsize_data(&tree_data, &model, nseqs);
+    popsize_tree_stats(&tree_data, &model, trees.front().tree);
+    CoalCountsMemo memo;
+
+    vector<const PopsizeConfigParam*> params;
+    const list<PopsizeConfigParam> &l = model.popsize_config.params;
+    for (list<PopsizeConfigParam>::const_iterator it=l.begin();
+         it != l.end(); ++it)
+        params.push_back(&*it);
+    const int nparams = params.size();
+    ASSERT_EQ(ntimes, nparams);
+
+    // log popsizes of the parameters
+    seed_rand(6);
+    vector<double> theta(nparams);
+    for (int p=0; p<nparams; p++)
+        theta[p] = log(frand(2000.0, 50000.0));
+    const double prior = calc_arg_prior(&model, &trees);
+    const double target = popsize_hmc_target(&data, &tree_data, &model,
+                                             &memo);
+    for (int p=0; p<nparams; p++) {
+        const set<PopTime> &intervals = params[p]->intervals;
+        for (set<PopTime>::const_iterator it=intervals.begin();
+             it != intervals.end(); ++it)
+            model.popsizes[it->pop][it->time] = exp(theta[p]);
+    }
+
+    // the target is the ARG prior up to terms without popsizes
+    const double prior2 = calc_arg_prior(&model, &trees);
+    const double target2 = popsize_hmc_target(&data, &tree_data, &model,
+                                              &memo);
+    EXPECT_NEAR(prior2 - prior, target2 - target, 1e-6);
+
+    const double heat = 0.5;
+    vector<double> grad(nparams);
+    popsize_params_dlike(&data, &tree_data, &model, params, &theta[0], heat,
+                         &memo, &grad[0]);
+    EXPECT_EQ(target2, popsize_hmc_target(&data, &tree_data, &model, &memo));
+
+    const double h = 1e-4;
+    for (int p=0; p<nparams; p++) {
+        ArgModel model2(model);
+        const set<PopTime> &intervals = params[p]->intervals;
+        double like[2];
+        for (int side=0; side<2; side++) {
+            for (set<PopTime>::const_iterator it=intervals.begin();
+                 it != intervals.end(); ++it)
+                model2.popsizes[it->pop][it->time] =
+                    exp(theta[p] + (side ? h : -h));
+            like[side] = popsize_hmc_target(&data, &tree_data, &model2,
+                                            &memo);
+        }
+        const double dlike = heat * (like[1] - like[0]) / (2.0 * h);
+        EXPECT_NEAR(dlike, grad[p], 1e-5 * (1.0 + fabs(dlike)))
+            << params[p]->name;
+    }
+
+    delete_popsize_data(&data);
+    delete_popsize_data(&tree_data);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,329 @@
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+// Exposes the slot allocation of PackedBaseProbs.
+class SlotPackedBaseProbs : public PackedBaseProbs
+{
+public:
+    explicit SlotPackedBaseProbs(const vector<BaseProbs> &probs) :
+        PackedBaseProbs(probs) {}
+
+    using PackedBaseProbs::add_slot;
+
+    bool has_slot(int i) const {
+        return uncertain[i >> 6] & (uint64_t(1) << (i & 63));
+    }
+};
+
+
+// A certain base, a masked entry or uncertain probabilities, some of
+// them below the smallest 16-bit float.
+static BaseProbs random_base_probs()
+{
+    const int kind = irand(4);
+    if (kind == 0)
+        return BaseProbs("ACGT"[irand(4)]);
+    if (kind == 1)
+        return BaseProbs('N');
+
+    BaseProbs bp;
+    for (int k=0; k<4; k++)
+        bp.prob[k] = (irand(3) == 0 ? 0.0 : frand());
+    if (irand(4) == 0)
+        bp.prob[irand(4)] = 1e-9;
+    bp.prob[irand(4)] = 0.9;
+    return bp;
+}
+
+
+// Expect a stored entry to match the original probabilities within the
+// precision of a 16-bit float.  Nonzero probabilities stay nonzero.
+static void expect_base_probs(const BaseProbs &expected,
+                              const BaseProbs &stored, int i)
+{
+    for (int k=0; k<4; k++) {
+        if (expected.prob[k] == 0.0) {
+            EXPECT_EQ(0.0, stored.prob[k]) << "entry " << i;
+        } else {
+            EXPECT_GT(stored.prob[k], 0.0) << "entry " << i;
+            EXPECT_NEAR(expected.prob[k], stored.prob[k],
+                        1e-3 * expected.prob[k] + 6e-8) << "entry " << i;
+        }
+    }
+}
+
+
+static void expect_packed(const vector<BaseProbs> &expected,
+                          const PackedBaseProbs &packed)
+{
+    ASSERT_EQ(int(expected.size()), packed.size());
+    for (unsigned int i=0; i<expected.size(); i++)
+        expect_base_probs(expected[i], packed[i], i);
+}
+
+
+// set(), swap() and slice() of packed entries should agree with a plain
+// vector of BaseProbs.
+TEST(SequencesTest, test_packed_base_probs)
+{
+    seed_rand(1);
+    const int n = 1000;
+    vector<BaseProbs> probs1, probs2;
+    for (int i=0; i<n; i++) {
+        probs1.push_back(random_base_probs());
+        probs2.push_back(random_base_probs());
+    }
+    PackedBaseProbs packed1(probs1), packed2(probs2);
+    expect_packed(probs1, packed1);
+    expect_packed(probs2, packed2);
+
+    for (int iter=0; iter<5000; iter++) {
+        const int i = irand(n);
+        if (irand(3) == 0) {
+            const BaseProbs bp = random_base_probs();
+            probs1[i] = bp;
+            packed1.set(i, bp);
+        } else {
+            // swaps between certain, masked and uncertain entries
+            std::swap(probs1[i], probs2[i]);
+            packed1.swap(i, packed2);
+        }
+    }
+    expect_packed(probs1, packed1);
+    expect_packed(probs2, packed2);
+
+    // repeated swaps of a site are undone exactly
+    for (int i=0; i<n; i++) {
+        const BaseProbs bp1 = packed1[i], bp2 = packed2[i];
+        packed1.swap(i, packed2);
+        packed1.swap(i, packed2);
+        for (int k=0; k<4; k++) {
+            EXPECT_EQ(bp1.prob[k], packed1[i].prob[k]);
+            EXPECT_EQ(bp2.prob[k], packed2[i].prob[k]);
+        }
+    }
+
+    const int starts[] = {0, 1, 63, 64, 500, n - 1};
+    for (unsigned int s=0; s<sizeof(starts) / sizeof(starts[0]); s++) {
+        const int start = starts[s];
+        for (int end=start; end<=n; end+=97) {
+            expect_packed(vector<BaseProbs>(probs1.begin() + start,
+                                            probs1.begin() + end),
+                          packed1.slice(start, end));
+        }
+    }
+}
+
+
+// Giving an entry stored probabilities should not move the others.
+TEST(SequencesTest, test_packed_base_probs_add_slot)
+{
+    seed_rand(2);
+    const int n = 300;
+    vector<BaseProbs> probs;
+    for (int i=0; i<n; i++)
+        probs.push_back(random_base_probs());
+    SlotPackedBaseProbs packed(probs);
+
+    // new slots are left zero, so only the other entries are checked
+    const int uncertain = packed.get_num_uncertain();
+    vector<bool> added(n, false);
+    int nslots = 0;
+    for (int i=n-1; i>=0; i-=7) {
+        if (packed.has_slot(i))
+            continue;
+        packed.add_slot(i);
+        added[i] = true;
+        nslots++;
+        EXPECT_TRUE(packed.has_slot(i));
+        for (int j=0; j<n; j++)
+            if (!added[j])
+                expect_base_probs(probs[j], packed[j], j);
+    }
+    EXPECT_GT(nslots, 0);
+    EXPECT_EQ(uncertain + nslots, packed.get_num_uncertain());
+}
+
+
+// Nonzero probabilities stay nonzero as 16-bit floats, and ones and
+// zeros are exact.
+TEST(SequencesTest, test_double_to_half)
+{
+    EXPECT_EQ(0.0, PackedBaseProbs::half_to_double(
+                  PackedBaseProbs::double_to_half(0.0)));
+    EXPECT_EQ(1.0, PackedBaseProbs::half_to_double(
+                  PackedBaseProbs::double_to_half(1.0)));
+    const double tiny[] = {1e-30, 1e-9, 3e-8, 6e-8};
+    for (int i=0; i<4; i++)
+        EXPECT_EQ(ldexp(1.0, -24), PackedBaseProbs::half_to_double(
+                      PackedBaseProbs::double_to_half(tiny[i])));
+    for (double x=1e-7; x<1.0; x*=1.37) {
+        const double y = PackedBaseProbs::half_to_double(
+            PackedBaseProbs::double_to_half(x));
+        EXPECT_NEAR(x, y, x * ldexp(1.0, -11) + ldexp(1.0, -25));
+    }
+}
+
+
+
+// VCF files written by test/data/tabix/make_fixtures.py.  The first has
+// diploid samples A and B and haploid sample C, the second diploid
+// sample D.
+static const char *VCF_GENOTYPES1 = "test/data/tabix/genotypes1.vcf.gz";
+static const char *VCF_GENOTYPES2 = "test/data/tabix/genotypes2.vcf.gz";
+static const char *VCF_REGION = "chr1:1-1000";
+
+
+static BaseProbs pl_probs(char ref, char alt, double pl0, double pl1,
+                          double pl2, int hap)
+{
+    const double pl[3] = {pl0, pl1, pl2};
+    BaseProbs bp;
+    bp.set_by_pl(ref, alt, pl, hap);
+    return bp;
+}
+
+
+static BaseProbs pp_probs(const char *pp, int hap)
+{
+    BaseProbs bp;
+    bp.set_by_pp(string(pp), hap);
+    return bp;
+}
+
+
+// The alignment of both files merged, with the expected bases and
+// probabilities of haplotypes A_1, A_2, B_1, B_2, C, D_1, D_2 at each
+// site.  The indel at 25 is skipped, the site at 30 is masked for having
+// three alleles and the one at 50 for its quality.  Sites missing from
+// a file take its reference allele.
+static void expected_vcf_sites(vector<int> &positions, vector<string> &cols,
+                               vector<vector<BaseProbs> > &probs)
+{
+    const char *pp_a = "60,40,60,40,60,60,60,60,0,60";
+    const char *pp_c = "60,60,60,0,60,60,60,60,30,60";
+    const BaseProbs n('N');
+
+    const int pos[] = {9, 19, 29, 34, 39, 49};
+    const char *col[] = {"AGGGAGG", "CTNNTCC", "NNNNNGG", "CCCCCCA",
+                         "CTTTCTT", "NNNNNGG"};
+    const BaseProbs site_probs[][7] = {
+        {pl_probs('A', 'G', 30, 0, 40, 0), pl_probs('A', 'G', 30, 0, 40, 1),
+         pl_probs('A', 'G', 50, 20, 0, 0), pl_probs('A', 'G', 50, 20, 0, 1),
+         pl_probs('A', 'G', 0, 10, 60, 0), pl_probs('A', 'G', 60, 30, 0, 0),
+         pl_probs('A', 'G', 60, 30, 0, 1)},
+        {pp_probs(pp_a, 0), pp_probs(pp_a, 1), n, n, pp_probs(pp_c, 0),
+         BaseProbs('C'), BaseProbs('C')},
+        {n, n, n, n, n, BaseProbs('G'), BaseProbs('G')},
+        {BaseProbs('C'), BaseProbs('C'), BaseProbs('C'), BaseProbs('C'),
+         BaseProbs('C'), pl_probs('C', 'A', 20, 0, 20, 0),
+         pl_probs('C', 'A', 20, 0, 20, 1)},
+        {BaseProbs('C'), BaseProbs('T'), BaseProbs('T'), BaseProbs('T'),
+         BaseProbs('C'), pl_probs('T', 'C', 0, 30, 60, 0),
+         pl_probs('T', 'C', 0, 30, 60, 1)},
+        {n, n, n, n, n, BaseProbs('G'), BaseProbs('G')},
+    };
+
+    positions.assign(pos, pos + 6);
+    cols.assign(col, col + 6);
+    probs.clear();
+    for (int i=0; i<6; i++)
+        probs.push_back(vector<BaseProbs>(site_probs[i], site_probs[i] + 7));
+}
+
+
+// Expect the sequences made from 'sites' to hold the expected sites,
+// restricted to the haplotypes 'keep', with 'A' elsewhere.
+static void expect_vcf_sequences(const Sites &sites, const vector<int> &keep,
+                                 bool parse_genotype_probs)
+{
+    const char *names[] = {"A_1", "A_2", "B_1", "B_2", "C", "D_1", "D_2"};
+    vector<int> positions;
+    vector<string> cols;
+    vector<vector<BaseProbs> > probs;
+    expected_vcf_sites(positions, cols, probs);
+
+    Sequences sequences;
+    make_sequences_from_sites(&sites, &sequences);
+    ASSERT_EQ(int(keep.size()), sequences.get_num_seqs());
+    ASSERT_EQ(1000, sequences.length());
+    EXPECT_EQ(parse_genotype_probs, sequences.base_probs.size() > 0);
+
+    for (unsigned int j=0; j<keep.size(); j++) {
+        EXPECT_EQ(names[keep[j]], sequences.names[j]);
+        unsigned int site = 0;
+        for (int i=0; i<sequences.length(); i++) {
+            char base = 'A';
+            BaseProbs bp('A');
+            if (site < positions.size() && positions[site] == i) {
+                base = cols[site][keep[j]];
+                bp = probs[site][keep[j]];
+                site++;
+            }
+            ASSERT_EQ(base, sequences.seqs[j][i])
+                << sequences.names[j] << " " << i;
+            if (parse_genotype_probs)
+                expect_base_probs(bp, sequences.base_probs[j][i], i);
+        }
+    }
+}
+
+
+// read_vcfs() should parse GT, PL and PP fields, keep only the samples
+// asked for and merge the files by position, on one thread or several.
+TEST(SequencesTest, test_read_vcfs)
+{
+    vector<string> filenames;
+    filenames.push_back(VCF_GENOTYPES1);
+    filenames.push_back(VCF_GENOTYPES2);
+
+    vector<int> all;
+    for (int i=0; i<7; i++)
+        all.push_back(i);
+
+    for (int nthreads=1; nthreads<=2; nthreads++) {
+        for (int probs=0; probs<2; probs++) {
+            Sites sites;
+            ASSERT_TRUE(read_vcfs(filenames, &sites, VCF_REGION, 10.0, "",
+                                  probs, 0.0, "", set<string>(), nthreads));
+            EXPECT_EQ("chr1", sites.chrom);
+            EXPECT_EQ(0, sites.start_coord);
+            EXPECT_EQ(1000, sites.end_coord);
+            expect_vcf_sequences(sites, all, probs);
+        }
+
+        // samples from --subsites
+        set<string> keep_inds;
+        keep_inds.insert("A");
+        keep_inds.insert("C");
+        keep_inds.insert("D");
+        Sites sites;
+        ASSERT_TRUE(read_vcfs(filenames, &sites, VCF_REGION, 10.0, "",
+                              true, 0.0, "", keep_inds, nthreads));
+        const int keep[] = {0, 1, 4, 5, 6};
+        expect_vcf_sequences(sites, vector<int>(keep, keep + 5), true);
+    }
+
+    // a single file keeps its reference sequence
+    Sites sites;
+    ASSERT_TRUE(read_vcf(VCF_GENOTYPES2, &sites, VCF_REGION, 10.0, "",
+                         true, 0.0, true));
+    ASSERT_EQ(3, sites.get_num_seqs());
+    EXPECT_EQ("REF", sites.names[2]);
+    ASSERT_EQ(3, sites.get_num_sites());
+    EXPECT_EQ(0, strncmp(sites.cols[0], "GGA", 3));
+    EXPECT_EQ(0, strncmp(sites.cols[1], "CAC", 3));
+    EXPECT_EQ(0, strncmp(sites.cols[2], "TTT", 3));
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/compress.h"
+#include "argweaver/tabix.h"
+
+
+namespace argweaver {
+
+// BGZF files with indexes, written by test/data/tabix/make_fixtures.py.
+// Blocks are small, so records are split between blocks.
+static const char *TABIX_BED = "test/data/tabix/regions.bed.gz";
+static const char *TABIX_VCF = "test/data/tabix/sites.vcf.gz";
+
+
+// Reads a whole stream.
+static string read_stream(FILE *stream)
+{
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    return text;
+}
+
+
+// A record of a fixture, with its 0-based half-open interval.
+struct TabixRecord
+{
+    string line;
+    string chrom;
+    int beg;
+    int end;
+};
+
+
+// Reads the header and records of a fixture without the index.
+static void read_fixture(const char *filename, bool vcf, string &header,
+                         vector<TabixRecord> &records)
+{
+    FILE *stream = read_compress(filename);
+    ASSERT_TRUE(stream != NULL);
+    const string text = read_stream(stream);
+    close_compress(stream);
+
+    header.clear();
+    records.clear();
+    for (size_t start=0; start<text.size(); ) {
+        size_t stop = text.find('\n', start) + 1;
+        const string line = text.substr(start, stop - start);
+        start = stop;
+        if (line[0] == '#') {
+            header += line;
+            continue;
+        }
+
+        TabixRecord record;
+        record.line = line;
+        char chrom[100], ref[100];
+        if (vcf) {
+            int pos;
+            ASSERT_EQ(3, sscanf(line.c_str(), "%99s %d %*s %99s", chrom,
+                                &pos, ref));
+            record.beg = pos - 1;
+            record.end = pos - 1 + strlen(ref);
+        } else {
+            ASSERT_EQ(3, sscanf(line.c_str(), "%99s %d %d", chrom,
+                                &record.beg, &record.end));
+        }
+        record.chrom = chrom;
+        records.push_back(record);
+    }
+}
+
+
+// Expect a region query through the index to give the header and the
+// records found by a linear scan.  Returns the number of records.
+static int expect_query(const char *filename, const string &header,
+                        const vector<TabixRecord> &records,
+                        const string &chrom, int beg, int end)
+{
+    char region[200];
+    snprintf(region, sizeof(region), "%s:%d-%d", chrom.c_str(), beg + 1,
+             end);
+    string expected = header;
+    int nrecords = 0;
+    for (unsigned int i=0; i<records.size(); i++) {
+        if (records[i].chrom == chrom && records[i].beg < end &&
+            records[i].end > beg) {
+            expected += records[i].line;
+            nrecords++;
+        }
+    }
+
+    FILE *stream = read_tabix(filename, region, NULL);
+    EXPECT_TRUE(stream != NULL) << region;
+    if (!stream)
+        return nrecords;
+    EXPECT_EQ(expected, read_stream(stream)) << region;
+    close_tabix(stream);
+    return nrecords;
+}
+
+
+// Query 'filename' at chromosome boundaries, at random regions, and where
+// nothing overlaps.
+static void expect_queries(const char *filename, bool vcf)
+{
+    string header;
+    vector<TabixRecord> records;
+    read_fixture(filename, vcf, header, records);
+    ASSERT_GT(records.size(), 100u);
+
+    vector<string> chroms;
+    for (unsigned int i=0; i<records.size(); i++)
+        if (chroms.size() == 0 || chroms.back() != records[i].chrom)
+            chroms.push_back(records[i].chrom);
+    ASSERT_GT(chroms.size(), 1u);
+
+    seed_rand(1);
+    for (unsigned int c=0; c<chroms.size(); c++) {
+        int first = -1, last = -1, max_end = 0;
+        for (unsigned int i=0; i<records.size(); i++) {
+            if (records[i].chrom != chroms[c])
+                continue;
+            if (first < 0)
+                first = i;
+            last = i;
+            max_end = max(max_end, records[i].end);
+        }
+        const int beg = records[first].beg, last_beg = records[last].beg;
+
+        // the whole chromosome, by name alone and as a region
+        FILE *stream = read_tabix(filename, chroms[c].c_str(), NULL);
+        ASSERT_TRUE(stream != NULL);
+        string expected = header;
+        for (int i=first; i<=last; i++)
+            expected += records[i].line;
+        EXPECT_EQ(expected, read_stream(stream));
+        close_tabix(stream);
+        EXPECT_EQ(last - first + 1,
+                  expect_query(filename, header, records, chroms[c], 0,
+                               max_end));
+
+        // boundaries of the chromosome
+        EXPECT_EQ(0, expect_query(filename, header, records, chroms[c],
+                                  0, beg));
+        EXPECT_GT(expect_query(filename, header, records, chroms[c],
+                               beg, beg + 1), 0);
+        EXPECT_GT(expect_query(filename, header, records, chroms[c],
+                               last_beg, last_beg + 1), 0);
+        EXPECT_GT(expect_query(filename, header, records, chroms[c],
+                               max_end - 1, max_end + 1000), 0);
+        EXPECT_EQ(0, expect_query(filename, header, records, chroms[c],
+                                  max_end, max_end + 100000));
+
+        // random regions of many sizes
+        for (int i=0; i<100; i++) {
+            const int len = 1 << irand(1, 20);
+            const int start = irand(max(beg - len, 0), max_end);
+            expect_query(filename, header, records, chroms[c], start,
+                         start + len);
+        }
+    }
+
+    // unknown chromosome
+    EXPECT_EQ(0, expect_query(filename, header, records, "chrX", 0, 1000));
+}
+
+
+// Region queries through a .tbi index should match a linear scan.
+TEST(TabixTest, test_tbi_queries)
+{
+    expect_queries(TABIX_BED, false);
+}
+
+
+// Region queries through a .csi index should match a linear scan.
+TEST(TabixTest, test_csi_queries)
+{
+    expect_queries(TABIX_VCF, true);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,220 @@
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/emit.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+#include "argweaver/total_prob.h"
+#include "argweaver/track.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+// Update 'cache' and expect its terms to equal a full evaluation of the
+// ARG.
+static void expect_cache_matches(ArgProbCache *cache, const ArgModel *model,
+                                 const Sequences *sequences,
+                                 const LocalTrees *trees)
+{
+    TrackNullValue maskmap;
+    cache->update_noncompat(trees, sequences);
+    cache->update(model, sequences, trees, NULL, &maskmap);
+
+    const double prior = calc_arg_prior(model, trees);
+    const double prior2 = calc_arg_prior_recomb_integrate(
+        model, trees, NULL, NULL, NULL);
+    const double likelihood = calc_arg_likelihood(model, sequences, trees);
+    EXPECT_NEAR(prior, cache->prior, 1e-8 * fabs(prior));
+    EXPECT_NEAR(prior2, cache->prior2, 1e-8 * fabs(prior2));
+    EXPECT_NEAR(likelihood, cache->likelihood, 1e-8 * fabs(likelihood));
+    EXPECT_EQ(count_noncompat(trees, sequences), cache->noncompats);
+}
+
+
+static vector<string> copy_seqs(const Sequences *sequences)
+{
+    vector<string> seqs;
+    for (int i=0; i<sequences->get_num_seqs(); i++)
+        seqs.push_back(string(sequences->seqs[i], sequences->length()));
+    return seqs;
+}
+
+
+// The cached terms should match a fresh evaluation after a window of the
+// ARG is resampled.
+TEST(TotalProbTest, test_prob_cache_resample)
+{
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.5e-8, 2.5e-8);
+
+    const int nseqs = 6;
+    const int seqlen = 50000;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, seqlen, 1, nseqs);
+    ASSERT_GT(trees.get_num_trees(), 5);
+
+    ArgProbCache cache;
+    expect_cache_matches(&cache, &model, &sequences, &trees);
+
+    // changing part of the ARG reuses the terms of the rest
+    for (int i=0; i<3; i++) {
+        const int start = irand(seqlen - 10000);
+        resample_arg_region(&model, &sequences, &trees, start,
+                            start + 10000, 1, false);
+        expect_cache_matches(&cache, &model, &sequences, &trees);
+    }
+
+    // an unchanged ARG gives the same terms again
+    const double prior = cache.prior, likelihood = cache.likelihood;
+    expect_cache_matches(&cache, &model, &sequences, &trees);
+    EXPECT_EQ(prior, cache.prior);
+    EXPECT_EQ(likelihood, cache.likelihood);
+}
+
+
+// Phase sampling changes the sequences in place.  Once the sequence
+// terms are cleared, the cache should match a fresh evaluation again.
+TEST(TotalProbTest, test_prob_cache_phase)
+{
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.5e-8, 2.5e-8);
+
+    // three individuals, each two adjacent sequences
+    const int nseqs = 6;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, 50000, 2, nseqs);
+    sequences.set_age();
+    model.unphased = true;
+    for (int i=0; i<nseqs; i++)
+        sequences.pairs.push_back(i ^ 1);
+
+    ArgProbCache cache;
+    expect_cache_matches(&cache, &model, &sequences, &trees);
+
+    int nchanged = 0;
+    for (int i=0; i<20 && nchanged < 3; i++) {
+        const vector<string> seqs = copy_seqs(&sequences);
+        resample_arg_leaf(&model, &sequences, &trees,
+                          irand(trees.get_num_leaves()));
+        if (copy_seqs(&sequences) == seqs)
+            continue;
+        nchanged++;
+
+        cache.clear_sequence_terms();
+        expect_cache_matches(&cache, &model, &sequences, &trees);
+    }
+    EXPECT_GT(nchanged, 0);
+}
+
+
+
+static void expect_same_stats(const RegionStats &expected,
+                              const RegionStats &stats, int i)
+{
+    EXPECT_DOUBLE_EQ(expected.prior, stats.prior) << "region " << i;
+    EXPECT_DOUBLE_EQ(expected.prior2, stats.prior2) << "region " << i;
+    EXPECT_DOUBLE_EQ(expected.likelihood, stats.likelihood) << "region " << i;
+    EXPECT_EQ(expected.nrecomb, stats.nrecomb) << "region " << i;
+    EXPECT_EQ(expected.noncompat, stats.noncompat) << "region " << i;
+}
+
+
+// The statistics of a region should add up over its parts, and should
+// not depend on the other regions evaluated with it.
+TEST(TotalProbTest, test_region_stats)
+{
+    const int ntimes = 20;
+    ArgModel model(ntimes, 200e3, 1e4, 1.5e-8, 2.5e-8);
+
+    const int nseqs = 6;
+    const int seqlen = 50000;
+    Sequences sequences;
+    LocalTrees trees;
+    make_random_arg(&model, &sequences, &trees, nseqs, seqlen, 3, nseqs);
+    ASSERT_GT(trees.get_num_trees(), 10);
+
+    const vector<int> invisible_recomb_pos;
+    const vector<Spr> invisible_recombs;
+    const vector<MigEvent> migevents;
+    vector<RegionStats> stats;
+
+    // the whole ARG
+    vector<Region> whole(1, Region("chr", 0, seqlen));
+    calc_region_stats(&model, &sequences, &trees, whole,
+                      invisible_recomb_pos, invisible_recombs, NULL,
+                      migevents, stats);
+    const RegionStats total = stats[0];
+    EXPECT_NEAR(calc_arg_prior(&model, &trees), total.prior,
+                1e-8 * fabs(total.prior));
+    EXPECT_NEAR(calc_arg_prior_recomb_integrate(&model, &trees, NULL, NULL,
+                                                NULL),
+                total.prior2, 1e-8 * fabs(total.prior2));
+    EXPECT_NEAR(calc_arg_likelihood(&model, &sequences, &trees),
+                total.likelihood, 1e-8 * fabs(total.likelihood));
+    EXPECT_EQ(trees.get_num_trees() - 1, total.nrecomb);
+    EXPECT_EQ(count_noncompat(&trees, &sequences), total.noncompat);
+
+    // split within a block, so that no recombination falls on the split
+    vector<int> splits;
+    int end = trees.start_coord;
+    for (LocalTrees::const_iterator it=trees.begin(); it != trees.end();
+         ++it) {
+        if (it->blocklen > 1 && splits.size() < 5)
+            splits.push_back(end + it->blocklen / 2);
+        end += it->blocklen;
+    }
+    ASSERT_GT(splits.size(), 0u);
+    for (unsigned int j=0; j<splits.size(); j++) {
+        vector<Region> halves;
+        halves.push_back(Region("chr", 0, splits[j]));
+        halves.push_back(Region("chr", splits[j], seqlen));
+        calc_region_stats(&model, &sequences, &trees, halves,
+                          invisible_recomb_pos, invisible_recombs, NULL,
+                          migevents, stats);
+        EXPECT_NEAR(total.prior, stats[0].prior + stats[1].prior,
+                    1e-8 * fabs(total.prior));
+        EXPECT_NEAR(total.prior2, stats[0].prior2 + stats[1].prior2,
+                    1e-8 * fabs(total.prior2));
+        EXPECT_NEAR(total.likelihood,
+                    stats[0].likelihood + stats[1].likelihood,
+                    1e-8 * fabs(total.likelihood));
+        EXPECT_EQ(total.nrecomb, stats[0].nrecomb + stats[1].nrecomb);
+        EXPECT_EQ(total.noncompat, stats[0].noncompat + stats[1].noncompat);
+    }
+
+    // overlapping regions out of order, including empty ones and ones
+    // past the end of the ARG
+    vector<Region> regions;
+    for (int i=0; i<30; i++) {
+        const int start = irand(seqlen);
+        regions.push_back(Region("chr", start, start + irand(20000)));
+    }
+    regions.push_back(Region("chr", 0, seqlen));
+    regions.push_back(Region("chr", 100, 100));
+    regions.push_back(Region("chr", seqlen - 10, seqlen + 1000));
+    regions.push_back(Region("chr", 0, 1));
+    calc_region_stats(&model, &sequences, &trees, regions,
+                      invisible_recomb_pos, invisible_recombs, NULL,
+                      migevents, stats);
+    ASSERT_EQ(regions.size(), stats.size());
+    for (unsigned int i=0; i<regions.size(); i++) {
+        vector<RegionStats> stats2;
+        calc_region_stats(&model, &sequences, &trees,
+                          vector<Region>(1, regions[i]),
+                          invisible_recomb_pos, invisible_recombs, NULL,
+                          migevents, stats2);
+        expect_same_stats(stats2[0], stats[i], i);
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,48 @@
+#ifndef ARGWEAVER_TEST_UTIL_H
+#define ARGWEAVER_TEST_UTIL_H
+
+#include <stdio.h>
+
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+
+namespace argweaver {
+
+// Random alignment of 'nseqs' sequences with shared mutations, drawn
+// after seeding with 'seed'.  The first 'nthreaded' sequences are
+// threaded into 'trees'; the others are left out of the ARG.
+inline void make_random_arg(const ArgModel *model, Sequences *sequences,
+                            LocalTrees *trees, int nseqs, int seqlen,
+                            int seed, int nthreaded)
+{
+    const char *bases = "ACGT";
+    seed_rand(seed);
+    for (int i=0; i<nseqs; i++) {
+        char *seq = new char [seqlen + 1];
+        fill(seq, seq + seqlen, 'A');
+        seq[seqlen] = '\0';
+        char name[20];
+        snprintf(name, sizeof(name), "n%d", i);
+        sequences->append(name, seq, vector<BaseProbs>());
+    }
+    sequences->set_owned(true);
+    for (int i=0; i<seqlen; i++) {
+        if (frand() < .01) {
+            char base = bases[irand(1, 4)];
+            for (int j=0; j<nseqs; j++)
+                if (frand() < .3)
+                    sequences->seqs[j][i] = base;
+        }
+    }
+
+    trees->make_trunk(0, seqlen, 0, 0, 2 * nseqs - 1);
+    for (int i=1; i<nthreaded; i++)
+        sample_arg_thread(model, sequences, trees, i);
+}
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_TEST_UTIL_H
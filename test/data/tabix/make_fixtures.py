@@ -0,0 +1,230 @@
+#!/usr/bin/env python
+"""
+Writes the BGZF files and indexes used by src/tests/test_tabix.cpp and
+src/tests/test_sequences.cpp.
+
+The files are written here rather than with bgzip and tabix, following
+the BGZF, TBI and CSI specifications, so that the tests do not need
+htslib.  Blocks are kept small so that records are split between blocks.
+
+  regions.bed.gz(.tbi)  bed records (0-based) on three chromosomes
+  sites.vcf.gz(.csi)    VCF records with a deeper CSI binning
+  genotypes1.vcf.gz(.tbi), genotypes2.vcf.gz(.tbi)
+                        small VCF files with GT, PL and PP fields, to be
+                        merged by read_vcfs()
+"""
+
+import random
+import struct
+import zlib
+
+BLOCK_SIZE = 1000
+EOF_BLOCK = bytes.fromhex(
+    "1f8b08040000000000ff0600424302001b0003000000000000000000")
+
+
+def bgzf_block(data):
+    comp = zlib.compressobj(6, zlib.DEFLATED, -15)
+    payload = comp.compress(data) + comp.flush()
+    header = struct.pack("<BBBBIBBHBBHH", 0x1f, 0x8b, 8, 4, 0, 0, 0xff, 6,
+                         ord("B"), ord("C"), 2, 18 + len(payload) + 8 - 1)
+    return (header + payload +
+            struct.pack("<II", zlib.crc32(data) & 0xffffffff, len(data)))
+
+
+def bgzf(data, block_size=BLOCK_SIZE):
+    """Returns the compressed file and the virtual offset of each byte."""
+    out = b""
+    starts = []
+    for i in range(0, len(data), block_size):
+        starts.append((len(out), i))
+        out += bgzf_block(data[i:i+block_size])
+    eof_offset = len(out)
+    out += EOF_BLOCK
+
+    def voffset(pos):
+        for coffset, start in reversed(starts):
+            if start <= pos < start + block_size and pos < len(data):
+                return (coffset << 16) | (pos - start)
+        return eof_offset << 16
+    return out, voffset
+
+
+def reg2bin(beg, end, min_shift, depth):
+    end -= 1
+    s = min_shift
+    t = ((1 << depth * 3) - 1) // 7
+    for level in range(depth, 0, -1):
+        if beg >> s == end >> s:
+            return t + (beg >> s)
+        s += 3
+        t -= 1 << ((level - 1) * 3)
+    return 0
+
+
+def build_index(records, names, voffset, min_shift, depth):
+    """records: (tid, beg, end, line start, line end) in file order"""
+    refs = [{"bins": {}, "linear": {}, "beg": None, "end": None, "n": 0}
+            for _ in names]
+    last = None
+    for tid, beg, end, start, stop in records:
+        ref = refs[tid]
+        vbeg, vend = voffset(start), voffset(stop)
+        b = reg2bin(beg, end, min_shift, depth)
+        chunks = ref["bins"].setdefault(b, [])
+        # consecutive records of a bin share a chunk
+        if last == (tid, b):
+            chunks[-1][1] = vend
+        else:
+            chunks.append([vbeg, vend])
+        last = (tid, b)
+        for w in range(beg >> min_shift, ((end - 1) >> min_shift) + 1):
+            ref["linear"].setdefault(w, vbeg)
+        if ref["beg"] is None:
+            ref["beg"] = vbeg
+        ref["end"] = vend
+        ref["n"] += 1
+    return refs
+
+
+def tabix_header(fmt, col_seq, col_beg, col_end, names):
+    text = b"".join(name.encode() + b"\0" for name in names)
+    return struct.pack("<iiiiiii", fmt, col_seq, col_beg, col_end, ord("#"),
+                       0, len(text)) + text
+
+
+def pseudo_bin(depth):
+    return ((1 << ((depth + 1) * 3)) - 1) // 7 + 1
+
+
+def write_tbi(filename, refs, header, depth=5):
+    out = b"TBI\1" + struct.pack("<i", len(refs)) + header
+    for ref in refs:
+        bins = sorted(ref["bins"].items())
+        out += struct.pack("<i", len(bins) + 1)
+        for b, chunks in bins:
+            out += struct.pack("<Ii", b, len(chunks))
+            for beg, end in chunks:
+                out += struct.pack("<QQ", beg, end)
+        out += struct.pack("<IiQQQQ", pseudo_bin(depth), 2, ref["beg"],
+                           ref["end"], ref["n"], 0)
+        # empty windows take the offset of the window before them
+        nwindows = max(ref["linear"]) + 1
+        out += struct.pack("<i", nwindows)
+        offset = 0
+        for w in range(nwindows):
+            offset = ref["linear"].get(w, offset)
+            out += struct.pack("<Q", offset)
+    open(filename, "wb").write(bgzf(out, 0xff00)[0])
+
+
+def write_csi(filename, refs, header, min_shift, depth):
+    out = b"CSI\1" + struct.pack("<iii", min_shift, depth, len(header))
+    out += header + struct.pack("<i", len(refs))
+    for ref in refs:
+        bins = sorted(ref["bins"].items())
+        out += struct.pack("<i", len(bins) + 1)
+        for b, chunks in bins:
+            out += struct.pack("<IQi", b, chunks[0][0], len(chunks))
+            for beg, end in chunks:
+                out += struct.pack("<QQ", beg, end)
+        out += struct.pack("<IQiQQQQ", pseudo_bin(depth), 0, 2, ref["beg"],
+                           ref["end"], ref["n"], 0)
+    open(filename, "wb").write(bgzf(out, 0xff00)[0])
+
+
+def write_records(filename, header_lines, lines):
+    """lines: (tid, beg, end, text)"""
+    data = b"".join(line.encode() for line in header_lines)
+    records = []
+    for tid, beg, end, text in lines:
+        start = len(data)
+        data += text.encode()
+        records.append((tid, beg, end, start, len(data)))
+    out, voffset = bgzf(data)
+    open(filename, "wb").write(out)
+    return records, voffset
+
+
+def make_bed(rand):
+    names = ["chr1", "chr2", "chr3"]
+    lines = []
+    for tid, name in enumerate(names):
+        pos = rand.randint(0, 5000)
+        for i in range(300 if tid != 1 else 40):
+            pos += rand.randint(0, 3000)
+            # mostly short records, and some that span large bins
+            length = (rand.randint(1, 500) if rand.random() < 0.9 else
+                      rand.randint(20000, 400000))
+            lines.append((tid, pos, pos + length, "%s\t%d\t%d\tr%d\n" % (
+                name, pos, pos + length, len(lines))))
+    records, voffset = write_records(
+        "regions.bed.gz", ["#chrom\tstart\tend\tname\n"], lines)
+    refs = build_index(records, names, voffset, 14, 5)
+    write_tbi("regions.bed.gz.tbi", refs,
+              tabix_header(0x10000, 1, 2, 3, names))
+
+
+def make_vcf(rand):
+    names = ["1", "2"]
+    header = ["##fileformat=VCFv4.2\n",
+              "##contig=<ID=1>\n",
+              "##contig=<ID=2>\n",
+              "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n"]
+    lines = []
+    for tid, name in enumerate(names):
+        pos = rand.randint(1, 1000)
+        for i in range(400):
+            pos += rand.randint(1, 2000)
+            ref = "".join(rand.choice("ACGT")
+                          for _ in range(1 if rand.random() < 0.8 else
+                                         rand.randint(2, 30)))
+            lines.append((tid, pos - 1, pos - 1 + len(ref),
+                          "%s\t%d\t.\t%s\t%s\t.\tPASS\t.\n" % (
+                              name, pos, ref, "T" if ref[0] != "T" else "A")))
+    records, voffset = write_records("sites.vcf.gz", header, lines)
+    refs = build_index(records, names, voffset, 14, 6)
+    write_csi("sites.vcf.gz.csi", refs, tabix_header(2, 1, 2, 0, names),
+              14, 6)
+
+
+def write_genotype_vcf(filename, samples, lines):
+    header = ["##fileformat=VCFv4.2\n",
+              "##contig=<ID=chr1>\n",
+              "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t" +
+              "\t".join(samples) + "\n"]
+    records = []
+    for line in lines:
+        fields = line.split()
+        pos, ref = int(fields[1]), fields[3]
+        records.append((0, pos - 1, pos - 1 + len(ref),
+                        "\t".join(fields) + "\n"))
+    records, voffset = write_records(filename, header, records)
+    refs = build_index(records, ["chr1"], voffset, 14, 5)
+    write_tbi(filename + ".tbi", refs, tabix_header(2, 1, 2, 0, ["chr1"]))
+
+
+def make_genotype_vcfs():
+    # the expected alignments are written out in test_sequences.cpp
+    write_genotype_vcf("genotypes1.vcf.gz", ["A", "B", "C"], [
+        "chr1 10 . A G 50 PASS . GT:PL 0|1:30,0,40 1/1:50,20,0 0:0,10,60",
+        "chr1 20 . C T 50 PASS . GT:PP "
+        "0/1:60,40,60,40,60,60,60,60,0,60 ./.:0,0,0,0,0,0,0,0,0,0 "
+        "1:60,60,60,0,60,60,60,60,30,60",
+        "chr1 25 . AT A 50 PASS . GT:PL 0|1:30,0,40 0|0:0,20,50 1:60,10,0",
+        "chr1 30 . G A,C 50 PASS . GT:PL 0|2:0,0,0 1|1:0,0,0 0:0,0,0",
+        "chr1 40 . T C 50 PASS . GT 1|0 0|0 1",
+        "chr1 50 . G A 5 PASS . GT:PL 0|1:30,0,40 0|0:0,20,50 1:60,10,0",
+    ])
+    write_genotype_vcf("genotypes2.vcf.gz", ["D"], [
+        "chr1 10 . A G 50 PASS . GT:PL 1|1:60,30,0",
+        "chr1 35 . C A 50 PASS . GT:PL 0|1:20,0,20",
+        "chr1 40 . T C 50 PASS . GT:PL 0/0:0,30,60",
+    ])
+
+
+if __name__ == "__main__":
+    rand = random.Random(1)
+    make_bed(rand)
+    make_vcf(rand)
+    make_genotype_vcfs()